@@ -1,5 +1,12 @@
-CC=/opt/homebrew/opt/llvm/bin/clang
+if [ "$(uname)" = "Darwin" ]; then
+  CC=${CC:-/opt/homebrew/opt/llvm/bin/clang}
+  FLAGS=""
+else
+  # blocks used by z_defer need libBlocksRuntime on linux
+  CC=${CC:-clang}
+  FLAGS="-fblocks -lBlocksRuntime"
+fi
 rm -rf bin
 mkdir bin
-$CC -o ./bin/test ztest/test.c -I./ --std=c2x -g -pthread;
-$CC -o ./bin/benchmark zbenchmark/benchmark.c -I./ --std=c2x -O3 -pthread;
\ No newline at end of file
+$CC -o ./bin/test ztest/test.c -I./ --std=c2x -g -pthread $FLAGS;
+$CC -o ./bin/benchmark zbenchmark/benchmark.c -I./ --std=c2x -O3 -pthread $FLAGS;
@@ -1,13 +1,16 @@
+#include "zcache/cache.h"
 #include "zerror/error.h"
 #include "znet/client.h"
 #include "znet/kv_proto.h"
 #include "znet/svr_kv.h"
 #include "zrecord/record.h"
 #include "zutils/buffer.h"
+#include "zutils/hash.h"
 #include "zutils/log.h"
 #include "zutils/threads.h"
 #include "zutils/time.h"
 #include <pthread.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -147,23 +150,18 @@ void *z_BenchmarkFind(void *as) {
   return nullptr;
 }
 
-int main() {
-  int64_t thread_count = 8;
-  int64_t key_count = 1024 * 1024;
-
-  const char *bp = "./bin/binlog.log";
-  remove(bp);
-
-  z_LogInit("", 2);
-  z_defer(z_LogDestroy);
-
-  FILE *bmFile = fopen("./zbenchmark/benchmark.his", "a");
-  z_defer(^{
-    fclose(bmFile);
-  });
-
+// the stripe mode has as many stripes as workers, see z_SvrKVInitStripes
+void z_BenchmarkSvrKV(FILE *bmFile, const char *bp, int64_t thread_count,
+                      int64_t key_count, bool is_striped) {
   z_unique(z_SvrKV) svr_kv;
-  z_Error ret = z_SvrKVInit(&svr_kv, bp, 1024*1024*1024, 1024, "127.0.0.1", 12301, 16);
+  z_Error ret =
+      is_striped
+          ? z_SvrKVInitStripes(&svr_kv, bp, 1024 * 1024 * 1024, 1024,
+                               (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                               "127.0.0.1", 12301, 16, z_EVENT_LEN)
+          : z_SvrKVInit(&svr_kv, bp, 1024 * 1024 * 1024, 1024,
+                        (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                        "127.0.0.1", 12301, 16, z_EVENT_LEN);
   if (ret != z_OK) {
     z_panic("z_SvrKVInit %d", ret);
   }
@@ -186,13 +184,37 @@ int main() {
   for (int64_t i = 0; i < thread_count; ++i) {
     z_ThreadJion(args[i].Tid);
   }
+  int64_t insert_ms = z_NowMS() - start;
+  z_BinLogStats stats = {};
+  for (int64_t i = 0; i < (is_striped ? svr_kv.Stripes.Len : 1); ++i) {
+    z_BinLogStats s;
+    z_BinLogGetStats(is_striped ? &svr_kv.Stripes.KVs[i].BinLog
+                                : &svr_kv.KV.BinLog,
+                     &s);
+    stats.RecordCount += s.RecordCount;
+    stats.BatchCount += s.BatchCount;
+    stats.MaxBatchLen =
+        s.MaxBatchLen > stats.MaxBatchLen ? s.MaxBatchLen : stats.MaxBatchLen;
+  }
   char date[32] = {};
   z_LocalDate(date);
-  fprintf(bmFile, "======== %s ========\n", date);
-  fprintf(bmFile, "z_BenchmarkInsert: %lld ms key_count %lld\n",
-          z_NowMS() - start, key_count);
-  printf("z_BenchmarkInsert: %lld ms key_count %lld\n", z_NowMS() - start,
-         key_count);
+  if (is_striped == false) {
+    fprintf(bmFile, "======== %s ========\n", date);
+  }
+  fprintf(bmFile, "z_BenchmarkInsert: %lld ms key_count %lld striped %d\n",
+          insert_ms, key_count, is_striped);
+  printf("z_BenchmarkInsert: %lld ms key_count %lld striped %d\n", insert_ms,
+         key_count, is_striped);
+  fprintf(bmFile,
+          "z_BinLog: %lld records/s %lld batches avg_batch %.2f max_batch "
+          "%lld\n",
+          stats.RecordCount * 1000 / (insert_ms + 1), stats.BatchCount,
+          (double)stats.RecordCount / (stats.BatchCount + 1),
+          stats.MaxBatchLen);
+  printf("z_BinLog: %lld records/s %lld batches avg_batch %.2f max_batch "
+         "%lld\n",
+         stats.RecordCount * 1000 / (insert_ms + 1), stats.BatchCount,
+         (double)stats.RecordCount / (stats.BatchCount + 1), stats.MaxBatchLen);
 
   start = z_NowMS();
   for (int64_t i = 0; i < thread_count; ++i) {
@@ -203,7 +225,7 @@ int main() {
   for (int64_t i = 0; i < thread_count; ++i) {
     z_ThreadJion(args[i].Tid);
   }
-  fprintf(bmFile, "z_BenchmarkFind: %lld ms key_count %lld\n\n",
+  fprintf(bmFile, "z_BenchmarkFind: %lld ms key_count %lld\n",
           z_NowMS() - start, key_count);
   printf("z_BenchmarkFind: %lld ms key_count %lld\n", z_NowMS() - start,
          key_count);
@@ -211,5 +233,330 @@ int main() {
   z_SvrKVStop(&svr_kv);
 
   z_ThreadJion(t);
+}
+
+// restarts from the binlog of z_BenchmarkSvrKV
+void z_BenchmarkRecover(FILE *bmFile, const char *bp, int64_t threads) {
+  z_KV kv;
+  z_Error ret = z_KVInitParallel(&kv, bp, 1024 * 1024 * 1024, 1024,
+                                 z_MAP_ENGINE_LIST,
+                                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                                 threads);
+  if (ret != z_OK) {
+    z_panic("z_KVInitParallel %d", ret);
+  }
+
+  int64_t ms = kv.Recovery.NS / 1000000;
+  int64_t rps = kv.Recovery.Records * 1000000000 / (kv.Recovery.NS + 1);
+  fprintf(bmFile, "z_BenchmarkRecover: threads %lld %lld ms %lld records/s\n",
+          threads, ms, rps);
+  printf("z_BenchmarkRecover: threads %lld %lld ms %lld records/s\n", threads,
+         ms, rps);
+  z_KVDestroy(&kv);
+}
+
+typedef struct {
+  z_Cache *Cache;
+  int64_t ID;
+  int64_t Count;
+  z_Thread Tid;
+} z_BenchmarkCacheArgs;
+
+// a record of the producer id and the seq, the rest is a pattern of both
+int64_t z_benchmarkCacheSize(int64_t seq) { return 16 + (seq % 8) * 24; }
+
+int8_t z_benchmarkCacheByte(int64_t id, int64_t seq, int64_t i) {
+  return (int8_t)(id * 31 + seq * 7 + i);
+}
+
+void *z_BenchmarkCacheProduce(void *as) {
+  z_BenchmarkCacheArgs *args = (z_BenchmarkCacheArgs *)as;
+  int8_t data[256];
+  for (int64_t seq = 0; seq < args->Count; ++seq) {
+    int64_t size = z_benchmarkCacheSize(seq);
+    memcpy(data, &args->ID, sizeof(int64_t));
+    memcpy(data + sizeof(int64_t), &seq, sizeof(int64_t));
+    for (int64_t i = 16; i < size; ++i) {
+      data[i] = z_benchmarkCacheByte(args->ID, seq, i);
+    }
+
+    uint64_t offset = 0;
+    z_Error ret = z_ERR_NOSPACE;
+    while ((ret = z_CacheAdd(args->Cache, data, size, &offset)) ==
+           z_ERR_NOSPACE) {
+      sched_yield();
+    }
+    if (ret != z_OK) {
+      z_panic("z_CacheAdd %d", ret);
+    }
+  }
+  return nullptr;
+}
+
+// producers add to a small ring at once, one consumer checks every record in
+// the ring order and removes them
+void z_BenchmarkCache(FILE *bmFile, int64_t threads) {
+  int64_t count = 1024 * 1024;
+  z_Cache cache;
+  if (z_CacheInit(&cache, 64 * 1024) != z_OK) {
+    z_panic("z_CacheInit");
+  }
+
+  z_BenchmarkCacheArgs *args =
+      z_malloc(sizeof(z_BenchmarkCacheArgs) * threads);
+  int64_t *seqs = z_malloc(sizeof(int64_t) * threads);
+  int64_t start = z_NowMS();
+  for (int64_t i = 0; i < threads; ++i) {
+    args[i] = (z_BenchmarkCacheArgs){.Cache = &cache, .ID = i, .Count = count};
+    seqs[i] = 0;
+    z_ThreadCreate(&args[i].Tid, z_BenchmarkCacheProduce, &args[i]);
+  }
+
+  int64_t errors = 0;
+  for (int64_t done = 0; done < threads * count;) {
+    uint64_t unused = atomic_load(&cache.Unused);
+    void *ptr = nullptr;
+    if (unused == atomic_load(&cache.End) ||
+        z_CachePtr(&cache, unused, &ptr) != z_OK) {
+      sched_yield();
+      continue;
+    }
+
+    z_CacheRecord *cr = (z_CacheRecord *)ptr;
+    if (cr->IsPad == false) {
+      int8_t *data = (int8_t *)(cr + 1);
+      int64_t id = 0;
+      int64_t seq = 0;
+      memcpy(&id, data, sizeof(int64_t));
+      memcpy(&seq, data + sizeof(int64_t), sizeof(int64_t));
+      if (id < 0 || id >= threads || seq != seqs[id]) {
+        ++errors;
+      } else {
+        for (int64_t i = 16; i < z_benchmarkCacheSize(seq); ++i) {
+          if (data[i] != z_benchmarkCacheByte(id, seq, i)) {
+            ++errors;
+            break;
+          }
+        }
+        ++seqs[id];
+      }
+      ++done;
+    }
+
+    z_CacheUnused(&cache);
+    unused = atomic_load(&cache.Unused);
+    if (unused - atomic_load(&cache.Start) >= (uint64_t)cache.Size / 4) {
+      z_CacheRemove(&cache, unused);
+    }
+  }
+
+  for (int64_t i = 0; i < threads; ++i) {
+    z_ThreadJion(args[i].Tid);
+  }
+  int64_t ms = z_NowMS() - start;
+  int64_t rps = threads * count * 1000 / (ms + 1);
+  fprintf(bmFile,
+          "z_BenchmarkCache: threads %lld %lld ms %lld records/s errors "
+          "%lld\n",
+          threads, ms, rps, errors);
+  printf("z_BenchmarkCache: threads %lld %lld ms %lld records/s errors %lld\n",
+         threads, ms, rps, errors);
+  if (errors > 0) {
+    z_panic("z_BenchmarkCache errors %lld", errors);
+  }
+
+  z_free(seqs);
+  z_free(args);
+  z_CacheDestory(&cache);
+}
+
+// hashes bytes_total bytes in keys of each size, by each family
+void z_BenchmarkHash(FILE *bmFile, int64_t bytes_total) {
+  int64_t sizes[] = {8, 16, 32, 64, 256, 1024, 4096};
+  z_HashFamily families[] = {z_HASH_FNV, z_HASH_WY};
+  const char *names[] = {"fnv", "wy"};
+  int8_t *data = z_malloc(4096 + 64);
+  for (int64_t i = 0; i < 4096 + 64; ++i) {
+    data[i] = (int8_t)(i * 131 + 7);
+  }
+
+  for (int64_t s = 0; s < (int64_t)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+    for (int64_t f = 0; f < 2; ++f) {
+      int64_t count = bytes_total / sizes[s];
+      // each hash depends on the one before, so they are not folded away
+      uint64_t h = 0;
+      int64_t start = z_NowNS();
+      for (int64_t i = 0; i < count; ++i) {
+        h = z_HashOf(families[f], data + (h & 63), sizes[s]);
+      }
+      int64_t ns = z_NowNS() - start;
+      int64_t mbps = bytes_total * 1000 / (ns + 1);
+      fprintf(bmFile,
+              "z_BenchmarkHash: %s size %lld %lld MB/s %lld ns/hash %llu\n",
+              names[f], sizes[s], mbps, ns / count, h & 1);
+      printf("z_BenchmarkHash: %s size %lld %lld MB/s %lld ns/hash %llu\n",
+             names[f], sizes[s], mbps, ns / count, h & 1);
+    }
+  }
+  z_free(data);
+}
+
+// z_RecordSum and z_RecordCheck of records of each format and value size
+void z_BenchmarkRecordSum(FILE *bmFile, int64_t bytes_total) {
+  int64_t sizes[] = {64, 1024, 16 * 1024, 256 * 1024};
+  const char *names[] = {"fnv8", "crc32c", "compact"};
+  uint8_t formats[] = {0, z_RECORD_FLAGS_FORMAT_2, z_RECORD_COMPACT};
+  int8_t *value = z_malloc(256 * 1024);
+  memset(value, 'v', 256 * 1024);
+
+  for (int64_t s = 0; s < (int64_t)(sizeof(sizes) / sizeof(sizes[0])); ++s) {
+    for (int64_t f = 0; f < 3; ++f) {
+      z_ConstBuffer k = {.Data = (int8_t *)"key", .Size = 3};
+      z_ConstBuffer v = {.Data = value, .Size = sizes[s]};
+      z_Record *r =
+          z_RecordNew(formats[f], z_ROP_INSERT, k, v, (z_ConstBuffer){});
+
+      int64_t count = bytes_total / sizes[s];
+      int64_t fails = 0;
+      int64_t start = z_NowNS();
+      for (int64_t i = 0; i < count; ++i) {
+        z_RecordSum(r);
+        fails += z_RecordCheck(r) != z_OK;
+      }
+      int64_t ns = z_NowNS() - start;
+      int64_t mbps = bytes_total * 2 * 1000 / (ns + 1);
+      fprintf(bmFile,
+              "z_BenchmarkRecordSum: %s value %lld %lld MB/s %lld "
+              "ns/record fails %lld\n",
+              names[f], sizes[s], mbps, ns / count, fails);
+      printf("z_BenchmarkRecordSum: %s value %lld %lld MB/s %lld ns/record "
+             "fails %lld\n",
+             names[f], sizes[s], mbps, ns / count, fails);
+      z_RecordFree(r);
+    }
+  }
+  z_free(value);
+}
+
+// the key of offset i of z_BenchmarkMapFind
+int64_t z_benchmarkMapKey(int64_t i, char *key) {
+  return sprintf(key, "key%lld", i);
+}
+
+bool z_benchmarkMapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value,
+                           int64_t offset) {
+  char k[32];
+  int64_t size = z_benchmarkMapKey(offset, k);
+  return key.Size == size && memcmp(key.Data, k, size) == 0;
+}
+
+// finds every key of a map of key_count keys once in a random order, by
+// z_MapFind one at a time and by z_MapFindBatch of batch_len keys
+void z_BenchmarkMapFind(FILE *bmFile, int64_t key_count, int64_t batch_len) {
+  z_ThreadIDs tids;
+  if (z_ThreadIDsInit(&tids, 1) != z_OK || z_ThreadIDInit(&tids) != z_OK) {
+    z_panic("z_ThreadIDsInit");
+  }
+
+  z_Map m;
+  int64_t attr = 0;
+  if (z_MapInit(&m, 1024, z_MAP_ENGINE_LIST, &attr, z_benchmarkMapIsEqual) !=
+      z_OK) {
+    z_panic("z_MapInit");
+  }
+  char key[32];
+  for (int64_t i = 0; i < key_count; ++i) {
+    z_ConstBuffer k = {.Data = key, .Size = z_benchmarkMapKey(i, key)};
+    if (z_MapInsert(&m, k, i, 64) != z_OK) {
+      z_panic("z_MapInsert %lld", i);
+    }
+  }
+
+  // a stride prime to key_count visits every key once, far from the last one
+  int64_t stride = 1000003;
+  char(*keys)[32] = z_malloc(32 * batch_len);
+  z_ConstBuffer *ks = z_malloc(sizeof(z_ConstBuffer) * batch_len);
+  int64_t *offsets = z_malloc(sizeof(int64_t) * batch_len);
+  z_Error *rets = z_malloc(sizeof(z_Error) * batch_len);
+  int64_t errors = 0;
+
+  int64_t start = z_NowMS();
+  for (int64_t i = 0; i < key_count; ++i) {
+    int64_t j = i * stride % key_count;
+    z_ConstBuffer k = {.Data = key, .Size = z_benchmarkMapKey(j, key)};
+    int64_t offset = -1;
+    if (z_MapFind(&m, k, &offset) != z_OK || offset != j) {
+      ++errors;
+    }
+  }
+  int64_t single_ms = z_NowMS() - start;
+
+  start = z_NowMS();
+  for (int64_t i = 0; i < key_count; i += batch_len) {
+    int64_t len = key_count - i < batch_len ? key_count - i : batch_len;
+    for (int64_t b = 0; b < len; ++b) {
+      ks[b] = (z_ConstBuffer){
+          .Data = keys[b],
+          .Size = z_benchmarkMapKey((i + b) * stride % key_count, keys[b])};
+    }
+    z_MapFindBatch(&m, ks, len, offsets, rets);
+    for (int64_t b = 0; b < len; ++b) {
+      if (rets[b] != z_OK || offsets[b] != (i + b) * stride % key_count) {
+        ++errors;
+      }
+    }
+  }
+  int64_t batch_ms = z_NowMS() - start;
+
+  int64_t single_lps = key_count * 1000 / (single_ms + 1);
+  int64_t batch_lps = key_count * 1000 / (batch_ms + 1);
+  fprintf(bmFile,
+          "z_BenchmarkMapFind: key_count %lld single %lld lookups/s batch "
+          "%lld %lld lookups/s errors %lld\n",
+          key_count, single_lps, batch_len, batch_lps, errors);
+  printf("z_BenchmarkMapFind: key_count %lld single %lld lookups/s batch %lld "
+         "%lld lookups/s errors %lld\n",
+         key_count, single_lps, batch_len, batch_lps, errors);
+  if (errors > 0) {
+    z_panic("z_BenchmarkMapFind errors %lld", errors);
+  }
+
+  z_free(rets);
+  z_free(offsets);
+  z_free(ks);
+  z_free(keys);
+  z_MapDestroy(&m);
+  z_ThreadIDDestroy(&tids);
+  z_ThreadIDsDestroy(&tids);
+}
+
+int main() {
+  int64_t thread_count = 8;
+  int64_t key_count = 1024 * 1024;
+
+  const char *bp = "./bin/binlog.log";
+  z_SegmentsRemove(bp);
+
+  z_LogInit("", 2);
+  z_defer(z_LogDestroy);
+
+  FILE *bmFile = fopen("./zbenchmark/benchmark.his", "a");
+  z_defer(^{
+    fclose(bmFile);
+  });
+
+  z_BenchmarkSvrKV(bmFile, bp, thread_count, key_count, false);
+  for (int64_t threads = 1; threads <= thread_count; threads *= 2) {
+    z_BenchmarkRecover(bmFile, bp, threads);
+  }
+  z_KVStripesRemove(bp, 16);
+  z_BenchmarkSvrKV(bmFile, bp, thread_count, key_count, true);
+  for (int64_t threads = 1; threads <= thread_count; threads *= 2) {
+    z_BenchmarkCache(bmFile, threads);
+  }
+  z_BenchmarkMapFind(bmFile, 16 * 1024 * 1024, 64);
+  z_BenchmarkHash(bmFile, 256 * 1024 * 1024);
+  z_BenchmarkRecordSum(bmFile, 256 * 1024 * 1024);
+  fprintf(bmFile, "\n");
   return 0;
 }
\ No newline at end of file
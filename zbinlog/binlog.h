@@ -1,21 +1,83 @@
 #ifndef z_BINLOG_H
 #define z_BINLOG_H
 
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "zbinlog/file.h"
 #include "zbinlog/file_record.h"
 #include "zerror/error.h"
 #include "zutils/lock.h"
+#include "zutils/threads.h"
 
-typedef z_Error z_BinLogAfterWrite(void *, z_Record *, int64_t);
+// called with a record written at offset and the bytes of its frame
+typedef z_Error z_BinLogAfterWrite(void *, z_Record *, int64_t, int64_t);
+
+typedef enum : uint8_t {
+  // left to the os, DurableSeq stays 0
+  z_BINLOG_SYNC_NEVER = 0,
+  // a write and a sync per record
+  z_BINLOG_SYNC_ALWAYS = 1,
+  // a sync per group commit
+  z_BINLOG_SYNC_GROUP = 2,
+  // a background sync every IntervalMS
+  z_BINLOG_SYNC_INTERVAL = 3,
+} z_BinLogSyncMode;
+
+typedef struct {
+  z_BinLogSyncMode Mode;
+  int64_t IntervalMS;
+} z_BinLogSync;
+
+// records per writev, two iovecs each
+#define z_BINLOG_BATCH_LEN 512
+
+// an appender waiting for the leader to write its record, lives on the
+// appender's stack until IsDone
+typedef struct z_BinLogWaiter {
+  z_FileRecord *Record;
+  z_Error Ret;
+  atomic_bool IsDone;
+  struct z_BinLogWaiter *Next;
+} z_BinLogWaiter;
+
+typedef struct {
+  int64_t RecordCount;
+  int64_t BatchCount;
+  int64_t ByteCount;
+  int64_t MaxBatchLen;
+  int64_t AckedSeq;
+  int64_t DurableSeq;
+} z_BinLogStats;
 
 typedef struct {
   void *Attr;
   z_BinLogAfterWrite *AfterWrite;
+  // held by the leader, the only thread writing the file and the map
   z_Lock Lock;
   z_Writer Writer;
   atomic_int_fast64_t Seq;
+  // appenders not taken by a leader yet, newest first
+  _Atomic(z_BinLogWaiter *) Waiters;
+  atomic_int_fast64_t RecordCount;
+  atomic_int_fast64_t BatchCount;
+  atomic_int_fast64_t ByteCount;
+  atomic_int_fast64_t MaxBatchLen;
+  z_BinLogSync Sync;
+  // the last seq returned to an appender
+  atomic_int_fast64_t AckedSeq;
+  // the offset of the AckedSeq record, -1 if none
+  atomic_int_fast64_t AckedOffset;
+  // the last seq on the disk
+  atomic_int_fast64_t DurableSeq;
+  z_Thread Syncer;
+  atomic_bool IsSyncerRunning;
+  // the appender holding Turn reserves the next offset and seq, see
+  // z_binLogAppendParallel
+  atomic_int_fast64_t Ticket;
+  atomic_int_fast64_t Turn;
 } z_BinLog;
 
 void z_BinLogDestroy(z_BinLog *bl) {
@@ -24,18 +86,42 @@ void z_BinLogDestroy(z_BinLog *bl) {
     return;
   }
 
+  if (atomic_exchange(&bl->IsSyncerRunning, false) == true) {
+    z_ThreadJion(bl->Syncer);
+  }
+
   z_WriterDestroy(&bl->Writer);
 
   z_LockDestroy(&bl->Lock);
   return;
 }
 
-z_Error z_BinLogInit(z_BinLog *bl, char *path, int64_t max_size, void *attr,
+void *z_binLogSyncerRun(void *arg) {
+  z_BinLog *bl = (z_BinLog *)arg;
+  while (atomic_load(&bl->IsSyncerRunning) == true) {
+    usleep(bl->Sync.IntervalMS * 1000);
+
+    // records up to acked_seq are written before the sync starts
+    int64_t acked_seq = atomic_load(&bl->AckedSeq);
+    if (acked_seq == atomic_load(&bl->DurableSeq)) {
+      continue;
+    }
+
+    if (z_WriterSync(&bl->Writer) == z_OK) {
+      atomic_store(&bl->DurableSeq, acked_seq);
+    }
+  }
+  return nullptr;
+}
+
+z_Error z_BinLogInit(z_BinLog *bl, char *path, int64_t max_size,
+                     z_BinLogSync sync, void *attr,
                      z_BinLogAfterWrite *after_write) {
   if (bl == nullptr || path == nullptr || max_size == 0 || attr == nullptr ||
-      after_write == nullptr) {
+      after_write == nullptr ||
+      (sync.Mode == z_BINLOG_SYNC_INTERVAL && sync.IntervalMS <= 0)) {
     z_error("bl == nullptr || path == nullptr || max_size == 0 || attr == "
-            "nullptr || after_write == nullptr");
+            "nullptr || after_write == nullptr || IntervalMS <= 0");
     return z_ERR_INVALID_DATA;
   }
 
@@ -49,35 +135,421 @@ z_Error z_BinLogInit(z_BinLog *bl, char *path, int64_t max_size, void *attr,
   bl->Attr = attr;
   bl->AfterWrite = after_write;
   atomic_store(&bl->Seq, 1);
+  atomic_store(&bl->Waiters, nullptr);
+  atomic_store(&bl->RecordCount, 0);
+  atomic_store(&bl->BatchCount, 0);
+  atomic_store(&bl->ByteCount, 0);
+  atomic_store(&bl->MaxBatchLen, 0);
+  bl->Sync = sync;
+  // nothing waits for a sync, the rollover under the lock skips it too
+  bl->Writer.IsRollSynced = sync.Mode != z_BINLOG_SYNC_NEVER;
+  atomic_store(&bl->AckedSeq, 0);
+  atomic_store(&bl->AckedOffset, -1);
+  atomic_store(&bl->DurableSeq, 0);
+  atomic_store(&bl->IsSyncerRunning, false);
+  atomic_store(&bl->Ticket, 0);
+  atomic_store(&bl->Turn, 0);
+
+  if (sync.Mode == z_BINLOG_SYNC_INTERVAL) {
+    atomic_store(&bl->IsSyncerRunning, true);
+    if (z_ThreadCreate(&bl->Syncer, z_binLogSyncerRun, bl) != 0) {
+      z_error("z_ThreadCreate");
+      atomic_store(&bl->IsSyncerRunning, false);
+      z_WriterDestroy(&bl->Writer);
+      return z_ERR_INVALID_DATA;
+    }
+  }
   return z_OK;
 }
 
-z_Error z_BinLogAppendRecord(z_BinLog *bl, z_FileRecord *r) {
+// continues the seq of a reopened binlog, seq is its last record at offset
+void z_BinLogRestore(z_BinLog *bl, int64_t seq, int64_t offset) {
   z_LockLock(&bl->Lock);
+  atomic_store(&bl->Seq, seq + 1);
+  atomic_store(&bl->AckedSeq, seq);
+  atomic_store(&bl->AckedOffset, offset);
+  if (bl->Sync.Mode != z_BINLOG_SYNC_NEVER) {
+    atomic_store(&bl->DurableSeq, seq);
+  }
+  z_LockUnLock(&bl->Lock);
+}
 
+void z_BinLogGetStats(z_BinLog *bl, z_BinLogStats *stats) {
+  stats->RecordCount = atomic_load(&bl->RecordCount);
+  stats->BatchCount = atomic_load(&bl->BatchCount);
+  stats->ByteCount = atomic_load(&bl->ByteCount);
+  stats->MaxBatchLen = atomic_load(&bl->MaxBatchLen);
+  stats->AckedSeq = atomic_load(&bl->AckedSeq);
+  stats->DurableSeq = atomic_load(&bl->DurableSeq);
+}
+
+// writes the records of ws still ok, a failed write fails all of them
+void z_binLogWrite(z_BinLog *bl, z_BinLogWaiter **ws, int64_t ws_len,
+                   struct iovec *iov, int64_t iov_len, int64_t size) {
   z_Error ret = z_OK;
-  int64_t offset = 0;
+  if (bl->Sync.Mode == z_BINLOG_SYNC_ALWAYS) {
+    for (int64_t i = 0; i < iov_len && ret == z_OK; i += 2) {
+      ret = z_WriterWriteV(&bl->Writer, &iov[i], 2,
+                           iov[i].iov_len + iov[i + 1].iov_len);
+      if (ret == z_OK) {
+        ret = z_WriterSync(&bl->Writer);
+      }
+    }
+  } else if (iov_len > 0) {
+    ret = z_WriterWriteV(&bl->Writer, iov, iov_len, size);
+    if (ret == z_OK && bl->Sync.Mode == z_BINLOG_SYNC_GROUP) {
+      ret = z_WriterSync(&bl->Writer);
+    }
+  }
+
+  if (ret == z_OK) {
+    return;
+  }
+
+  for (int64_t i = 0; i < ws_len; ++i) {
+    if (ws[i]->Ret == z_OK) {
+      ws[i]->Ret = ret;
+    }
+  }
+}
+
+// writes ws with one writev per segment, then applies them to the map in the
+// same order
+void z_binLogCommit(z_BinLog *bl, z_BinLogWaiter **ws, int64_t ws_len) {
+  struct iovec iov[z_BINLOG_BATCH_LEN * 2];
+  int64_t iov_len = 0;
+  int64_t size = 0;
+  int64_t total_size = 0;
+  // the first waiter of the pending writev
+  int64_t first = 0;
+
+  for (int64_t i = 0; i < ws_len; ++i) {
+    z_FileRecord *r = ws[i]->Record;
+    // the frame is not known before the seq, its most bytes decide
+    int64_t max_size = z_FrameMaxSize(r->Record);
+    if (max_size >= bl->Writer.MaxSize) {
+      z_error("nospace size:%lld max:%lld", max_size, bl->Writer.MaxSize);
+      ws[i]->Ret = z_ERR_NOSPACE;
+      continue;
+    }
+
+    if (bl->Writer.Offset + size + max_size >= bl->Writer.MaxSize) {
+      z_binLogWrite(bl, &ws[first], i - first, iov, iov_len, size);
+      total_size += size;
+      iov_len = 0;
+      size = 0;
+      first = i;
+
+      z_Error ret = z_WriterRoll(&bl->Writer, atomic_load(&bl->Seq));
+      if (ret != z_OK) {
+        for (int64_t j = i; j < ws_len; ++j) {
+          ws[j]->Ret = ret;
+        }
+        break;
+      }
+    }
+
+    r->Seq = atomic_fetch_add(&bl->Seq, 1);
+    r->Offset =
+        z_SegmentOffset(bl->Writer.Segment, bl->Writer.Offset + size);
+    z_WriterFrame(&bl->Writer, r);
+    z_FrameIOV(r, &iov[iov_len]);
+    iov_len += 2;
+    size += r->Size;
+  }
+
+  z_binLogWrite(bl, &ws[first], ws_len - first, iov, iov_len, size);
+  total_size += size;
+
+  int64_t len = 0;
+  int64_t last_seq = 0;
+  int64_t last_offset = -1;
+  for (int64_t i = 0; i < ws_len; ++i) {
+    if (ws[i]->Ret != z_OK) {
+      continue;
+    }
+
+    ++len;
+    last_seq = ws[i]->Record->Seq;
+    last_offset = ws[i]->Record->Offset;
+    ws[i]->Ret = bl->AfterWrite(bl->Attr, ws[i]->Record->Record,
+                                ws[i]->Record->Offset, ws[i]->Record->Size);
+  }
+
+  if (len > 0) {
+    if (bl->Sync.Mode == z_BINLOG_SYNC_ALWAYS ||
+        bl->Sync.Mode == z_BINLOG_SYNC_GROUP) {
+      atomic_store(&bl->DurableSeq, last_seq);
+    }
+    atomic_store(&bl->AckedSeq, last_seq);
+    atomic_store(&bl->AckedOffset, last_offset);
+
+    atomic_fetch_add(&bl->RecordCount, len);
+    atomic_fetch_add(&bl->BatchCount, 1);
+    atomic_fetch_add(&bl->ByteCount, total_size);
+    if (len > atomic_load(&bl->MaxBatchLen)) {
+      atomic_store(&bl->MaxBatchLen, len);
+    }
+  }
+
+  for (int64_t i = 0; i < ws_len; ++i) {
+    atomic_store(&ws[i]->IsDone, true);
+  }
+}
+
+// takes all the queued appenders and commits them in arrival order
+void z_binLogLead(z_BinLog *bl) {
+  z_BinLogWaiter *head = atomic_exchange(&bl->Waiters, nullptr);
+
+  z_BinLogWaiter *fifo = nullptr;
+  while (head != nullptr) {
+    z_BinLogWaiter *next = head->Next;
+    head->Next = fifo;
+    fifo = head;
+    head = next;
+  }
+
+  z_BinLogWaiter *ws[z_BINLOG_BATCH_LEN];
+  while (fifo != nullptr) {
+    int64_t ws_len = 0;
+    // Next is read before IsDone is set, a finished waiter is gone
+    while (fifo != nullptr && ws_len < z_BINLOG_BATCH_LEN) {
+      ws[ws_len++] = fifo;
+      fifo = fifo->Next;
+    }
+    z_binLogCommit(bl, ws, ws_len);
+  }
+}
+
+// the appends to a hybrid log skip the leader unless every commit is synced,
+// a group commit then shares the sync
+bool z_binLogIsParallel(z_BinLog *bl) {
+  return bl->Writer.HLog != nullptr &&
+         (bl->Sync.Mode == z_BINLOG_SYNC_NEVER ||
+          bl->Sync.Mode == z_BINLOG_SYNC_INTERVAL);
+}
+
+// holds off the other writers, the caller then commits by z_binLogCommit as a
+// leader does. the parallel appends reserved before are published first
+void z_BinLogLock(z_BinLog *bl) {
+  if (z_binLogIsParallel(bl)) {
+    int64_t ticket = atomic_fetch_add(&bl->Ticket, 1);
+    while (atomic_load(&bl->Turn) != ticket) {
+      sched_yield();
+    }
+    z_HLogDrain(bl->Writer.HLog);
+  }
+  z_LockLock(&bl->Lock);
+}
+
+void z_BinLogUnLock(z_BinLog *bl) {
+  z_LockUnLock(&bl->Lock);
+  if (z_binLogIsParallel(bl)) {
+    atomic_fetch_add(&bl->Turn, 1);
+  }
+}
 
-  ret = z_WriterOffset(&bl->Writer, &offset);
+// commits r alone as a leader
+z_Error z_binLogAppendLocked(z_BinLog *bl, z_FileRecord *r) {
+  z_BinLogWaiter w = {.Record = r, .Ret = z_OK};
+  z_BinLogWaiter *ws[1] = {&w};
+  z_BinLogLock(bl);
+  z_binLogCommit(bl, ws, 1);
+  z_BinLogUnLock(bl);
+  return w.Ret;
+}
+
+// takes the offset and the seq of r and encodes its frame, holding Turn. a
+// rollover waits for the records before it and holds the leader lock
+z_Error z_binLogReserve(z_BinLog *bl, z_FileRecord *r) {
+  z_Writer *wr = &bl->Writer;
+  int64_t max_size = z_FrameMaxSize(r->Record);
+  if (max_size >= wr->MaxSize) {
+    z_error("nospace size:%lld max:%lld", max_size, wr->MaxSize);
+    return z_ERR_NOSPACE;
+  }
+
+  if (wr->Offset + max_size >= wr->MaxSize) {
+    z_HLogDrain(wr->HLog);
+    z_LockLock(&bl->Lock);
+    z_Error ret = z_WriterRoll(wr, atomic_load(&bl->Seq));
+    z_LockUnLock(&bl->Lock);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  // no one else takes a seq while Turn is held, it is taken after the reserve
+  r->Seq = atomic_load(&bl->Seq);
+  z_WriterFrame(wr, r);
+  z_Error ret = z_HLogReserve(wr->HLog, r->Size, &r->Offset);
   if (ret != z_OK) {
     return ret;
   }
-  
-  r->Seq = atomic_fetch_add(&bl->Seq, 1);
-  z_RecordSum(r->Record);
-  ret = z_WriterAppendRecord(&bl->Writer, r);
+  wr->Offset += r->Size;
+  z_writerPrepare(wr);
+  atomic_fetch_add(&bl->Seq, 1);
+  return z_OK;
+}
+
+// the appenders reserve in ticket order, so the seqs follow the offsets, then
+// copy their records to the hybrid log at the same time. each one applies
+// its record to the map and publishes it once the ones before are published,
+// the flusher writes the published bytes
+z_Error z_binLogAppendParallel(z_BinLog *bl, z_FileRecord *r) {
+  z_HLog *hl = bl->Writer.HLog;
+  if (z_FrameMaxSize(r->Record) > hl->Size) {
+    return z_binLogAppendLocked(bl, r);
+  }
+
+  int64_t ticket = atomic_fetch_add(&bl->Ticket, 1);
+  while (atomic_load(&bl->Turn) != ticket) {
+    sched_yield();
+  }
+  z_Error ret = z_binLogReserve(bl, r);
+  atomic_store(&bl->Turn, ticket + 1);
   if (ret != z_OK) {
-    z_LockUnLock(&bl->Lock);
     return ret;
   }
 
-  ret = bl->AfterWrite(bl->Attr, r->Record, offset);
-  if (ret != z_OK) {
+  int64_t size = r->Size;
+  struct iovec iov[2];
+  z_FrameIOV(r, iov);
+  z_HLogCopy(hl, r->Offset, iov, 2);
+
+  while (atomic_load(&hl->Tail) != r->Offset) {
+    sched_yield();
+  }
+
+  // the lock keeps the next one from applying before this one
+  z_LockLock(&bl->Lock);
+  z_HLogPublish(hl, r->Offset + size);
+  ret = bl->AfterWrite(bl->Attr, r->Record, r->Offset, size);
+  atomic_store(&bl->AckedSeq, r->Seq);
+  atomic_store(&bl->AckedOffset, r->Offset);
+  atomic_fetch_add(&bl->RecordCount, 1);
+  atomic_fetch_add(&bl->BatchCount, 1);
+  atomic_fetch_add(&bl->ByteCount, size);
+  if (atomic_load(&bl->MaxBatchLen) == 0) {
+    atomic_store(&bl->MaxBatchLen, 1);
+  }
+  z_LockUnLock(&bl->Lock);
+  return ret;
+}
+
+// group commit, concurrent appends share one writev, or the parallel append
+// to a hybrid log. r->Seq and r->Offset are set when it returns
+z_Error z_BinLogAppendRecord(z_BinLog *bl, z_FileRecord *r) {
+  if (z_RecordCheckSize(r->Record) != z_OK) {
+    z_error("invalid record size op %d", z_RecordOPOf(r->Record));
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_RecordSetBatched(r->Record, false);
+  z_RecordSum(r->Record);
+  if (z_binLogIsParallel(bl)) {
+    return z_binLogAppendParallel(bl, r);
+  }
+
+  z_BinLogWaiter w = {.Record = r, .Ret = z_OK};
+  atomic_store(&w.IsDone, false);
+  w.Next = atomic_load(&bl->Waiters);
+  while (atomic_compare_exchange_weak(&bl->Waiters, &w.Next, &w) == false) {
+  }
+
+  while (atomic_load(&w.IsDone) == false) {
+    if (z_LockTryLock(&bl->Lock) == false) {
+      sched_yield();
+      continue;
+    }
+
+    z_binLogLead(bl);
     z_LockUnLock(&bl->Lock);
+  }
+
+  return w.Ret;
+}
+
+// checks rs of a z_BinLogAppendBatch and marks them as one batch, a record
+// of an invalid size fails the whole batch before it is written
+z_Error z_BinLogBatchPrepare(z_BinLog *bl, z_FileRecord *rs, int64_t rs_len,
+                             z_Error *rets) {
+  if (rs_len <= 0 || rs_len > z_BINLOG_BATCH_LEN) {
+    z_error("rs_len %lld", rs_len);
+    return z_ERR_INVALID_DATA;
+  }
+
+  for (int64_t i = 0; i < rs_len; ++i) {
+    if (z_RecordCheckSize(rs[i].Record) != z_OK) {
+      z_error("invalid record size op %d", z_RecordOPOf(rs[i].Record));
+      for (int64_t j = 0; rets != nullptr && j < rs_len; ++j) {
+        rets[j] = z_ERR_INVALID_DATA;
+      }
+      return z_ERR_INVALID_DATA;
+    }
+  }
+
+  int64_t size = 0;
+  for (int64_t i = 0; i < rs_len; ++i) {
+    z_Record *r = rs[i].Record;
+    z_RecordSetBatched(r, i + 1 < rs_len);
+    z_RecordSum(r);
+    size += z_FrameMaxSize(r);
+  }
+  if (size >= bl->Writer.MaxSize) {
+    z_error("nospace size:%lld max:%lld", size, bl->Writer.MaxSize);
+    return z_ERR_NOSPACE;
+  }
+  return z_OK;
+}
+
+// writes the prepared rs with one writev and applies them, the caller holds
+// z_BinLogLock. the batch does not cross a segment
+z_Error z_BinLogBatchCommit(z_BinLog *bl, z_FileRecord *rs, int64_t rs_len,
+                            z_Error *rets) {
+  z_BinLogWaiter waiters[z_BINLOG_BATCH_LEN];
+  z_BinLogWaiter *ws[z_BINLOG_BATCH_LEN];
+  int64_t size = 0;
+  for (int64_t i = 0; i < rs_len; ++i) {
+    waiters[i] = (z_BinLogWaiter){.Record = &rs[i], .Ret = z_OK};
+    ws[i] = &waiters[i];
+    size += z_FrameMaxSize(rs[i].Record);
+  }
+
+  z_Error ret = z_OK;
+  if (bl->Writer.Offset + size >= bl->Writer.MaxSize) {
+    ret = z_WriterRoll(&bl->Writer, atomic_load(&bl->Seq));
+  }
+  if (ret == z_OK) {
+    z_binLogCommit(bl, ws, rs_len);
+  }
+
+  z_Error first = ret;
+  for (int64_t i = 0; i < rs_len; ++i) {
+    z_Error r = ret != z_OK ? ret : waiters[i].Ret;
+    if (rets != nullptr) {
+      rets[i] = r;
+    }
+    if (first == z_OK) {
+      first = r;
+    }
+  }
+  return first;
+}
+
+// appends rs as one batch with one lock and one writev, a replay applies all
+// of them or none, see z_RECORD_FLAG_BATCH. rets[i] is the result of rs[i],
+// the first failed one is returned
+z_Error z_BinLogAppendBatch(z_BinLog *bl, z_FileRecord *rs, int64_t rs_len,
+                            z_Error *rets) {
+  z_Error ret = z_BinLogBatchPrepare(bl, rs, rs_len, rets);
+  if (ret != z_OK) {
     return ret;
   }
 
-  z_LockUnLock(&bl->Lock);
+  z_BinLogLock(bl);
+  ret = z_BinLogBatchCommit(bl, rs, rs_len, rets);
+  z_BinLogUnLock(bl);
   return ret;
 }
-#endif
\ No newline at end of file
+#endif
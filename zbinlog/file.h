@@ -1,120 +1,545 @@
 #ifndef z_FILE_H
 #define z_FILE_H
 
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/falloc.h>
+#endif
 
 #include "zbinlog/file_record.h"
+#include "zbinlog/hlog.h"
+#include "zepoch/epoch.h"
 #include "zerror/error.h"
+#include "zutils/buffer.h"
+#include "zutils/lock.h"
+#include "zutils/threads.h"
+
+// a binlog is a list of segments, segment 0 is path and segment n is path.n,
+// an offset keeps the segment in the high bits and the position in the low
+#define z_SEGMENT_POS_BITS 40
+#define z_SEGMENT_MAX_SIZE (1LL << z_SEGMENT_POS_BITS)
+#define z_SEGMENTS_LEN 4096
+#define z_SEGMENT_PATH_LEN 1024
+
+int64_t z_SegmentOffset(int64_t segment, int64_t pos) {
+  return (segment << z_SEGMENT_POS_BITS) | pos;
+}
+
+int64_t z_SegmentOf(int64_t offset) { return offset >> z_SEGMENT_POS_BITS; }
+
+int64_t z_SegmentPos(int64_t offset) {
+  return offset & (z_SEGMENT_MAX_SIZE - 1);
+}
+
+void z_SegmentPath(const char *path, int64_t segment, char *dst) {
+  if (segment == 0) {
+    snprintf(dst, z_SEGMENT_PATH_LEN, "%s", path);
+    return;
+  }
+  snprintf(dst, z_SEGMENT_PATH_LEN, "%s.%lld", path, segment);
+}
+
+// the size of a segment, -1 if it does not exist
+int64_t z_SegmentSize(const char *path, int64_t segment) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(path, segment, p);
+  struct stat st;
+  if (stat(p, &st) != 0) {
+    return -1;
+  }
+  return st.st_size;
+}
+
+// the first segment after segment, -1 if there is none, compaction leaves
+// holes between the segments
+int64_t z_SegmentNext(const char *path, int64_t segment) {
+  for (int64_t i = segment + 1; i < z_SEGMENTS_LEN; ++i) {
+    if (z_SegmentSize(path, i) >= 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// the last segment, -1 if there is none
+int64_t z_SegmentLast(const char *path) {
+  for (int64_t i = z_SEGMENTS_LEN - 1; i >= 0; --i) {
+    if (z_SegmentSize(path, i) >= 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// where the first frame of a segment of base starts, after its head
+int64_t z_SegmentStart(int64_t base) {
+  return base == z_SEGMENT_LEGACY ? 0 : sizeof(z_SegmentHead);
+}
+
+// the base of the frames of the segment of fd, see z_SegmentHead. a head is
+// written before the frames after it, a segment shorter than one on the disk
+// is legacy for now and z_ERR_NOT_FOUND is returned
+z_Error z_segmentReadBase(int64_t fd, int64_t *base) {
+  z_SegmentHead head;
+  int64_t l = pread(fd, &head, sizeof(head), 0);
+  if (l < 0) {
+    z_error("pread %d", errno);
+    return z_ERR_FS;
+  }
+  if (l < (int64_t)sizeof(head)) {
+    *base = z_SEGMENT_LEGACY;
+    return z_ERR_NOT_FOUND;
+  }
+
+  // a legacy segment starts with a seq, it is never negative
+  *base = head.Magic == z_SEGMENT_MAGIC ? head.Base : z_SEGMENT_LEGACY;
+  return z_OK;
+}
+
+// z_segmentReadBase of a segment of path
+z_Error z_SegmentBase(const char *path, int64_t segment, int64_t *base) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(path, segment, p);
+  int64_t fd = open(p, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    z_error("open %s %d", p, errno);
+    return z_ERR_FS;
+  }
+
+  z_Error ret = z_segmentReadBase(fd, base);
+  close(fd);
+  return ret;
+}
+
+// removes all the segments of path
+void z_SegmentsRemove(const char *path) {
+  char p[z_SEGMENT_PATH_LEN];
+  for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+    z_SegmentPath(path, i, p);
+    remove(p);
+  }
+}
 
 typedef struct {
+  // the max size of a segment
   int64_t MaxSize;
-  FILE *File;
+  int64_t FD;
+  // the end of the current segment, only changed by the writer
+  int64_t Offset;
+  int64_t Segment;
+  // the base of the frames of the current segment, z_SEGMENT_LEGACY for a
+  // segment written before the compact frames, see z_FrameEncode
+  int64_t Base;
+  char Path[z_SEGMENT_PATH_LEN];
+  // the next segment, opened and preallocated by Preparer before it is needed
+  atomic_int_fast64_t NextFD;
+  atomic_bool IsPreparing;
+  z_Thread Preparer;
+  // held by z_WriterSync and the rollover, FD is not closed under a sync
+  z_Lock SyncLock;
+  // the rollover syncs the old segment, false for a binlog that is never
+  // synced, see z_WriterRoll
+  bool IsRollSynced;
+  // set by z_WriterSetHLog, the writes go to its memory and Offset runs ahead
+  // of the file until they are flushed
+  z_HLog *HLog;
 } z_Writer;
 
+// the offset of the next record
 z_Error z_WriterOffset(z_Writer *wr, int64_t *offset) {
-  if (wr->File == nullptr) {
-    z_error("wr->File == nullptr");
+  if (wr->FD < 0) {
+    z_error("wr->FD < 0");
     return z_ERR_INVALID_DATA;
   }
 
-  *offset = ftell(wr->File);
-  if (*offset < 0) {
-    z_error("ftell %lld", *offset);
-    return z_ERR_FS;
+  *offset = z_SegmentOffset(wr->Segment, wr->Offset);
+  return z_OK;
+}
+
+int64_t z_writerOpen(z_Writer *wr, int64_t segment, int flags) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(wr->Path, segment, p);
+  int64_t fd = open(p, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | flags, 0644);
+  if (fd < 0) {
+    z_error("open %s %d", p, errno);
   }
+  return fd;
+}
 
-  return z_OK;
+void *z_writerPrepareRun(void *arg) {
+  z_Writer *wr = (z_Writer *)arg;
+  // an empty segment may be left by a crash before the rollover
+  int64_t fd = z_writerOpen(wr, wr->Segment + 1, O_TRUNC);
+  if (fd < 0) {
+    return nullptr;
+  }
+
+#if defined(__linux__)
+  // reserves the blocks, the size stays 0 so the appends start at 0
+  if (fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, wr->MaxSize) != 0) {
+    z_debug("fallocate %d", errno);
+  }
+#endif
+
+  atomic_store(&wr->NextFD, fd);
+  return nullptr;
+}
+
+// opens the next segment in the background once half of the current is used
+void z_writerPrepare(z_Writer *wr) {
+  if (wr->Offset < wr->MaxSize / 2 || atomic_load(&wr->IsPreparing) == true ||
+      atomic_load(&wr->NextFD) >= 0 || wr->Segment + 1 >= z_SEGMENTS_LEN) {
+    return;
+  }
+
+  atomic_store(&wr->IsPreparing, true);
+  if (z_ThreadCreate(&wr->Preparer, z_writerPrepareRun, wr) != 0) {
+    z_error("z_ThreadCreate");
+    atomic_store(&wr->IsPreparing, false);
+  }
+}
+
+void z_writerPrepareJoin(z_Writer *wr) {
+  if (atomic_exchange(&wr->IsPreparing, false) == true) {
+    z_ThreadJion(wr->Preparer);
+  }
 }
 
+// starts the empty segment of fd with the head of the frames from seq,
+// without a head if the frames are legacy. *base is the base of the segment
+z_Error z_writerStart(int64_t fd, int64_t seq, int64_t *base) {
+  *base = z_FRAME_COMPACT ? seq : z_SEGMENT_LEGACY;
+  if (*base == z_SEGMENT_LEGACY) {
+    return z_OK;
+  }
+
+  z_SegmentHead head = {.Magic = z_SEGMENT_MAGIC, .Base = seq};
+  struct iovec iov = {.iov_base = &head, .iov_len = sizeof(head)};
+  return z_hlogWriteAll(fd, &iov, 1);
+}
+
+// appends to the last segment, a legacy one keeps its frames until the next
+// rollover
 z_Error z_WriterInit(z_Writer *wr, char *path, int64_t max_size) {
-  if (wr == nullptr || path == nullptr || max_size == 0) {
-    z_error("wr == nullptr || path == nullptr || max_size == 0");
+  if (wr == nullptr || path == nullptr || max_size == 0 ||
+      max_size > z_SEGMENT_MAX_SIZE || strlen(path) + 8 >= z_SEGMENT_PATH_LEN) {
+    z_error("wr == nullptr || path == nullptr || max_size == 0 || max_size > "
+            "z_SEGMENT_MAX_SIZE || path is too long");
     return z_ERR_INVALID_DATA;
   }
   wr->MaxSize = max_size;
+  snprintf(wr->Path, z_SEGMENT_PATH_LEN, "%s", path);
+  atomic_store(&wr->NextFD, -1);
+  atomic_store(&wr->IsPreparing, false);
+  z_LockInit(&wr->SyncLock);
+  wr->IsRollSynced = true;
+  wr->HLog = nullptr;
+
+  wr->Segment = z_SegmentLast(path);
+  if (wr->Segment < 0) {
+    wr->Segment = 0;
+  }
+
+  // an empty last segment was preopened for a rollover, it is opened again
+  // when needed
+  char p[z_SEGMENT_PATH_LEN];
+  while (wr->Segment > 0 && z_SegmentSize(path, wr->Segment) == 0 &&
+         z_SegmentNext(path, -1) < wr->Segment) {
+    z_SegmentPath(path, wr->Segment, p);
+    if (remove(p) != 0) {
+      break;
+    }
+    wr->Segment = z_SegmentLast(path);
+  }
+
+  wr->FD = z_writerOpen(wr, wr->Segment, 0);
+  if (wr->FD < 0) {
+    return z_ERR_FS;
+  }
 
-  wr->File = fopen(path, "a");
-  if (wr->File == nullptr) {
-    z_error("fopen %s", path);
+  wr->Offset = lseek(wr->FD, 0, SEEK_END);
+  if (wr->Offset < 0) {
+    z_error("lseek %s", path);
+    close(wr->FD);
+    wr->FD = -1;
     return z_ERR_FS;
   }
-  
+
+  // shorter than a head it holds no frame of either kind, the seqs of a new
+  // binlog start at 1
+  z_Error ret = z_OK;
+  if (wr->Offset < (int64_t)sizeof(z_SegmentHead)) {
+    if (wr->Offset > 0 && ftruncate(wr->FD, 0) != 0) {
+      z_error("ftruncate %d", errno);
+      ret = z_ERR_FS;
+    }
+    if (ret == z_OK) {
+      ret = z_writerStart(wr->FD, 1, &wr->Base);
+      wr->Offset = z_SegmentStart(wr->Base);
+    }
+  } else {
+    ret = z_SegmentBase(path, wr->Segment, &wr->Base);
+  }
+  if (ret != z_OK) {
+    close(wr->FD);
+    wr->FD = -1;
+    return ret;
+  }
+
+  z_writerPrepare(wr);
+  return z_OK;
+}
+
+// writes to hl from now on, see zbinlog/hlog.h. call it before the writer is
+// shared
+z_Error z_WriterSetHLog(z_Writer *wr, z_HLog *hl, int64_t size) {
+  z_Error ret =
+      z_HLogInit(hl, size, wr->FD, z_SegmentOffset(wr->Segment, wr->Offset));
+  if (ret != z_OK) {
+    return ret;
+  }
+  wr->HLog = hl;
   return z_OK;
 }
 
 void z_WriterDestroy(z_Writer *wr) {
-  if (wr == nullptr || wr->File == nullptr) {
+  if (wr == nullptr || wr->FD < 0) {
     return;
   }
 
-  int ret = fclose(wr->File);
-  if (ret != 0) {
-    z_error("fclose");
+  if (wr->HLog != nullptr && z_HLogFlushAll(wr->HLog) != z_OK) {
+    z_error("z_HLogFlushAll");
   }
 
+  z_writerPrepareJoin(wr);
+  int64_t next_fd = atomic_exchange(&wr->NextFD, -1);
+  if (next_fd >= 0) {
+    close(next_fd);
+  }
+
+  if (close(wr->FD) != 0) {
+    z_error("close");
+  }
+
+  wr->FD = -1;
   wr->MaxSize = 0;
+  z_LockDestroy(&wr->SyncLock);
 }
 
-z_Error z_WriterWrite(z_Writer *wr, int8_t *data, int64_t size) {
-  int64_t offset = {};
-  z_Error ret = z_WriterOffset(wr, &offset);
-  if (ret != z_OK) {
-    z_error("z_WriterOffset %d", ret);
+// flushes the written data to the disk
+z_Error z_WriterSync(z_Writer *wr) {
+  z_LockLock(&wr->SyncLock);
+  if (wr->HLog != nullptr && z_HLogFlushAll(wr->HLog) != z_OK) {
+    z_LockUnLock(&wr->SyncLock);
     return z_ERR_FS;
   }
+#if defined(__APPLE__)
+  int ret = fsync(wr->FD);
+#else
+  int ret = fdatasync(wr->FD);
+#endif
+  z_LockUnLock(&wr->SyncLock);
+  if (ret != 0) {
+    z_error("fdatasync %d", errno);
+    return z_ERR_FS;
+  }
+  return z_OK;
+}
+
+// writes the memory of the hlog to the file, without a sync
+z_Error z_writerFlush(z_Writer *wr) {
+  if (wr->HLog != nullptr && z_HLogFlushAll(wr->HLog) != z_OK) {
+    return z_ERR_FS;
+  }
+  return z_OK;
+}
+
+// moves to the next segment, its frames start at seq. the old one is synced
+// first because the syncers only know the current one, unless IsRollSynced is
+// off and it is only flushed
+z_Error z_WriterRoll(z_Writer *wr, int64_t seq) {
+  if (wr->Segment + 1 >= z_SEGMENTS_LEN) {
+    z_error("nospace segment:%lld", wr->Segment);
+    return z_ERR_NOSPACE;
+  }
 
-  if (offset + size < wr->MaxSize) {
-    if (fwrite(data, sizeof(int8_t), size, wr->File) != size) {
-      z_error("fwrite");
+  // only waits when the writer is faster than the preparer
+  z_writerPrepareJoin(wr);
+  int64_t fd = atomic_exchange(&wr->NextFD, -1);
+  if (fd < 0) {
+    fd = z_writerOpen(wr, wr->Segment + 1, O_TRUNC);
+    if (fd < 0) {
       return z_ERR_FS;
     }
+  }
 
-    if (fflush(wr->File) != 0) {
-      z_error("fflush");
-    }
-  } else {
-    z_error("nospace current:%lld size:%lld max:%lld", offset, size,
-            wr->MaxSize);
-    return z_ERR_NOSPACE;
+  int64_t base = 0;
+  z_Error ret = z_writerStart(fd, seq, &base);
+  if (ret == z_OK) {
+    ret = wr->IsRollSynced ? z_WriterSync(wr) : z_writerFlush(wr);
+  }
+  if (ret != z_OK) {
+    close(fd);
+    return ret;
+  }
+
+  z_LockLock(&wr->SyncLock);
+  if (close(wr->FD) != 0) {
+    z_error("close");
+  }
+  wr->FD = fd;
+  wr->Base = base;
+  wr->Offset = z_SegmentStart(base);
+  ++wr->Segment;
+  if (wr->HLog != nullptr) {
+    z_HLogReset(wr->HLog, fd, z_SegmentOffset(wr->Segment, wr->Offset));
   }
+  z_LockUnLock(&wr->SyncLock);
   return z_OK;
 }
 
-z_Error z_WriterAppendRecord(z_Writer *wr, z_FileRecord *r) {
-  z_Error ret = z_WriterWrite(wr, (int8_t*)&r->Seq, sizeof(r->Seq));
-  if (ret != z_OK) {
-    return ret;
+// cuts the current segment at offset, the appends go on from there. call it
+// before the writer is shared
+z_Error z_WriterTruncate(z_Writer *wr, int64_t offset) {
+  if (z_SegmentOf(offset) != wr->Segment || wr->HLog != nullptr) {
+    z_error("offset %lld segment %lld", offset, wr->Segment);
+    return z_ERR_INVALID_DATA;
   }
 
-  ret = z_WriterWrite(wr, (int8_t *)r->Record, z_RecordSize(r->Record));
-  if (ret != z_OK) {
-    return ret;
+  if (ftruncate(wr->FD, z_SegmentPos(offset)) != 0) {
+    z_error("ftruncate %d", errno);
+    return z_ERR_FS;
+  }
+  wr->Offset = z_SegmentPos(offset);
+  return z_OK;
+}
+
+// writes size bytes of iov in one writev, only retries a short write
+z_Error z_WriterWriteV(z_Writer *wr, struct iovec *iov, int64_t iov_len,
+                       int64_t size) {
+  if (wr->Offset + size >= wr->MaxSize) {
+    z_error("nospace current:%lld size:%lld max:%lld", wr->Offset, size,
+            wr->MaxSize);
+    return z_ERR_NOSPACE;
+  }
+
+  if (wr->HLog != nullptr) {
+    z_Error ret = z_HLogAppend(wr->HLog, iov, iov_len, size);
+    if (ret != z_OK) {
+      return ret;
+    }
+    wr->Offset += size;
+    z_writerPrepare(wr);
+    return z_OK;
+  }
+
+  int64_t left = size;
+  while (left > 0) {
+    int64_t n = writev(wr->FD, iov, iov_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      z_error("writev %d", errno);
+      return z_ERR_FS;
+    }
+
+    wr->Offset += n;
+    left -= n;
+    while (iov_len > 0 && n >= (int64_t)iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iov_len;
+    }
+    if (iov_len > 0) {
+      iov->iov_base = (int8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
   }
 
+  z_writerPrepare(wr);
   return z_OK;
 }
 
+z_Error z_WriterWrite(z_Writer *wr, int8_t *data, int64_t size) {
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  return z_WriterWriteV(wr, &iov, 1, size);
+}
+
+// the frame of r in the current segment, r->Size is its bytes
+void z_WriterFrame(z_Writer *wr, z_FileRecord *r) { z_FrameEncode(r, wr->Base); }
+
+z_Error z_WriterAppendRecord(z_Writer *wr, z_FileRecord *r) {
+  struct iovec iov[2];
+  z_WriterFrame(wr, r);
+  z_FrameIOV(r, iov);
+  return z_WriterWriteV(wr, iov, 2, r->Size);
+}
+
+// reads the records of all the segments in order
 typedef struct {
   FILE *File;
+  int64_t Segment;
+  // the base of the frames of Segment, see z_SegmentHead
+  int64_t Base;
+  char Path[z_SEGMENT_PATH_LEN];
 } z_Reader;
 
-z_Error z_ReaderInit(z_Reader *rd, char *path) {
-  if (rd == nullptr || path == nullptr) {
-    return z_ERR_INVALID_DATA;
+z_Error z_readerOpen(z_Reader *rd, int64_t segment) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(rd->Path, segment, p);
+  FILE *f = fopen(p, "r");
+  if (f == nullptr) {
+    z_error("fopen %s", p);
+    return z_ERR_FS;
   }
 
-  rd->File = fopen(path, "r");
-  if (rd->File == nullptr) {
-    z_error("fopen %s", path);
+  // the frames start after the head, a legacy segment has none
+  z_SegmentHead head;
+  int64_t base = z_SEGMENT_LEGACY;
+  if (fread(&head, 1, sizeof(head), f) == sizeof(head) &&
+      head.Magic == z_SEGMENT_MAGIC) {
+    base = head.Base;
+  }
+  if (fseek(f, z_SegmentStart(base), SEEK_SET) != 0) {
+    z_error("fseek %s", p);
+    fclose(f);
     return z_ERR_FS;
   }
 
+  if (rd->File != nullptr) {
+    fclose(rd->File);
+  }
+  rd->File = f;
+  rd->Segment = segment;
+  rd->Base = base;
   return z_OK;
 }
 
+z_Error z_ReaderInit(z_Reader *rd, char *path) {
+  if (rd == nullptr || path == nullptr ||
+      strlen(path) + 8 >= z_SEGMENT_PATH_LEN) {
+    return z_ERR_INVALID_DATA;
+  }
+
+  rd->File = nullptr;
+  snprintf(rd->Path, z_SEGMENT_PATH_LEN, "%s", path);
+  int64_t first = z_SegmentNext(path, -1);
+  return z_readerOpen(rd, first < 0 ? 0 : first);
+}
+
 void z_ReaderDestroy(z_Reader *rd) {
-  if (rd == nullptr) {
+  if (rd == nullptr || rd->File == nullptr) {
     return;
   }
 
@@ -122,6 +547,33 @@ void z_ReaderDestroy(z_Reader *rd) {
   if (ret != 0) {
     z_error("fclose");
   }
+  rd->File = nullptr;
+}
+
+// moves to the next segment at the end of the current one
+z_Error z_readerNext(z_Reader *rd) {
+  while (true) {
+    int c = fgetc(rd->File);
+    if (c != EOF) {
+      ungetc(c, rd->File);
+      return z_OK;
+    }
+    clearerr(rd->File);
+
+    // an empty segment is preopened for a rollover, it has no records
+    int64_t next = z_SegmentNext(rd->Path, rd->Segment);
+    while (next >= 0 && z_SegmentSize(rd->Path, next) == 0) {
+      next = z_SegmentNext(rd->Path, next);
+    }
+    if (next < 0) {
+      return z_OK;
+    }
+
+    z_Error ret = z_readerOpen(rd, next);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
 }
 
 z_Error z_ReaderRead(z_Reader *rd, int8_t *data, int64_t size) {
@@ -139,36 +591,100 @@ z_Error z_ReaderRead(z_Reader *rd, int8_t *data, int64_t size) {
   return z_OK;
 }
 
+// whether the last read of rd stopped at the end of its segment before it got
+// all of its bytes
+bool z_ReaderIsShort(z_Reader *rd) {
+  return rd->File != nullptr && feof(rd->File) != 0;
+}
+
+// the offset of the next record
+z_Error z_ReaderOffset(z_Reader *rd, int64_t *offset) {
+  if (rd->File == nullptr) {
+    z_error("rd->File == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_Error ret = z_readerNext(rd);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  int64_t pos = ftell(rd->File);
+  if (pos < 0) {
+    z_error("ftell %lld", pos);
+    return z_ERR_FS;
+  }
+
+  *offset = z_SegmentOffset(rd->Segment, pos);
+  return z_OK;
+}
+
+// r->Offset is set to where the record starts
 z_Error z_ReaderGetRecord(z_Reader *rd, z_FileRecord *r) {
   if (rd == nullptr || r == nullptr) {
     z_error("rd == nullptr || r == nullptr");
     return z_ERR_INVALID_DATA;
   }
-  
-  z_Error ret = z_ReaderRead(rd, (int8_t *)&r->Seq, sizeof(r->Seq));
+
+  z_Error ret = z_ReaderOffset(rd, &r->Offset);
   if (ret != z_OK) {
-    z_error("z_ReaderRead");
     return ret;
   }
-  
-  z_Record record;
-  ret = z_ReaderRead(rd, (int8_t *)&record, sizeof(z_Record));
-  if (ret != z_OK) {
-    z_error("z_ReaderRead");
-    return ret;
+
+  // a legacy head is read at once, the varint of a compact one a byte at a
+  // time, then the 8 bytes a record has at least and the rest of its head a
+  // byte at a time, no byte after the frame is read
+  int8_t head[z_FRAME_PARSE_MAX];
+  int64_t head_size = 0;
+  int64_t frame_head_size = 0;
+  z_Frame f;
+  while (z_FrameParse(head, head_size, rd->Base, &f) == false) {
+    if (rd->Base == z_SEGMENT_LEGACY) {
+      frame_head_size = sizeof(r->Seq);
+    } else if (head_size > 0 && frame_head_size == 0 &&
+               ((uint8_t)head[head_size - 1] & 0x80) == 0) {
+      frame_head_size = head_size;
+    }
+    int64_t n = 1;
+    if (frame_head_size > 0 &&
+        head_size < frame_head_size + (int64_t)sizeof(z_Record)) {
+      n = frame_head_size + sizeof(z_Record) - head_size;
+    }
+    if (head_size + n > (int64_t)sizeof(head)) {
+      z_error("z_FrameParse offset %lld", r->Offset);
+      return z_ERR_INVALID_DATA;
+    }
+
+    ret = z_ReaderRead(rd, head + head_size, n);
+    if (ret != z_OK) {
+      z_error("z_ReaderRead");
+      return ret;
+    }
+    head_size += n;
   }
 
-  int64_t size = z_RecordSize(&record);
-  z_Record *ret_record = z_RecordNewBySize(size);
-  *ret_record = record;
-  ret =
-      z_ReaderRead(rd, (int8_t *)(ret_record + 1), size - sizeof(z_Record));
+  // a torn or broken head must not size the allocation below
+  ret = z_RecordCheckHead(&f.Head);
   if (ret != z_OK) {
-    z_error("z_ReaderRead");
-    z_RecordFree(ret_record);
+    z_error("z_RecordCheckHead");
     return ret;
   }
 
+  z_Record *ret_record = z_RecordNewBySize(f.Size - f.HeadSize);
+  if (ret_record == nullptr) {
+    return z_ERR_NOSPACE;
+  }
+  memcpy(ret_record, head + f.HeadSize, head_size - f.HeadSize);
+  if (f.Size > head_size) {
+    ret = z_ReaderRead(rd, (int8_t *)ret_record + head_size - f.HeadSize,
+                       f.Size - head_size);
+    if (ret != z_OK) {
+      z_error("z_ReaderRead");
+      z_RecordFree(ret_record);
+      return ret;
+    }
+  }
+
   ret = z_RecordCheck(ret_record);
   if (ret != z_OK) {
     z_error("z_RecordCheck");
@@ -176,17 +692,31 @@ z_Error z_ReaderGetRecord(z_Reader *rd, z_FileRecord *r) {
     return ret;
   }
 
+  r->Seq = f.Seq;
   r->Record = ret_record;
+  r->Size = f.Size;
   return z_OK;
 }
 
+// an offset in the head of a segment moves to its first frame
 z_Error z_ReaderSet(z_Reader *rd, int64_t offset) {
   if (rd == nullptr) {
     z_error("rd == nullptr");
     return z_ERR_INVALID_DATA;
   }
 
-  if (fseek(rd->File, offset, SEEK_SET) != 0) {
+  if (z_SegmentOf(offset) != rd->Segment) {
+    z_Error ret = z_readerOpen(rd, z_SegmentOf(offset));
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  int64_t pos = z_SegmentPos(offset);
+  if (pos < z_SegmentStart(rd->Base)) {
+    pos = z_SegmentStart(rd->Base);
+  }
+  if (fseek(rd->File, pos, SEEK_SET) != 0) {
     z_error("fseek");
     return z_ERR_FS;
   }
@@ -195,47 +725,484 @@ z_Error z_ReaderSet(z_Reader *rd, int64_t offset) {
 
 z_Error z_ReaderReset(z_Reader *rd) { return z_ReaderSet(rd, 0); }
 
-z_Error z_ReaderOffset(z_Reader *rd, int64_t *offset) {
-  if (rd->File == nullptr) {
-    z_error("rd->File == nullptr");
+// the end of the last non empty segment
+z_Error z_ReaderMaxOffset(z_Reader *rd, int64_t *offset) {
+  z_assert(rd != nullptr, offset != nullptr);
+
+  *offset = z_SegmentOffset(rd->Segment, 0);
+  for (int64_t i = rd->Segment; i >= 0; i = z_SegmentNext(rd->Path, i)) {
+    int64_t size = z_SegmentSize(rd->Path, i);
+    if (size > 0) {
+      *offset = z_SegmentOffset(i, size);
+    }
+  }
+
+  return z_OK;
+}
+
+// bytes of the first pread, most records are read by one syscall
+#define z_PREAD_LEN 256
+
+// positional reader, pread is thread safe so one fd per segment is shared by
+// all threads, the fds are opened on the first read of their segment
+typedef struct {
+  char Path[z_SEGMENT_PATH_LEN];
+  atomic_int_fast64_t FDs[z_SEGMENTS_LEN];
+  // a reader pins the phase from getting an offset to reading it, a retired
+  // fd is closed once the pins of the phase before are gone
+  atomic_int_fast64_t Phase;
+  atomic_int_fast64_t Pins[2];
+  // the segments before Sealed are not written anymore, see z_PReaderSeal
+  atomic_int_fast64_t Sealed;
+  // set by z_PReaderMapSealed, a sealed segment is then read from a read only
+  // mapping, a retire unmaps it once the readers protected by Epoch are gone
+  z_Epoch *Epoch;
+  atomic_uint_fast64_t Maps[z_SEGMENTS_LEN];
+  atomic_int_fast64_t MapSizes[z_SEGMENTS_LEN];
+  // the tail of the active segment not flushed yet, nullptr if none
+  z_HLog *HLog;
+  // the bases of the segments read so far, see z_PReaderSegmentBase
+  atomic_int_fast64_t Bases[z_SEGMENTS_LEN];
+} z_PReader;
+
+z_Error z_PReaderInit(z_PReader *rd, char *path) {
+  if (rd == nullptr || path == nullptr ||
+      strlen(path) + 8 >= z_SEGMENT_PATH_LEN) {
+    z_error("rd == nullptr || path == nullptr || path is too long");
     return z_ERR_INVALID_DATA;
   }
 
-  *offset = ftell(rd->File);
-  if (*offset < 0) {
-    z_error("ftell %lld", *offset);
+  snprintf(rd->Path, z_SEGMENT_PATH_LEN, "%s", path);
+  for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+    atomic_store(&rd->FDs[i], -1);
+    atomic_store(&rd->Maps[i], 0);
+    atomic_store(&rd->MapSizes[i], 0);
+    atomic_store(&rd->Bases[i], z_SEGMENT_UNKNOWN);
+  }
+  atomic_store(&rd->Phase, 0);
+  atomic_store(&rd->Pins[0], 0);
+  atomic_store(&rd->Pins[1], 0);
+  atomic_store(&rd->Sealed, 0);
+  rd->Epoch = nullptr;
+  rd->HLog = nullptr;
+
+  return z_OK;
+}
+
+// the segments before segment are sealed
+void z_PReaderSeal(z_PReader *rd, int64_t segment) {
+  int64_t sealed = atomic_load(&rd->Sealed);
+  while (sealed < segment && atomic_compare_exchange_weak(
+                                 &rd->Sealed, &sealed, segment) == false) {
+  }
+}
+
+// reads the sealed segments from read only mappings from now on, the active
+// one is still read by pread. call it before the reader is shared
+void z_PReaderMapSealed(z_PReader *rd, z_Epoch *epoch) {
+  z_assert(rd != nullptr, epoch != nullptr);
+  rd->Epoch = epoch;
+}
+
+// attr is the size of the mapping at addr
+z_Error z_preaderUnmap(void *attr, uint64_t addr) {
+  if (munmap((void *)addr, (size_t)attr) != 0) {
+    z_error("munmap %d", errno);
+  }
+  return z_OK;
+}
+
+// returns the phase to unpin
+int64_t z_PReaderPin(z_PReader *rd) {
+  while (true) {
+    int64_t phase = atomic_load(&rd->Phase) & 1;
+    atomic_fetch_add(&rd->Pins[phase], 1);
+    // a retire that missed the pin has not flipped the phase yet
+    if ((atomic_load(&rd->Phase) & 1) == phase) {
+      return phase;
+    }
+    atomic_fetch_sub(&rd->Pins[phase], 1);
+  }
+}
+
+void z_PReaderUnPin(z_PReader *rd, int64_t phase) {
+  atomic_fetch_sub(&rd->Pins[phase], 1);
+}
+
+// closes the fd of a segment no offset points to anymore, waits for the
+// readers pinned before
+void z_PReaderRetire(z_PReader *rd, int64_t segment) {
+  int64_t phase = atomic_fetch_add(&rd->Phase, 1) & 1;
+  while (atomic_load(&rd->Pins[phase]) > 0) {
+    sched_yield();
+  }
+
+  int64_t fd = atomic_exchange(&rd->FDs[segment], -1);
+  if (fd >= 0 && close(fd) != 0) {
+    z_error("close");
+  }
+  atomic_store(&rd->Bases[segment], z_SEGMENT_UNKNOWN);
+
+  // a reader may still hold a pointer into the mapping after it unpinned
+  uint64_t addr = atomic_exchange(&rd->Maps[segment], 0);
+  if (addr != 0) {
+    z_EpochAction action = {
+        .Attr = (void *)atomic_load(&rd->MapSizes[segment]),
+        .Addr = addr,
+        .Func = z_preaderUnmap};
+    // a full epoch parks the action, it only fails without memory and the
+    // mapping is left
+    if (z_EpohBump(rd->Epoch, action) != z_OK) {
+      z_error("z_EpohBump");
+    }
+  }
+}
+
+void z_PReaderDestroy(z_PReader *rd) {
+  if (rd == nullptr) {
+    return;
+  }
+
+  for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+    int64_t fd = atomic_exchange(&rd->FDs[i], -1);
+    if (fd >= 0 && close(fd) != 0) {
+      z_error("close");
+    }
+
+    uint64_t addr = atomic_exchange(&rd->Maps[i], 0);
+    if (addr != 0) {
+      z_preaderUnmap((void *)atomic_load(&rd->MapSizes[i]), addr);
+    }
+  }
+}
+
+// the fd of the segment of offset, -1 on error
+int64_t z_preaderFD(z_PReader *rd, int64_t offset) {
+  int64_t segment = z_SegmentOf(offset);
+  if (segment < 0 || segment >= z_SEGMENTS_LEN) {
+    z_error("invalid segment %lld", segment);
+    return -1;
+  }
+
+  int64_t fd = atomic_load(&rd->FDs[segment]);
+  if (fd >= 0) {
+    return fd;
+  }
+
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(rd->Path, segment, p);
+  int64_t new_fd = open(p, O_RDONLY | O_CLOEXEC);
+  if (new_fd < 0) {
+    z_error("open %s", p);
+    return -1;
+  }
+
+  // another reader may open it at the same time, the first one is kept
+  if (atomic_compare_exchange_strong(&rd->FDs[segment], &fd, new_fd) == false) {
+    close(new_fd);
+    return fd;
+  }
+  return new_fd;
+}
+
+// maps a sealed segment, 0 if it cannot be mapped
+uint64_t z_preaderMap(z_PReader *rd, int64_t segment) {
+  int64_t fd = z_preaderFD(rd, z_SegmentOffset(segment, 0));
+  if (fd < 0) {
+    return 0;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size == 0) {
+    return 0;
+  }
+
+  void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    z_debug("mmap %d", errno);
+    return 0;
+  }
+  // the lookups hit random records, a read ahead is mostly wasted
+  madvise(data, st.st_size, MADV_RANDOM);
+
+  // another reader may map it at the same time, the first one is kept
+  atomic_store(&rd->MapSizes[segment], st.st_size);
+  uint64_t addr = 0;
+  if (atomic_compare_exchange_strong(&rd->Maps[segment], &addr,
+                                     (uint64_t)data) == false) {
+    munmap(data, st.st_size);
+    return addr;
+  }
+  return (uint64_t)data;
+}
+
+// the mapping of the segment of offset, nullptr if it is not sealed or not
+// mapped
+const int8_t *z_preaderMapped(z_PReader *rd, int64_t offset, int64_t *size) {
+  int64_t segment = z_SegmentOf(offset);
+  if (rd->Epoch == nullptr || segment < 0 ||
+      segment >= atomic_load(&rd->Sealed)) {
+    return nullptr;
+  }
+
+  uint64_t addr = atomic_load(&rd->Maps[segment]);
+  if (addr == 0) {
+    addr = z_preaderMap(rd, segment);
+    if (addr == 0) {
+      return nullptr;
+    }
+  }
+
+  *size = atomic_load(&rd->MapSizes[segment]);
+  return (const int8_t *)addr;
+}
+
+z_Error z_PReaderRead(z_PReader *rd, int64_t offset, int8_t *data,
+                      int64_t size) {
+  if (rd == nullptr || data == nullptr || size == 0) {
+    z_error("rd == nullptr || data == nullptr || size == 0");
+    return z_ERR_INVALID_DATA;
+  }
+
+  if (z_HLogRead(rd->HLog, offset, data, size) == z_OK) {
+    return z_OK;
+  }
+
+  int64_t fd = z_preaderFD(rd, offset);
+  if (fd < 0) {
     return z_ERR_FS;
   }
 
+  int64_t pos = z_SegmentPos(offset);
+  while (size > 0) {
+    int64_t l = pread(fd, data, size, pos);
+    if (l <= 0) {
+      z_error("pread %lld offset %lld size %lld", l, offset, size);
+      return z_ERR_FS;
+    }
+    data += l;
+    pos += l;
+    size -= l;
+  }
+
   return z_OK;
 }
 
-z_Error z_ReaderMaxOffset(z_Reader *rd, int64_t *offset) {
-  z_assert(rd != nullptr, offset != nullptr);
+// the record at offset is read from memory, a mapping of its sealed segment or
+// the hybrid log, rather than by a pread
+bool z_PReaderIsInMemory(z_PReader *rd, int64_t offset) {
+  int64_t map_size = 0;
+  return z_preaderMapped(rd, offset, &map_size) != nullptr ||
+         z_HLogHas(rd->HLog, offset);
+}
+
+// one pread of up to size bytes at offset from the disk, the bytes read, fewer
+// at the end of the segment, -1 on error
+int64_t z_PReaderReadSpan(z_PReader *rd, int64_t offset, int8_t *data,
+                          int64_t size) {
+  int64_t fd = z_preaderFD(rd, offset);
+  if (fd < 0) {
+    return -1;
+  }
+
+  int64_t l = pread(fd, data, size, z_SegmentPos(offset));
+  if (l < 0) {
+    z_error("pread %lld offset %lld size %lld", l, offset, size);
+    return -1;
+  }
+  return l;
+}
+
+// the base of the frames of segment, read once from its head
+z_Error z_PReaderSegmentBase(z_PReader *rd, int64_t segment, int64_t *base) {
+  if (segment < 0 || segment >= z_SEGMENTS_LEN) {
+    z_error("invalid segment %lld", segment);
+    return z_ERR_INVALID_DATA;
+  }
+
+  *base = atomic_load(&rd->Bases[segment]);
+  if (*base != z_SEGMENT_UNKNOWN) {
+    return z_OK;
+  }
 
-  int64_t src_offset = 0;
-  z_Error ret = z_ReaderOffset(rd, &src_offset);
+  int64_t fd = z_preaderFD(rd, z_SegmentOffset(segment, 0));
+  if (fd < 0) {
+    return z_ERR_FS;
+  }
+  // the frames of a short segment may still be in the hybrid log
+  z_Error ret = z_segmentReadBase(fd, base);
+  if (ret == z_ERR_NOT_FOUND) {
+    return z_OK;
+  }
   if (ret != z_OK) {
     return ret;
   }
+  atomic_store(&rd->Bases[segment], *base);
+  return z_OK;
+}
 
-  if (fseek(rd->File, 0, SEEK_END) != 0) {
-    z_error("fseek");
-    return z_ERR_FS;
+// the offset of the first frame of segment
+int64_t z_PReaderFirst(z_PReader *rd, int64_t segment) {
+  int64_t base = z_SEGMENT_LEGACY;
+  if (z_PReaderSegmentBase(rd, segment, &base) != z_OK) {
+    base = z_SEGMENT_LEGACY;
   }
+  return z_SegmentOffset(segment, z_SegmentStart(base));
+}
 
-  ret = z_ReaderOffset(rd, offset);
+// reads up to size bytes at offset from the hybrid log, or else by one pread,
+// and parses the frame head at them. the bytes read
+z_Error z_preaderFrame(z_PReader *rd, int64_t offset, int8_t *data,
+                       int64_t size, z_Frame *f, int64_t *l) {
+  int64_t base = 0;
+  z_Error ret = z_PReaderSegmentBase(rd, z_SegmentOf(offset), &base);
   if (ret != z_OK) {
     return ret;
   }
 
-  if (fseek(rd->File, src_offset, SEEK_SET) != 0) {
-    z_error("fseek");
+  *l = z_HLogReadSome(rd->HLog, offset, data, size);
+  if (*l < 0) {
+    *l = z_PReaderReadSpan(rd, offset, data, size);
+    if (*l < 0) {
+      return z_ERR_FS;
+    }
+  }
+
+  if (z_FrameParse(data, *l, base, f) == false) {
+    z_error("z_FrameParse offset %lld read %lld", offset, *l);
+    return *l < z_FRAME_PARSE_MAX ? z_ERR_FS : z_ERR_INVALID_DATA;
+  }
+  return z_OK;
+}
+
+// the size of the frame at offset, its head is read only
+z_Error z_PReaderRecordSize(z_PReader *rd, int64_t offset, int64_t *size) {
+  int8_t head[z_FRAME_PARSE_MAX];
+  z_Frame f;
+  int64_t l = 0;
+  z_Error ret = z_preaderFrame(rd, offset, head, sizeof(head), &f, &l);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  *size = f.Size;
+  return z_OK;
+}
+
+// reads the record at offset to buf, an in place update keeps the size
+z_Error z_preaderReadRecord(z_PReader *rd, int64_t offset, z_FileRecord *r,
+                            z_Buffer *buf) {
+  z_Error ret = z_BufferReserve(buf, z_PREAD_LEN);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_Frame f;
+  int64_t l = 0;
+  ret = z_preaderFrame(rd, offset, buf->Data, z_PREAD_LEN, &f, &l);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  // read again as a whole, an in place update may come between two reads
+  if (f.Size > l) {
+    ret = z_BufferReserve(buf, f.Size);
+    if (ret != z_OK) {
+      return ret;
+    }
+
+    ret = z_PReaderRead(rd, offset, buf->Data, f.Size);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  r->Seq = f.Seq;
+  r->Record = z_FrameRecord(&f, buf->Data);
+  r->Size = f.Size;
+  return z_OK;
+}
+
+// the record at offset of a mapped segment of base, see z_PReaderGetRecord
+z_Error z_preaderMappedRecord(const int8_t *map, int64_t map_size,
+                              int64_t base, int64_t offset, z_FileRecord *r) {
+  int64_t pos = z_SegmentPos(offset);
+  z_Frame f;
+  if (pos > map_size ||
+      z_FrameParse(map + pos, map_size - pos, base, &f) == false ||
+      pos + f.Size > map_size) {
+    z_error("offset %lld is out of the mapping %lld", offset, map_size);
     return z_ERR_FS;
   }
 
+  r->Seq = f.Seq;
+  r->Record = z_FrameRecord(&f, map + pos);
+  r->Size = f.Size;
   return z_OK;
 }
 
+// r->Record points to the mapping of a sealed segment, or else into buf,
+// which grows to hold it. the caller owns buf, reuses it for the next read and
+// z_BufferDestroy it at the end. do not free or write r->Record, it is valid
+// while the reader is pinned and buf is not read into again
+z_Error z_PReaderGetRecord(z_PReader *rd, int64_t offset, z_FileRecord *r,
+                           z_Buffer *buf) {
+  if (rd == nullptr || r == nullptr || buf == nullptr) {
+    z_error("rd == nullptr || r == nullptr || buf == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  int64_t map_size = 0;
+  const int8_t *map = z_preaderMapped(rd, offset, &map_size);
+  if (map != nullptr) {
+    int64_t base = 0;
+    z_Error ret = z_PReaderSegmentBase(rd, z_SegmentOf(offset), &base);
+    if (ret == z_OK) {
+      ret = z_preaderMappedRecord(map, map_size, base, offset, r);
+    }
+    if (ret != z_OK) {
+      return ret;
+    }
+  } else {
+    z_Error ret = z_preaderReadRecord(rd, offset, r, buf);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  z_Error ret = z_RecordCheck(r->Record);
+  if (ret != z_OK) {
+    z_error("z_RecordCheck offset %lld", offset);
+    return ret;
+  }
+
+  return z_OK;
+}
+
+// the offset of the record after the one at offset of size, the first one of
+// the next segment at the end of a segment, -1 after the last segment. the
+// records up to end are complete, a segment before end is sealed
+int64_t z_PReaderNext(z_PReader *rd, int64_t offset, int64_t size,
+                      int64_t end) {
+  int64_t next = offset + size;
+  int64_t segment = z_SegmentOf(offset);
+  while (segment >= 0) {
+    if (segment == z_SegmentOf(end)) {
+      return next <= end ? next : -1;
+    }
+
+    int64_t segment_size = 0;
+    if (z_preaderMapped(rd, next, &segment_size) == nullptr) {
+      segment_size = z_SegmentSize(rd->Path, segment);
+    }
+    if (z_SegmentPos(next) < segment_size) {
+      return next;
+    }
+
+    segment = z_SegmentNext(rd->Path, segment);
+    next = segment < 0 ? -1 : z_PReaderFirst(rd, segment);
+  }
+  return -1;
+}
 
 #endif
\ No newline at end of file
@@ -2,13 +2,125 @@
 #define z_FILE_RECORD
 
 #include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "zrecord/record.h"
+#include "zutils/varint.h"
+
+// a segment of the compact frames starts with a z_SegmentHead, a frame is
+// then the seq as a varint delta from Base and the record as it is. a segment
+// without the head is of the legacy frames, the 8 byte seq and the record. the
+// record is whole in both, of either head, a mapped segment is read without a
+// copy
+#define z_SEGMENT_MAGIC ((int64_t)0xC3A9E1F07A5C2D01ULL)
+
+typedef struct {
+  int64_t Magic;
+  // the seq the frames of the segment are deltas from
+  int64_t Base;
+} z_SegmentHead;
+
+// the base of a segment of the legacy frames
+#define z_SEGMENT_LEGACY -1LL
+// the base of a segment not read yet
+#define z_SEGMENT_UNKNOWN -2LL
+
+// the most bytes of a frame before its record, of both kinds
+#define z_FRAME_HEAD_MAX z_VARINT_MAX
+// the most bytes z_FrameParse needs, the frame head and the record head
+#define z_FRAME_PARSE_MAX (z_FRAME_HEAD_MAX + z_RECORD_HEAD_MAX)
+
+#ifndef z_FRAME_COMPACT
+// new segments are written in the compact frames, 0 keeps the legacy frames
+// for the readers before them
+#define z_FRAME_COMPACT 1
+#endif
 
 typedef struct {
   int64_t Seq;
   z_Record *Record;
+  // where the frame of Seq and Record starts in the binlog, see
+  // z_SegmentOffset, and its bytes. set by the append and the readers, not
+  // written
+  int64_t Offset;
+  int64_t Size;
+  // the frame head of an append, see z_FrameEncode
+  int8_t Head[z_FRAME_HEAD_MAX];
+  int64_t HeadSize;
 } z_FileRecord;
 
+// the head of a frame, see z_FrameParse
+typedef struct {
+  int64_t Seq;
+  // the bytes of the frame and of its head, the record follows the head
+  int64_t Size;
+  int64_t HeadSize;
+  // a copy of the head of the record, of RecordHeadSize bytes
+  union {
+    z_Record Head;
+    int8_t HeadBytes[z_RECORD_HEAD_MAX];
+  };
+  int64_t RecordHeadSize;
+} z_Frame;
+
+// the most bytes of the frame of r, before its seq and segment are known
+int64_t z_FrameMaxSize(z_Record *r) {
+  return z_FRAME_HEAD_MAX + z_RecordSize(r);
+}
+
+// writes the frame head of r->Seq in a segment of base to r->Head, sets
+// r->HeadSize and r->Size
+void z_FrameEncode(z_FileRecord *r, int64_t base) {
+  if (base == z_SEGMENT_LEGACY) {
+    memcpy(r->Head, &r->Seq, sizeof(r->Seq));
+    r->HeadSize = sizeof(r->Seq);
+  } else {
+    z_assert(r->Seq >= base);
+    r->HeadSize = z_VarintPut(r->Head, r->Seq - base);
+  }
+  r->Size = r->HeadSize + z_RecordSize(r->Record);
+}
+
+// the two iovecs of the frame of r encoded by z_FrameEncode, the head and the
+// record
+void z_FrameIOV(z_FileRecord *r, struct iovec iov[2]) {
+  iov[0] = (struct iovec){.iov_base = r->Head, .iov_len = r->HeadSize};
+  iov[1] = (struct iovec){.iov_base = r->Record,
+                          .iov_len = r->Size - r->HeadSize};
+}
+
+// parses the frame head and the record head at data of a segment of base,
+// false if size bytes do not hold them. false with z_FRAME_PARSE_MAX bytes is
+// a broken frame
+bool z_FrameParse(const int8_t *data, int64_t size, int64_t base, z_Frame *f) {
+  if (base == z_SEGMENT_LEGACY) {
+    if (size < (int64_t)sizeof(int64_t)) {
+      return false;
+    }
+    memcpy(&f->Seq, data, sizeof(int64_t));
+    f->HeadSize = sizeof(int64_t);
+  } else {
+    uint64_t delta = 0;
+    f->HeadSize = z_VarintGet(data, size, z_FRAME_HEAD_MAX, &delta);
+    if (f->HeadSize == 0) {
+      return false;
+    }
+    f->Seq = base + (int64_t)delta;
+  }
+
+  f->RecordHeadSize = z_RecordHeadSize(data + f->HeadSize, size - f->HeadSize);
+  if (f->RecordHeadSize == 0) {
+    return false;
+  }
+  memcpy(f->HeadBytes, data + f->HeadSize, f->RecordHeadSize);
+  f->Size = f->HeadSize + z_RecordSize(&f->Head);
+  return true;
+}
+
+// the record of the frame f at frame
+z_Record *z_FrameRecord(const z_Frame *f, const int8_t *frame) {
+  return (z_Record *)(frame + f->HeadSize);
+}
 
-#endif
\ No newline at end of file
+#endif
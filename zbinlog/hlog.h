@@ -0,0 +1,464 @@
+#ifndef z_HLOG_H
+#define z_HLOG_H
+
+#include <errno.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "zerror/error.h"
+#include "zutils/lock.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+#include "zutils/threads.h"
+
+// the flusher writes the read only region this often
+#define z_HLOG_FLUSH_INTERVAL_US 1000
+// the default of ReadOnlyUS
+#define z_HLOG_READ_ONLY_US 10000
+
+// the hybrid log, the tail of the active segment lives in memory first. the
+// byte at offset is Data[offset % Size], all the offsets are in the segment of
+// Head and only grow:
+// [Head, Flushed) is on the disk and still in memory
+// [Flushed, ReadOnly) is read only and written by the flusher, which also
+// moves ReadOnly on its own interval
+// [ReadOnly, Tail) is mutable, z_HLogUpdate overwrites it in place
+// [Tail, Reserved) is being copied by the appenders, see z_HLogReserve
+// a rollover flushes everything and starts over at the next segment. a reader
+// copies from memory and checks Head and SeqLock after, a record overwritten
+// meanwhile is on the disk
+typedef struct {
+  int8_t *Data;
+  int64_t Size;
+  atomic_int_fast64_t Head;
+  atomic_int_fast64_t Flushed;
+  atomic_int_fast64_t ReadOnly;
+  atomic_int_fast64_t Tail;
+  atomic_int_fast64_t Reserved;
+  // held by the appends, the in place updates and the moves of ReadOnly
+  z_Lock Lock;
+  // odd while an in place update is copied
+  z_SeqLock SeqLock;
+  // held by a flush, FD is the segment of Head
+  z_Lock FlushLock;
+  int64_t FD;
+  z_Thread Flusher;
+  atomic_bool IsFlusherRunning;
+  // the flusher makes a record read only one to two ReadOnlyUS after it is
+  // appended, so a log that is not full is still written out
+  atomic_int_fast64_t ReadOnlyUS;
+  atomic_int_fast64_t ReadCount;
+  atomic_int_fast64_t InPlaceCount;
+  atomic_int_fast64_t FlushBytes;
+} z_HLog;
+
+int64_t z_hlogPos(z_HLog *hl, int64_t offset) { return offset % hl->Size; }
+
+void z_hlogCopyIn(z_HLog *hl, int64_t offset, const int8_t *data,
+                  int64_t size) {
+  int64_t pos = z_hlogPos(hl, offset);
+  int64_t n = size < hl->Size - pos ? size : hl->Size - pos;
+  memcpy(hl->Data + pos, data, n);
+  memcpy(hl->Data, data + n, size - n);
+}
+
+void z_hlogCopyOut(z_HLog *hl, int64_t offset, int8_t *data, int64_t size) {
+  int64_t pos = z_hlogPos(hl, offset);
+  int64_t n = size < hl->Size - pos ? size : hl->Size - pos;
+  memcpy(data, hl->Data + pos, n);
+  memcpy(data + n, hl->Data, size - n);
+}
+
+// writes all of iov to fd, it is opened with O_APPEND
+z_Error z_hlogWriteAll(int64_t fd, struct iovec *iov, int64_t iov_len) {
+  while (iov_len > 0) {
+    ssize_t n = writev(fd, iov, iov_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      z_error("writev %d", errno);
+      return z_ERR_FS;
+    }
+
+    while (iov_len > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iov_len;
+    }
+    if (iov_len > 0) {
+      iov->iov_base = (int8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return z_OK;
+}
+
+// writes [Flushed, end) to the disk, end is not after ReadOnly
+z_Error z_hlogFlush(z_HLog *hl, int64_t end) {
+  z_LockLock(&hl->FlushLock);
+  int64_t flushed = atomic_load(&hl->Flushed);
+  if (end <= flushed) {
+    z_LockUnLock(&hl->FlushLock);
+    return z_OK;
+  }
+
+  int64_t size = end - flushed;
+  int64_t pos = z_hlogPos(hl, flushed);
+  int64_t n = size < hl->Size - pos ? size : hl->Size - pos;
+  struct iovec iov[2] = {
+      {.iov_base = hl->Data + pos, .iov_len = n},
+      {.iov_base = hl->Data, .iov_len = size - n},
+  };
+  z_Error ret = z_hlogWriteAll(hl->FD, iov, size > n ? 2 : 1);
+  if (ret == z_OK) {
+    atomic_store(&hl->Flushed, end);
+    atomic_fetch_add(&hl->FlushBytes, size);
+  }
+  z_LockUnLock(&hl->FlushLock);
+  return ret;
+}
+
+// moves ReadOnly up to offset, a Tail seen before. it is a record boundary
+// unless a rollover came between, then ReadOnly is already past it
+void z_hlogReadOnly(z_HLog *hl, int64_t offset) {
+  if (offset <= atomic_load(&hl->ReadOnly)) {
+    return;
+  }
+
+  z_LockLock(&hl->Lock);
+  if (offset > atomic_load(&hl->ReadOnly) && offset <= atomic_load(&hl->Tail)) {
+    atomic_store(&hl->ReadOnly, offset);
+  }
+  z_LockUnLock(&hl->Lock);
+}
+
+void *z_hlogFlusherRun(void *arg) {
+  z_HLog *hl = (z_HLog *)arg;
+  int64_t tail = atomic_load(&hl->Tail);
+  int64_t elapsed = 0;
+  while (atomic_load(&hl->IsFlusherRunning) == true) {
+    usleep(z_HLOG_FLUSH_INTERVAL_US);
+    elapsed += z_HLOG_FLUSH_INTERVAL_US;
+    if (elapsed >= atomic_load(&hl->ReadOnlyUS)) {
+      z_hlogReadOnly(hl, tail);
+      tail = atomic_load(&hl->Tail);
+      elapsed = 0;
+    }
+    z_hlogFlush(hl, atomic_load(&hl->ReadOnly));
+  }
+  return nullptr;
+}
+
+// fd is the active segment with its end at offset
+z_Error z_HLogInit(z_HLog *hl, int64_t size, int64_t fd, int64_t offset) {
+  if (hl == nullptr || size <= 0 || fd < 0) {
+    z_error("hl == nullptr || size <= 0 || fd < 0");
+    return z_ERR_INVALID_DATA;
+  }
+
+  hl->Data = z_malloc(size);
+  if (hl->Data == nullptr) {
+    z_error("hl->Data == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  hl->Size = size;
+  atomic_store(&hl->Head, offset);
+  atomic_store(&hl->Flushed, offset);
+  atomic_store(&hl->ReadOnly, offset);
+  atomic_store(&hl->Tail, offset);
+  atomic_store(&hl->Reserved, offset);
+  z_LockInit(&hl->Lock);
+  z_SeqLockInit(&hl->SeqLock);
+  z_LockInit(&hl->FlushLock);
+  hl->FD = fd;
+  atomic_store(&hl->ReadOnlyUS, z_HLOG_READ_ONLY_US);
+  atomic_store(&hl->ReadCount, 0);
+  atomic_store(&hl->InPlaceCount, 0);
+  atomic_store(&hl->FlushBytes, 0);
+
+  atomic_store(&hl->IsFlusherRunning, true);
+  if (z_ThreadCreate(&hl->Flusher, z_hlogFlusherRun, hl) != 0) {
+    z_error("z_ThreadCreate");
+    atomic_store(&hl->IsFlusherRunning, false);
+    z_free(hl->Data);
+    return z_ERR_INVALID_DATA;
+  }
+  return z_OK;
+}
+
+// stops the flusher, the flushes after are done by the writer
+void z_HLogStop(z_HLog *hl) {
+  if (hl == nullptr) {
+    return;
+  }
+
+  if (atomic_exchange(&hl->IsFlusherRunning, false) == true) {
+    z_ThreadJion(hl->Flusher);
+  }
+}
+
+void z_HLogDestroy(z_HLog *hl) {
+  if (hl == nullptr || hl->Data == nullptr) {
+    return;
+  }
+
+  z_HLogStop(hl);
+  z_free(hl->Data);
+  hl->Size = 0;
+  z_LockDestroy(&hl->Lock);
+  z_LockDestroy(&hl->FlushLock);
+}
+
+// makes the whole log read only and writes it to the disk
+z_Error z_HLogFlushAll(z_HLog *hl) {
+  z_LockLock(&hl->Lock);
+  int64_t tail = atomic_load(&hl->Tail);
+  atomic_store(&hl->ReadOnly, tail);
+  z_LockUnLock(&hl->Lock);
+  return z_hlogFlush(hl, tail);
+}
+
+// starts over at the next segment, everything before is flushed
+void z_HLogReset(z_HLog *hl, int64_t fd, int64_t offset) {
+  z_LockLock(&hl->Lock);
+  z_LockLock(&hl->FlushLock);
+  hl->FD = fd;
+  // a reader of the last segment goes to the disk from now on
+  atomic_store(&hl->Head, offset);
+  atomic_store(&hl->Flushed, offset);
+  atomic_store(&hl->ReadOnly, offset);
+  atomic_store(&hl->Tail, offset);
+  atomic_store(&hl->Reserved, offset);
+  z_LockUnLock(&hl->FlushLock);
+  z_LockUnLock(&hl->Lock);
+}
+
+// appends size bytes of iov at Tail, only called by the binlog leader with no
+// reservation pending. the tail before is a record boundary, the mutable
+// region is kept under half of the log
+z_Error z_HLogAppend(z_HLog *hl, struct iovec *iov, int64_t iov_len,
+                     int64_t size) {
+  z_LockLock(&hl->Lock);
+  int64_t tail = atomic_load(&hl->Tail);
+  if (tail - atomic_load(&hl->ReadOnly) > hl->Size / 2) {
+    atomic_store(&hl->ReadOnly, tail);
+  }
+
+  z_Error ret = z_OK;
+  if (tail + size - atomic_load(&hl->Head) > hl->Size) {
+    // the flusher is behind, the read only region is written here
+    if (tail + size - atomic_load(&hl->Flushed) > hl->Size) {
+      ret = z_hlogFlush(hl, atomic_load(&hl->ReadOnly));
+    }
+    if (ret == z_OK && tail + size - atomic_load(&hl->Flushed) > hl->Size) {
+      atomic_store(&hl->ReadOnly, tail);
+      ret = z_hlogFlush(hl, tail);
+    }
+    if (ret != z_OK) {
+      z_LockUnLock(&hl->Lock);
+      return ret;
+    }
+
+    // a larger write goes to the disk directly
+    if (size > hl->Size) {
+      z_LockLock(&hl->FlushLock);
+      ret = z_hlogWriteAll(hl->FD, iov, iov_len);
+      if (ret == z_OK) {
+        atomic_store(&hl->Head, tail + size);
+        atomic_store(&hl->Flushed, tail + size);
+        atomic_store(&hl->ReadOnly, tail + size);
+        atomic_store(&hl->Tail, tail + size);
+        atomic_store(&hl->Reserved, tail + size);
+        atomic_fetch_add(&hl->FlushBytes, size);
+      }
+      z_LockUnLock(&hl->FlushLock);
+      z_LockUnLock(&hl->Lock);
+      return ret;
+    }
+
+    // Head moves before the bytes are overwritten
+    atomic_store(&hl->Head, tail + size - hl->Size);
+    atomic_thread_fence(memory_order_release);
+  }
+
+  int64_t offset = tail;
+  for (int64_t i = 0; i < iov_len; ++i) {
+    z_hlogCopyIn(hl, offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+  atomic_store(&hl->Tail, tail + size);
+  atomic_store(&hl->Reserved, tail + size);
+  z_LockUnLock(&hl->Lock);
+  return z_OK;
+}
+
+// reserves size bytes at Reserved, *offset is where they start. one appender
+// reserves at a time, it then copies by z_HLogCopy with the others and
+// publishes by z_HLogPublish in offset order. when the log is full it waits
+// for the copies before it, z_ERR_NOSPACE if size does not fit at all
+z_Error z_HLogReserve(z_HLog *hl, int64_t size, int64_t *offset) {
+  if (size > hl->Size) {
+    return z_ERR_NOSPACE;
+  }
+
+  z_LockLock(&hl->Lock);
+  int64_t reserved = atomic_load(&hl->Reserved);
+  int64_t tail = atomic_load(&hl->Tail);
+  if (tail - atomic_load(&hl->ReadOnly) > hl->Size / 2) {
+    atomic_store(&hl->ReadOnly, tail);
+  }
+
+  while (reserved + size - atomic_load(&hl->Head) > hl->Size) {
+    int64_t flushed = atomic_load(&hl->Flushed);
+    if (reserved + size - flushed <= hl->Size) {
+      // Head moves before the bytes are overwritten
+      atomic_store(&hl->Head, reserved + size - hl->Size);
+      atomic_thread_fence(memory_order_release);
+      break;
+    }
+
+    // the flusher is behind, the read only region is written here
+    tail = atomic_load(&hl->Tail);
+    int64_t read_only = atomic_load(&hl->ReadOnly);
+    if (flushed < read_only) {
+      z_Error ret = z_hlogFlush(hl, read_only);
+      if (ret != z_OK) {
+        z_LockUnLock(&hl->Lock);
+        return ret;
+      }
+    } else if (read_only < tail) {
+      atomic_store(&hl->ReadOnly, tail);
+    } else {
+      // the copies before are not published yet
+      z_LockUnLock(&hl->Lock);
+      sched_yield();
+      z_LockLock(&hl->Lock);
+    }
+  }
+
+  atomic_store(&hl->Reserved, reserved + size);
+  z_LockUnLock(&hl->Lock);
+  *offset = reserved;
+  return z_OK;
+}
+
+// copies iov to the bytes reserved at offset
+void z_HLogCopy(z_HLog *hl, int64_t offset, struct iovec *iov,
+                int64_t iov_len) {
+  for (int64_t i = 0; i < iov_len; ++i) {
+    z_hlogCopyIn(hl, offset, iov[i].iov_base, iov[i].iov_len);
+    offset += iov[i].iov_len;
+  }
+}
+
+// the copied bytes up to end are readable and flushable, Tail is at the start
+// of them
+void z_HLogPublish(z_HLog *hl, int64_t end) { atomic_store(&hl->Tail, end); }
+
+// waits for the reserved bytes to be published
+void z_HLogDrain(z_HLog *hl) {
+  while (atomic_load(&hl->Tail) != atomic_load(&hl->Reserved)) {
+    sched_yield();
+  }
+}
+
+// copies [offset, offset + size) from memory, z_ERR_NOT_FOUND if it is only
+// on the disk
+z_Error z_HLogRead(z_HLog *hl, int64_t offset, int8_t *data, int64_t size) {
+  if (hl == nullptr || hl->Data == nullptr) {
+    return z_ERR_NOT_FOUND;
+  }
+
+  while (true) {
+    uint64_t seq = z_SeqLockReadBegin(&hl->SeqLock);
+    if (offset < atomic_load(&hl->Head) ||
+        offset + size > atomic_load(&hl->Tail)) {
+      return z_ERR_NOT_FOUND;
+    }
+
+    z_hlogCopyOut(hl, offset, data, size);
+    if (z_SeqLockReadRetry(&hl->SeqLock, seq)) {
+      continue;
+    }
+    // the append moved Head over it before it was overwritten
+    if (offset < atomic_load(&hl->Head)) {
+      return z_ERR_NOT_FOUND;
+    }
+
+    atomic_fetch_add(&hl->ReadCount, 1);
+    return z_OK;
+  }
+}
+
+// copies up to size bytes at offset from memory, fewer at Tail. the bytes
+// copied, -1 if offset is only on the disk
+int64_t z_HLogReadSome(z_HLog *hl, int64_t offset, int8_t *data,
+                       int64_t size) {
+  if (hl == nullptr || hl->Data == nullptr) {
+    return -1;
+  }
+
+  while (true) {
+    uint64_t seq = z_SeqLockReadBegin(&hl->SeqLock);
+    int64_t tail = atomic_load(&hl->Tail);
+    if (offset < atomic_load(&hl->Head) || offset >= tail) {
+      return -1;
+    }
+
+    int64_t n = size < tail - offset ? size : tail - offset;
+    z_hlogCopyOut(hl, offset, data, n);
+    if (z_SeqLockReadRetry(&hl->SeqLock, seq)) {
+      continue;
+    }
+    if (offset < atomic_load(&hl->Head)) {
+      return -1;
+    }
+
+    atomic_fetch_add(&hl->ReadCount, 1);
+    return n;
+  }
+}
+
+// the record at offset may be in memory, the ones before Head are only on the
+// disk
+bool z_HLogHas(z_HLog *hl, int64_t offset) {
+  return hl != nullptr && hl->Data != nullptr &&
+         offset >= atomic_load(&hl->Head);
+}
+
+// overwrites [offset, offset + size) in place, z_ERR_NOT_FOUND if it is not
+// mutable anymore
+z_Error z_HLogUpdate(z_HLog *hl, int64_t offset, const int8_t *data,
+                     int64_t size) {
+  if (hl == nullptr || hl->Data == nullptr) {
+    return z_ERR_NOT_FOUND;
+  }
+
+  z_LockLock(&hl->Lock);
+  if (offset < atomic_load(&hl->ReadOnly) ||
+      offset + size > atomic_load(&hl->Tail)) {
+    z_LockUnLock(&hl->Lock);
+    return z_ERR_NOT_FOUND;
+  }
+
+  z_SeqLockWriteBegin(&hl->SeqLock);
+  z_hlogCopyIn(hl, offset, data, size);
+  z_SeqLockWriteEnd(&hl->SeqLock);
+  z_LockUnLock(&hl->Lock);
+
+  atomic_fetch_add(&hl->InPlaceCount, 1);
+  return z_OK;
+}
+
+// the record at offset is not written in place anymore
+bool z_HLogIsReadOnly(z_HLog *hl, int64_t offset) {
+  return hl == nullptr || hl->Data == nullptr ||
+         offset < atomic_load(&hl->ReadOnly);
+}
+
+#endif
@@ -0,0 +1,485 @@
+#ifndef z_RECOVER_H
+#define z_RECOVER_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "zbinlog/binlog.h"
+#include "zbinlog/file.h"
+#include "zerror/error.h"
+#include "zrecord/record.h"
+#include "zutils/defer.h"
+#include "zutils/hash.h"
+#include "zutils/mem.h"
+#include "zutils/threads.h"
+#include "zutils/time.h"
+
+// parallel replay of a binlog. the calling thread reads the segments in large
+// chunks cut at record boundaries, the workers parse and check the chunks in
+// any order, and worker i applies the records of the keys with
+// hash % Buckets % Partitions == i in chunk order, so the records of a key
+// keep their order without a lock of the replay. the chunks are cut at the
+// end of a write batch, a batch without its last record is not replayed
+#define z_RECOVER_CHUNK_SIZE (1LL << 20)
+
+typedef struct {
+  // the end of the last record, and the last seq at SeqOffset, both are kept
+  // if there is no record
+  int64_t Offset;
+  int64_t Seq;
+  int64_t SeqOffset;
+  int64_t Records;
+  int64_t Bytes;
+  int64_t NS;
+  // the hash and the InitBucketsLen of the map. linear hashing puts a key in
+  // a bucket i with i % Buckets == hash % Buckets at every length, a split
+  // moves keys from i to i + level_len, a multiple of Buckets. so the keys of
+  // hash % Buckets % threads == w have buckets of their own, worker w takes
+  // the locks of another one only for the split its inserts are due
+  z_HashFamily Hash;
+  int64_t Buckets;
+  // the binlog ends in a batch without its last record, a torn write, Offset
+  // is where it starts and z_KVInit cuts it off
+  bool IsTorn;
+} z_Recovery;
+
+typedef struct {
+  z_Record *Record;
+  int64_t Offset;
+  // the bytes of the frame
+  int64_t Size;
+  int64_t Partition;
+} z_RecoverItem;
+
+typedef struct {
+  int8_t *Data;
+  int64_t Cap;
+  int64_t Size;
+  // where Data starts in the binlog, and the base of its segment
+  int64_t Offset;
+  int64_t Base;
+  int64_t Len;
+  // Items of partition i are [Starts[i], Starts[i + 1])
+  z_RecoverItem *Raw;
+  z_RecoverItem *Items;
+  int64_t ItemsCap;
+  int64_t *Starts;
+  atomic_bool IsParsed;
+  // partitions done with the chunk, it is reused after all of them
+  atomic_int_fast64_t Applied;
+} z_RecoverChunk;
+
+typedef struct {
+  void *Attr;
+  z_BinLogAfterWrite *Apply;
+  int64_t Partitions;
+  // see z_Recovery
+  z_HashFamily Hash;
+  int64_t Buckets;
+  z_RecoverChunk *Chunks;
+  int64_t ChunksLen;
+  atomic_int_fast64_t ReadLen;
+  atomic_int_fast64_t ParseNext;
+  atomic_bool IsReadDone;
+  // the first z_Error of a stage
+  atomic_int_fast64_t Ret;
+} z_RecoverState;
+
+typedef struct {
+  z_RecoverState *Recover;
+  int64_t Partition;
+  z_Thread Tid;
+} z_RecoverWorker;
+
+void z_recoverFail(z_RecoverState *rc, z_Error ret) {
+  int64_t ok = z_OK;
+  atomic_compare_exchange_strong(&rc->Ret, &ok, (int64_t)ret);
+}
+
+z_RecoverChunk *z_recoverChunk(z_RecoverState *rc, int64_t i) {
+  return &rc->Chunks[i % rc->ChunksLen];
+}
+
+// checks the records of c and sorts them by partition
+z_Error z_recoverParse(z_RecoverState *rc, z_RecoverChunk *c) {
+  if (c->Len > c->ItemsCap) {
+    z_free(c->Raw);
+    z_free(c->Items);
+    c->Raw = z_malloc(sizeof(z_RecoverItem) * c->Len);
+    c->Items = z_malloc(sizeof(z_RecoverItem) * c->Len);
+    if (c->Raw == nullptr || c->Items == nullptr) {
+      c->ItemsCap = 0;
+      return z_ERR_NOSPACE;
+    }
+    c->ItemsCap = c->Len;
+  }
+
+  memset(c->Starts, 0, sizeof(int64_t) * (rc->Partitions + 1));
+  int64_t pos = 0;
+  for (int64_t i = 0; i < c->Len; ++i) {
+    z_Frame f;
+    if (z_FrameParse(c->Data + pos, c->Size - pos, c->Base, &f) == false) {
+      z_error("z_FrameParse offset %lld", c->Offset + pos);
+      return z_ERR_INVALID_DATA;
+    }
+    z_Record *r = z_FrameRecord(&f, c->Data + pos);
+    if (z_RecordCheck(r) != z_OK) {
+      z_error("z_RecordCheck offset %lld", c->Offset + pos);
+      return z_ERR_INVALID_DATA;
+    }
+
+    z_ConstBuffer k;
+    z_Error ret = z_RecordKey(r, &k);
+    if (ret != z_OK) {
+      return ret;
+    }
+
+    uint64_t hash = z_HashOf(rc->Hash, k.Data, k.Size);
+    int64_t p = hash % (uint64_t)rc->Buckets % rc->Partitions;
+    c->Raw[i] = (z_RecoverItem){.Record = r,
+                                .Offset = c->Offset + pos,
+                                .Size = f.Size,
+                                .Partition = p};
+    ++c->Starts[p + 1];
+    pos += f.Size;
+  }
+
+  for (int64_t p = 0; p < rc->Partitions; ++p) {
+    c->Starts[p + 1] += c->Starts[p];
+  }
+
+  // Starts[p] moves to the end of p and back to its start after the loop
+  for (int64_t i = 0; i < c->Len; ++i) {
+    c->Items[c->Starts[c->Raw[i].Partition]++] = c->Raw[i];
+  }
+  for (int64_t p = rc->Partitions; p > 0; --p) {
+    c->Starts[p] = c->Starts[p - 1];
+  }
+  c->Starts[0] = 0;
+  return z_OK;
+}
+
+z_Error z_recoverApply(z_RecoverState *rc, z_RecoverChunk *c, int64_t p) {
+  for (int64_t i = c->Starts[p]; i < c->Starts[p + 1]; ++i) {
+    z_RecoverItem *item = &c->Items[i];
+    z_Error ret = rc->Apply(rc->Attr, item->Record, item->Offset, item->Size);
+    if (ret != z_OK && ret != z_ERR_EXIST && ret != z_ERR_NOT_FOUND &&
+        ret != z_ERR_CONFLICT) {
+      z_error("apply %d offset %lld", ret, item->Offset);
+      return ret;
+    }
+  }
+  return z_OK;
+}
+
+void *z_recoverWorkerRun(void *arg) {
+  z_RecoverWorker *w = (z_RecoverWorker *)arg;
+  z_RecoverState *rc = w->Recover;
+  // the next chunk to apply
+  int64_t next = 0;
+  while (atomic_load(&rc->Ret) == z_OK) {
+    bool is_read_done = atomic_load(&rc->IsReadDone);
+    int64_t read_len = atomic_load(&rc->ReadLen);
+
+    if (next < read_len) {
+      z_RecoverChunk *c = z_recoverChunk(rc, next);
+      if (atomic_load(&c->IsParsed) == true) {
+        z_Error ret = z_recoverApply(rc, c, w->Partition);
+        if (ret != z_OK) {
+          z_recoverFail(rc, ret);
+          break;
+        }
+        atomic_fetch_add(&c->Applied, 1);
+        ++next;
+        continue;
+      }
+    }
+
+    int64_t parse = atomic_load(&rc->ParseNext);
+    if (parse < read_len &&
+        atomic_compare_exchange_strong(&rc->ParseNext, &parse, parse + 1)) {
+      z_RecoverChunk *c = z_recoverChunk(rc, parse);
+      z_Error ret = z_recoverParse(rc, c);
+      if (ret != z_OK) {
+        z_recoverFail(rc, ret);
+        break;
+      }
+      atomic_store(&c->IsParsed, true);
+      continue;
+    }
+
+    if (is_read_done == true && next == read_len) {
+      break;
+    }
+    sched_yield();
+  }
+  return nullptr;
+}
+
+// waits until the chunk read before in the same slot is applied
+z_RecoverChunk *z_recoverWaitChunk(z_RecoverState *rc, int64_t i) {
+  z_RecoverChunk *c = z_recoverChunk(rc, i);
+  while (i >= rc->ChunksLen && atomic_load(&c->Applied) < rc->Partitions) {
+    if (atomic_load(&rc->Ret) != z_OK) {
+      return nullptr;
+    }
+    sched_yield();
+  }
+  return c;
+}
+
+z_Error z_recoverPRead(int64_t fd, int8_t *data, int64_t size, int64_t pos) {
+  while (size > 0) {
+    int64_t l = pread(fd, data, size, pos);
+    if (l < 0 && errno == EINTR) {
+      continue;
+    }
+    if (l <= 0) {
+      z_error("pread %lld pos %lld", l, pos);
+      return z_ERR_FS;
+    }
+    data += l;
+    size -= l;
+    pos += l;
+  }
+  return z_OK;
+}
+
+// reads [pos, size) of a segment into chunks, *chunk is the next chunk index.
+// a pos in the head of the segment starts at its first frame
+z_Error z_recoverReadSegment(z_RecoverState *rc, char *path, int64_t segment,
+                             int64_t pos, int64_t *chunk, z_Recovery *rcv) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(path, segment, p);
+  int64_t size = z_SegmentSize(path, segment);
+  int64_t fd = open(p, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    z_error("open %s %d", p, errno);
+    return z_ERR_FS;
+  }
+
+  // a segment too short for a head holds a torn legacy frame at most
+  int64_t base = z_SEGMENT_LEGACY;
+  z_Error ret = z_segmentReadBase(fd, &base);
+  if (ret == z_ERR_NOT_FOUND) {
+    ret = z_OK;
+  }
+  if (pos < z_SegmentStart(base)) {
+    pos = z_SegmentStart(base);
+  }
+  posix_fadvise(fd, pos, 0, POSIX_FADV_SEQUENTIAL);
+
+  while (pos < size && ret == z_OK) {
+    z_RecoverChunk *c = z_recoverWaitChunk(rc, *chunk);
+    if (c == nullptr) {
+      ret = (z_Error)atomic_load(&rc->Ret);
+      break;
+    }
+
+    int64_t l = size - pos < c->Cap ? size - pos : c->Cap;
+    ret = z_recoverPRead(fd, c->Data, l, pos);
+    if (ret != z_OK) {
+      break;
+    }
+    // the kernel reads the next chunk while this one is parsed
+    posix_fadvise(fd, pos + l, c->Cap, POSIX_FADV_WILLNEED);
+
+    // [0, end) is the records of the whole batches, next scans the one after
+    int64_t end = 0;
+    int64_t len = 0;
+    int64_t next = 0;
+    int64_t next_len = 0;
+    int64_t record_size = 0;
+    while (next < l) {
+      z_Frame f;
+      if (z_FrameParse(c->Data + next, l - next, base, &f) == false) {
+        if (l - next >= z_FRAME_PARSE_MAX) {
+          z_error("broken frame at %lld of segment %lld", pos + next, segment);
+          ret = z_ERR_INVALID_DATA;
+        }
+        // the head is cut, the chunk takes at least its most bytes
+        record_size = z_FRAME_PARSE_MAX;
+        break;
+      }
+      record_size = f.Size;
+      if (next + record_size > l) {
+        break;
+      }
+      next += record_size;
+      ++next_len;
+      if (z_RecordIsBatched(&f.Head)) {
+        continue;
+      }
+
+      rcv->Seq = f.Seq;
+      rcv->SeqOffset = z_SegmentOffset(segment, pos + next - record_size);
+      end = next;
+      len = next_len;
+    }
+    if (ret != z_OK) {
+      break;
+    }
+
+    if (len == 0) {
+      if (pos + l == size && next_len > 0) {
+        rcv->IsTorn = true;
+        break;
+      }
+
+      // a record larger than the chunk, or a torn one at the end
+      if (pos + l == size) {
+        z_error("torn record at %lld of segment %lld", pos + next, segment);
+        ret = z_ERR_INVALID_DATA;
+        break;
+      }
+
+      // a batch larger than the chunk, the chunk grows to take it
+      int64_t cap = next + record_size > c->Cap * 2 ? next + record_size
+                                                    : c->Cap * 2;
+      int8_t *data = z_realloc(c->Data, cap);
+      if (data == nullptr) {
+        ret = z_ERR_NOSPACE;
+        break;
+      }
+      c->Data = data;
+      c->Cap = cap;
+      continue;
+    }
+
+    c->Size = end;
+    c->Offset = z_SegmentOffset(segment, pos);
+    c->Base = base;
+    c->Len = len;
+    atomic_store(&c->IsParsed, false);
+    atomic_store(&c->Applied, 0);
+    atomic_store(&rc->ReadLen, ++*chunk);
+
+    rcv->Records += len;
+    rcv->Bytes += end;
+    pos += end;
+  }
+
+  close(fd);
+  rcv->Offset = z_SegmentOffset(segment, pos);
+  return ret;
+}
+
+void z_RecoverStateDestroy(z_RecoverState *rc) {
+  if (rc == nullptr || rc->Chunks == nullptr) {
+    return;
+  }
+
+  for (int64_t i = 0; i < rc->ChunksLen; ++i) {
+    z_free(rc->Chunks[i].Data);
+    z_free(rc->Chunks[i].Raw);
+    z_free(rc->Chunks[i].Items);
+    z_free(rc->Chunks[i].Starts);
+  }
+  z_free(rc->Chunks);
+}
+
+z_Error z_recoverInit(z_RecoverState *rc, int64_t threads, void *attr,
+                      z_BinLogAfterWrite *apply) {
+  *rc = (z_RecoverState){.Attr = attr, .Apply = apply, .Partitions = threads};
+  atomic_store(&rc->ReadLen, 0);
+  atomic_store(&rc->ParseNext, 0);
+  atomic_store(&rc->IsReadDone, false);
+  atomic_store(&rc->Ret, z_OK);
+
+  rc->ChunksLen = threads * 2;
+  rc->Chunks = z_malloc(sizeof(z_RecoverChunk) * rc->ChunksLen);
+  if (rc->Chunks == nullptr) {
+    return z_ERR_NOSPACE;
+  }
+  memset(rc->Chunks, 0, sizeof(z_RecoverChunk) * rc->ChunksLen);
+
+  for (int64_t i = 0; i < rc->ChunksLen; ++i) {
+    z_RecoverChunk *c = &rc->Chunks[i];
+    c->Data = z_malloc(z_RECOVER_CHUNK_SIZE);
+    c->Cap = z_RECOVER_CHUNK_SIZE;
+    c->Starts = z_malloc(sizeof(int64_t) * (threads + 1));
+    if (c->Data == nullptr || c->Starts == nullptr) {
+      return z_ERR_NOSPACE;
+    }
+    atomic_store(&c->IsParsed, false);
+    atomic_store(&c->Applied, 0);
+  }
+  return z_OK;
+}
+
+// replays the segments from start with threads workers, apply must be safe to
+// call from several threads for different keys
+z_Error z_Recover(char *path, int64_t start, int64_t threads, void *attr,
+                  z_BinLogAfterWrite *apply, z_Recovery *rcv) {
+  if (path == nullptr || threads <= 0 || apply == nullptr || rcv == nullptr ||
+      rcv->Buckets <= 0) {
+    z_error("path == nullptr || threads <= 0 || apply == nullptr || rcv == "
+            "nullptr || rcv->Buckets <= 0");
+    return z_ERR_INVALID_DATA;
+  }
+
+  int64_t start_ns = z_NowNS();
+  z_unique(z_RecoverState) rc = {};
+  z_Error ret = z_recoverInit(&rc, threads, attr, apply);
+  rc.Hash = rcv->Hash;
+  rc.Buckets = rcv->Buckets;
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_RecoverWorker *ws = z_malloc(sizeof(z_RecoverWorker) * threads);
+  if (ws == nullptr) {
+    return z_ERR_NOSPACE;
+  }
+  z_defer(
+      ^(z_RecoverWorker **ptr) {
+        z_free(*ptr);
+      },
+      &ws);
+
+  int64_t started = 0;
+  for (; started < threads; ++started) {
+    ws[started] = (z_RecoverWorker){.Recover = &rc, .Partition = started};
+    if (z_ThreadCreate(&ws[started].Tid, z_recoverWorkerRun, &ws[started]) !=
+        0) {
+      z_error("z_ThreadCreate");
+      z_recoverFail(&rc, z_ERR_INVALID_DATA);
+      break;
+    }
+  }
+
+  // a compacted segment has its live records in the later ones
+  int64_t segment = z_SegmentOf(start);
+  int64_t pos = z_SegmentPos(start);
+  if (z_SegmentSize(path, segment) < 0) {
+    segment = z_SegmentNext(path, segment);
+    pos = 0;
+  }
+
+  int64_t chunk = 0;
+  for (; segment >= 0 && atomic_load(&rc.Ret) == z_OK && rcv->IsTorn == false;
+       segment = z_SegmentNext(path, segment), pos = 0) {
+    if (z_SegmentSize(path, segment) <= pos) {
+      continue;
+    }
+
+    ret = z_recoverReadSegment(&rc, path, segment, pos, &chunk, rcv);
+    if (ret != z_OK) {
+      z_recoverFail(&rc, ret);
+    }
+  }
+
+  atomic_store(&rc.IsReadDone, true);
+  for (int64_t i = 0; i < started; ++i) {
+    z_ThreadJion(ws[i].Tid);
+  }
+
+  rcv->NS = z_NowNS() - start_ns;
+  return (z_Error)atomic_load(&rc.Ret);
+}
+
+#endif
@@ -2,14 +2,27 @@
 #define z_CACHE_H
 
 #include <stdatomic.h>
+#include <string.h>
+#include <sys/uio.h>
 
 #include "zerror/error.h"
+#include "zutils/assert.h"
 #include "zutils/log.h"
 #include "zutils/mem.h"
 
-
+// a ring of records, the offsets only grow and Data + offset % Size is where
+// a record is. [Start, Unused) is waiting for its removal, [Unused, End) is
+// readable once published. a record never wraps around, a pad fills the end
+// of Data instead.
+// any thread adds by z_CacheReserve, a fill and z_CachePublish, the space is
+// taken by a cas on End. one thread at a time moves Unused and removes, the
+// removed bytes are zeroed so a reserved head reads as not ready
 typedef struct {
+  // of the data after the head, rounded up to sizeof(z_CacheRecord)
   int64_t Size;
+  atomic_bool IsReady;
+  // fills the end of Data, BeforeRemove is not called on it
+  bool IsPad;
 } z_CacheRecord;
 
 typedef bool z_CacheBeforeRemove(void *attr, z_CacheRecord *r);
@@ -30,16 +43,21 @@ z_Error z_CacheInit(z_Cache *cache, int64_t size) {
     return z_ERR_INVALID_DATA;
   }
 
+  // records and pads are aligned, so a pad always fits in the end of Data
+  size -= size % sizeof(z_CacheRecord);
   cache->Data = z_malloc(size);
   if (cache->Data == nullptr) {
     z_error("cache->Data == nullptr");
     return z_ERR_NOSPACE;
   }
+  memset(cache->Data, 0, size);
 
   cache->Size = size;
   atomic_store(&cache->Start, 0);
   atomic_store(&cache->End, 0);
   atomic_store(&cache->Unused, 0);
+  cache->Attr = nullptr;
+  cache->BeforeRemove = nullptr;
   return z_OK;
 }
 
@@ -54,34 +72,107 @@ void z_CacheDestory(z_Cache *cache) {
   cache->Size = 0;
 }
 
-z_Error z_CacheAdd(z_Cache *cache, int8_t *data, int64_t size,
-                   uint64_t *offset) {
-  if (cache == nullptr || data == nullptr || size == 0 || offset == nullptr) {
-    z_error(
-        "cache == nullptr || data == nullptr || size == 0 || offset == nullptr");
+int64_t z_cacheAlign(int64_t size) {
+  return (size + sizeof(z_CacheRecord) - 1) / sizeof(z_CacheRecord) *
+         sizeof(z_CacheRecord);
+}
+
+// takes the space of a record of size bytes, *offset is where it is. fill
+// (*cr + 1) and z_CachePublish it
+z_Error z_CacheReserve(z_Cache *cache, int64_t size, uint64_t *offset,
+                       z_CacheRecord **cr) {
+  if (cache == nullptr || size == 0 || offset == nullptr || cr == nullptr) {
+    z_error("cache == nullptr || size == 0 || offset == nullptr || cr == "
+            "nullptr");
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t start = atomic_load(&cache->Start);
-  uint64_t end = atomic_load(&cache->End);
-  if (start > end) {
-    z_panic("add cache panic start(%llu) > end(%llu)", start, end);
+  int64_t len = sizeof(z_CacheRecord) + z_cacheAlign(size);
+  if (len > cache->Size) {
+    z_error("size %lld is larger than the cache %lld", size, cache->Size);
     return z_ERR_INVALID_DATA;
   }
 
-  if (end + size + sizeof(z_CacheRecord) - start > cache->Size) {
-    z_error("no space start %llu end %llu size %lld", start, end, size);
-    return z_ERR_NOSPACE;
+  uint64_t end = atomic_load(&cache->End);
+  int64_t pad = 0;
+  while (true) {
+    uint64_t start = atomic_load(&cache->Start);
+    // End moved on and was removed up to since it was loaded
+    if (start > end) {
+      end = atomic_load(&cache->End);
+      continue;
+    }
+
+    pad = 0;
+    if (end % cache->Size + len > cache->Size) {
+      pad = cache->Size - end % cache->Size;
+    }
+    if (end + pad + len - start > cache->Size) {
+      z_debug("no space start %llu end %llu size %lld", start, end, size);
+      return z_ERR_NOSPACE;
+    }
+
+    if (atomic_compare_exchange_weak(&cache->End, &end, end + pad + len)) {
+      break;
+    }
+  }
+
+  // the pad needs no fill, it is published at once
+  if (pad > 0) {
+    z_CacheRecord *pr = (z_CacheRecord *)(cache->Data + end % cache->Size);
+    pr->Size = pad - sizeof(z_CacheRecord);
+    pr->IsPad = true;
+    atomic_store(&pr->IsReady, true);
+  }
+
+  *offset = end + pad;
+  *cr = (z_CacheRecord *)(cache->Data + *offset % cache->Size);
+  (*cr)->Size = len - sizeof(z_CacheRecord);
+  (*cr)->IsPad = false;
+  return z_OK;
+}
+
+// the filled record is readable from now on
+void z_CachePublish(z_Cache *cache, z_CacheRecord *cr) {
+  z_assert(cache != nullptr, cr != nullptr);
+  atomic_store(&cr->IsReady, true);
+}
+
+// copies the iov to one record, *offset is where it is
+z_Error z_CacheAddV(z_Cache *cache, struct iovec *iov, int64_t iov_len,
+                    uint64_t *offset) {
+  int64_t size = 0;
+  for (int64_t i = 0; i < iov_len; ++i) {
+    size += iov[i].iov_len;
   }
 
-  *offset = atomic_fetch_add(&cache->End, size + sizeof(z_CacheRecord));
-  z_CacheRecord *cr = (z_CacheRecord *)(cache->Data + *offset % cache->Size);
-  cr->Size = size;
+  z_CacheRecord *cr = nullptr;
+  z_Error ret = z_CacheReserve(cache, size, offset, &cr);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  int8_t *dst = (int8_t *)(cr + 1);
+  for (int64_t i = 0; i < iov_len; ++i) {
+    memcpy(dst, iov[i].iov_base, iov[i].iov_len);
+    dst += iov[i].iov_len;
+  }
 
-  memcpy(cr + 1, data, size);
+  z_CachePublish(cache, cr);
   return z_OK;
 }
 
+z_Error z_CacheAdd(z_Cache *cache, int8_t *data, int64_t size,
+                   uint64_t *offset) {
+  if (data == nullptr) {
+    z_error("data == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  struct iovec iov = {.iov_base = data, .iov_len = size};
+  return z_CacheAddV(cache, &iov, 1, offset);
+}
+
 z_Error z_CachePtr(z_Cache *cache, uint64_t offset, void **ptr) {
   if (cache == nullptr || ptr == nullptr) {
     z_error("cache == nullptr || ptr == nullptr");
@@ -98,14 +189,22 @@ z_Error z_CachePtr(z_Cache *cache, uint64_t offset, void **ptr) {
     return z_ERR_INVALID_DATA;
   }
 
-  *ptr = cache->Data + (offset % cache->Size);
+  // reserved and not published yet
+  z_CacheRecord *cr = (z_CacheRecord *)(cache->Data + (offset % cache->Size));
+  if (atomic_load(&cr->IsReady) == false) {
+    return z_ERR_CACHE_MISS;
+  }
+
+  *ptr = cr;
   return z_OK;
 }
 
-void z_CacheUnused(z_Cache *cache) {
+// moves Unused over one record, false if there is none or it is not
+// published yet
+bool z_CacheUnused(z_Cache *cache) {
   if (cache == nullptr) {
     z_error("cache == nullptr");
-    return;
+    return false;
   }
 
   uint64_t unused = atomic_load(&cache->Unused);
@@ -113,22 +212,25 @@ void z_CacheUnused(z_Cache *cache) {
 
   if (unused > end) {
     z_error("unused > end unused %llu end %llu", unused, end);
-    return;
+    return false;
   }
 
   if (unused == end) {
-    z_info("unused == end unused %llu end %llu", unused, end);
-    return;
+    return false;
   }
 
   z_CacheRecord *cr = (z_CacheRecord *)(cache->Data + unused % cache->Size);
+  if (atomic_load(&cr->IsReady) == false) {
+    return false;
+  }
+
   uint64_t des = unused + cr->Size + sizeof(z_CacheRecord);
   bool ret = atomic_compare_exchange_strong(&cache->Unused, &unused, des);
   if (ret == false) {
     z_error("unused %llu", unused);
   }
 
-  return;
+  return ret;
 }
 
 void z_CacheRemove(z_Cache *cache, uint64_t unused) {
@@ -155,13 +257,14 @@ void z_CacheRemove(z_Cache *cache, uint64_t unused) {
   while (start < unused) {
     z_CacheRecord *cr = (z_CacheRecord *)(cache->Data + start % cache->Size);
 
-    z_Error ret = cache->BeforeRemove(cache->Attr, cr);
-    if (ret != z_OK) {
+    if (cr->IsPad == false && cache->BeforeRemove != nullptr &&
+        cache->BeforeRemove(cache->Attr, cr) == false) {
       z_error("BeforeRemove start %llu unused %llu", start, unused);
       break;
     }
 
     uint64_t des = start + cr->Size + sizeof(z_CacheRecord);
+    memset(cr, 0, des - start);
     bool atomic_ret =
         atomic_compare_exchange_strong(&cache->Start, &start, des);
     if (atomic_ret == false) {
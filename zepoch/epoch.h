@@ -19,15 +19,38 @@ typedef struct {
   z_EpochFunc *Func;
 } z_EpochAction;
 
+// an action bumped while all the slots are taken, it waits on Parked
+typedef struct z_epochParked {
+  int64_t Epoch;
+  z_EpochAction Action;
+  struct z_epochParked *Next;
+} z_epochParked;
+
 typedef struct {
   atomic_int_fast64_t CurrentEpoch;
   atomic_int_fast64_t *LocalEpochs;
   int64_t LocalEpochsLen;
   z_EpochAction *Actions;
   int64_t ActionsLen;
+  _Atomic(z_epochParked *) Parked;
 } z_Epoch;
 
+void z_epochPark(z_Epoch *e, z_epochParked *p) {
+  p->Next = atomic_load(&e->Parked);
+  while (atomic_compare_exchange_weak(&e->Parked, &p->Next, p) == false) {
+  }
+}
+
+// an action not run by now is dropped, parked or in a slot, the owner runs
+// z_EpochRunActions before
 void z_EpochDestroy(z_Epoch *e) {
+  z_epochParked *p = atomic_exchange(&e->Parked, nullptr);
+  while (p != nullptr) {
+    z_epochParked *next = p->Next;
+    z_free(p);
+    p = next;
+  }
+
   if (e->LocalEpochs != nullptr) {
     z_free(e->LocalEpochs);
     e->LocalEpochsLen = 0;
@@ -46,6 +69,7 @@ z_Error z_EpochInit(z_Epoch *e, int64_t local_epochs_len, int64_t actions_len) {
   e->LocalEpochsLen = local_epochs_len;
   e->ActionsLen = actions_len;
   atomic_store(&e->CurrentEpoch, 0);
+  atomic_store(&e->Parked, nullptr);
 
   e->LocalEpochs = z_malloc(sizeof(atomic_int_fast64_t) * e->LocalEpochsLen);
   if (e->LocalEpochs == nullptr) {
@@ -86,6 +110,13 @@ void z_EpochUnProtect(z_Epoch *e) {
   atomic_store(&e->LocalEpochs[z_ThreadID()], z_INVALID_EPOCH);
 }
 
+// z_EpochProtect does not nest, a protected thread must not protect again
+bool z_EpochIsProtected(z_Epoch *e) {
+  z_assert(e != nullptr);
+  z_assert(z_ThreadID() != z_INVALID_THREAD_ID);
+  return atomic_load(&e->LocalEpochs[z_ThreadID()]) != z_INVALID_EPOCH;
+}
+
 int64_t z_EpochSafe(z_Epoch *e) {
   z_assert(e != nullptr);
 
@@ -100,23 +131,49 @@ int64_t z_EpochSafe(z_Epoch *e) {
   return se;
 }
 
+// an action slot being filled or run
+#define z_EPOCH_ACTION_BUSY -2
+
 void z_EpochRunActions(z_Epoch *e) {
   z_assert(e != nullptr);
   int64_t safe_epoch =  z_EpochSafe(e);
 
   for (int64_t i = 0; i < e->ActionsLen; ++i) {
     int64_t action_epoch = atomic_load(&e->Actions[i].Epoch);
-    if (action_epoch != z_INVALID_EPOCH && action_epoch < safe_epoch) {
-      void *Attr = e->Actions[i].Attr;
-      uint64_t Addr = e->Actions[i].Addr;
-      z_EpochFunc *Func = e->Actions[i].Func;
-      z_Error ret = Func(Attr, Addr);
-      if (ret != z_OK) {
-        z_error("action run failed %d", ret);
-        continue;
-      }
-      atomic_store(&e->Actions[i].Epoch, z_INVALID_EPOCH);
+    if (action_epoch < 0 || action_epoch >= safe_epoch) {
+      continue;
     }
+
+    // claim it so that a concurrent bump doesn't run it twice
+    if (atomic_compare_exchange_strong(&e->Actions[i].Epoch, &action_epoch,
+                                       z_EPOCH_ACTION_BUSY) == false) {
+      continue;
+    }
+
+    void *Attr = e->Actions[i].Attr;
+    uint64_t Addr = e->Actions[i].Addr;
+    z_EpochFunc *Func = e->Actions[i].Func;
+    z_Error ret = Func(Attr, Addr);
+    if (ret != z_OK) {
+      z_error("action run failed %d", ret);
+      atomic_store(&e->Actions[i].Epoch, action_epoch);
+      continue;
+    }
+    atomic_store(&e->Actions[i].Epoch, z_INVALID_EPOCH);
+  }
+
+  // the list is taken whole so no other thread runs them too, the ones not
+  // safe yet are parked again
+  z_epochParked *p = atomic_exchange(&e->Parked, nullptr);
+  while (p != nullptr) {
+    z_epochParked *next = p->Next;
+    if (p->Epoch < safe_epoch &&
+        p->Action.Func(p->Action.Attr, p->Action.Addr) == z_OK) {
+      z_free(p);
+    } else {
+      z_epochPark(e, p);
+    }
+    p = next;
   }
 }
 
@@ -129,17 +186,28 @@ z_Error z_EpohBump(z_Epoch *e, z_EpochAction action) {
     int64_t action_epoch = atomic_load(&e->Actions[i].Epoch);
     if (action_epoch == z_INVALID_EPOCH) {
       if (atomic_compare_exchange_strong(&e->Actions[i].Epoch, &action_epoch,
-                                         current_epoch) == true) {
+                                         z_EPOCH_ACTION_BUSY) == true) {
         e->Actions[i].Attr = action.Attr;
         e->Actions[i].Addr = action.Addr;
         e->Actions[i].Func = action.Func;
+        atomic_store(&e->Actions[i].Epoch, current_epoch);
         return z_OK;
       }
     }
   }
 
-  z_error("no more free actions");
-  return z_ERR_NOSPACE;
+  // the slots are all taken, the action waits on the list and the bump does
+  // not fail
+  z_epochParked *p = z_malloc(sizeof(z_epochParked));
+  if (p == nullptr) {
+    z_error("no more free actions");
+    return z_ERR_NOSPACE;
+  }
+  p->Epoch = current_epoch;
+  p->Action = (z_EpochAction){
+      .Attr = action.Attr, .Addr = action.Addr, .Func = action.Func};
+  z_epochPark(e, p);
+  return z_OK;
 }
 
 #endif
\ No newline at end of file
@@ -1,6 +1,11 @@
 #include "zepoch/epoch.h"
 #include "ztest/test.h"
 
+z_Error z_EpochTestRun(void *attr, uint64_t addr) {
+  ++*(int64_t *)attr;
+  return z_OK;
+}
+
 void z_EpochTest() {
   z_ThreadIDs ts;
   z_Error ret = z_ThreadIDsInit(&ts, 1024);
@@ -16,6 +21,21 @@ void z_EpochTest() {
   int64_t tid = z_ThreadID();
   z_ASSERT_TRUE(tid != z_INVALID_THREAD_ID);
 
+  // a protected thread holds the actions, the ones past the 32 slots are
+  // parked and all of them run once it is gone
+  int64_t runs = 0;
+  z_EpochProtect(&e);
+  bool is_bumped = true;
+  for (int64_t i = 0; i < 40; ++i) {
+    z_EpochAction action = {.Attr = &runs, .Func = z_EpochTestRun};
+    is_bumped = is_bumped && z_EpohBump(&e, action) == z_OK;
+  }
+  z_ASSERT_TRUE(is_bumped);
+  z_ASSERT_TRUE(runs == 0 && atomic_load(&e.Parked) != nullptr);
+  z_EpochUnProtect(&e);
+  z_EpochRunActions(&e);
+  z_ASSERT_TRUE(runs == 40 && atomic_load(&e.Parked) == nullptr);
+
   z_ThreadIDDestroy(&ts);
   z_ThreadIDsDestroy(&ts);
   z_EpochDestroy(&e);
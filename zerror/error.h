@@ -13,6 +13,7 @@ typedef enum : uint8_t {
   z_ERR_EXIST = 32,
   z_ERR_NOT_FOUND = 33,
   z_ERR_CONFLICT = 34,
+  z_ERR_ABORTED = 35,
 
   z_ERR_CACHE_MISS = 64,
 } z_Error;
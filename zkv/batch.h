@@ -0,0 +1,453 @@
+#ifndef z_BATCH_H
+#define z_BATCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "zbinlog/binlog.h"
+#include "zbinlog/file.h"
+#include "zbinlog/file_record.h"
+#include "zerror/error.h"
+#include "zkv/kv.h"
+#include "zrecord/record.h"
+#include "zutils/assert.h"
+#include "zutils/buffer.h"
+#include "zutils/defer.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// the writes of z_KVWrite, appended and applied as one unit or not at all. the
+// records are
+// kept back to back in Data as they go on the wire, so a batch costs one
+// allocation as it grows rather than one per write
+typedef struct {
+  int8_t *Data;
+  int64_t Size;
+  int64_t Cap;
+  int64_t Len;
+} z_KVWriteBatch;
+
+void z_KVWriteBatchInit(z_KVWriteBatch *b) {
+  z_assert(b != nullptr);
+  *b = (z_KVWriteBatch){};
+}
+
+void z_KVWriteBatchDestroy(z_KVWriteBatch *b) {
+  if (b == nullptr || b->Data == nullptr) {
+    return;
+  }
+  z_free(b->Data);
+  b->Size = 0;
+  b->Cap = 0;
+  b->Len = 0;
+}
+
+// drops the writes, the memory is kept for the next batch
+void z_KVWriteBatchClear(z_KVWriteBatch *b) {
+  b->Size = 0;
+  b->Len = 0;
+}
+
+z_Error z_kvWriteBatchAdd(z_KVWriteBatch *b, uint8_t op, z_ConstBuffer k,
+                          z_ConstBuffer v, z_ConstBuffer src_v) {
+  z_assert(b != nullptr, k.Size != 0, k.Data != nullptr);
+  if (b->Len >= z_BINLOG_BATCH_LEN) {
+    z_error("batch len %lld", b->Len);
+    return z_ERR_NOSPACE;
+  }
+
+  int64_t size =
+      z_RecordPutSize(z_RECORD_NEW_FORMAT, op, k.Size, v.Size, src_v.Size);
+  if (size == 0) {
+    z_error("op %u key %lld val %lld", op, k.Size, v.Size);
+    return z_ERR_INVALID_DATA;
+  }
+  if (b->Size + size > b->Cap) {
+    int64_t cap = b->Cap == 0 ? 1024 : b->Cap * 2;
+    while (cap < b->Size + size) {
+      cap *= 2;
+    }
+    int8_t *data = z_realloc(b->Data, cap);
+    if (data == nullptr) {
+      z_error("data == nullptr");
+      return z_ERR_NOSPACE;
+    }
+    b->Data = data;
+    b->Cap = cap;
+  }
+
+  z_RecordPut(b->Data + b->Size, z_RECORD_NEW_FORMAT, op, k, v, src_v);
+  b->Size += size;
+  ++b->Len;
+  return z_OK;
+}
+
+z_Error z_KVWriteBatchInsert(z_KVWriteBatch *b, z_ConstBuffer k,
+                             z_ConstBuffer v) {
+  z_assert(v.Size != 0, v.Data != nullptr);
+  return z_kvWriteBatchAdd(b, z_ROP_INSERT, k, v, (z_ConstBuffer){});
+}
+
+z_Error z_KVWriteBatchForceUpdate(z_KVWriteBatch *b, z_ConstBuffer k,
+                                  z_ConstBuffer v) {
+  z_assert(v.Size != 0, v.Data != nullptr);
+  return z_kvWriteBatchAdd(b, z_ROP_FORCE_UPDATE, k, v, (z_ConstBuffer){});
+}
+
+z_Error z_KVWriteBatchForceUpsert(z_KVWriteBatch *b, z_ConstBuffer k,
+                                  z_ConstBuffer v) {
+  z_assert(v.Size != 0, v.Data != nullptr);
+  return z_kvWriteBatchAdd(b, z_ROP_FORCE_UPSERT, k, v, (z_ConstBuffer){});
+}
+
+z_Error z_KVWriteBatchUpdate(z_KVWriteBatch *b, z_ConstBuffer k,
+                             z_ConstBuffer v, z_ConstBuffer src_v) {
+  z_assert(v.Size != 0, v.Data != nullptr);
+  z_assert(src_v.Size != 0, src_v.Data != nullptr);
+  return z_kvWriteBatchAdd(b, z_ROP_UPDATE, k, v, src_v);
+}
+
+z_Error z_KVWriteBatchDelete(z_KVWriteBatch *b, z_ConstBuffer k) {
+  return z_kvWriteBatchAdd(b, z_ROP_DELETE, k, (z_ConstBuffer){},
+                           (z_ConstBuffer){});
+}
+
+// splits the back to back records of data into rs, false if one has no key,
+// they do not end at size or are more than z_BINLOG_BATCH_LEN
+bool z_KVRecordsSplit(int8_t *data, int64_t size, z_FileRecord *rs,
+                      int64_t *rs_len) {
+  int64_t pos = 0;
+  *rs_len = 0;
+  while (pos < size && *rs_len < z_BINLOG_BATCH_LEN) {
+    z_Record *r = (z_Record *)(data + pos);
+    if (z_RecordHeadSize(data + pos, size - pos) == 0 ||
+        z_RecordOPOf(r) == 0 || pos + z_RecordSize(r) > size ||
+        z_RecordSizesOf(r).KeySize == 0) {
+      return false;
+    }
+    rs[(*rs_len)++] = (z_FileRecord){.Record = r};
+    pos += z_RecordSize(r);
+  }
+  return pos == size && *rs_len > 0;
+}
+
+// the result rs[i] would have applied after rs[0, i), a key written before in
+// the batch is taken from there and the others from the map. the caller holds
+// z_BinLogLock, so no write changes the map meanwhile
+z_Error z_kvBatchCheckRecord(z_KV *kv, z_FileRecord *rs, int64_t i) {
+  z_Record *r = rs[i].Record;
+  z_ConstBuffer k;
+  z_Error ret = z_RecordKey(r, &k);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_Record *last = nullptr;
+  for (int64_t j = i - 1; j >= 0 && last == nullptr; --j) {
+    z_ConstBuffer jk;
+    if (z_RecordKey(rs[j].Record, &jk) == z_OK && z_BufferIsEqual(&jk, &k)) {
+      last = rs[j].Record;
+    }
+  }
+
+  int64_t offset = -1;
+  bool is_found = last != nullptr ? z_RecordOPOf(last) != z_ROP_DELETE
+                                  : z_MapFind(&kv->Map, k, &offset) == z_OK;
+  switch (z_RecordOPOf(r)) {
+  case z_ROP_INSERT:
+    return is_found ? z_ERR_EXIST : z_OK;
+  case z_ROP_DELETE:
+  case z_ROP_FORCE_UPDATE:
+    return is_found ? z_OK : z_ERR_NOT_FOUND;
+  case z_ROP_FORCE_UPSERT:
+    return z_OK;
+  case z_ROP_UPDATE: {
+    if (is_found == false) {
+      return z_ERR_NOT_FOUND;
+    }
+    z_ConstBuffer src_v;
+    ret = z_RecordSrcValue(r, &src_v);
+    if (ret != z_OK) {
+      return ret;
+    }
+    if (last == nullptr) {
+      return z_mapIsEqual(kv, (z_ConstBuffer){}, src_v, offset)
+                 ? z_OK
+                 : z_ERR_CONFLICT;
+    }
+    z_ConstBuffer v;
+    ret = z_RecordValue(last, &v);
+    if (ret != z_OK) {
+      return ret;
+    }
+    return z_BufferIsEqual(&v, &src_v) ? z_OK : z_ERR_CONFLICT;
+  }
+  default:
+    z_error("invalid op %d", z_RecordOPOf(r));
+    return z_ERR_INVALID_DATA;
+  }
+}
+
+// a batch with a record that would fail is not written, the record has its
+// error and the others z_ERR_ABORTED
+z_Error z_kvBatchCheck(z_KV *kv, z_FileRecord *rs, int64_t rs_len,
+                       z_Error *rets) {
+  for (int64_t i = 0; i < rs_len; ++i) {
+    z_Error ret = z_kvBatchCheckRecord(kv, rs, i);
+    if (ret == z_OK) {
+      continue;
+    }
+
+    for (int64_t j = 0; rets != nullptr && j < rs_len; ++j) {
+      rets[j] = j == i ? ret : z_ERR_ABORTED;
+    }
+    return ret;
+  }
+  return z_OK;
+}
+
+// appends rs as one batch and applies them to the map in order, holding the
+// binlog lock once. they are checked first, when one would fail none of them
+// is written. a replay applies all of them or none, and a find sees all of
+// them or none, see z_MapBatchBegin. rets[i] is the result of rs[i], it may
+// be nullptr, the first failed one is returned, *seq is the seq of the last
+// one
+z_Error z_KVWriteRecords(z_KV *kv, z_FileRecord *rs, int64_t rs_len,
+                         z_Error *rets, int64_t *seq) {
+  z_assert(kv != nullptr, rs != nullptr, rs_len > 0);
+
+  z_Error ret = z_BinLogBatchPrepare(&kv->BinLog, rs, rs_len, rets);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_BinLogLock(&kv->BinLog);
+  ret = z_kvBatchCheck(kv, rs, rs_len, rets);
+  if (ret == z_OK) {
+    z_MapBatchBegin(&kv->Map);
+    ret = z_BinLogBatchCommit(&kv->BinLog, rs, rs_len, rets);
+    z_MapBatchEnd(&kv->Map);
+  }
+  z_BinLogUnLock(&kv->BinLog);
+
+  if (seq != nullptr) {
+    *seq = rs[rs_len - 1].Seq;
+  }
+  return ret;
+}
+
+z_Error z_KVWrite(z_KV *kv, z_KVWriteBatch *b, z_Error *rets, int64_t *seq) {
+  z_assert(kv != nullptr, b != nullptr);
+  if (b->Len == 0) {
+    return z_OK;
+  }
+
+  z_FileRecord rs[z_BINLOG_BATCH_LEN];
+  int64_t rs_len = 0;
+  if (z_KVRecordsSplit(b->Data, b->Size, rs, &rs_len) == false) {
+    z_error("invalid batch size %lld", b->Size);
+    return z_ERR_INVALID_DATA;
+  }
+  return z_KVWriteRecords(kv, rs, rs_len, rets, seq);
+}
+
+// the most keys of a z_KVFindBatch
+#define z_KV_FIND_BATCH_LEN 1024
+// records closer than this on the disk are read by one pread, reading the gap
+// costs less than another syscall
+#define z_KV_FIND_BATCH_GAP 4096
+// the most bytes of one pread of a z_KVFindBatch
+#define z_KV_FIND_BATCH_SPAN (64 * 1024)
+
+typedef struct {
+  int64_t Offset;
+  int64_t Index;
+} z_kvFindBatchItem;
+
+int z_kvFindBatchCompare(const void *a, const void *b) {
+  int64_t l = ((const z_kvFindBatchItem *)a)->Offset;
+  int64_t r = ((const z_kvFindBatchItem *)b)->Offset;
+  return (l > r) - (l < r);
+}
+
+// copies the value of r read at offset from the disk, it is cached as a
+// z_KVFind does
+z_Error z_kvFindBatchValue(z_KV *kv, z_Record *r, int64_t offset,
+                           bool is_protected, z_Buffer *v) {
+  z_Error ret = z_RecordCheck(r);
+  if (ret != z_OK) {
+    z_error("z_RecordCheck offset %lld", offset);
+    return ret;
+  }
+  if (is_protected) {
+    z_ValueCacheAdd(&kv->Cache, offset, r);
+  }
+
+  z_ConstBuffer vv;
+  ret = z_RecordValue(r, &vv);
+  if (ret != z_OK) {
+    z_error("z_RecordValue %d", ret);
+    return ret;
+  }
+  return z_BufferInitByConstBuffer(v, &vv);
+}
+
+// copies the value at offset read as a z_KVFind does
+z_Error z_kvFindBatchCopy(z_KV *kv, int64_t offset, bool is_protected,
+                          z_Buffer *v) {
+  z_ConstBuffer vv;
+  z_unique(z_Buffer) own = {};
+  z_Error ret =
+      z_kvOffsetValue(kv, offset, &vv, is_protected, z_kvBuffer(kv, &own));
+  if (ret != z_OK) {
+    return ret;
+  }
+  return z_BufferInitByConstBuffer(v, &vv);
+}
+
+// the record of the frame at pos of the l bytes of span, nullptr if they do
+// not hold all of it
+z_Record *z_kvFindBatchRecord(const int8_t *span, int64_t l, int64_t pos,
+                              int64_t base) {
+  z_Frame f;
+  if (pos >= l || z_FrameParse(span + pos, l - pos, base, &f) == false ||
+      pos + f.Size > l) {
+    return nullptr;
+  }
+  return z_FrameRecord(&f, span + pos);
+}
+
+// reads the records of items[start, end), sorted by offset and in the same
+// segment, by one pread of span. a record past the bytes read is read alone
+void z_kvFindBatchRead(z_KV *kv, z_kvFindBatchItem *items, int64_t start,
+                       int64_t end, int8_t *span, bool is_protected,
+                       z_Buffer *vs, z_Error *rets) {
+  int64_t first = items[start].Offset;
+  int64_t size = items[end - 1].Offset - first + z_PREAD_LEN;
+  if (size > z_KV_FIND_BATCH_SPAN) {
+    size = z_KV_FIND_BATCH_SPAN;
+  }
+  int64_t base = 0;
+  int64_t l = span == nullptr || z_PReaderSegmentBase(&kv->Reader,
+                                                      z_SegmentOf(first),
+                                                      &base) != z_OK
+                  ? -1
+                  : z_PReaderReadSpan(&kv->Reader, first, span, size);
+
+  for (int64_t i = start; i < end; ++i) {
+    int64_t pos = items[i].Offset - first;
+    int64_t index = items[i].Index;
+    z_Record *r = z_kvFindBatchRecord(span, l, pos, base);
+    if (r != nullptr) {
+      rets[index] =
+          z_kvFindBatchValue(kv, r, items[i].Offset, is_protected, &vs[index]);
+      continue;
+    }
+
+    rets[index] =
+        z_kvFindBatchCopy(kv, items[i].Offset, is_protected, &vs[index]);
+  }
+}
+
+// z_KVFind of len keys, rets[i] and vs[i] are the result of ks[i],
+// z_BufferDestroy the values found. the keys are looked up first by
+// z_MapFindBatch, the records on the disk are then read in offset order and
+// the ones close to each other by one pread. the cached ones and those in
+// memory are copied. the first failure other than z_ERR_NOT_FOUND is returned
+z_Error z_KVFindBatch(z_KV *kv, z_ConstBuffer *ks, int64_t len, z_Buffer *vs,
+                      z_Error *rets) {
+  z_assert(kv != nullptr, ks != nullptr, vs != nullptr, rets != nullptr);
+  if (len < 0 || len > z_KV_FIND_BATCH_LEN) {
+    z_error("find batch len %lld", len);
+    return z_ERR_INVALID_DATA;
+  }
+
+  bool is_new = false;
+  bool is_protected = z_kvProtect(kv, &is_new);
+  // the segments of the offsets are not retired by a compaction until unpinned
+  int64_t phase = z_PReaderPin(&kv->Reader);
+  z_defer(z_PReaderUnPin, &kv->Reader, phase);
+
+  int64_t offsets[z_KV_FIND_BATCH_LEN];
+  z_MapFindBatch(&kv->Map, ks, len, offsets, rets);
+
+  z_kvFindBatchItem items[z_KV_FIND_BATCH_LEN];
+  int64_t items_len = 0;
+  for (int64_t i = 0; i < len; ++i) {
+    vs[i] = (z_Buffer){};
+    int64_t offset = offsets[i];
+    if (rets[i] != z_OK) {
+      continue;
+    }
+
+    z_Record *r = nullptr;
+    if (z_PReaderIsInMemory(&kv->Reader, offset)) {
+      rets[i] = z_kvFindBatchCopy(kv, offset, is_protected, &vs[i]);
+    } else if (is_protected && z_ValueCacheGet(&kv->Cache, offset, &r)) {
+      z_ConstBuffer vv;
+      rets[i] = z_RecordValue(r, &vv);
+      if (rets[i] == z_OK) {
+        rets[i] = z_BufferInitByConstBuffer(&vs[i], &vv);
+      }
+    } else {
+      items[items_len++] = (z_kvFindBatchItem){.Offset = offset, .Index = i};
+    }
+  }
+
+  qsort(items, items_len, sizeof(z_kvFindBatchItem), z_kvFindBatchCompare);
+  // a failed allocation reads every record alone
+  int8_t *span = nullptr;
+  if (items_len > 0) {
+    span = z_malloc(z_KV_FIND_BATCH_SPAN);
+  }
+  int64_t start = 0;
+  while (start < items_len) {
+    int64_t end = start + 1;
+    while (end < items_len &&
+           z_SegmentOf(items[end].Offset) == z_SegmentOf(items[start].Offset) &&
+           items[end].Offset - items[end - 1].Offset <= z_KV_FIND_BATCH_GAP &&
+           items[end].Offset + z_PREAD_LEN - items[start].Offset <=
+               z_KV_FIND_BATCH_SPAN) {
+      ++end;
+    }
+    z_kvFindBatchRead(kv, items, start, end, span, is_protected, vs, rets);
+    start = end;
+  }
+  if (span != nullptr) {
+    z_free(span);
+  }
+
+  if (is_new) {
+    z_EpochUnProtect(&kv->Epoch);
+  }
+
+  for (int64_t i = 0; i < len; ++i) {
+    if (rets[i] != z_OK && rets[i] != z_ERR_NOT_FOUND) {
+      return rets[i];
+    }
+  }
+  return z_OK;
+}
+
+// splits the back to back records of data into their keys, each of them as
+// the record of a z_KV_REQ_TYPE_GET. false if one has no key, they do not end
+// at size or are more than z_KV_FIND_BATCH_LEN
+bool z_KVKeysSplit(int8_t *data, int64_t size, z_ConstBuffer *ks,
+                   int64_t *ks_len) {
+  int64_t pos = 0;
+  *ks_len = 0;
+  while (pos < size && *ks_len < z_KV_FIND_BATCH_LEN) {
+    z_Record *r = (z_Record *)(data + pos);
+    if (z_RecordHeadSize(data + pos, size - pos) == 0 ||
+        z_IsUpdateRecord(r) || z_RecordSizesOf(r).KeySize == 0 ||
+        pos + z_RecordSize(r) > size) {
+      return false;
+    }
+    z_RecordKey(r, &ks[(*ks_len)++]);
+    pos += z_RecordSize(r);
+  }
+  return pos == size && *ks_len > 0;
+}
+
+#endif
@@ -0,0 +1,276 @@
+#ifndef z_CHECKPOINT_H
+#define z_CHECKPOINT_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "zbinlog/file.h"
+#include "zerror/error.h"
+#include "zmap/map_record.h"
+#include "zutils/hash.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// a checkpoint is the index of a binlog up to Offset, path.ckpt holds a head,
+// RecordsLen z_MapRecord and DeadLen z_CheckpointDead, a restart loads it and
+// replays the records from Offset only
+#define z_CHECKPOINT_MAGIC 0x74706b637a
+#define z_CHECKPOINT_VERSION 4
+
+typedef struct {
+  uint64_t Magic;
+  int64_t Version;
+  // the records before Offset are in the checkpoint
+  int64_t Offset;
+  // the last record before Offset, it tells a checkpoint of another binlog
+  int64_t Seq;
+  int64_t SeqOffset;
+  int64_t RecordsLen;
+  int64_t DeadLen;
+  // the z_HashFamily of the map, the hashes of the records are of it
+  int64_t Hash;
+  // of what follows the head
+  uint64_t Sum;
+} z_CheckpointHead;
+
+// the dead bytes of a segment, see z_KV
+typedef struct {
+  int64_t Segment;
+  int64_t Bytes;
+} z_CheckpointDead;
+
+typedef struct {
+  int8_t *Data;
+  int64_t Size;
+  bool IsMapped;
+  const z_CheckpointHead *Head;
+  const z_MapRecord *Records;
+  const z_CheckpointDead *Dead;
+} z_Checkpoint;
+
+void z_CheckpointPath(const char *path, char *dst) {
+  snprintf(dst, z_SEGMENT_PATH_LEN, "%s.ckpt", path);
+}
+
+void z_CheckpointRemove(const char *path) {
+  char p[z_SEGMENT_PATH_LEN];
+  z_CheckpointPath(path, p);
+  remove(p);
+}
+
+// the CRC32C of the records and then the dead bytes, 8 bytes a step where the
+// cpu has the crc32 instructions, a restart sums the whole checkpoint
+uint64_t z_checkpointSum(const z_MapRecord *rs, int64_t rs_len,
+                         const z_CheckpointDead *dead, int64_t dead_len) {
+  uint32_t crc = z_Crc32c(0, (const int8_t *)rs, sizeof(z_MapRecord) * rs_len);
+  return z_Crc32c(crc, (const int8_t *)dead,
+                  sizeof(z_CheckpointDead) * dead_len);
+}
+
+z_Error z_checkpointWriteAll(int64_t fd, struct iovec *iov, int64_t iov_len) {
+  while (iov_len > 0) {
+    ssize_t n = writev(fd, iov, iov_len);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      z_error("writev %d", errno);
+      return z_ERR_FS;
+    }
+
+    while (iov_len > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      ++iov;
+      --iov_len;
+    }
+    if (iov_len > 0) {
+      iov->iov_base = (int8_t *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  return z_OK;
+}
+
+// fsyncs the directory of the file p, a rename is durable only after it
+z_Error z_checkpointSyncDir(const char *p) {
+  char dir[z_SEGMENT_PATH_LEN];
+  snprintf(dir, z_SEGMENT_PATH_LEN, "%s", p);
+  char *slash = strrchr(dir, '/');
+  if (slash == nullptr) {
+    snprintf(dir, z_SEGMENT_PATH_LEN, ".");
+  } else if (slash == dir) {
+    slash[1] = '\0';
+  } else {
+    slash[0] = '\0';
+  }
+
+  int64_t fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    z_error("open %s %d", dir, errno);
+    return z_ERR_FS;
+  }
+  z_Error ret = z_OK;
+  if (fsync(fd) != 0) {
+    z_error("fsync %s %d", dir, errno);
+    ret = z_ERR_FS;
+  }
+  close(fd);
+  return ret;
+}
+
+// writes path.tmp and renames it to path.ckpt, a crash leaves the old one
+z_Error z_CheckpointWrite(const char *path, z_CheckpointHead head,
+                          const z_MapRecord *rs, const z_CheckpointDead *dead) {
+  if (path == nullptr || rs == nullptr && head.RecordsLen > 0 ||
+      dead == nullptr && head.DeadLen > 0) {
+    z_error("path == nullptr || rs == nullptr || dead == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  head.Magic = z_CHECKPOINT_MAGIC;
+  head.Version = z_CHECKPOINT_VERSION;
+  head.Sum = z_checkpointSum(rs, head.RecordsLen, dead, head.DeadLen);
+
+  char p[z_SEGMENT_PATH_LEN];
+  char tmp[z_SEGMENT_PATH_LEN];
+  z_CheckpointPath(path, p);
+  snprintf(tmp, z_SEGMENT_PATH_LEN, "%s.tmp", p);
+
+  int64_t fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    z_error("open %s %d", tmp, errno);
+    return z_ERR_FS;
+  }
+
+  struct iovec iov[3] = {
+      {.iov_base = &head, .iov_len = sizeof(head)},
+      {.iov_base = (void *)rs, .iov_len = sizeof(z_MapRecord) * head.RecordsLen},
+      {.iov_base = (void *)dead,
+       .iov_len = sizeof(z_CheckpointDead) * head.DeadLen},
+  };
+  z_Error ret = z_checkpointWriteAll(fd, iov, 3);
+  if (ret == z_OK && fsync(fd) != 0) {
+    z_error("fsync %s %d", tmp, errno);
+    ret = z_ERR_FS;
+  }
+  close(fd);
+
+  if (ret == z_OK && rename(tmp, p) != 0) {
+    z_error("rename %s %d", tmp, errno);
+    ret = z_ERR_FS;
+  }
+
+  if (ret != z_OK) {
+    remove(tmp);
+    return ret;
+  }
+  // the new checkpoint is only found after a crash once its name is synced
+  return z_checkpointSyncDir(p);
+}
+
+void z_CheckpointDestroy(z_Checkpoint *c) {
+  if (c == nullptr || c->Data == nullptr) {
+    return;
+  }
+
+  if (c->IsMapped) {
+    munmap(c->Data, c->Size);
+    c->Data = nullptr;
+  } else {
+    z_free(c->Data);
+  }
+}
+
+// reads the file with mmap, or read if mmap fails
+z_Error z_checkpointRead(int64_t fd, z_Checkpoint *c) {
+  void *data = mmap(nullptr, c->Size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data != MAP_FAILED) {
+    // the advices are values, not flags
+    madvise(data, c->Size, MADV_SEQUENTIAL);
+    madvise(data, c->Size, MADV_WILLNEED);
+    c->Data = data;
+    c->IsMapped = true;
+    return z_OK;
+  }
+
+  z_debug("mmap %d", errno);
+  c->Data = z_malloc(c->Size);
+  if (c->Data == nullptr) {
+    return z_ERR_NOSPACE;
+  }
+
+  for (int64_t pos = 0; pos < c->Size;) {
+    ssize_t n = pread(fd, c->Data + pos, c->Size - pos, pos);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      z_error("pread %d", errno);
+      z_free(c->Data);
+      return z_ERR_FS;
+    }
+    pos += n;
+  }
+  return z_OK;
+}
+
+// opens path.ckpt and checks it, z_ERR_NOT_FOUND if there is none
+z_Error z_CheckpointOpen(const char *path, z_Checkpoint *c) {
+  if (path == nullptr || c == nullptr) {
+    z_error("path == nullptr || c == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+  *c = (z_Checkpoint){};
+
+  char p[z_SEGMENT_PATH_LEN];
+  z_CheckpointPath(path, p);
+  int64_t fd = open(p, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return errno == ENOENT ? z_ERR_NOT_FOUND : z_ERR_FS;
+  }
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (int64_t)sizeof(z_CheckpointHead)) {
+    z_error("checkpoint %s is too short", p);
+    close(fd);
+    return z_ERR_INVALID_DATA;
+  }
+
+  c->Size = st.st_size;
+  z_Error ret = z_checkpointRead(fd, c);
+  close(fd);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  c->Head = (const z_CheckpointHead *)c->Data;
+  const z_CheckpointHead *h = c->Head;
+  if (h->Magic != z_CHECKPOINT_MAGIC || h->Version != z_CHECKPOINT_VERSION ||
+      h->RecordsLen < 0 || h->DeadLen < 0 ||
+      c->Size != (int64_t)(sizeof(z_CheckpointHead) +
+                           sizeof(z_MapRecord) * h->RecordsLen +
+                           sizeof(z_CheckpointDead) * h->DeadLen)) {
+    z_error("checkpoint %s is invalid", p);
+    z_CheckpointDestroy(c);
+    return z_ERR_INVALID_DATA;
+  }
+
+  c->Records = (const z_MapRecord *)(c->Data + sizeof(z_CheckpointHead));
+  c->Dead = (const z_CheckpointDead *)(c->Records + h->RecordsLen);
+  if (z_checkpointSum(c->Records, h->RecordsLen, c->Dead, h->DeadLen) !=
+      h->Sum) {
+    z_error("checkpoint %s sum mismatch", p);
+    z_CheckpointDestroy(c);
+    return z_ERR_INVALID_DATA;
+  }
+  return z_OK;
+}
+
+#endif
@@ -0,0 +1,317 @@
+#ifndef z_COMPACT_H
+#define z_COMPACT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include "zbinlog/binlog.h"
+#include "zbinlog/file.h"
+#include "zerror/error.h"
+#include "zkv/kv.h"
+#include "zrecord/record.h"
+#include "zutils/defer.h"
+#include "zutils/time.h"
+
+// a compaction copies the live records of a sealed segment to the end of the
+// binlog and removes the segment. the liveness checks and the preads are made
+// before z_BinLogLock, the copies are appended holding it once the map still
+// has the offsets they were made from
+
+// the current segment of the binlog, the ones before it are sealed
+int64_t z_kvCurrentSegment(z_KV *kv) {
+  z_LockLock(&kv->BinLog.Lock);
+  int64_t segment = kv->BinLog.Writer.Segment;
+  z_LockUnLock(&kv->BinLog.Lock);
+  return segment;
+}
+
+// the sealed segment with the most dead bytes, -1 if none reaches ratio
+int64_t z_KVCompactPick(z_KV *kv, double ratio) {
+  int64_t current = z_kvCurrentSegment(kv);
+  int64_t picked = -1;
+  double picked_ratio = ratio;
+  for (int64_t i = z_SegmentNext(kv->BinLogPath, -1); i >= 0 && i < current;
+       i = z_SegmentNext(kv->BinLogPath, i)) {
+    int64_t size = z_SegmentSize(kv->BinLogPath, i);
+    if (size <= 0) {
+      continue;
+    }
+
+    double r = (double)atomic_load(&kv->DeadBytes[i]) / size;
+    if (r >= picked_ratio) {
+      picked = i;
+      picked_ratio = r;
+    }
+  }
+  return picked;
+}
+
+// the offset the map has for the key of fr, -1 if none
+int64_t z_kvCompactSeen(z_KV *kv, z_FileRecord *fr) {
+  z_ConstBuffer k;
+  int64_t offset = -1;
+  if (z_RecordKey(fr->Record, &k) != z_OK ||
+      z_MapFind(&kv->Map, k, &offset) != z_OK) {
+    return -1;
+  }
+  return offset;
+}
+
+// the copy to append for fr, nullptr if none, *seen is the offset of the map
+// it is made from. replay runs the records in order, so the copies keep the
+// state of each key the same without fr:
+// - a live record becomes a force upsert, it needs no older record
+// - a delete is kept while an older segment or the checkpoint may still hold
+//   its key
+// - the live record after a dead one may need it, e.g. a force update needs
+//   the insert, it is copied as a force upsert too
+z_Record *z_kvCompactCopy(z_KV *kv, z_FileRecord *fr, int64_t segment,
+                          bool is_first, int64_t *seen) {
+  *seen = -1;
+  z_ConstBuffer k;
+  if (z_RecordKey(fr->Record, &k) != z_OK) {
+    return nullptr;
+  }
+
+  // the live record read by a pread, see z_kvBuffer
+  z_unique(z_Buffer) own = {};
+  z_Buffer *buf = z_kvBuffer(kv, &own);
+
+  int64_t offset = -1;
+  z_Error ret = z_MapFind(&kv->Map, k, &offset);
+  if (ret == z_OK) {
+    *seen = offset;
+  }
+  if (ret == z_ERR_NOT_FOUND) {
+    if (z_RecordOPOf(fr->Record) != z_ROP_DELETE ||
+        is_first == true && fr->Offset < atomic_load(&kv->CheckpointOffset)) {
+      return nullptr;
+    }
+    return z_RecordNewByKV(z_ROP_DELETE, k, (z_ConstBuffer){});
+  }
+
+  if (ret != z_OK) {
+    return nullptr;
+  }
+
+  z_Record *live = fr->Record;
+  if (offset != fr->Offset) {
+    if (z_SegmentOf(offset) <= segment) {
+      return nullptr;
+    }
+
+    z_FileRecord lfr;
+    if (z_PReaderGetRecord(&kv->Reader, offset, &lfr, buf) != z_OK ||
+        z_RecordOPOf(lfr.Record) == z_ROP_FORCE_UPSERT) {
+      return nullptr;
+    }
+    live = lfr.Record;
+  }
+
+  z_ConstBuffer v;
+  if (z_RecordValue(live, &v) != z_OK) {
+    return nullptr;
+  }
+  return z_RecordNewByKV(z_ROP_FORCE_UPSERT, k, v);
+}
+
+// a copy made before z_BinLogLock is made again under it when a write came
+// in between, the map has another offset for the key or the record at the
+// offset is still mutable and may be updated in place
+bool z_kvCompactIsStale(z_KV *kv, z_FileRecord *fr, int64_t seen) {
+  return z_kvCompactSeen(kv, fr) != seen ||
+         seen >= 0 && kv->IsInPlace &&
+             z_HLogIsReadOnly(&kv->HLog, seen) == false;
+}
+
+// copies the live ones of frs as one group commit, returns the bytes written
+int64_t z_kvCompactCommit(z_KV *kv, z_FileRecord *frs, int64_t frs_len,
+                          int64_t segment, bool is_first) {
+  z_BinLogWaiter waiters[z_BINLOG_BATCH_LEN];
+  z_BinLogWaiter *ws[z_BINLOG_BATCH_LEN];
+  z_FileRecord copies[z_BINLOG_BATCH_LEN];
+  z_Record *rs[z_BINLOG_BATCH_LEN];
+  int64_t seens[z_BINLOG_BATCH_LEN];
+  int64_t ws_len = 0;
+  int64_t size = 0;
+
+  for (int64_t i = 0; i < frs_len; ++i) {
+    rs[i] = z_kvCompactCopy(kv, &frs[i], segment, is_first, &seens[i]);
+  }
+
+  z_BinLogLock(&kv->BinLog);
+  for (int64_t i = 0; i < frs_len; ++i) {
+    if (z_kvCompactIsStale(kv, &frs[i], seens[i])) {
+      z_RecordFree(rs[i]);
+      rs[i] = z_kvCompactCopy(kv, &frs[i], segment, is_first, &seens[i]);
+    }
+
+    z_Record *r = rs[i];
+    if (r == nullptr) {
+      continue;
+    }
+
+    z_RecordSum(r);
+    copies[ws_len] = (z_FileRecord){.Record = r};
+    waiters[ws_len] = (z_BinLogWaiter){.Record = &copies[ws_len], .Ret = z_OK};
+    ws[ws_len] = &waiters[ws_len];
+    ++ws_len;
+  }
+
+  if (ws_len > 0) {
+    z_binLogCommit(&kv->BinLog, ws, ws_len);
+  }
+  z_BinLogUnLock(&kv->BinLog);
+
+  for (int64_t i = 0; i < ws_len; ++i) {
+    if (waiters[i].Ret != z_OK && waiters[i].Ret != z_ERR_NOT_FOUND) {
+      z_error("compact write %d", waiters[i].Ret);
+    }
+    size += copies[i].Size;
+    z_RecordFree(copies[i].Record);
+  }
+  return size;
+}
+
+// sleeps until bytes fit in the budget since start_ns
+void z_kvCompactThrottle(int64_t start_ns, int64_t bytes,
+                         int64_t bytes_per_second) {
+  if (bytes_per_second <= 0) {
+    return;
+  }
+
+  int64_t due_ns = start_ns + bytes * 1000000000LL / bytes_per_second;
+  int64_t now_ns = z_NowNS();
+  if (due_ns > now_ns) {
+    usleep((due_ns - now_ns) / 1000);
+  }
+}
+
+// compacts a sealed segment, bytes_per_second <= 0 means no budget. it stops
+// early when is_running turns false, the segment is kept then
+z_Error z_kvCompact(z_KV *kv, int64_t segment, int64_t bytes_per_second,
+                    atomic_bool *is_running) {
+  int64_t size = z_SegmentSize(kv->BinLogPath, segment);
+  if (segment >= z_kvCurrentSegment(kv) || size < 0) {
+    z_error("segment %lld is not sealed", segment);
+    return z_ERR_INVALID_DATA;
+  }
+  bool is_first = z_SegmentNext(kv->BinLogPath, -1) == segment;
+
+  z_unique(z_Reader) rd = {};
+  z_Error ret = z_ReaderInit(&rd, kv->BinLogPath);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  ret = z_ReaderSet(&rd, z_SegmentOffset(segment, 0));
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  int64_t end = z_SegmentOffset(segment, size);
+  int64_t start_ns = z_NowNS();
+  int64_t bytes = 0;
+  int64_t written = 0;
+  while (true) {
+    if (is_running != nullptr && atomic_load(is_running) == false) {
+      return z_ERR_TIMEOUT;
+    }
+
+    z_FileRecord frs[z_BINLOG_BATCH_LEN];
+    int64_t frs_len = 0;
+    int64_t offset = 0;
+    while (frs_len < z_BINLOG_BATCH_LEN) {
+      ret = z_ReaderOffset(&rd, &offset);
+      if (ret != z_OK || offset >= end) {
+        break;
+      }
+
+      ret = z_ReaderGetRecord(&rd, &frs[frs_len]);
+      if (ret != z_OK) {
+        break;
+      }
+      bytes += frs[frs_len].Size;
+      ++frs_len;
+    }
+
+    int64_t n = z_kvCompactCommit(kv, frs, frs_len, segment, is_first);
+    written += n;
+    bytes += n;
+    for (int64_t i = 0; i < frs_len; ++i) {
+      z_RecordFree(frs[i].Record);
+    }
+
+    if (ret != z_OK) {
+      z_error("read segment %lld %d", segment, ret);
+      return ret;
+    }
+
+    if (offset >= end) {
+      break;
+    }
+    z_kvCompactThrottle(start_ns, bytes, bytes_per_second);
+  }
+
+  // no key points to the segment anymore
+  z_PReaderRetire(&kv->Reader, segment);
+  char p[z_SEGMENT_PATH_LEN];
+  z_SegmentPath(kv->BinLogPath, segment, p);
+  if (remove(p) != 0) {
+    z_error("remove %s", p);
+    return z_ERR_FS;
+  }
+
+  atomic_store(&kv->DeadBytes[segment], 0);
+  atomic_store(&kv->IsRemoved[segment], true);
+  atomic_fetch_add(&kv->CompactCount, 1);
+  atomic_fetch_add(&kv->CompactBytes, written);
+  z_info("compact segment %lld size %lld written %lld", segment, size,
+         written);
+  return z_OK;
+}
+
+z_Error z_KVCompact(z_KV *kv, int64_t segment, int64_t bytes_per_second) {
+  z_assert(kv != nullptr);
+  return z_kvCompact(kv, segment, bytes_per_second, nullptr);
+}
+
+void *z_kvCompactorRun(void *arg) {
+  z_KV *kv = (z_KV *)arg;
+  while (atomic_load(&kv->IsCompactorRunning) == true) {
+    usleep(kv->CompactOptions.IntervalMS * 1000);
+
+    int64_t segment = z_KVCompactPick(kv, kv->CompactOptions.DeadRatio);
+    if (segment < 0) {
+      continue;
+    }
+
+    z_kvCompact(kv, segment, kv->CompactOptions.BytesPerSecond,
+                &kv->IsCompactorRunning);
+  }
+  return nullptr;
+}
+
+// starts the background compaction, it is stopped by z_KVDestroy
+z_Error z_KVCompactStart(z_KV *kv, z_KVCompactOptions opts) {
+  if (kv == nullptr || opts.DeadRatio <= 0 || opts.IntervalMS <= 0) {
+    z_error("kv == nullptr || opts.DeadRatio <= 0 || opts.IntervalMS <= 0");
+    return z_ERR_INVALID_DATA;
+  }
+
+  if (atomic_exchange(&kv->IsCompactorRunning, true) == true) {
+    z_error("compactor is running");
+    return z_ERR_EXIST;
+  }
+
+  kv->CompactOptions = opts;
+  if (z_ThreadCreate(&kv->Compactor, z_kvCompactorRun, kv) != 0) {
+    z_error("z_ThreadCreate");
+    atomic_store(&kv->IsCompactorRunning, false);
+    return z_ERR_INVALID_DATA;
+  }
+  return z_OK;
+}
+
+#endif
@@ -1,40 +1,155 @@
 #ifndef z_KV_H
 #define z_KV_H
 
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "zbinlog/binlog.h"
 #include "zbinlog/file.h"
 #include "zbinlog/file_record.h"
+#include "zbinlog/hlog.h"
+#include "zbinlog/recover.h"
+#include "zepoch/epoch.h"
 #include "zerror/error.h"
+#include "zkv/checkpoint.h"
+#include "zkv/value_cache.h"
 #include "zmap/map.h"
 #include "zrecord/record.h"
 #include "zutils/assert.h"
 #include "zutils/defer.h"
 
 #define z_MAX_PATH_LENGTH 1024
+#define z_KV_EPOCH_THREADS_LEN 1024
+#define z_KV_EPOCH_ACTIONS_LEN 1024
+
+typedef struct {
+  // a sealed segment is compacted once DeadRatio of it is dead
+  double DeadRatio;
+  // the read and write budget of a compaction
+  int64_t BytesPerSecond;
+  int64_t IntervalMS;
+} z_KVCompactOptions;
 
 typedef struct {
   z_BinLog BinLog;
+  z_PReader Reader;
+  // the pread buffers of the lookups, one per thread id below
+  // z_KV_EPOCH_THREADS_LEN, see z_kvBuffer
+  z_Buffer Buffers[z_KV_EPOCH_THREADS_LEN];
   char BinLogPath[z_MAX_PATH_LENGTH];
+  // the max size of a binlog segment
   int64_t BinLogFileMaxSize;
   z_Map Map;
   int64_t BucketsLen;
+  z_MapEngine MapEngine;
+  // record reads of z_mapIsEqual and those of them with a different key,
+  // the latter only happens on a full hash and fingerprint collision
+  atomic_int_fast64_t IsEqualCount;
+  atomic_int_fast64_t IsEqualMissCount;
+  // bytes of each segment no key points to, see zkv/compact.h
+  atomic_int_fast64_t DeadBytes[z_SEGMENTS_LEN];
+  // removed by a compaction, the offsets of a checkpoint may still point there
+  atomic_bool IsRemoved[z_SEGMENTS_LEN];
+  z_KVCompactOptions CompactOptions;
+  z_Thread Compactor;
+  atomic_bool IsCompactorRunning;
+  atomic_int_fast64_t CompactCount;
+  atomic_int_fast64_t CompactBytes;
+  // the watermark of the checkpoint a restart may load, INT64_MAX if none,
+  // a compaction keeps the deletes after it
+  atomic_int_fast64_t CheckpointOffset;
+  int64_t CheckpointIntervalMS;
+  z_Thread Checkpointer;
+  atomic_bool IsCheckpointerRunning;
+  atomic_int_fast64_t CheckpointCount;
+  // the binlog replay of z_KVInit
+  z_Recovery Recovery;
+  // the readers of a borrowed value, see z_KVView
+  z_Epoch Epoch;
+  // off unless z_KVCacheInit, see zkv/value_cache.h
+  z_ValueCache Cache;
+  // off unless z_KVHLogInit, see zbinlog/hlog.h
+  z_HLog HLog;
+  // off unless z_KVInPlaceEnable
+  bool IsInPlace;
 } z_KV;
 
-z_Error z_binLogAfterWrite(void *attr, z_Record *r, int64_t offset) {
-  z_assert(attr != nullptr, r != nullptr);
+// a value borrowed from the kv without a copy, valid until z_KVViewDestroy.
+// it points to the cache, a mapped segment or Buffer. a thread with an id
+// below z_KV_EPOCH_THREADS_LEN holds kv->Epoch meanwhile, the others pin
+// kv->Reader and hold off the retire of a compacted segment
+typedef struct {
+  z_KV *KV;
+  z_ConstBuffer Value;
+  // the record read by a pread, see z_PReaderGetRecord
+  z_Buffer Buffer;
+  // whether the view protected the thread
+  bool IsProtected;
+  // the pinned phase of kv->Reader, -1 if none
+  int64_t Phase;
+} z_KVView;
+
+// the pread buffer of the calling thread, it grows to the largest record the
+// thread reads and is kept for its next lookup. own for a thread without an
+// id. a lookup does not call another one while it holds the buffer
+z_Buffer *z_kvBuffer(z_KV *kv, z_Buffer *own) {
+  int64_t tid = z_ThreadID();
+  if (tid == z_INVALID_THREAD_ID || tid >= z_KV_EPOCH_THREADS_LEN) {
+    return own;
+  }
+  return &kv->Buffers[tid];
+}
 
-  z_Map *m = (z_Map *)attr;
+// protects the thread with kv->Epoch unless it already is, false if it has no
+// id for it. *is_new tells whether z_EpochUnProtect is due
+bool z_kvProtect(z_KV *kv, bool *is_new) {
+  *is_new = false;
+  int64_t tid = z_ThreadID();
+  if (tid == z_INVALID_THREAD_ID || tid >= kv->Epoch.LocalEpochsLen) {
+    return false;
+  }
+
+  if (z_EpochIsProtected(&kv->Epoch) == false) {
+    z_EpochProtect(&kv->Epoch);
+    *is_new = true;
+  }
+  return true;
+}
+
+void z_kvDead(z_KV *kv, int64_t offset, int64_t size) {
+  int64_t segment = z_SegmentOf(offset);
+  if (segment >= 0 && segment < z_SEGMENTS_LEN) {
+    atomic_fetch_add(&kv->DeadBytes[segment], size);
+  }
+}
+
+// the record at offset is replaced or deleted, only a large one is read for
+// its size
+void z_mapOnRemove(void *attr, int64_t offset, int64_t size) {
+  z_KV *kv = (z_KV *)attr;
+  int64_t segment = z_SegmentOf(offset);
+  if (segment < 0 || segment >= z_SEGMENTS_LEN ||
+      atomic_load(&kv->IsRemoved[segment]) == true) {
+    return;
+  }
+
+  if (size < z_MAP_RECORD_SIZE_LARGE ||
+      z_PReaderRecordSize(&kv->Reader, offset, &size) == z_OK) {
+    z_kvDead(kv, offset, size);
+  }
+}
+
+// size is the bytes of the frame of r
+z_Error z_binLogApply(z_Map *m, z_Record *r, int64_t offset, int64_t size) {
   z_Error ret = z_OK;
-  switch (r->OP) {
+  switch (z_RecordOPOf(r)) {
   case z_ROP_INSERT: {
     z_ConstBuffer k;
     ret = z_RecordKey(r, &k);
     if (ret != z_OK) {
       return ret;
     }
-    return z_MapInsert(m, k, offset);
+    return z_MapInsert(m, k, offset, size);
   }
   case z_ROP_DELETE: {
     z_ConstBuffer k;
@@ -55,7 +170,7 @@ z_Error z_binLogAfterWrite(void *attr, z_Record *r, int64_t offset) {
     if (ret != z_OK) {
       return ret;
     }
-    return z_MapUpdate(m, k, offset, src_v);
+    return z_MapUpdate(m, k, offset, size, src_v);
   }
   case z_ROP_FORCE_UPDATE: {
     z_ConstBuffer k;
@@ -63,7 +178,7 @@ z_Error z_binLogAfterWrite(void *attr, z_Record *r, int64_t offset) {
     if (ret != z_OK) {
       return ret;
     }
-    return z_MapForceUpdate(m, k, offset);
+    return z_MapForceUpdate(m, k, offset, size);
   }
   case z_ROP_FORCE_UPSERT: {
     z_ConstBuffer k;
@@ -71,53 +186,44 @@ z_Error z_binLogAfterWrite(void *attr, z_Record *r, int64_t offset) {
     if (ret != z_OK) {
       return ret;
     }
-    return z_MapForceUpsert(m, k, offset);
+    return z_MapForceUpsert(m, k, offset, size);
   }
   default:
-    z_error("invalid op %d", r->OP);
+    z_error("invalid op %d", z_RecordOPOf(r));
     return z_ERR_INVALID_DATA;
   }
   return z_OK;
 }
 
-bool z_mapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t offset) {
-  if (attr == nullptr || z_ConstBufferIsEmpty(&key) && z_ConstBufferIsEmpty(&value)) {
-    z_error(
-        "attr == nullptr || z_ConstBufferIsEmpty(&key) && z_ConstBufferIsEmpty(&value)");
-    return false;
-  }
-
-  char *path = (char *)attr;
-  z_Reader rd;
-  z_Error ret = z_ReaderInit(&rd, path);
-  if (ret != z_OK) {
-    return ret;
-  }
-
-  ret = z_ReaderSet(&rd, offset);
-  if (ret != z_OK) {
-    return false;
-  }
+// a failed write and a delete are dead once written
+z_Error z_binLogAfterWrite(void *attr, z_Record *r, int64_t offset,
+                           int64_t size) {
+  z_assert(attr != nullptr, r != nullptr);
 
-  z_FileRecord fr;
-  ret = z_ReaderGetRecord(&rd, &fr);
-  if (ret != z_OK) {
-    return false;
+  z_Map *m = (z_Map *)attr;
+  z_KV *kv = (z_KV *)m->Attr;
+  // the writer moved on from the segments before
+  z_PReaderSeal(&kv->Reader, z_SegmentOf(offset));
+  z_Error ret = z_binLogApply(m, r, offset, size);
+  if (ret != z_OK || z_RecordOPOf(r) == z_ROP_DELETE) {
+    z_kvDead(kv, offset, size);
+  } else {
+    z_ValueCacheAdd(&kv->Cache, offset, r);
   }
+  return ret;
+}
 
+bool z_kvRecordIsEqual(z_KV *kv, z_Record *r, z_ConstBuffer key,
+                       z_ConstBuffer value) {
   z_ConstBuffer k;
-  ret = z_RecordKey(fr.Record, &k);
+  z_Error ret = z_RecordKey(r, &k);
   if (ret != z_OK) {
-    z_RecordFree(fr.Record);
-    z_ReaderDestroy(&rd);
     return false;
   }
 
   z_ConstBuffer v;
-  ret = z_RecordValue(fr.Record, &v);
+  ret = z_RecordValue(r, &v);
   if (ret != z_OK) {
-    z_RecordFree(fr.Record);
-    z_ReaderDestroy(&rd);
     return false;
   }
 
@@ -125,6 +231,9 @@ bool z_mapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t of
 
   if (z_ConstBufferIsEmpty(&key) == false && z_ConstBufferIsEmpty(&value) == true) {
     isEqual = z_BufferIsEqual(&k, &key);
+    if (isEqual == false) {
+      atomic_fetch_add(&kv->IsEqualMissCount, 1);
+    }
   } else if (z_ConstBufferIsEmpty(&key) == true &&
              z_ConstBufferIsEmpty(&value) == false) {
     isEqual = z_BufferIsEqual(&v, &value);
@@ -133,36 +242,54 @@ bool z_mapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t of
     isEqual = z_BufferIsEqual(&k, &key) && z_BufferIsEqual(&v, &value);
   }
 
-  z_RecordFree(fr.Record);
-  z_ReaderDestroy(&rd);
-
   return isEqual;
 }
 
-z_Error z_fileGetRecord(z_Reader *rd, z_Record **r, int64_t *offset) {
-  z_assert(rd != nullptr, r != nullptr, offset != nullptr);
+bool z_mapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t offset) {
+  if (attr == nullptr || z_ConstBufferIsEmpty(&key) && z_ConstBufferIsEmpty(&value)) {
+    z_error(
+        "attr == nullptr || z_ConstBufferIsEmpty(&key) && z_ConstBufferIsEmpty(&value)");
+    return false;
+  }
 
-  z_Error ret = z_ReaderOffset(rd, offset);
-  if (ret != z_OK) {
-    return ret;
+  z_KV *kv = (z_KV *)attr;
+  // a checkpoint may point to a compacted segment until the copy of the
+  // record is replayed, the key matched by hash and fingerprint is taken
+  int64_t segment = z_SegmentOf(offset);
+  if (segment >= 0 && segment < z_SEGMENTS_LEN &&
+      atomic_load(&kv->IsRemoved[segment]) == true) {
+    return z_ConstBufferIsEmpty(&value);
   }
 
-  z_FileRecord fr;
-  ret = z_ReaderGetRecord(rd, &fr);
-  if (ret != z_OK) {
-    return ret;
+  atomic_fetch_add(&kv->IsEqualCount, 1);
+  bool is_new = false;
+  bool is_protected = z_kvProtect(kv, &is_new);
+  z_FileRecord fr = {};
+  z_Buffer own = {};
+  z_Buffer *buf = z_kvBuffer(kv, &own);
+  bool isEqual = false;
+  if (is_protected && z_ValueCacheGet(&kv->Cache, offset, &fr.Record) ||
+      z_PReaderGetRecord(&kv->Reader, offset, &fr, buf) == z_OK) {
+    isEqual = z_kvRecordIsEqual(kv, fr.Record, key, value);
   }
+  z_BufferDestroy(&own);
 
-  *r = fr.Record;
-  return z_OK;
+  if (is_new) {
+    z_EpochUnProtect(&kv->Epoch);
+  }
+  return isEqual;
 }
 
-z_Error z_mapInitFromFile(z_Map *m, char *path, int64_t *last_offset) {
-  if (m == nullptr || path == nullptr) {
-    z_error("m == nullptr || path == nullptr");
+// replays the segments from start on the calling thread
+z_Error z_mapInitFromFile(z_Map *m, char *path, int64_t start,
+                          z_Recovery *rcv) {
+  if (m == nullptr || path == nullptr || rcv == nullptr) {
+    z_error("m == nullptr || path == nullptr || rcv == nullptr");
     return z_ERR_INVALID_DATA;
   }
 
+  int64_t start_ns = z_NowNS();
+
   z_unique(z_Reader) rd;
   z_Error ret = z_ReaderInit(&rd, path);
   if (ret != z_OK) {
@@ -175,59 +302,227 @@ z_Error z_mapInitFromFile(z_Map *m, char *path, int64_t *last_offset) {
     return ret;
   }
 
-  *last_offset = 0;
-  while (*last_offset < max_offset) {
-    z_Record *r = nullptr;
-    z_defer(z_RecordFree, r);
-    int64_t offset = 0;
+  if (start > 0) {
+    // a compacted segment has its live records in the later ones
+    int64_t segment = z_SegmentOf(start);
+    if (z_SegmentSize(path, segment) < 0) {
+      segment = z_SegmentNext(path, segment);
+      start = segment < 0 ? max_offset : z_SegmentOffset(segment, 0);
+    }
+
+    if (start >= max_offset) {
+      rcv->Offset = max_offset;
+      return z_OK;
+    }
 
-    ret = z_fileGetRecord(&rd, &r, &offset);
+    ret = z_ReaderSet(&rd, start);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  ret = z_ReaderOffset(&rd, &rcv->Offset);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  // the records of a batch are applied once its last one is read
+  z_FileRecord batch[z_BINLOG_BATCH_LEN];
+  int64_t batch_len = 0;
+  int64_t batch_size = 0;
+  while (rcv->Offset + batch_size < max_offset) {
+    z_FileRecord *fr = &batch[batch_len];
+    ret = z_ReaderGetRecord(&rd, fr);
+    int64_t end = 0;
+    if (ret != z_OK && batch_len > 0 && z_ReaderIsShort(&rd) &&
+        z_ReaderOffset(&rd, &end) == z_OK && end == max_offset) {
+      // the last record of a torn batch runs past the end of the binlog, any
+      // other failure is a broken record
+      ret = z_OK;
+      break;
+    }
     if (ret != z_OK) {
       break;
     }
+    ++batch_len;
+    batch_size += fr->Size;
+    if (z_RecordIsBatched(fr->Record)) {
+      if (batch_len < z_BINLOG_BATCH_LEN) {
+        continue;
+      }
+      z_error("batch longer than %d at %lld", z_BINLOG_BATCH_LEN, rcv->Offset);
+      ret = z_ERR_INVALID_DATA;
+      break;
+    }
 
-    ret = z_binLogAfterWrite((void *)m, r, offset);
-    if (ret != z_OK && ret != z_ERR_EXIST && ret != z_ERR_NOT_FOUND &&
-        ret != z_ERR_CONFLICT) {
-      z_error("z_binLogAfterWrite %d", ret);
+    for (int64_t i = 0; i < batch_len && ret == z_OK; ++i) {
+      ret = z_binLogAfterWrite((void *)m, batch[i].Record, batch[i].Offset,
+                               batch[i].Size);
+      if (ret != z_OK && ret != z_ERR_EXIST && ret != z_ERR_NOT_FOUND &&
+          ret != z_ERR_CONFLICT) {
+        z_error("z_binLogAfterWrite %d", ret);
+        break;
+      }
+      ret = z_OK;
+      rcv->Seq = batch[i].Seq;
+      rcv->SeqOffset = batch[i].Offset;
+      rcv->Records += 1;
+    }
+    for (int64_t i = 0; i < batch_len; ++i) {
+      z_RecordFree(batch[i].Record);
+    }
+    rcv->Bytes += batch_size;
+    batch_len = 0;
+    batch_size = 0;
+    if (ret != z_OK) {
       break;
     }
 
-    ret = z_ReaderOffset(&rd, last_offset);
+    ret = z_ReaderOffset(&rd, &rcv->Offset);
     if (ret != z_OK) {
       break;
     }
   }
 
+  if (batch_len > 0 && ret == z_OK) {
+    rcv->IsTorn = true;
+  }
+  for (int64_t i = 0; i < batch_len; ++i) {
+    z_RecordFree(batch[i].Record);
+  }
+
+  rcv->NS = z_NowNS() - start_ns;
   return ret;
 }
 
+// loads path.ckpt if it belongs to the binlog, start is where the replay
+// goes on, 0 without a checkpoint
+z_Error z_kvLoadCheckpoint(z_KV *kv, int64_t wr_offset, int64_t *start,
+                           int64_t *seq, int64_t *seq_offset) {
+  z_unique(z_Checkpoint) c = {};
+  z_Error ret = z_CheckpointOpen(kv->BinLogPath, &c);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  const z_CheckpointHead *h = c.Head;
+  if (h->Offset > wr_offset || h->Seq <= 0) {
+    z_error("checkpoint offset %lld seq %lld", h->Offset, h->Seq);
+    return z_ERR_INVALID_DATA;
+  }
+  if (h->Hash != kv->Map.Hash) {
+    z_info("checkpoint hash %lld map hash %d", h->Hash, kv->Map.Hash);
+    return z_ERR_INVALID_DATA;
+  }
+
+  // the segment of the record may be compacted since
+  if (z_SegmentSize(kv->BinLogPath, z_SegmentOf(h->SeqOffset)) >= 0) {
+    z_FileRecord fr = {};
+    z_unique(z_Buffer) buf = {};
+    ret = z_PReaderGetRecord(&kv->Reader, h->SeqOffset, &fr, &buf);
+    if (ret != z_OK || fr.Seq != h->Seq) {
+      z_error("checkpoint seq %lld is not in the binlog", h->Seq);
+      return z_ERR_INVALID_DATA;
+    }
+  }
+
+  for (int64_t i = 0; i < z_SegmentOf(wr_offset); ++i) {
+    if (z_SegmentSize(kv->BinLogPath, i) < 0) {
+      atomic_store(&kv->IsRemoved[i], true);
+    }
+  }
+
+  ret = z_MapLoad(&kv->Map, c.Records, h->RecordsLen);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  for (int64_t i = 0; i < h->DeadLen; ++i) {
+    int64_t segment = c.Dead[i].Segment;
+    if (segment >= 0 && segment < z_SEGMENTS_LEN &&
+        z_SegmentSize(kv->BinLogPath, segment) >= 0) {
+      atomic_store(&kv->DeadBytes[segment], c.Dead[i].Bytes);
+    }
+  }
+
+  atomic_store(&kv->CheckpointOffset, h->Offset);
+  *start = h->Offset;
+  *seq = h->Seq;
+  *seq_offset = h->SeqOffset;
+  return z_OK;
+}
+
 void z_KVDestroy(z_KV *kv) {
   if (kv == nullptr) {
     return;
   }
 
+  if (atomic_exchange(&kv->IsCompactorRunning, false) == true) {
+    z_ThreadJion(kv->Compactor);
+  }
+
+  // the checkpointer writes a last checkpoint before it returns
+  if (atomic_exchange(&kv->IsCheckpointerRunning, false) == true) {
+    z_ThreadJion(kv->Checkpointer);
+  }
+
   z_MapDestroy(&kv->Map);
+  z_PReaderDestroy(&kv->Reader);
+  // the writer flushes the rest
+  z_HLogStop(&kv->HLog);
   z_BinLogDestroy(&kv->BinLog);
+  z_HLogDestroy(&kv->HLog);
+  z_EpochRunActions(&kv->Epoch);
+  z_ValueCacheDestroy(&kv->Cache);
+  z_EpochDestroy(&kv->Epoch);
+  for (int64_t i = 0; i < z_KV_EPOCH_THREADS_LEN; ++i) {
+    z_BufferDestroy(&kv->Buffers[i]);
+  }
 
   return;
 }
 
-z_Error z_KVInit(z_KV *kv, const char *path, int64_t binlog_file_max_size,
-                 int64_t buckets_len) {
+// z_KVInit with the binlog replayed by recover_threads workers, see
+// zbinlog/recover.h, 1 replays it on the calling thread. a worker takes the
+// keys of its own buckets, see z_Recovery
+z_Error z_KVInitParallel(z_KV *kv, const char *path,
+                         int64_t binlog_file_max_size, int64_t buckets_len,
+                         z_MapEngine map_engine, z_BinLogSync sync,
+                         int64_t recover_threads) {
   if (kv == nullptr || strlen(path) >= z_MAX_PATH_LENGTH ||
-      binlog_file_max_size == 0 || buckets_len == 0) {
+      binlog_file_max_size == 0 || buckets_len == 0 || recover_threads <= 0) {
     z_error("kv == nullptr || strlen(path) >= z_MAX_PATH_LENGTH || "
-            "binlog_file_max_size == 0 || buckets_len == 0");
+            "binlog_file_max_size == 0 || buckets_len == 0 || recover_threads "
+            "<= 0");
     return z_ERR_INVALID_DATA;
   }
   memset(kv->BinLogPath, 0, z_MAX_PATH_LENGTH);
   strncpy(kv->BinLogPath, path, z_MAX_PATH_LENGTH - 1);
   kv->BinLogFileMaxSize = binlog_file_max_size;
   kv->BucketsLen = buckets_len;
+  kv->MapEngine = map_engine;
+  atomic_store(&kv->IsEqualCount, 0);
+  atomic_store(&kv->IsEqualMissCount, 0);
+  for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+    atomic_store(&kv->DeadBytes[i], 0);
+    atomic_store(&kv->IsRemoved[i], false);
+  }
+  kv->CompactOptions = (z_KVCompactOptions){};
+  atomic_store(&kv->IsCompactorRunning, false);
+  atomic_store(&kv->CompactCount, 0);
+  atomic_store(&kv->CompactBytes, 0);
+  atomic_store(&kv->CheckpointOffset, INT64_MAX);
+  kv->CheckpointIntervalMS = 0;
+  atomic_store(&kv->IsCheckpointerRunning, false);
+  atomic_store(&kv->CheckpointCount, 0);
+  kv->Recovery = (z_Recovery){.SeqOffset = -1};
+  memset(&kv->Cache, 0, sizeof(kv->Cache));
+  memset(&kv->HLog, 0, sizeof(kv->HLog));
+  kv->IsInPlace = false;
+  memset(kv->Buffers, 0, sizeof(kv->Buffers));
   int64_t wr_offset = {};
   z_Error ret = z_BinLogInit(&kv->BinLog, kv->BinLogPath, kv->BinLogFileMaxSize,
-                             &kv->Map, z_binLogAfterWrite);
+                             sync, &kv->Map, z_binLogAfterWrite);
   if (ret != z_OK) {
     return ret;
   }
@@ -238,39 +533,308 @@ z_Error z_KVInit(z_KV *kv, const char *path, int64_t binlog_file_max_size,
     return ret;
   }
 
-  ret = z_MapInit(&kv->Map, kv->BucketsLen, kv->BinLogPath, z_mapIsEqual);
+  ret = z_PReaderInit(&kv->Reader, kv->BinLogPath);
   if (ret != z_OK) {
     z_BinLogDestroy(&kv->BinLog);
     return ret;
   }
 
-  if (wr_offset == 0) {
-    return z_OK;
+  ret = z_EpochInit(&kv->Epoch, z_KV_EPOCH_THREADS_LEN,
+                    z_KV_EPOCH_ACTIONS_LEN);
+  if (ret != z_OK) {
+    z_PReaderDestroy(&kv->Reader);
+    z_BinLogDestroy(&kv->BinLog);
+    return ret;
   }
 
-  int64_t rd_offset = 0;
-  ret = z_mapInitFromFile(&kv->Map, kv->BinLogPath, &rd_offset);
+  ret = z_MapInit(&kv->Map, kv->BucketsLen, kv->MapEngine, kv,
+                  z_mapIsEqual);
   if (ret != z_OK) {
+    z_EpochDestroy(&kv->Epoch);
+    z_PReaderDestroy(&kv->Reader);
     z_BinLogDestroy(&kv->BinLog);
+    return ret;
+  }
+  kv->Map.OnRemove = z_mapOnRemove;
+
+  // a new binlog has no frame yet
+  if (wr_offset ==
+      z_SegmentOffset(0, z_SegmentStart(kv->BinLog.Writer.Base))) {
+    return z_OK;
+  }
+
+  int64_t start = 0;
+  z_Recovery *rcv = &kv->Recovery;
+  ret = z_kvLoadCheckpoint(kv, wr_offset, &start, &rcv->Seq, &rcv->SeqOffset);
+  if (ret != z_OK && ret != z_ERR_NOT_FOUND) {
+    z_info("replay the binlog without the checkpoint %d", ret);
+  }
+
+  rcv->Offset = start;
+  rcv->Hash = kv->Map.Hash;
+  rcv->Buckets = kv->Map.InitBucketsLen;
+  if (recover_threads > 1) {
+    ret = z_Recover(kv->BinLogPath, start, recover_threads, &kv->Map,
+                    z_binLogAfterWrite, rcv);
+  } else {
+    ret = z_mapInitFromFile(&kv->Map, kv->BinLogPath, start, rcv);
+  }
+  if (ret != z_OK) {
     z_MapDestroy(&kv->Map);
+    z_EpochDestroy(&kv->Epoch);
+    z_PReaderDestroy(&kv->Reader);
+    z_BinLogDestroy(&kv->BinLog);
+    return ret;
+  }
+
+  if (rcv->IsTorn) {
+    z_info("cut off the torn batch at %lld", rcv->Offset);
+    ret = z_WriterTruncate(&kv->BinLog.Writer, rcv->Offset);
+    if (ret == z_OK) {
+      wr_offset = rcv->Offset;
+    }
+  }
+
+  if (wr_offset != rcv->Offset) {
+    z_error("writer_offset(%lld) != reader_offset(%lld)", wr_offset,
+            rcv->Offset);
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_PReaderSeal(&kv->Reader, z_SegmentOf(wr_offset));
+  z_info("recover %lld records %lld ms %lld/s threads %lld", rcv->Records,
+         rcv->NS / 1000000, rcv->Records * 1000000000 / (rcv->NS + 1),
+         recover_threads);
+  z_BinLogRestore(&kv->BinLog, rcv->Seq, rcv->SeqOffset);
+  return z_OK;
+}
+
+z_Error z_KVInit(z_KV *kv, const char *path, int64_t binlog_file_max_size,
+                 int64_t buckets_len, z_MapEngine map_engine,
+                 z_BinLogSync sync) {
+  return z_KVInitParallel(kv, path, binlog_file_max_size, buckets_len,
+                          map_engine, sync, 1);
+}
+
+// caches the records of the recent writes and reads in size bytes, so the
+// finds of hot keys skip the binlog. call it before the kv is shared
+z_Error z_KVCacheInit(z_KV *kv, int64_t size) {
+  z_assert(kv != nullptr);
+  return z_ValueCacheInit(&kv->Cache, size, &kv->Epoch);
+}
+
+// keeps the last size bytes of the binlog in memory, they are flushed in the
+// background as they turn read only, so the hot keys are read without the
+// filesystem. call it before the kv is shared
+z_Error z_KVHLogInit(z_KV *kv, int64_t size) {
+  z_assert(kv != nullptr);
+  z_Error ret = z_WriterSetHLog(&kv->BinLog.Writer, &kv->HLog, size);
+  if (ret != z_OK) {
+    return ret;
+  }
+  kv->Reader.HLog = &kv->HLog;
+  return z_OK;
+}
+
+// a force update of a record still mutable in kv->HLog is done in place from
+// now on, the hot keys are written without growing the binlog. the record
+// keeps its seq, so a replica that has the seq never gets the new value and
+// the writer gets a seq issued before. only a kv that is never synced may do
+// it, nothing waits on its seqs, and a replicated kv must not. call it after
+// z_KVHLogInit before the kv is shared
+z_Error z_KVInPlaceEnable(z_KV *kv) {
+  z_assert(kv != nullptr);
+  if (kv->HLog.Data == nullptr ||
+      kv->BinLog.Sync.Mode != z_BINLOG_SYNC_NEVER) {
+    z_error("no hlog or sync mode %d", kv->BinLog.Sync.Mode);
+    return z_ERR_INVALID_DATA;
+  }
+  kv->IsInPlace = true;
+  return z_OK;
+}
+
+// reads the sealed segments from read only mappings, the active one is still
+// read by pread. call it before the kv is shared
+void z_KVMapSealed(z_KV *kv) { z_PReaderMapSealed(&kv->Reader, &kv->Epoch); }
+
+// takes the head of a checkpoint and begins the map snapshot holding
+// z_BinLogLock, nothing is begun when head->Seq <= 0
+z_Error z_kvCheckpointBegin(z_KV *kv, z_CheckpointHead *head,
+                            z_CheckpointDead *dead) {
+  z_BinLogLock(&kv->BinLog);
+  z_Error ret = z_WriterOffset(&kv->BinLog.Writer, &head->Offset);
+  head->Seq = atomic_load(&kv->BinLog.AckedSeq);
+  head->SeqOffset = atomic_load(&kv->BinLog.AckedOffset);
+  head->Hash = kv->Map.Hash;
+  if (ret == z_OK && head->Seq > 0) {
+    for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+      int64_t bytes = atomic_load(&kv->DeadBytes[i]);
+      if (bytes > 0) {
+        dead[head->DeadLen++] =
+            (z_CheckpointDead){.Segment = i, .Bytes = bytes};
+      }
+    }
+    // the deletes after it are kept until the file is renamed
+    if (head->Offset < atomic_load(&kv->CheckpointOffset)) {
+      atomic_store(&kv->CheckpointOffset, head->Offset);
+    }
+    ret = z_MapSnapshotBegin(&kv->Map);
+  }
+  z_BinLogUnLock(&kv->BinLog);
+  return ret;
+}
+
+// copies the buckets without z_BinLogLock, the writes meanwhile leave the
+// snapshot as it was at the head, and writes the checkpoint
+z_Error z_kvCheckpointEnd(z_KV *kv, z_CheckpointHead head,
+                          z_CheckpointDead *dead) {
+  z_MapRecord *rs = nullptr;
+  z_defer(
+      ^(z_MapRecord **ptr) {
+        z_free(*ptr);
+      },
+      &rs);
+
+  z_Error ret = z_MapSnapshotEnd(&kv->Map, &rs, &head.RecordsLen);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  ret = z_CheckpointWrite(kv->BinLogPath, head, rs, dead);
+  if (ret != z_OK) {
     return ret;
   }
 
-  if (wr_offset != rd_offset) {
-    z_error("writer_offset(%lld) != reader_offset(%lld)", wr_offset, rd_offset);
+  atomic_store(&kv->CheckpointOffset, head.Offset);
+  atomic_fetch_add(&kv->CheckpointCount, 1);
+  z_debug("checkpoint offset %lld records %lld", head.Offset, head.RecordsLen);
+  return z_OK;
+}
+
+// writes the index up to the binlog head to path.ckpt, see z_MapSnapshotBegin
+z_Error z_KVCheckpoint(z_KV *kv) {
+  z_assert(kv != nullptr);
+
+  z_CheckpointHead head = {};
+  z_CheckpointDead dead[z_SEGMENTS_LEN];
+  z_Error ret = z_kvCheckpointBegin(kv, &head, dead);
+  if (ret != z_OK || head.Seq <= 0) {
+    return ret;
+  }
+  return z_kvCheckpointEnd(kv, head, dead);
+}
+
+void *z_kvCheckpointerRun(void *arg) {
+  z_KV *kv = (z_KV *)arg;
+  while (atomic_load(&kv->IsCheckpointerRunning) == true) {
+    usleep(kv->CheckpointIntervalMS * 1000);
+    if (atomic_load(&kv->IsCheckpointerRunning) == false) {
+      break;
+    }
+    z_KVCheckpoint(kv);
+  }
+
+  // a restart after z_KVDestroy replays nothing
+  z_KVCheckpoint(kv);
+  return nullptr;
+}
+
+// writes a checkpoint every interval_ms, it is stopped by z_KVDestroy
+z_Error z_KVCheckpointStart(z_KV *kv, int64_t interval_ms) {
+  if (kv == nullptr || interval_ms <= 0) {
+    z_error("kv == nullptr || interval_ms <= 0");
     return z_ERR_INVALID_DATA;
   }
 
+  if (atomic_exchange(&kv->IsCheckpointerRunning, true) == true) {
+    z_error("checkpointer is running");
+    return z_ERR_EXIST;
+  }
+
+  kv->CheckpointIntervalMS = interval_ms;
+  if (z_ThreadCreate(&kv->Checkpointer, z_kvCheckpointerRun, kv) != 0) {
+    z_error("z_ThreadCreate");
+    atomic_store(&kv->IsCheckpointerRunning, false);
+    return z_ERR_INVALID_DATA;
+  }
   return z_OK;
 }
 
-z_Error z_KVFromRecord(z_KV *kv, z_Record *r) {
+// a force update of a record in the mutable region of kv->HLog with the same
+// size overwrites it, the record keeps its seq, op and flags, so a replay
+// applies the new value where the old one was. holding the binlog lock, no
+// record is applied meanwhile. see z_KVInPlaceEnable
+bool z_kvUpdateInPlace(z_KV *kv, z_Record *r, int64_t *seq) {
+  if (kv->IsInPlace == false || z_RecordOPOf(r) != z_ROP_FORCE_UPDATE) {
+    return false;
+  }
+
+  z_ConstBuffer k;
+  if (z_RecordKey(r, &k) != z_OK) {
+    return false;
+  }
+
+  z_LockLock(&kv->BinLog.Lock);
+  z_defer(z_LockUnLock, &kv->BinLog.Lock);
+
+  int64_t offset = 0;
+  if (z_MapFind(&kv->Map, k, &offset) != z_OK ||
+      z_HLogIsReadOnly(&kv->HLog, offset)) {
+    return false;
+  }
+
+  // the mutable records are all in the current segment
+  int8_t head[z_FRAME_PARSE_MAX];
+  z_Frame f;
+  int64_t l = z_HLogReadSome(&kv->HLog, offset, head, sizeof(head));
+  if (l < 0 || z_FrameParse(head, l, kv->BinLog.Writer.Base, &f) == false) {
+    return false;
+  }
+  z_Record *old = &f.Head;
+  if (z_RecordOPOf(old) == z_ROP_UPDATE ||
+      z_RecordIsCompact(old) != z_RecordIsCompact(r) ||
+      z_RecordHasCrc32c(old) != z_RecordHasCrc32c(r) ||
+      z_RecordSize(old) != z_RecordSize(r)) {
+    return false;
+  }
+
+  // the flags keep the batch of the old record together, both are of the
+  // same format. the record is written over the old one, the frame head
+  // keeps the seq
+  bool is_batched = z_RecordIsBatched(r);
+  z_RecordSetOP(r, z_RecordOPOf(old));
+  z_RecordSetBatched(r, z_RecordIsBatched(old));
+  z_RecordSum(r);
+  if (z_HLogUpdate(&kv->HLog, offset + f.HeadSize, (int8_t *)r,
+                   z_RecordSize(r)) != z_OK) {
+    z_RecordSetOP(r, z_ROP_FORCE_UPDATE);
+    z_RecordSetBatched(r, is_batched);
+    return false;
+  }
+
+  // the cached record of offset is replaced, see z_kvFindValue
+  z_ValueCacheAdd(&kv->Cache, offset, r);
+  if (seq != nullptr) {
+    *seq = f.Seq;
+  }
+  return true;
+}
+
+// seq is the binlog seq of r, it may be nullptr
+z_Error z_KVFromRecord(z_KV *kv, z_Record *r, int64_t *seq) {
   z_assert(kv != nullptr, r != nullptr);
-  z_assert(r->OP != 0);
+  z_assert(z_RecordOPOf(r) != 0);
+
+  if (z_kvUpdateInPlace(kv, r, seq)) {
+    return z_OK;
+  }
 
   z_Error ret = z_OK;
   z_FileRecord fr = {.Record = r};
   ret = z_BinLogAppendRecord(&kv->BinLog, &fr);
+  if (seq != nullptr) {
+    *seq = fr.Seq;
+  }
   if (ret != z_OK) {
     z_debug("z_BinLogAppendRecord %d", ret);
     return ret;
@@ -278,6 +842,14 @@ z_Error z_KVFromRecord(z_KV *kv, z_Record *r) {
   return z_OK;
 }
 
+// the last seq acknowledged to a writer
+int64_t z_KVAckedSeq(z_KV *kv) { return atomic_load(&kv->BinLog.AckedSeq); }
+
+// the last seq on the disk, see z_BinLogSyncMode
+int64_t z_KVDurableSeq(z_KV *kv) {
+  return atomic_load(&kv->BinLog.DurableSeq);
+}
+
 z_Error z_KVInsert(z_KV *kv, z_ConstBuffer k, z_ConstBuffer v) {
   z_assert(kv != nullptr, k.Size != 0, k.Data != nullptr);
   z_assert(v.Size != 0, v.Data != nullptr);
@@ -287,7 +859,7 @@ z_Error z_KVInsert(z_KV *kv, z_ConstBuffer k, z_ConstBuffer v) {
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_KVFromRecord(kv, r);
+  z_Error ret = z_KVFromRecord(kv, r, nullptr);
 
   z_RecordFree(r);
   return ret;
@@ -302,7 +874,7 @@ z_Error z_KVForceUpdate(z_KV *kv, z_ConstBuffer k, z_ConstBuffer v) {
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_KVFromRecord(kv, r);
+  z_Error ret = z_KVFromRecord(kv, r, nullptr);
 
   z_RecordFree(r);
   return ret;
@@ -317,7 +889,7 @@ z_Error z_KVForceUpsert(z_KV *kv, z_ConstBuffer k, z_ConstBuffer v) {
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_KVFromRecord(kv, r);
+  z_Error ret = z_KVFromRecord(kv, r, nullptr);
 
   z_RecordFree(r);
   return ret;
@@ -333,54 +905,107 @@ z_Error z_KVUpdate(z_KV *kv, z_ConstBuffer k, z_ConstBuffer v, z_ConstBuffer src
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_KVFromRecord(kv, r);
+  z_Error ret = z_KVFromRecord(kv, r, nullptr);
 
   z_RecordFree(r);
   return ret;
 }
 
-z_Error z_KVFind(z_KV *kv, z_ConstBuffer k, z_Buffer *v) {
-  z_assert(kv != nullptr, k.Size != 0, k.Data != nullptr);
-  z_assert(v != nullptr);
+// the value of the record at offset, the reader is pinned. v points to the
+// cache, a mapped segment or buf, the cache is only read by a thread protected
+// by kv->Epoch
+z_Error z_kvOffsetValue(z_KV *kv, int64_t offset, z_ConstBuffer *v,
+                        bool is_protected, z_Buffer *buf) {
+  z_FileRecord fr = {};
+  if (is_protected == false ||
+      z_ValueCacheGet(&kv->Cache, offset, &fr.Record) == false) {
+    // a record still mutable may be updated in place after the read
+    bool is_read_only = z_HLogIsReadOnly(&kv->HLog, offset);
+    z_Error ret = z_PReaderGetRecord(&kv->Reader, offset, &fr, buf);
+    if (ret != z_OK) {
+      return ret;
+    }
 
-  int64_t offset = 0;
-  z_Error ret = z_MapFind(&kv->Map, k, &offset);
-  if (ret != z_OK) {
-    return ret;
+    // the read is cached too, the recent reads are likely read again
+    if (is_protected && is_read_only) {
+      z_ValueCacheAdd(&kv->Cache, offset, fr.Record);
+    }
   }
 
-  z_Reader rd;
-  ret = z_ReaderInit(&rd, kv->BinLogPath);
+  z_Error ret = z_RecordValue(fr.Record, v);
   if (ret != z_OK) {
+    z_error("z_RecordValue %d", ret);
     return ret;
   }
+  return z_OK;
+}
 
-  ret = z_ReaderSet(&rd, offset);
-  if (ret != z_OK) {
-    z_ReaderDestroy(&rd);
-    return ret;
-  }
+// see z_kvOffsetValue
+z_Error z_kvFindValue(z_KV *kv, z_ConstBuffer k, z_ConstBuffer *v,
+                      bool is_protected, z_Buffer *buf) {
+  // the segment of offset is not retired by a compaction until unpinned
+  int64_t phase = z_PReaderPin(&kv->Reader);
+  z_defer(z_PReaderUnPin, &kv->Reader, phase);
 
-  z_FileRecord fr = {};
-  ret = z_ReaderGetRecord(&rd, &fr);
+  int64_t offset = 0;
+  z_Error ret = z_MapFind(&kv->Map, k, &offset);
   if (ret != z_OK) {
-    z_ReaderDestroy(&rd);
     return ret;
   }
+  return z_kvOffsetValue(kv, offset, v, is_protected, buf);
+}
+
+z_Error z_KVFind(z_KV *kv, z_ConstBuffer k, z_Buffer *v) {
+  z_assert(kv != nullptr, k.Size != 0, k.Data != nullptr);
+  z_assert(v != nullptr);
 
+  bool is_new = false;
+  bool is_protected = z_kvProtect(kv, &is_new);
   z_ConstBuffer vv;
-  ret = z_RecordValue(fr.Record, &vv);
-  if (ret != z_OK) {
-    z_error("z_RecordValue %d", ret);
-    z_RecordFree(fr.Record);
-    z_ReaderDestroy(&rd);
-    return ret;
+  z_unique(z_Buffer) own = {};
+  z_Error ret =
+      z_kvFindValue(kv, k, &vv, is_protected, z_kvBuffer(kv, &own));
+  if (ret == z_OK) {
+    ret = z_BufferInitByConstBuffer(v, &vv);
   }
 
-  ret = z_BufferInitByConstBuffer(v, &vv);
+  if (is_new) {
+    z_EpochUnProtect(&kv->Epoch);
+  }
+  return ret;
+}
+
+void z_KVViewDestroy(z_KVView *view) {
+  if (view == nullptr || view->KV == nullptr) {
+    return;
+  }
+
+  if (view->IsProtected) {
+    z_EpochUnProtect(&view->KV->Epoch);
+  }
+  if (view->Phase >= 0) {
+    z_PReaderUnPin(&view->KV->Reader, view->Phase);
+  }
+  z_BufferDestroy(&view->Buffer);
+  *view = (z_KVView){};
+}
+
+// z_KVFind without the copy, z_KVViewDestroy the view once it is consumed
+z_Error z_KVFindView(z_KV *kv, z_ConstBuffer k, z_KVView *view) {
+  z_assert(kv != nullptr, k.Size != 0, k.Data != nullptr);
+  z_assert(view != nullptr);
 
-  z_RecordFree(fr.Record);
-  z_ReaderDestroy(&rd);
+  *view = (z_KVView){.KV = kv, .Phase = -1};
+  bool is_protected = z_kvProtect(kv, &view->IsProtected);
+  if (is_protected == false) {
+    view->Phase = z_PReaderPin(&kv->Reader);
+  }
+
+  z_Error ret =
+      z_kvFindValue(kv, k, &view->Value, is_protected, &view->Buffer);
+  if (ret != z_OK) {
+    z_KVViewDestroy(view);
+  }
   return ret;
 }
 
@@ -393,7 +1018,7 @@ z_Error z_KVDelete(z_KV *kv, z_ConstBuffer k) {
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_KVFromRecord(kv, r);
+  z_Error ret = z_KVFromRecord(kv, r, nullptr);
   z_RecordFree(r);
   return ret;
 }
@@ -0,0 +1,359 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "zkv/batch.h"
+#include "zkv/kv_loop_test.h"
+#include "ztest/test.h"
+#include "zutils/threads.h"
+
+// adds an op of key i with value v, and src value src for an update
+z_Error z_KVBatchTestAdd(z_KVWriteBatch *b, uint8_t op, int64_t i, int64_t v,
+                         int64_t src) {
+  char key[32] = {};
+  char value[32] = {};
+  char src_value[32] = {};
+  sprintf(key, "key%lld", i);
+  sprintf(value, "value%lld", v);
+  sprintf(src_value, "value%lld", src);
+  z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+  z_ConstBuffer vb = {.Data = value, .Size = strlen(value)};
+  z_ConstBuffer src_vb = {.Data = src_value, .Size = strlen(src_value)};
+
+  switch (op) {
+  case z_ROP_INSERT:
+    return z_KVWriteBatchInsert(b, k, vb);
+  case z_ROP_FORCE_UPDATE:
+    return z_KVWriteBatchForceUpdate(b, k, vb);
+  case z_ROP_FORCE_UPSERT:
+    return z_KVWriteBatchForceUpsert(b, k, vb);
+  case z_ROP_UPDATE:
+    return z_KVWriteBatchUpdate(b, k, vb, src_vb);
+  default:
+    return z_KVWriteBatchDelete(b, k);
+  }
+}
+
+// a batch inserting [start, end) with the values of the keys
+z_Error z_KVBatchTestInsert(z_KV *kv, int64_t start, int64_t end) {
+  z_unique(z_KVWriteBatch) b = {};
+  for (int64_t i = start; i < end; ++i) {
+    z_Error ret = z_KVBatchTestAdd(&b, z_ROP_INSERT, i, i, 0);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+  return z_KVWrite(kv, &b, nullptr, nullptr);
+}
+
+// the binlog is cut at size as a crash in the middle of the last batch does
+void z_KVBatchTestTorn(char *binlog_path, int64_t size,
+                       int64_t recover_threads) {
+  z_ASSERT_TRUE(truncate(binlog_path, size) == 0);
+
+  z_KV kv;
+  z_Error ret = z_KVInitParallel(&kv, binlog_path, 1024 * 1024, 64,
+                                 z_MAP_ENGINE_SWISS,
+                                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                                 recover_threads);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.Recovery.IsTorn);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 100, 1, 0));
+  z_ASSERT_TRUE(z_FindNotFoundRange(&kv, 100, 110));
+
+  // the torn batch is cut off, the next one takes its place
+  z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, 100, 110) == z_OK);
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, 1024 * 1024, 64, z_MAP_ENGINE_LIST,
+                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.Recovery.IsTorn == false);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 110, 1, 0));
+  z_KVDestroy(&kv);
+}
+
+// a flipped byte at pos of a batch fails the replay, it is not torn
+void z_KVBatchTestBroken(char *binlog_path, int64_t pos,
+                         int64_t recover_threads) {
+  int64_t fd = open(binlog_path, O_RDWR);
+  z_ASSERT_TRUE(fd >= 0);
+  int8_t b = 0;
+  z_ASSERT_TRUE(pread(fd, &b, 1, pos) == 1);
+  b ^= 1;
+  z_ASSERT_TRUE(pwrite(fd, &b, 1, pos) == 1);
+
+  z_KV kv;
+  z_Error ret = z_KVInitParallel(&kv, binlog_path, 1024 * 1024, 64,
+                                 z_MAP_ENGINE_SWISS,
+                                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                                 recover_threads);
+  z_ASSERT_TRUE(ret != z_OK);
+
+  b ^= 1;
+  z_ASSERT_TRUE(pwrite(fd, &b, 1, pos) == 1);
+  close(fd);
+}
+
+// one find batch of the keys of [start, end) backwards with a duplicate and a
+// key never written, the value of key i is value i
+bool z_KVBatchTestFind(z_KV *kv, int64_t start, int64_t end) {
+  int64_t len = end - start + 2;
+  char keys[z_KV_FIND_BATCH_LEN][32];
+  z_ConstBuffer ks[z_KV_FIND_BATCH_LEN];
+  for (int64_t i = 0; i < len; ++i) {
+    int64_t key = i < len - 2 ? end - 1 - i : (i == len - 2 ? start : -1);
+    ks[i] = (z_ConstBuffer){.Data = keys[i],
+                            .Size = sprintf(keys[i], "key%lld", key)};
+  }
+
+  z_Buffer vs[z_KV_FIND_BATCH_LEN];
+  z_Error rets[z_KV_FIND_BATCH_LEN];
+  bool is_found = z_KVFindBatch(kv, ks, len, vs, rets) == z_OK &&
+                  rets[len - 1] == z_ERR_NOT_FOUND;
+  for (int64_t i = 0; i < len - 1; ++i) {
+    int64_t key = i < len - 2 ? end - 1 - i : start;
+    char value[32] = {};
+    z_ConstBuffer v = {.Data = value,
+                       .Size = sprintf(value, "value%lld", key)};
+    is_found = is_found && rets[i] == z_OK && z_BufferIsEqual(&vs[i], &v);
+    z_BufferDestroy(&vs[i]);
+  }
+  return is_found;
+}
+
+typedef struct {
+  z_KV *KV;
+  int64_t Rounds;
+  bool Ret;
+  z_Thread TID;
+} z_KVBatchTestArg;
+
+// batches of force updates of key0 and key1 to the same value
+void *z_KVBatchTestWriter(void *ptr) {
+  z_KVBatchTestArg *arg = (z_KVBatchTestArg *)ptr;
+  z_unique(z_KVWriteBatch) b = {};
+  arg->Ret = true;
+  for (int64_t v = 1; v <= arg->Rounds && arg->Ret; ++v) {
+    z_KVWriteBatchClear(&b);
+    z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 0, v, 0);
+    z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 1, v, 0);
+    arg->Ret = z_KVWrite(arg->KV, &b, nullptr, nullptr) == z_OK;
+  }
+  return nullptr;
+}
+
+// the finds never see one update of a batch without the other
+void z_KVBatchTestAtomic() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+
+  z_KV kv;
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024 * 1024, 64,
+                         z_MAP_ENGINE_SWISS,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, 0, 2) == z_OK);
+  z_ASSERT_TRUE(z_ForceUpdate(&kv, 1, 0));
+
+  z_KVBatchTestArg arg = {.KV = &kv, .Rounds = 2000};
+  z_ASSERT_TRUE(z_ThreadCreate(&arg.TID, z_KVBatchTestWriter, &arg) == 0);
+  char keys[2][32];
+  z_ConstBuffer ks[2];
+  for (int64_t i = 0; i < 2; ++i) {
+    ks[i] = (z_ConstBuffer){.Data = keys[i],
+                            .Size = sprintf(keys[i], "key%lld", i)};
+  }
+  bool is_equal = true;
+  char last[32] = {};
+  sprintf(last, "value%lld", arg.Rounds);
+  z_ConstBuffer last_v = {.Data = last, .Size = strlen(last)};
+  for (int64_t i = 0; i < 1000000 && is_equal; ++i) {
+    z_Buffer vs[2];
+    z_Error rets[2];
+    is_equal = z_KVFindBatch(&kv, ks, 2, vs, rets) == z_OK &&
+               z_BufferIsEqual(&vs[0], &vs[1]);
+    bool is_last = is_equal && z_BufferIsEqual(&vs[0], &last_v);
+    z_BufferDestroy(&vs[0]);
+    z_BufferDestroy(&vs[1]);
+    if (is_last) {
+      break;
+    }
+  }
+  z_ThreadJion(arg.TID);
+  z_ASSERT_TRUE(arg.Ret);
+  z_ASSERT_TRUE(is_equal);
+
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
+// the records on the disk, mapped, cached and in the hybrid log
+void z_KVFindBatchTest() {
+  // the cache is read by the threads with an id only
+  z_ThreadIDs tids;
+  z_Error ret = z_ThreadIDsInit(&tids, 1);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_ThreadIDInit(&tids);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_NEVER};
+
+  z_KV kv;
+  ret = z_KVInit(&kv, binlog_path, 64 * 1024, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  for (int64_t i = 0; i < 5000; i += 500) {
+    z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, i, i + 500) == z_OK);
+  }
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment > 0);
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 0, 1000));
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 4000, 5000));
+
+  z_KVMapSealed(&kv);
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 1000, 2000));
+  ret = z_KVCacheInit(&kv, 1024 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 4000, 5000));
+  int64_t hits = atomic_load(&kv.Cache.HitCount);
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 4000, 5000));
+  z_ASSERT_TRUE(atomic_load(&kv.Cache.HitCount) > hits);
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, 64 * 1024, 1024, z_MAP_ENGINE_LIST, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVHLogInit(&kv, 64 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, 5000, 5100) == z_OK);
+  z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 4500, 5100));
+  z_KVDestroy(&kv);
+
+  z_SegmentsRemove(binlog_path);
+  z_ThreadIDDestroy(&tids);
+  z_ThreadIDsDestroy(&tids);
+}
+
+void z_KVBatchTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_NEVER};
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, 1024 * 1024, 64, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  // a batch holds off the parallel appends to the hybrid log
+  ret = z_KVHLogInit(&kv, 64 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  // one commit for the whole batch
+  z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, 0, 100) == z_OK);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 100, 1, 0));
+  z_ASSERT_TRUE(atomic_load(&kv.BinLog.BatchCount) == 1);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == 100);
+
+  // a failed one fails the whole batch, none of it is written
+  z_unique(z_KVWriteBatch) b = {};
+  z_KVBatchTestAdd(&b, z_ROP_DELETE, 0, 0, 0);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 1, 2, 0);
+  z_KVBatchTestAdd(&b, z_ROP_UPDATE, 2, 3, 2);
+  z_KVBatchTestAdd(&b, z_ROP_INSERT, 3, 3, 0);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPSERT, 200, 200, 0);
+  z_Error rets[5];
+  int64_t seq = 0;
+  ret = z_KVWrite(&kv, &b, rets, &seq);
+  z_ASSERT_TRUE(ret == z_ERR_EXIST);
+  z_ASSERT_TRUE(rets[0] == z_ERR_ABORTED && rets[1] == z_ERR_ABORTED &&
+                rets[2] == z_ERR_ABORTED && rets[3] == z_ERR_EXIST &&
+                rets[4] == z_ERR_ABORTED);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == 100);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 100, 1, 0));
+  z_ASSERT_TRUE(z_FindNotFound(&kv, 200));
+
+  // a record sees the ones before it in the batch
+  z_KVWriteBatchClear(&b);
+  z_KVBatchTestAdd(&b, z_ROP_INSERT, 300, 300, 0);
+  z_KVBatchTestAdd(&b, z_ROP_UPDATE, 300, 301, 1);
+  ret = z_KVWrite(&kv, &b, rets, &seq);
+  z_ASSERT_TRUE(ret == z_ERR_CONFLICT);
+  z_ASSERT_TRUE(rets[0] == z_ERR_ABORTED && rets[1] == z_ERR_CONFLICT);
+  z_ASSERT_TRUE(z_FindNotFound(&kv, 300));
+
+  // every op
+  z_KVWriteBatchClear(&b);
+  z_KVBatchTestAdd(&b, z_ROP_DELETE, 0, 0, 0);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 1, 2, 0);
+  z_KVBatchTestAdd(&b, z_ROP_UPDATE, 2, 3, 2);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPSERT, 200, 201, 0);
+  z_KVBatchTestAdd(&b, z_ROP_UPDATE, 200, 200, 201);
+  ret = z_KVWrite(&kv, &b, rets, &seq);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(rets[0] == z_OK && rets[1] == z_OK && rets[2] == z_OK &&
+                rets[3] == z_OK && rets[4] == z_OK);
+  z_ASSERT_TRUE(seq == 105);
+  z_ASSERT_TRUE(z_FindNotFound(&kv, 0));
+  z_ASSERT_TRUE(z_Find(&kv, 1, 2) && z_Find(&kv, 2, 3) && z_Find(&kv, 3, 3));
+  z_ASSERT_TRUE(z_Find(&kv, 200, 200));
+
+  // put them back for the checks below
+  z_KVWriteBatchClear(&b);
+  z_KVBatchTestAdd(&b, z_ROP_INSERT, 0, 0, 0);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 1, 1, 0);
+  z_KVBatchTestAdd(&b, z_ROP_FORCE_UPDATE, 2, 2, 0);
+  z_KVBatchTestAdd(&b, z_ROP_DELETE, 200, 0, 0);
+  z_ASSERT_TRUE(z_KVWrite(&kv, &b, nullptr, nullptr) == z_OK);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 100, 1, 0));
+  z_KVDestroy(&kv);
+
+  // both replays apply the batches
+  int64_t last_seq = 0;
+  for (int64_t threads = 1; threads <= 4; threads *= 4) {
+    ret = z_KVInitParallel(&kv, binlog_path, 1024 * 1024, 64,
+                           z_MAP_ENGINE_LIST, sync, threads);
+    z_ASSERT_TRUE(ret == z_OK);
+    z_ASSERT_TRUE(z_FindRange(&kv, 0, 100, 1, 0));
+    z_ASSERT_TRUE(z_FindNotFound(&kv, 200));
+    z_ASSERT_TRUE(z_KVAckedSeq(&kv) == 109);
+    // the map is locked per key by a thread with no id
+    z_ASSERT_TRUE(z_KVBatchTestFind(&kv, 0, 100));
+    if (threads == 4) {
+      z_ASSERT_TRUE(z_KVBatchTestInsert(&kv, 100, 110) == z_OK);
+      last_seq = z_KVAckedSeq(&kv);
+    }
+    z_KVDestroy(&kv);
+  }
+
+  // the last batch cut after its first record, then in its last record. its
+  // ten frames are of the same size
+  int64_t size = z_SegmentSize(binlog_path, 0);
+  int64_t base = 0;
+  z_ASSERT_TRUE(z_SegmentBase(binlog_path, 0, &base) == z_OK);
+  z_ConstBuffer k = {.Data = "key100", .Size = strlen("key100")};
+  z_ConstBuffer v = {.Data = "value100", .Size = strlen("value100")};
+  z_Record *r = z_RecordNewByKV(z_ROP_INSERT, k, v);
+  z_FileRecord fr = {.Seq = last_seq - 9, .Record = r};
+  z_FrameEncode(&fr, base);
+  z_RecordFree(r);
+  int64_t first = fr.Size;
+  int64_t batch_size = first * 10;
+  for (int64_t threads = 1; threads <= 4; threads *= 4) {
+    z_KVBatchTestTorn(binlog_path, size - batch_size + first, threads);
+    z_KVBatchTestTorn(binlog_path, size - 3, threads);
+  }
+
+  // the second record of the last batch is broken past its head, the batch
+  // is whole
+  size = z_SegmentSize(binlog_path, 0);
+  for (int64_t threads = 1; threads <= 4; threads *= 4) {
+    z_KVBatchTestBroken(binlog_path, size - batch_size + first * 2 - 2,
+                        threads);
+    z_KVBatchTestBroken(binlog_path, size - 3, threads);
+  }
+
+  z_SegmentsRemove(binlog_path);
+
+  z_KVFindBatchTest();
+  z_KVBatchTestAtomic();
+}
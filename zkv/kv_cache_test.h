@@ -0,0 +1,56 @@
+#include "zkv/kv.h"
+#include "zkv/kv_loop_test.h"
+#include "ztest/test.h"
+#include "zutils/threads.h"
+
+bool z_KVCacheTestFill(z_KV *kv, int64_t start, int64_t count) {
+  for (int64_t i = start; i < start + count; ++i) {
+    if (z_Insert(kv, i) == false || z_ForceUpdate(kv, i, i + 1) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void z_KVCacheTest() {
+  // the cache is read by the threads with an id only
+  z_ThreadIDs tids;
+  z_Error ret = z_ThreadIDsInit(&tids, 1);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_ThreadIDInit(&tids);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 1000;
+
+  z_KV kv;
+  ret = z_KVInit(&kv, binlog_path, 1024 * 1024 * 1024, 1024,
+                 z_MAP_ENGINE_SWISS,
+                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVCacheInit(&kv, 16 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  // the last writes are still cached
+  z_ASSERT_TRUE(z_KVCacheTestFill(&kv, 0, count));
+  z_ASSERT_TRUE(z_FindRange(&kv, count - 10, count, 1, 1));
+  int64_t hit = atomic_load(&kv.Cache.HitCount);
+  z_ASSERT_TRUE(hit > 0);
+
+  // the first ones were evicted and are read again from the binlog
+  int64_t miss = atomic_load(&kv.Cache.MissCount);
+  z_ASSERT_TRUE(atomic_load(&kv.Cache.Cache.Start) > 0);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 1));
+  z_ASSERT_TRUE(atomic_load(&kv.Cache.MissCount) > miss);
+
+  // and cached by the reads
+  hit = atomic_load(&kv.Cache.HitCount);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, 10, 1, 1));
+  z_ASSERT_TRUE(atomic_load(&kv.Cache.HitCount) > hit);
+
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+  z_ThreadIDDestroy(&tids);
+  z_ThreadIDsDestroy(&tids);
+}
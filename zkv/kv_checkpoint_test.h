@@ -0,0 +1,155 @@
+#include <unistd.h>
+
+#include "zkv/compact.h"
+#include "zkv/kv_loop_test.h"
+#include "ztest/test.h"
+
+// keys of [start, start + count) are inserted and updated once, the first
+// deleted keys are deleted
+bool z_KVCheckpointTestFill(z_KV *kv, int64_t start, int64_t count,
+                            int64_t deleted) {
+  for (int64_t i = start; i < start + count; ++i) {
+    if (z_Insert(kv, i) == false || z_ForceUpdate(kv, i, i + 1) == false) {
+      return false;
+    }
+  }
+
+  for (int64_t i = start; i < start + deleted; ++i) {
+    char key[32] = {};
+    sprintf(key, "key%lld", i);
+    if (z_KVDelete(kv, (z_ConstBuffer){.Data = key, .Size = strlen(key)}) !=
+        z_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool z_KVCheckpointTestCheck(z_KV *kv, int64_t start, int64_t count,
+                             int64_t deleted) {
+  for (int64_t i = start; i < start + count; ++i) {
+    bool ret = i < start + deleted ? z_FindNotFound(kv, i) : z_Find(kv, i, i + 1);
+    if (ret == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the writes while the buckets are copied leave the checkpoint at its head,
+// the replay from there runs them again on the map they ran on: value1 to
+// value2 failed, value0 to value1 did, the key is value1 after a restart
+void z_KVCheckpointTestWrites(char *binlog_path) {
+  z_SegmentsRemove(binlog_path);
+  z_CheckpointRemove(binlog_path);
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_GROUP};
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, 16 * 1024, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_Insert(&kv, 0));
+
+  z_CheckpointHead head = {};
+  z_CheckpointDead dead[z_SEGMENTS_LEN];
+  ret = z_kvCheckpointBegin(&kv, &head, dead);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_UpdateConflict(&kv, 0, 2, 1));
+  z_ASSERT_TRUE(z_Update(&kv, 0, 1, 0));
+  z_ASSERT_TRUE(z_Insert(&kv, 1));
+  ret = z_kvCheckpointEnd(&kv, head, dead);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, 16 * 1024, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointOffset) == head.Offset);
+  z_ASSERT_TRUE(z_Find(&kv, 0, 1));
+  z_ASSERT_TRUE(z_Find(&kv, 1, 1));
+  z_KVDestroy(&kv);
+
+  z_SegmentsRemove(binlog_path);
+  z_CheckpointRemove(binlog_path);
+}
+
+void z_KVCheckpointTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_KVCheckpointTestWrites(binlog_path);
+  z_SegmentsRemove(binlog_path);
+  z_CheckpointRemove(binlog_path);
+  int64_t count = 1000;
+  int64_t deleted = 100;
+  int64_t max_size = 16 * 1024;
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_GROUP};
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVCheckpointTestFill(&kv, 0, count, deleted));
+
+  ret = z_KVCheckpoint(&kv);
+  z_ASSERT_TRUE(ret == z_OK);
+  int64_t offset = 0;
+  z_WriterOffset(&kv.BinLog.Writer, &offset);
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointOffset) == offset);
+
+  // the tail after the checkpoint, its deletes survive the compactions
+  z_ASSERT_TRUE(z_KVCheckpointTestFill(&kv, count, count, deleted));
+  for (int64_t i = 0; i < 100; ++i) {
+    int64_t segment = z_KVCompactPick(&kv, 0.01);
+    if (segment < 0 || z_KVCompact(&kv, segment, 0) != z_OK) {
+      break;
+    }
+  }
+  z_ASSERT_TRUE(atomic_load(&kv.CompactCount) > 0);
+  int64_t seq = z_KVAckedSeq(&kv);
+  z_KVDestroy(&kv);
+
+  // the checkpoint is loaded, the tail is replayed and the seq goes on
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_LIST, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointOffset) == offset);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq);
+  z_ASSERT_TRUE(z_KVDurableSeq(&kv) == seq);
+  z_ASSERT_TRUE(z_KVCheckpointTestCheck(&kv, 0, count, deleted));
+  z_ASSERT_TRUE(z_KVCheckpointTestCheck(&kv, count, count, deleted));
+  z_ASSERT_TRUE(z_Insert(&kv, count * 2));
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq + 1);
+
+  // the checkpointer writes one more before z_KVDestroy returns
+  ret = z_KVCheckpointStart(&kv, 1);
+  z_ASSERT_TRUE(ret == z_OK);
+  for (int64_t i = 0; i < 1000 && atomic_load(&kv.CheckpointCount) == 0;
+       ++i) {
+    usleep(1000);
+  }
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointCount) > 0);
+  z_ASSERT_TRUE(z_KVCheckpointTestFill(&kv, count * 3, count, deleted));
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_WriterOffset(&kv.BinLog.Writer, &offset);
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointOffset) == offset);
+  z_ASSERT_TRUE(z_KVCheckpointTestCheck(&kv, 0, count, deleted));
+  z_ASSERT_TRUE(z_KVCheckpointTestCheck(&kv, count * 3, count, deleted));
+  z_KVDestroy(&kv);
+
+  // the checkpoint of another binlog is not loaded
+  z_SegmentsRemove(binlog_path);
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVCheckpointTestFill(&kv, count * 4, 10, 0));
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(atomic_load(&kv.CheckpointOffset) == INT64_MAX);
+  z_ASSERT_TRUE(z_KVCheckpointTestCheck(&kv, count * 4, 10, 0));
+  z_ASSERT_TRUE(z_FindNotFound(&kv, deleted));
+  z_KVDestroy(&kv);
+
+  z_SegmentsRemove(binlog_path);
+  z_CheckpointRemove(binlog_path);
+}
@@ -5,15 +5,28 @@
 
 void z_OneThread() {
   char *binlog_path = "./bin/binlog.log";
-  remove(binlog_path);
+  z_SegmentsRemove(binlog_path);
 
   z_KV kv;
-  z_Error ret =
-      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024 * 1024);
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1,
+                         z_MAP_ENGINE_SWISS, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_ThreadIDs tids;
+  ret = z_ThreadIDsInit(&tids, 1);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_ThreadIDInit(&tids);
   z_ASSERT_TRUE(ret == z_OK);
 
   bool loop_ret = z_Loop(&kv, 0, 10000);
   z_ASSERT_TRUE(loop_ret == true);
+  z_ASSERT_TRUE(z_MapBucketsLen(&kv.Map) > 1);
+  z_ASSERT_TRUE(z_MapLen(&kv.Map) == 0);
+  // the preads of the thread go to its buffer, it is kept for the next ones
+  z_ASSERT_TRUE(kv.Buffers[z_ThreadID()].Data != nullptr);
+
+  z_ThreadIDDestroy(&tids);
+  z_ThreadIDsDestroy(&tids);
 
   z_KVDestroy(&kv);
   return;
@@ -25,30 +38,41 @@ typedef struct {
   int64_t count;
   bool ret;
   pthread_t tid;
+  z_ThreadIDs *tids;
 } z_Arg;
 
 void *z_KVThreadFunc(void *ptr) {
   z_Arg *arg = (z_Arg *)ptr;
+  // with a thread id z_MapFind takes the lock free path
+  z_ThreadIDInit(arg->tids);
   arg->ret = z_Loop(arg->kv, arg->start, arg->count);
+  z_ThreadIDDestroy(arg->tids);
   return nullptr;
 }
 
 void z_MutilThread() {
 
-  int64_t thread_count = 64;
-  int64_t step = 100000;
+  int64_t thread_count = 32;
+  int64_t step = 5000;
 
   char *binlog_path = "./bin/binlog.log";
-  remove(binlog_path);
+  z_SegmentsRemove(binlog_path);
   z_KV kv;
-  z_Error ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 10240);
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 10240,
+                         z_MAP_ENGINE_LIST, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_ThreadIDs tids;
+  ret = z_ThreadIDsInit(&tids, thread_count);
   z_ASSERT_TRUE(ret == z_OK);
 
   z_Arg *args = z_malloc(sizeof(z_Arg) * thread_count);
   for (int i = 0; i < thread_count; i++) {
     args[i].kv = &kv;
+    args[i].tids = &tids;
+    // z_Loop takes the keys in [start, count), count is the end
     args[i].start = i * step;
-    args[i].count = step;
+    args[i].count = args[i].start + step;
   }
   for (int i = 0; i < thread_count; i++) {
     int p_ret = pthread_create(&args[i].tid, nullptr, z_KVThreadFunc, &args[i]);
@@ -71,12 +95,103 @@ void z_MutilThread() {
   }
 
   z_ASSERT_TRUE(func_ret == true);
+  z_ASSERT_TRUE(z_MapBucketsLen(&kv.Map) > 10240);
+  z_ASSERT_TRUE(z_MapLen(&kv.Map) == 0);
+  // the second segment holds 10240 buckets, those not split into yet are not
+  // initialized
+  int64_t buckets_len = z_MapBucketsLen(&kv.Map);
+  z_ASSERT_TRUE(buckets_len < 10240 * 2 &&
+                z_mapBucket(&kv.Map, buckets_len)->List.Records == nullptr);
+
+  // z_Loop appends 6 records per key, every thread writes step keys and the
+  // writers of the same time commit together
+  z_BinLogStats stats;
+  z_BinLogGetStats(&kv.BinLog, &stats);
+  z_ASSERT_TRUE(stats.RecordCount == thread_count * step * 6);
+  z_ASSERT_TRUE(stats.BatchCount > 0 && stats.BatchCount < stats.RecordCount);
+  z_ASSERT_TRUE(stats.MaxBatchLen > 1 && stats.MaxBatchLen <= thread_count);
   z_free(args);
+  z_ThreadIDsDestroy(&tids);
   z_KVDestroy(&kv);
   return;
 }
 
+typedef struct {
+  z_KV *kv;
+  int64_t count;
+  atomic_bool *is_running;
+  bool ret;
+  pthread_t tid;
+  z_ThreadIDs *tids;
+} z_SplitArg;
+
+void *z_KVSplitFindFunc(void *ptr) {
+  z_SplitArg *arg = (z_SplitArg *)ptr;
+  z_ThreadIDInit(arg->tids);
+  arg->ret = true;
+  while (atomic_load(arg->is_running) == true && arg->ret == true) {
+    for (int64_t i = 0; i < arg->count && arg->ret == true; ++i) {
+      arg->ret = z_Find(arg->kv, i, i);
+    }
+  }
+  z_ThreadIDDestroy(arg->tids);
+  return nullptr;
+}
+
+// the lock free finds never miss a key while its bucket is split
+void z_SplitFind() {
+  int64_t thread_count = 4;
+  int64_t count = 1000;
+
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  z_KV kv;
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1,
+                         z_MAP_ENGINE_LIST,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+
+  bool insert_ret = true;
+  for (int64_t i = 0; i < count; ++i) {
+    insert_ret = insert_ret && z_Insert(&kv, i);
+  }
+  z_ASSERT_TRUE(insert_ret);
+
+  z_ThreadIDs tids;
+  ret = z_ThreadIDsInit(&tids, thread_count);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  atomic_bool is_running = true;
+  z_SplitArg args[thread_count];
+  for (int64_t i = 0; i < thread_count; ++i) {
+    args[i] = (z_SplitArg){
+        .kv = &kv, .count = count, .is_running = &is_running, .tids = &tids};
+    z_ASSERT_TRUE(pthread_create(&args[i].tid, nullptr, z_KVSplitFindFunc,
+                                 &args[i]) == 0);
+  }
+
+  int64_t buckets_len = z_MapBucketsLen(&kv.Map);
+  for (int64_t i = count; i < count * 100; ++i) {
+    insert_ret = insert_ret && z_Insert(&kv, i);
+  }
+  atomic_store(&is_running, false);
+
+  bool find_ret = true;
+  for (int64_t i = 0; i < thread_count; ++i) {
+    pthread_join(args[i].tid, nullptr);
+    find_ret = find_ret && args[i].ret;
+  }
+  z_ASSERT_TRUE(insert_ret);
+  z_ASSERT_TRUE(find_ret);
+  z_ASSERT_TRUE(z_MapBucketsLen(&kv.Map) > buckets_len);
+
+  z_ThreadIDsDestroy(&tids);
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
 void z_KVCocurrentTest() {
   z_OneThread();
   z_MutilThread();
+  z_SplitFind();
 }
\ No newline at end of file
@@ -0,0 +1,153 @@
+#include <unistd.h>
+
+#include "zkv/compact.h"
+#include "zkv/kv_loop_test.h"
+#include "ztest/test.h"
+
+// every key of [start, start + count) is written rounds + 1 times, only the
+// last round is live, the first deleted keys are deleted at the end
+bool z_KVCompactTestFill(z_KV *kv, int64_t start, int64_t count,
+                         int64_t rounds, int64_t deleted) {
+  if (z_InsertRange(kv, start, start + count) == false) {
+    return false;
+  }
+
+  for (int64_t r = 1; r <= rounds; ++r) {
+    for (int64_t i = start; i < start + count; ++i) {
+      if (z_ForceUpdate(kv, i, i + r * count) == false) {
+        return false;
+      }
+    }
+  }
+
+  for (int64_t i = start; i < start + deleted; ++i) {
+    char key[32] = {};
+    sprintf(key, "key%lld", i);
+    if (z_KVDelete(kv, (z_ConstBuffer){.Data = key, .Size = strlen(key)}) !=
+        z_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool z_KVCompactTestCheck(z_KV *kv, int64_t start, int64_t count,
+                          int64_t rounds, int64_t deleted) {
+  for (int64_t i = start; i < start + count; ++i) {
+    bool ret = i < start + deleted ? z_FindNotFound(kv, i)
+                           : z_Find(kv, i, i + rounds * count);
+    if (ret == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+int64_t z_KVCompactTestSize(char *path) {
+  int64_t size = 0;
+  for (int64_t i = z_SegmentNext(path, -1); i >= 0; i = z_SegmentNext(path, i)) {
+    size += z_SegmentSize(path, i);
+  }
+  return size;
+}
+
+// an overwrite makes the frame it replaced dead, the map keeps the size of a
+// small one and a large one is read
+void z_KVCompactTestDead(char *binlog_path) {
+  z_SegmentsRemove(binlog_path);
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, 1024 * 1024, 1024, z_MAP_ENGINE_SWISS,
+               (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+
+  static int8_t large[z_MAP_RECORD_SIZE_LARGE + 1];
+  memset(large, 'v', sizeof(large));
+  z_ConstBuffer ks[2] = {{.Data = "a", .Size = 1}, {.Data = "b", .Size = 1}};
+  z_ConstBuffer vs[2] = {{.Data = "value", .Size = 5},
+                         {.Data = large, .Size = sizeof(large)}};
+  int64_t offsets[4];
+  bool is_ok = true;
+  for (int64_t i = 0; i < 4; ++i) {
+    ret = i < 2 ? z_KVInsert(&kv, ks[i], vs[i])
+                : z_KVForceUpdate(&kv, ks[i % 2], vs[i % 2]);
+    is_ok = is_ok && ret == z_OK;
+    offsets[i] = atomic_load(&kv.BinLog.AckedOffset);
+  }
+  z_ASSERT_TRUE(is_ok);
+  z_ASSERT_TRUE(atomic_load(&kv.DeadBytes[0]) == offsets[2] - offsets[0]);
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
+void z_KVCompactTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_KVCompactTestDead(binlog_path);
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 500;
+  int64_t rounds = 4;
+  int64_t deleted = 50;
+  int64_t max_size = 16 * 1024;
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+               (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVCompactTestFill(&kv, 0, count, rounds, deleted));
+
+  int64_t size = z_KVCompactTestSize(binlog_path);
+  int64_t segment = z_KVCompactPick(&kv, 0.5);
+  z_ASSERT_TRUE(segment >= 0);
+  while (segment >= 0) {
+    ret = z_KVCompact(&kv, segment, 0);
+    if (ret != z_OK || z_SegmentSize(binlog_path, segment) >= 0) {
+      break;
+    }
+    segment = z_KVCompactPick(&kv, 0.5);
+  }
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(atomic_load(&kv.CompactCount) > 1);
+  z_ASSERT_TRUE(z_KVCompactTestSize(binlog_path) < size);
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, 0, count, rounds, deleted));
+
+  z_KVDestroy(&kv);
+
+  // the replay of the compacted binlog gives the same keys
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_LIST,
+                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_KVMapSealed(&kv);
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, 0, count, rounds, deleted));
+
+  // the background compaction runs along with the writes, the retired
+  // segments are unmapped
+  ret = z_KVCompactStart(&kv, (z_KVCompactOptions){.DeadRatio = 0.5,
+                                                   .BytesPerSecond = 1024 * 1024,
+                                                   .IntervalMS = 1});
+  z_ASSERT_TRUE(ret == z_OK);
+  int64_t compact_count = atomic_load(&kv.CompactCount);
+  z_ASSERT_TRUE(z_KVCompactTestFill(&kv, count, count, rounds, 0));
+  for (int64_t i = 0; i < 1000 && atomic_load(&kv.CompactCount) ==
+                                      compact_count; ++i) {
+    usleep(10 * 1000);
+  }
+  z_ASSERT_TRUE(atomic_load(&kv.CompactCount) > compact_count);
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, 0, count, rounds, deleted));
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, count, count, rounds, 0));
+  int64_t mapped = 0;
+  for (int64_t i = 0; i < z_SEGMENTS_LEN; ++i) {
+    mapped += atomic_load(&kv.Reader.Maps[i]) != 0;
+  }
+  z_ASSERT_TRUE(mapped > 0);
+
+  z_KVDestroy(&kv);
+
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, 0, count, rounds, deleted));
+  z_ASSERT_TRUE(z_KVCompactTestCheck(&kv, count, count, rounds, 0));
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
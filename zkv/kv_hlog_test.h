@@ -0,0 +1,185 @@
+#include "zkv/kv.h"
+#include "zkv/kv_loop_test.h"
+#include "ztest/test.h"
+#include "zutils/threads.h"
+
+// every key of [start, start + count) takes the values of [from, to), they
+// all have the same size
+bool z_KVHLogTestFill(z_KV *kv, int64_t start, int64_t count, int64_t from,
+                      int64_t to) {
+  for (int64_t v = from; v < to; ++v) {
+    for (int64_t i = start; i < start + count; ++i) {
+      if (z_ForceUpdate(kv, i, v) == false) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+typedef struct {
+  z_KV *KV;
+  z_ThreadIDs *TIDs;
+  int64_t Start;
+  int64_t End;
+  bool Ret;
+  z_Thread TID;
+} z_KVHLogTestArg;
+
+void *z_KVHLogTestThread(void *ptr) {
+  z_KVHLogTestArg *arg = (z_KVHLogTestArg *)ptr;
+  z_ThreadIDInit(arg->TIDs);
+  arg->Ret = z_Loop(arg->KV, arg->Start, arg->End);
+  z_ThreadIDDestroy(arg->TIDs);
+  return nullptr;
+}
+
+// the appenders copy in parallel, the binlog still has the seqs in offset
+// order
+void z_KVHLogParallelTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t thread_count = 8;
+  int64_t step = 4096;
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_NEVER};
+
+  z_KV kv;
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024 * 1024, 1024,
+                         z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVHLogInit(&kv, 64 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_ThreadIDs tids;
+  ret = z_ThreadIDsInit(&tids, thread_count);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_KVHLogTestArg args[thread_count];
+  for (int64_t i = 0; i < thread_count; ++i) {
+    args[i] = (z_KVHLogTestArg){
+        .KV = &kv, .TIDs = &tids, .Start = i * step, .End = (i + 1) * step};
+    z_ASSERT_TRUE(z_ThreadCreate(&args[i].TID, z_KVHLogTestThread, &args[i]) ==
+                  0);
+  }
+  bool loop_ret = true;
+  for (int64_t i = 0; i < thread_count; ++i) {
+    z_ThreadJion(args[i].TID);
+    loop_ret = loop_ret && args[i].Ret;
+  }
+  z_ASSERT_TRUE(loop_ret);
+  z_ASSERT_TRUE(z_MapLen(&kv.Map) == 0);
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment > 0);
+  int64_t seq = z_KVAckedSeq(&kv);
+  z_ThreadIDsDestroy(&tids);
+  z_KVDestroy(&kv);
+
+  z_Reader rd;
+  ret = z_ReaderInit(&rd, binlog_path);
+  z_ASSERT_TRUE(ret == z_OK);
+  int64_t max_offset = 0;
+  z_ReaderMaxOffset(&rd, &max_offset);
+  int64_t offset = 0;
+  int64_t last = 0;
+  bool in_order = true;
+  while (z_ReaderOffset(&rd, &offset) == z_OK && offset < max_offset) {
+    z_FileRecord r;
+    if (z_ReaderGetRecord(&rd, &r) != z_OK) {
+      in_order = false;
+      break;
+    }
+    in_order = in_order && (last == 0 || r.Seq == last + 1);
+    last = r.Seq;
+    z_RecordFree(r.Record);
+  }
+  z_ReaderDestroy(&rd);
+  z_ASSERT_TRUE(in_order);
+  z_ASSERT_TRUE(last == seq);
+
+  z_SegmentsRemove(binlog_path);
+}
+
+void z_KVHLogTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 10;
+  int64_t max_size = 64 * 1024;
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_NEVER};
+
+  // the seqs of a synced kv are waited on, its updates are never in place
+  z_KV kv;
+  z_Error ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_GROUP});
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVHLogInit(&kv, 16 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVInPlaceEnable(&kv) == z_ERR_INVALID_DATA);
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVHLogInit(&kv, 16 * 1024);
+  z_ASSERT_TRUE(ret == z_OK);
+  ret = z_KVInPlaceEnable(&kv);
+  z_ASSERT_TRUE(ret == z_OK);
+  // the records stay mutable until the log is half full
+  atomic_store(&kv.HLog.ReadOnlyUS, INT64_MAX);
+
+  // the hot keys are updated in place, the binlog does not grow
+  z_ASSERT_TRUE(z_InsertRange(&kv, 0, count));
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, 0, count, 10, 11));
+  int64_t offset = 0;
+  z_WriterOffset(&kv.BinLog.Writer, &offset);
+  int64_t seq = z_KVAckedSeq(&kv);
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, 0, count, 11, 91));
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.InPlaceCount) == count * 80);
+  int64_t end = 0;
+  z_WriterOffset(&kv.BinLog.Writer, &end);
+  z_ASSERT_TRUE(end == offset);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq);
+
+  // and read from memory
+  int64_t reads = atomic_load(&kv.HLog.ReadCount);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 0, 90));
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.ReadCount) > reads);
+
+  // an idle log turns read only and is flushed on the flusher interval
+  atomic_store(&kv.HLog.ReadOnlyUS, z_HLOG_FLUSH_INTERVAL_US);
+  int64_t tail = atomic_load(&kv.HLog.Tail);
+  for (int64_t i = 0; i < 1000 && atomic_load(&kv.HLog.Flushed) < tail; ++i) {
+    usleep(z_HLOG_FLUSH_INTERVAL_US);
+  }
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.ReadOnly) == tail);
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.Flushed) == tail);
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, 0, count, 90, 91));
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.InPlaceCount) == count * 80);
+
+  // the cold keys push them to the read only region, the next update is an
+  // append and the old records are flushed
+  atomic_store(&kv.HLog.ReadOnlyUS, INT64_MAX);
+  z_ASSERT_TRUE(z_InsertRange(&kv, count, count * 100));
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, 0, count, 91, 92));
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.InPlaceCount) == count * 80);
+  z_ASSERT_TRUE(atomic_load(&kv.HLog.FlushBytes) > 0);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 0, 91));
+
+  // more than a segment, the rollover flushes the rest of the last one
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, count, count * 99, 10, 20));
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment > 0);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 0, 91));
+  z_ASSERT_TRUE(z_FindRange(&kv, count, count * 100, 0, 19));
+  z_ASSERT_TRUE(z_KVHLogTestFill(&kv, 0, count, 20, 30));
+  seq = z_KVAckedSeq(&kv);
+  z_KVDestroy(&kv);
+
+  // the replay finds the values written in place
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_LIST, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 0, 29));
+  z_ASSERT_TRUE(z_FindRange(&kv, count, count * 100, 0, 19));
+  z_KVDestroy(&kv);
+
+  z_SegmentsRemove(binlog_path);
+
+  z_KVHLogParallelTest();
+}
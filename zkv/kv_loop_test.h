@@ -81,7 +81,16 @@ bool z_Find(z_KV *kv, int64_t i, int64_t iv) {
     isEqual = z_BufferIsEqual(&buffer, &v);
   }
 
-  return ret == z_OK && isEqual == true;
+  z_unique(z_KVView) view = {};
+  z_Error view_ret = z_KVFindView(kv, k, &view);
+  bool isViewEqual = false;
+  if (view_ret == z_OK) {
+    isViewEqual = view.Value.Size == v.Size &&
+                  memcmp(view.Value.Data, v.Data, v.Size) == 0;
+  }
+
+  return ret == z_OK && isEqual == true && view_ret == z_OK &&
+         isViewEqual == true;
 }
 
 bool z_Delete(z_KV *kv, int64_t i) {
@@ -118,6 +127,38 @@ bool z_DeleteNotFound(z_KV *kv, int64_t i) {
   return ret == z_ERR_NOT_FOUND;
 }
 
+// z_Insert of the keys of [start, end)
+bool z_InsertRange(z_KV *kv, int64_t start, int64_t end) {
+  for (int64_t i = start; i < end; ++i) {
+    if (z_Insert(kv, i) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// z_Find of the keys of [start, end), key i has the value i * step + v, a step
+// of 0 gives all of them v
+bool z_FindRange(z_KV *kv, int64_t start, int64_t end, int64_t step,
+                 int64_t v) {
+  for (int64_t i = start; i < end; ++i) {
+    if (z_Find(kv, i, i * step + v) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// z_FindNotFound of the keys of [start, end)
+bool z_FindNotFoundRange(z_KV *kv, int64_t start, int64_t end) {
+  for (int64_t i = start; i < end; ++i) {
+    if (z_FindNotFound(kv, i) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
 bool z_Loop(z_KV *kv, int64_t start, int64_t count) {
   bool final_ret = true;
   bool ret = false;
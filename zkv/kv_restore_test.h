@@ -16,20 +16,25 @@ bool z_KVRestoreTestCheck(z_KV *kv, int64_t start, int64_t count) {
 
 void z_KVRestoreTest() {
   char *binlog_path = "./bin/binlog.log";
-  remove(binlog_path);
+  z_SegmentsRemove(binlog_path);
   int64_t count = 2000;
 
   z_KV kv;
   z_Error ret =
-      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024 * 1024);
+      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024 * 1024,
+               z_MAP_ENGINE_LIST, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
   z_ASSERT_TRUE(ret == z_OK);
 
   bool loop_ret = z_Loop(&kv, 0, count);
   z_ASSERT_TRUE(loop_ret == true);
+  z_ASSERT_TRUE(atomic_load(&kv.IsEqualCount) > 0);
+  z_ASSERT_TRUE(atomic_load(&kv.IsEqualMissCount) == 0);
 
   z_KVDestroy(&kv);
 
-  ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 10);
+  // restore the same binlog into the other engine
+  ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 10,
+                 z_MAP_ENGINE_SWISS, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
   z_ASSERT_TRUE(ret == z_OK);
 
   loop_ret = z_KVRestoreTestCheck(&kv, 0, count);
@@ -37,4 +42,369 @@ void z_KVRestoreTest() {
 
   z_KVDestroy(&kv);
   return;
-}
\ No newline at end of file
+}
+
+void z_KVRolloverTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 4000;
+  int64_t max_size = 16 * 1024;
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+               (z_BinLogSync){.Mode = z_BINLOG_SYNC_GROUP});
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_ASSERT_TRUE(z_InsertRange(&kv, 0, count));
+  int64_t segment = kv.BinLog.Writer.Segment;
+  z_ASSERT_TRUE(segment > 1);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+
+  z_KVDestroy(&kv);
+
+  // the keys of all the segments are restored, the writer goes on in the last
+  ret = z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_LIST,
+                 (z_BinLogSync){.Mode = z_BINLOG_SYNC_GROUP});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment == segment);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+
+  z_ASSERT_TRUE(z_InsertRange(&kv, count, count * 2));
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment > segment);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count * 2, 1, 0));
+
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
+bool z_KVParallelRecoverTestFill(z_KV *kv, int64_t start, int64_t end) {
+  for (int64_t i = start; i < end; ++i) {
+    if (z_Insert(kv, i) == false || z_Update(kv, i, i + 1, i) == false ||
+        z_Update(kv, i, i + 2, i + 1) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the keys of bucket i of a list map have hash % InitBucketsLen ==
+// i % InitBucketsLen at any length, z_Recover partitions the keys on it
+bool z_KVParallelRecoverTestBuckets(z_Map *m) {
+  for (int64_t i = 0; i < z_MapBucketsLen(m); ++i) {
+    z_List *l = &z_mapBucket(m, i)->List;
+    for (int64_t j = 0; j < l->Pos; ++j) {
+      if (l->Records[j].Hash % m->InitBucketsLen != i % m->InitBucketsLen) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void z_KVParallelRecoverTest() {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 2000;
+  int64_t end = 42000;
+  // several chunks per segment, cut at the records
+  int64_t max_size = 3 * z_RECOVER_CHUNK_SIZE / 2;
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+               (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_Loop(&kv, 0, count));
+  z_ASSERT_TRUE(z_KVParallelRecoverTestFill(&kv, count, end));
+  z_ASSERT_TRUE(kv.BinLog.Writer.Segment > 1);
+  int64_t seq = z_KVAckedSeq(&kv);
+  z_KVDestroy(&kv);
+
+  // the updates of a key check the value before them, they replay in order
+  ret = z_KVInitParallel(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_LIST,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER}, 4);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.Recovery.Records == seq);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq);
+  z_ASSERT_TRUE(z_MapLen(&kv.Map) == end - count);
+  z_ASSERT_TRUE(z_KVRestoreTestCheck(&kv, 0, count));
+  z_ASSERT_TRUE(z_FindRange(&kv, count, end, 1, 2));
+  z_ASSERT_TRUE(z_MapBucketsLen(&kv.Map) > 1024);
+  z_ASSERT_TRUE(z_KVParallelRecoverTestBuckets(&kv.Map));
+
+  z_ASSERT_TRUE(z_KVParallelRecoverTestFill(&kv, end, end + count));
+  z_ASSERT_TRUE(z_FindRange(&kv, end, end + count, 1, 2));
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
+// every single bit flip of a format 2 or a compact record fails its check,
+// the flags of the format and the sizes too
+bool z_KVRecordFormatTestFlips(z_Record *r) {
+  int64_t size = z_RecordSize(r);
+  for (int64_t i = 0; i < size * 8; ++i) {
+    uint8_t bit = 1 << (i % 8);
+    ((uint8_t *)r)[i / 8] ^= bit;
+    bool is_broken = z_RecordCheck(r) != z_OK;
+    ((uint8_t *)r)[i / 8] ^= bit;
+    if (is_broken == false) {
+      return false;
+    }
+  }
+  return z_RecordCheck(r) == z_OK;
+}
+
+// the keys in turn in the format 1, the format 2 and the compact head
+bool z_KVRecordFormatTestInsert(z_KV *kv, int64_t start, int64_t end) {
+  uint8_t formats[] = {0, z_RECORD_FLAGS_FORMAT_2, z_RECORD_COMPACT};
+  for (int64_t i = start; i < end; ++i) {
+    char key[32] = {};
+    char value[32] = {};
+    sprintf(key, "key%lld", i);
+    sprintf(value, "value%lld", i);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    z_ConstBuffer v = {.Data = value, .Size = strlen(value)};
+
+    z_Record *r =
+        z_RecordNew(formats[i % 3], z_ROP_INSERT, k, v, (z_ConstBuffer){});
+    if (r == nullptr) {
+      return false;
+    }
+    z_Error ret = z_KVFromRecord(kv, r, nullptr);
+    z_RecordFree(r);
+    if (ret != z_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// the key and the values of r read back through the accessors, a cut head
+// does not parse
+bool z_KVRecordFormatTestRead(z_Record *r, z_ConstBuffer k, z_ConstBuffer v,
+                              z_ConstBuffer src_v) {
+  z_ConstBuffer got_k, got_v, got_src_v = {};
+  int64_t head_size = z_RecordSizesOf(r).HeadSize;
+  for (int64_t i = 0; i < head_size; ++i) {
+    if (z_RecordHeadSize((int8_t *)r, i) != 0) {
+      return false;
+    }
+  }
+  if (z_RecordHeadSize((int8_t *)r, z_RecordSize(r)) != head_size ||
+      z_RecordKey(r, &got_k) != z_OK || z_RecordValue(r, &got_v) != z_OK ||
+      z_IsUpdateRecord(r) && z_RecordSrcValue(r, &got_src_v) != z_OK) {
+    return false;
+  }
+  return z_BufferIsEqual(&got_k, &k) && z_BufferIsEqual(&got_v, &v) &&
+         z_BufferIsEqual(&got_src_v, &src_v) && z_RecordCheck(r) == z_OK;
+}
+
+void z_KVRecordFormatTest() {
+  z_ConstBuffer k = {.Data = (int8_t *)"key", .Size = 3};
+  z_ConstBuffer v = {.Data = (int8_t *)"value", .Size = 5};
+  z_ConstBuffer none = {};
+  z_Record *r = z_RecordNew(z_RECORD_FLAGS_FORMAT_2, z_ROP_INSERT, k, v, none);
+  z_Record *cr = z_RecordNew(z_RECORD_COMPACT, z_ROP_INSERT, k, v, none);
+  z_ASSERT_TRUE(r != nullptr && cr != nullptr);
+  z_ASSERT_TRUE(z_RecordSize(r) == sizeof(z_Record) + 3 + 5 + 4);
+  // the op and the flags, Sum and a byte of each size
+  z_ASSERT_TRUE(z_RecordSize(cr) == 4 + 3 + 5 + 4);
+  z_RecordSum(r);
+  z_RecordSum(cr);
+  z_ASSERT_TRUE(z_KVRecordFormatTestFlips(r));
+  z_ASSERT_TRUE(z_KVRecordFormatTestFlips(cr));
+  z_ASSERT_TRUE(z_KVRecordFormatTestRead(cr, k, v, none));
+  z_ASSERT_TRUE(z_RecordOPOf(cr) == z_ROP_INSERT && !z_RecordIsBatched(cr));
+  z_RecordSetBatched(cr, true);
+  z_RecordSum(cr);
+  z_ASSERT_TRUE(z_RecordIsBatched(cr) && z_RecordOPOf(cr) == z_ROP_INSERT);
+  z_ASSERT_TRUE(z_KVRecordFormatTestRead(cr, k, v, none));
+  z_RecordFree(r);
+  z_RecordFree(cr);
+
+  // the sizes of more than a byte of varint, up to the most the 8 byte head
+  // holds
+  int8_t *data = z_malloc(z_RECORD_VAL_MAX);
+  memset(data, 'd', z_RECORD_VAL_MAX);
+  z_ConstBuffer big_k = {.Data = data, .Size = z_RECORD_KEY_MAX};
+  z_ConstBuffer big_v = {.Data = data, .Size = 20000};
+  z_ConstBuffer max_v = {.Data = data, .Size = z_RECORD_VAL_MAX};
+  cr = z_RecordNew(z_RECORD_COMPACT, z_ROP_UPDATE, big_k, big_v, v);
+  z_ASSERT_TRUE(cr != nullptr);
+  z_ASSERT_TRUE(z_RecordSizesOf(cr).HeadSize == 2 + 3 + 3 + 1);
+  z_RecordSum(cr);
+  z_ASSERT_TRUE(z_KVRecordFormatTestRead(cr, big_k, big_v, v));
+  z_RecordFree(cr);
+  cr = z_RecordNew(z_RECORD_COMPACT, z_ROP_FORCE_UPSERT, k, max_v, none);
+  z_ASSERT_TRUE(cr != nullptr);
+  z_RecordSum(cr);
+  z_ASSERT_TRUE(z_KVRecordFormatTestRead(cr, k, max_v, none));
+  z_RecordFree(cr);
+  big_k.Size = z_RECORD_KEY_MAX + 1;
+  z_ASSERT_TRUE(z_RecordNew(z_RECORD_COMPACT, z_ROP_INSERT, big_k, v, none) ==
+                nullptr);
+  z_free(data);
+
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 2000;
+
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024,
+               z_MAP_ENGINE_SWISS, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVRecordFormatTestInsert(&kv, 0, count));
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+  z_KVDestroy(&kv);
+
+  // a binlog of all the formats replays one by one and in parallel
+  ret = z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024,
+                 z_MAP_ENGINE_LIST, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+  z_KVDestroy(&kv);
+
+  ret = z_KVInitParallel(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024,
+                         z_MAP_ENGINE_SWISS,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER}, 4);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.Recovery.Records == count);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+  z_KVDestroy(&kv);
+  z_SegmentsRemove(binlog_path);
+}
+
+// the frame of r at seq in a segment of base parses back to the same seq and
+// record
+bool z_KVFrameTestRoundTrip(z_Record *r, int64_t seq, int64_t base) {
+  z_RecordSum(r);
+  z_FileRecord fr = {.Seq = seq, .Record = r};
+  z_FrameEncode(&fr, base);
+
+  int8_t frame[256];
+  struct iovec iov[2];
+  z_FrameIOV(&fr, iov);
+  memcpy(frame, iov[0].iov_base, iov[0].iov_len);
+  memcpy(frame + iov[0].iov_len, iov[1].iov_base, iov[1].iov_len);
+
+  // a cut head does not parse
+  z_Frame f;
+  for (int64_t i = 0; i < fr.HeadSize + z_RecordSizesOf(r).HeadSize; ++i) {
+    if (z_FrameParse(frame, i, base, &f)) {
+      return false;
+    }
+  }
+  if (z_FrameParse(frame, fr.Size, base, &f) == false || f.Seq != seq ||
+      f.Size != fr.Size || f.HeadSize != fr.HeadSize) {
+    return false;
+  }
+  z_Record *got = z_FrameRecord(&f, frame);
+  return memcmp(got, r, z_RecordSize(r)) == 0 && z_RecordCheck(got) == z_OK;
+}
+
+// a binlog of legacy frames, the 8 byte seq before each record, as a binlog
+// written before the compact frames
+bool z_KVFrameTestLegacy(char *binlog_path, int64_t count) {
+  FILE *f = fopen(binlog_path, "w");
+  if (f == nullptr) {
+    return false;
+  }
+
+  bool is_ok = true;
+  for (int64_t i = 0; i < count && is_ok; ++i) {
+    char key[32] = {};
+    char value[32] = {};
+    sprintf(key, "key%lld", i);
+    sprintf(value, "value%lld", i);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    z_ConstBuffer v = {.Data = value, .Size = strlen(value)};
+    z_Record *r = z_RecordNew(i % 2 == 0 ? 0 : z_RECORD_FLAGS_FORMAT_2,
+                              z_ROP_INSERT, k, v, (z_ConstBuffer){});
+    if (r == nullptr) {
+      is_ok = false;
+      break;
+    }
+    z_RecordSum(r);
+
+    int64_t seq = i + 1;
+    is_ok = fwrite(&seq, sizeof(seq), 1, f) == 1 &&
+            fwrite(r, z_RecordSize(r), 1, f) == 1;
+    z_RecordFree(r);
+  }
+  return fclose(f) == 0 && is_ok;
+}
+
+void z_KVFrameTest() {
+  // a 16 byte key and a 24 byte value
+  z_ConstBuffer k = {.Data = (int8_t *)"key0000000000000", .Size = 16};
+  z_ConstBuffer v = {.Data = (int8_t *)"value0000000000000000000", .Size = 24};
+  z_ConstBuffer src_v = {.Data = (int8_t *)"src", .Size = 3};
+  uint8_t formats[] = {0, z_RECORD_FLAGS_FORMAT_2, z_RECORD_COMPACT};
+  for (int64_t i = 0; i < 3; ++i) {
+    z_Record *r =
+        z_RecordNew(formats[i], z_ROP_INSERT, k, v, (z_ConstBuffer){});
+    z_Record *ur = z_RecordNew(formats[i], z_ROP_UPDATE, k, v, src_v);
+    z_ASSERT_TRUE(r != nullptr && ur != nullptr);
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(r, 100, 1));
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(r, 1LL << 40, 1));
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(r, 100, z_SEGMENT_LEGACY));
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(ur, 100, 1));
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(ur, 100, z_SEGMENT_LEGACY));
+    z_RecordSetBatched(r, true);
+    z_ASSERT_TRUE(z_KVFrameTestRoundTrip(r, 100, 1));
+    z_RecordFree(r);
+    z_RecordFree(ur);
+  }
+
+  // the 8 byte seq takes a byte near the base, the compact head 4 bytes in
+  // place of 8 and a CRC32C, 49 bytes in place of the 60 of the legacy frame
+  // of the format 2
+  z_Record *r = z_RecordNewByKV(z_ROP_INSERT, k, v);
+  z_RecordSum(r);
+  z_FileRecord fr = {.Seq = 100, .Record = r};
+  z_FrameEncode(&fr, 1);
+  z_ASSERT_TRUE(fr.HeadSize == 1);
+  z_ASSERT_TRUE(fr.Size == z_RecordSize(r) + 1);
+  z_ASSERT_TRUE(z_RECORD_NEW_COMPACT == 0 || fr.Size == 1 + 4 + 16 + 24 + 4);
+  z_RecordFree(r);
+
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  int64_t count = 2000;
+  int64_t max_size = 16 * 1024;
+  z_ASSERT_TRUE(z_KVFrameTestLegacy(binlog_path, count));
+
+  // the legacy segment is replayed, the appends roll over to new segments
+  z_KV kv;
+  z_Error ret =
+      z_KVInit(&kv, binlog_path, max_size, 1024, z_MAP_ENGINE_SWISS,
+               (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(kv.Recovery.Records == count);
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == count);
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count, 1, 0));
+  z_ASSERT_TRUE(z_InsertRange(&kv, count, count * 2));
+  z_ASSERT_TRUE(z_FindRange(&kv, 0, count * 2, 1, 0));
+  int64_t base = 0;
+  z_ASSERT_TRUE(z_SegmentBase(binlog_path, 0, &base) == z_OK);
+  z_ASSERT_TRUE(base == z_SEGMENT_LEGACY);
+  z_ASSERT_TRUE(z_SegmentBase(binlog_path, 1, &base) == z_OK);
+  z_ASSERT_TRUE(base == (z_FRAME_COMPACT ? count + 1 : z_SEGMENT_LEGACY));
+  z_KVDestroy(&kv);
+
+  // both kinds of segments replay one by one and in parallel
+  for (int64_t threads = 1; threads <= 4; threads *= 4) {
+    ret = z_KVInitParallel(&kv, binlog_path, max_size, 1024,
+                           z_MAP_ENGINE_LIST,
+                           (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER},
+                           threads);
+    z_ASSERT_TRUE(ret == z_OK);
+    z_ASSERT_TRUE(kv.Recovery.Records == count * 2);
+    z_ASSERT_TRUE(z_KVAckedSeq(&kv) == count * 2);
+    z_ASSERT_TRUE(z_FindRange(&kv, 0, count * 2, 1, 0));
+    z_KVDestroy(&kv);
+  }
+  z_SegmentsRemove(binlog_path);
+}
@@ -44,12 +44,13 @@ bool z_KVSeqTestCheck() {
 
 void z_KVSeqTest() {
   char *binlog_path = "./bin/binlog.log";
-  remove(binlog_path);
+  z_SegmentsRemove(binlog_path);
   int64_t count = 2000;
 
   z_KV kv;
   z_Error ret =
-      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024 * 1024);
+      z_KVInit(&kv, binlog_path, 1024LL * 1024LL * 1024LL, 1024 * 1024,
+               z_MAP_ENGINE_LIST, (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
   z_ASSERT_TRUE(ret == z_OK);
 
   bool loop_ret = z_Loop(&kv, 0, count);
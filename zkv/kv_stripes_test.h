@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "zkv/kv_loop_test.h"
+#include "zkv/stripes.h"
+#include "ztest/test.h"
+#include "zutils/buffer.h"
+
+// inserts the keys, or updates them when is_update
+bool z_KVStripesTestSet(z_KVStripes *s, int64_t count, int64_t v,
+                        bool is_update) {
+  for (int64_t i = 0; i < count; ++i) {
+    char key[32] = {};
+    char value[32] = {};
+    sprintf(key, "key%lld", i);
+    sprintf(value, "value%lld", v);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    z_ConstBuffer vb = {.Data = value, .Size = strlen(value)};
+    z_KV *kv = z_KVStripesGet(s, k);
+    z_Error ret = is_update ? z_KVForceUpdate(kv, k, vb)
+                            : z_KVInsert(kv, k, vb);
+    if (ret != z_OK) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// z_Find of every key on its stripe, all of them have the value v
+bool z_KVStripesTestCheck(z_KVStripes *s, int64_t count, int64_t v) {
+  for (int64_t i = 0; i < count; ++i) {
+    char key[32] = {};
+    sprintf(key, "key%lld", i);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    if (z_Find(z_KVStripesGet(s, k), i, v) == false) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void z_KVStripesTest() {
+  char *binlog_path = "./bin/binlog.log";
+  int64_t stripes_len = 4;
+  int64_t count = 4096;
+  z_BinLogSync sync = {.Mode = z_BINLOG_SYNC_NEVER};
+  z_KVStripesRemove(binlog_path, stripes_len);
+
+  z_KVStripes s;
+  z_Error ret = z_KVStripesInit(&s, binlog_path, stripes_len, 1024 * 1024, 64,
+                                z_MAP_ENGINE_SWISS, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVStripesTestSet(&s, count, 1, false));
+  z_ASSERT_TRUE(z_KVStripesTestSet(&s, count, 2, true));
+  z_ASSERT_TRUE(z_KVStripesTestCheck(&s, count, 2));
+
+  // every stripe takes a part of the keys, and only its own
+  int64_t len = 0;
+  bool is_spread = true;
+  for (int64_t i = 0; i < stripes_len; ++i) {
+    int64_t l = z_MapLen(&s.KVs[i].Map);
+    is_spread = is_spread && l > count / stripes_len / 2;
+    len += l;
+  }
+  z_ASSERT_TRUE(is_spread);
+  z_ASSERT_TRUE(len == count);
+  z_ASSERT_TRUE(z_KVStripesAckedSeq(&s) == count * 2);
+  z_KVStripesDestroy(&s);
+
+  // a restart with the same stripes finds the keys where it left them
+  ret = z_KVStripesInit(&s, binlog_path, stripes_len, 1024 * 1024, 64,
+                        z_MAP_ENGINE_LIST, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(z_KVStripesAckedSeq(&s) == count * 2);
+  z_ASSERT_TRUE(z_KVStripesTestCheck(&s, count, 2));
+  z_KVStripesDestroy(&s);
+
+  z_KVStripesRemove(binlog_path, stripes_len);
+}
@@ -3,12 +3,13 @@
 #include "zutils/buffer.h"
 #include <string.h>
 
-void z_KVTest() {
+void z_KVTestByEngine(z_MapEngine engine) {
 
   char *binlog_path = "./bin/binlog.log";
-  remove(binlog_path);
+  z_SegmentsRemove(binlog_path);
   z_KV kv;
-  z_Error ret = z_KVInit(&kv, binlog_path, 1024 * 1024 * 1024, 1);
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024 * 1024 * 1024, 1, engine,
+                         (z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
   z_ASSERT_TRUE(ret == z_OK);
 
   z_ConstBuffer k = {.Data = "key", .Size = 3};
@@ -60,4 +61,55 @@ void z_KVTest() {
   z_ASSERT_TRUE(ret == z_ERR_NOT_FOUND);
 
   z_KVDestroy(&kv);
-}
\ No newline at end of file
+}
+
+void z_KVSyncTest(z_BinLogSync sync) {
+  char *binlog_path = "./bin/binlog.log";
+  z_SegmentsRemove(binlog_path);
+  z_KV kv;
+  z_Error ret = z_KVInit(&kv, binlog_path, 1024 * 1024 * 1024, 1,
+                         z_MAP_ENGINE_LIST, sync);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_ConstBuffer v = {.Data = "value", .Size = 5};
+  int64_t seq = 0;
+  for (int64_t i = 0; i < 16; ++i) {
+    char key[32] = {};
+    sprintf(key, "key%lld", i);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    z_Record *r = z_RecordNewByKV(z_ROP_INSERT, k, v);
+    ret = z_KVFromRecord(&kv, r, &seq);
+    z_RecordFree(r);
+    z_ASSERT_TRUE(ret == z_OK);
+  }
+  z_ASSERT_TRUE(z_KVAckedSeq(&kv) == seq);
+
+  switch (sync.Mode) {
+  case z_BINLOG_SYNC_NEVER:
+    z_ASSERT_TRUE(z_KVDurableSeq(&kv) == 0);
+    break;
+  case z_BINLOG_SYNC_ALWAYS:
+  case z_BINLOG_SYNC_GROUP:
+    z_ASSERT_TRUE(z_KVDurableSeq(&kv) == seq);
+    break;
+  case z_BINLOG_SYNC_INTERVAL:
+    for (int64_t i = 0; i < 100 && z_KVDurableSeq(&kv) != seq; ++i) {
+      usleep(sync.IntervalMS * 1000);
+    }
+    z_ASSERT_TRUE(z_KVDurableSeq(&kv) == seq);
+    break;
+  }
+
+  z_KVDestroy(&kv);
+}
+
+void z_KVTest() {
+  z_KVTestByEngine(z_MAP_ENGINE_LIST);
+  z_KVTestByEngine(z_MAP_ENGINE_SWISS);
+
+  z_KVSyncTest((z_BinLogSync){.Mode = z_BINLOG_SYNC_NEVER});
+  z_KVSyncTest((z_BinLogSync){.Mode = z_BINLOG_SYNC_ALWAYS});
+  z_KVSyncTest((z_BinLogSync){.Mode = z_BINLOG_SYNC_GROUP});
+  z_KVSyncTest(
+      (z_BinLogSync){.Mode = z_BINLOG_SYNC_INTERVAL, .IntervalMS = 10});
+}
@@ -0,0 +1,154 @@
+#ifndef z_STRIPES_H
+#define z_STRIPES_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "zerror/error.h"
+#include "zkv/batch.h"
+#include "zkv/kv.h"
+#include "zutils/buffer.h"
+#include "zutils/hash.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// the kv striped by the key hash into Len stripes, each with its own binlog at
+// path.s<i> and its own map. it is lock striping, not a shard per core: a
+// stripe is not owned by a thread, any thread writes to it through its binlog
+// lock and its bucket locks as to a single kv, only the writes of keys in the
+// same stripe contend on them. the stripe of a key depends on Len, a restart
+// must use the same Len
+typedef struct {
+  z_KV *KVs;
+  int64_t Len;
+} z_KVStripes;
+
+// the high bits of the FNV-1a of the key mixed by a multiply, alone they
+// hardly change with the last bytes of a key. it stays FNV-1a whatever
+// z_MAP_HASH is, the keys of the stripes on the disk do not move. the client
+// picks its connection by z_HASH_WY, it does not steer a key to its stripe
+int64_t z_KVStripeOf(z_KVStripes *s, z_ConstBuffer k) {
+  uint64_t h = z_Hash(k.Data, k.Size) * 0x9E3779B97F4A7C15ULL;
+  return (int64_t)((h >> 32) % (uint64_t)s->Len);
+}
+
+z_KV *z_KVStripesGet(z_KVStripes *s, z_ConstBuffer k) {
+  return &s->KVs[z_KVStripeOf(s, k)];
+}
+
+// the binlog path of stripe i
+void z_KVStripePath(const char *path, int64_t i, char *dst) {
+  snprintf(dst, z_MAX_PATH_LENGTH, "%s.s%lld", path, i);
+}
+
+// removes all the segments of the stripes of path
+void z_KVStripesRemove(const char *path, int64_t stripes_len) {
+  char p[z_MAX_PATH_LENGTH];
+  for (int64_t i = 0; i < stripes_len; ++i) {
+    z_KVStripePath(path, i, p);
+    z_SegmentsRemove(p);
+  }
+}
+
+void z_KVStripesDestroy(z_KVStripes *s) {
+  if (s == nullptr || s->KVs == nullptr) {
+    return;
+  }
+
+  for (int64_t i = 0; i < s->Len; ++i) {
+    z_KVDestroy(&s->KVs[i]);
+  }
+  z_free(s->KVs);
+  s->Len = 0;
+}
+
+// z_KVInit of every stripe, buckets_len is per stripe
+z_Error z_KVStripesInit(z_KVStripes *s, const char *path, int64_t stripes_len,
+                        int64_t binlog_file_max_size, int64_t buckets_len,
+                        z_MapEngine map_engine, z_BinLogSync sync) {
+  if (s == nullptr || path == nullptr || stripes_len <= 0 ||
+      strlen(path) + 24 >= z_MAX_PATH_LENGTH) {
+    z_error("s == nullptr || path == nullptr || stripes_len <= 0 || path is "
+            "too long");
+    return z_ERR_INVALID_DATA;
+  }
+
+  s->KVs = z_malloc(sizeof(z_KV) * stripes_len);
+  if (s->KVs == nullptr) {
+    z_error("s->KVs == nullptr");
+    return z_ERR_NOSPACE;
+  }
+
+  char p[z_MAX_PATH_LENGTH];
+  for (int64_t i = 0; i < stripes_len; ++i) {
+    z_KVStripePath(path, i, p);
+    z_Error ret = z_KVInit(&s->KVs[i], p, binlog_file_max_size, buckets_len,
+                           map_engine, sync);
+    if (ret != z_OK) {
+      z_error("z_KVInit %s %d", p, ret);
+      s->Len = i;
+      z_KVStripesDestroy(s);
+      return ret;
+    }
+  }
+
+  s->Len = stripes_len;
+  return z_OK;
+}
+
+// the acked records of all the stripes, each stripe has its own seqs
+int64_t z_KVStripesAckedSeq(z_KVStripes *s) {
+  int64_t seq = 0;
+  for (int64_t i = 0; i < s->Len; ++i) {
+    seq += z_KVAckedSeq(&s->KVs[i]);
+  }
+  return seq;
+}
+
+// z_KVFindBatch of keys of any stripe, each stripe looks up its own keys as one
+// batch
+z_Error z_KVStripesFindBatch(z_KVStripes *s, z_ConstBuffer *ks, int64_t len,
+                             z_Buffer *vs, z_Error *rets) {
+  z_assert(s != nullptr, ks != nullptr, vs != nullptr, rets != nullptr);
+  if (len < 0 || len > z_KV_FIND_BATCH_LEN) {
+    z_error("find batch len %lld", len);
+    return z_ERR_INVALID_DATA;
+  }
+
+  int64_t stripes[z_KV_FIND_BATCH_LEN];
+  for (int64_t i = 0; i < len; ++i) {
+    stripes[i] = z_KVStripeOf(s, ks[i]);
+  }
+
+  z_ConstBuffer stripe_ks[z_KV_FIND_BATCH_LEN];
+  z_Buffer stripe_vs[z_KV_FIND_BATCH_LEN];
+  z_Error stripe_rets[z_KV_FIND_BATCH_LEN];
+  int64_t indexes[z_KV_FIND_BATCH_LEN];
+  z_Error ret = z_OK;
+  for (int64_t stripe = 0; stripe < s->Len; ++stripe) {
+    int64_t stripe_len = 0;
+    for (int64_t i = 0; i < len; ++i) {
+      if (stripes[i] == stripe) {
+        indexes[stripe_len] = i;
+        stripe_ks[stripe_len++] = ks[i];
+      }
+    }
+    if (stripe_len == 0) {
+      continue;
+    }
+
+    z_Error stripe_ret = z_KVFindBatch(&s->KVs[stripe], stripe_ks, stripe_len,
+                                      stripe_vs, stripe_rets);
+    if (ret == z_OK) {
+      ret = stripe_ret;
+    }
+    for (int64_t i = 0; i < stripe_len; ++i) {
+      vs[indexes[i]] = stripe_vs[i];
+      rets[indexes[i]] = stripe_rets[i];
+    }
+  }
+  return ret;
+}
+
+#endif
@@ -0,0 +1,201 @@
+#ifndef z_VALUE_CACHE_H
+#define z_VALUE_CACHE_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "zcache/cache.h"
+#include "zepoch/epoch.h"
+#include "zerror/error.h"
+#include "zrecord/record.h"
+#include "zutils/hash.h"
+#include "zutils/lock.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// the ring bytes per slot
+#define z_VALUE_CACHE_SLOT_BYTES 64
+
+// the records of the recent writes and reads by their binlog offset. a ring
+// record is the offset and the z_Record, Slots finds it by the hash of the
+// offset, the latest record of a hash takes the slot. the readers are
+// protected by Epoch, the records moved to unused are removed once the
+// readers before are gone
+typedef struct {
+  z_Cache Cache;
+  // held by the eviction, the adds reserve without it
+  z_Lock Lock;
+  z_Epoch *Epoch;
+  // the ring offset + 1 of a record, 0 if none
+  atomic_uint_fast64_t *Slots;
+  int64_t SlotsLen;
+  // the ring before Removable has no reader anymore, an epoch action is
+  // queued for the unused up to Scheduled
+  atomic_uint_fast64_t Removable;
+  uint64_t Scheduled;
+  // a larger record would evict too much
+  int64_t MaxRecordSize;
+  atomic_int_fast64_t HitCount;
+  atomic_int_fast64_t MissCount;
+} z_ValueCache;
+
+atomic_uint_fast64_t *z_valueCacheSlot(z_ValueCache *vc, int64_t offset) {
+  return &vc->Slots[z_HashOf(z_HASH_WY, (int8_t *)&offset, sizeof(offset)) %
+                     vc->SlotsLen];
+}
+
+// clears the slot unless a newer record took it
+bool z_valueCacheBeforeRemove(void *attr, z_CacheRecord *cr) {
+  z_ValueCache *vc = (z_ValueCache *)attr;
+  int64_t offset = 0;
+  memcpy(&offset, cr + 1, sizeof(offset));
+
+  atomic_uint_fast64_t *slot = z_valueCacheSlot(vc, offset);
+  uint64_t v = atomic_load(slot);
+  if (v != 0 && vc->Cache.Data + (v - 1) % vc->Cache.Size == (int8_t *)cr) {
+    atomic_compare_exchange_strong(slot, &v, 0);
+  }
+  return true;
+}
+
+// the epoch action of the unused up to addr
+z_Error z_valueCacheRemovable(void *attr, uint64_t addr) {
+  z_ValueCache *vc = (z_ValueCache *)attr;
+  uint64_t removable = atomic_load(&vc->Removable);
+  while (removable < addr && atomic_compare_exchange_weak(
+                                 &vc->Removable, &removable, addr) == false) {
+  }
+  return z_OK;
+}
+
+z_Error z_ValueCacheInit(z_ValueCache *vc, int64_t size, z_Epoch *epoch) {
+  if (vc == nullptr || epoch == nullptr ||
+      size < z_VALUE_CACHE_SLOT_BYTES * 16) {
+    z_error("vc == nullptr || epoch == nullptr || size is too small");
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_Error ret = z_CacheInit(&vc->Cache, size);
+  if (ret != z_OK) {
+    return ret;
+  }
+  vc->Cache.Attr = vc;
+  vc->Cache.BeforeRemove = z_valueCacheBeforeRemove;
+
+  vc->SlotsLen = size / z_VALUE_CACHE_SLOT_BYTES;
+  vc->Slots = z_malloc(sizeof(atomic_uint_fast64_t) * vc->SlotsLen);
+  if (vc->Slots == nullptr) {
+    z_error("vc->Slots == nullptr");
+    z_CacheDestory(&vc->Cache);
+    return z_ERR_NOSPACE;
+  }
+  for (int64_t i = 0; i < vc->SlotsLen; ++i) {
+    atomic_store(&vc->Slots[i], 0);
+  }
+
+  z_LockInit(&vc->Lock);
+  vc->Epoch = epoch;
+  atomic_store(&vc->Removable, 0);
+  vc->Scheduled = 0;
+  vc->MaxRecordSize = size / 16;
+  atomic_store(&vc->HitCount, 0);
+  atomic_store(&vc->MissCount, 0);
+  return z_OK;
+}
+
+// the pending epoch actions are run before
+void z_ValueCacheDestroy(z_ValueCache *vc) {
+  if (vc == nullptr || vc->Slots == nullptr) {
+    return;
+  }
+
+  z_free(vc->Slots);
+  vc->SlotsLen = 0;
+  z_CacheDestory(&vc->Cache);
+  z_LockDestroy(&vc->Lock);
+}
+
+// removes the records no reader sees and moves the next quarter of the ring
+// to unused, holding Lock. a record not published yet stops the move
+void z_valueCacheEvict(z_ValueCache *vc) {
+  z_Cache *c = &vc->Cache;
+  if (vc->Scheduled > atomic_load(&vc->Removable)) {
+    z_EpochRunActions(vc->Epoch);
+  }
+
+  uint64_t start = atomic_load(&c->Start);
+  uint64_t removable = atomic_load(&vc->Removable);
+  if (removable > start) {
+    z_CacheRemove(c, removable);
+    start = removable;
+  }
+
+  uint64_t unused = atomic_load(&c->Unused);
+  uint64_t end = atomic_load(&c->End);
+  if (unused == start) {
+    while (unused < end && unused - start < (uint64_t)c->Size / 4) {
+      if (z_CacheUnused(c) == false) {
+        break;
+      }
+      unused = atomic_load(&c->Unused);
+    }
+  }
+
+  if (unused > vc->Scheduled) {
+    z_EpochAction action = {
+        .Attr = vc, .Addr = unused, .Func = z_valueCacheRemovable};
+    if (z_EpohBump(vc->Epoch, action) == z_OK) {
+      vc->Scheduled = unused;
+    }
+  }
+}
+
+// caches r of offset, it gives up if the ring is full while another thread
+// evicts
+void z_ValueCacheAdd(z_ValueCache *vc, int64_t offset, z_Record *r) {
+  int64_t size = z_RecordSize(r);
+  if (vc->Slots == nullptr || size > vc->MaxRecordSize) {
+    return;
+  }
+
+  struct iovec iov[2] = {
+      {.iov_base = &offset, .iov_len = sizeof(offset)},
+      {.iov_base = r, .iov_len = size},
+  };
+  uint64_t pos = 0;
+  z_Error ret = z_CacheAddV(&vc->Cache, iov, 2, &pos);
+  if (ret == z_ERR_NOSPACE && z_LockTryLock(&vc->Lock)) {
+    z_valueCacheEvict(vc);
+    z_LockUnLock(&vc->Lock);
+    ret = z_CacheAddV(&vc->Cache, iov, 2, &pos);
+  }
+  // a failed add drops the slot, it may hold an older record of offset
+  atomic_store(z_valueCacheSlot(vc, offset), ret == z_OK ? pos + 1 : 0);
+}
+
+// *r is the cached record of offset, the caller is protected by Epoch while
+// it reads it
+bool z_ValueCacheGet(z_ValueCache *vc, int64_t offset, z_Record **r) {
+  if (vc->Slots == nullptr) {
+    return false;
+  }
+
+  uint64_t v = atomic_load(z_valueCacheSlot(vc, offset));
+  void *ptr = nullptr;
+  int64_t cached = -1;
+  if (v != 0 && z_CachePtr(&vc->Cache, v - 1, &ptr) == z_OK) {
+    memcpy(&cached, (z_CacheRecord *)ptr + 1, sizeof(cached));
+  }
+  if (cached != offset) {
+    atomic_fetch_add(&vc->MissCount, 1);
+    return false;
+  }
+
+  atomic_fetch_add(&vc->HitCount, 1);
+  *r = (z_Record *)((int8_t *)((z_CacheRecord *)ptr + 1) + sizeof(cached));
+  return true;
+}
+
+#endif
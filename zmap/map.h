@@ -1,26 +1,26 @@
 #ifndef z_MAP_H
 #define z_MAP_H
 
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "zerror/error.h"
 #include "zutils/buffer.h"
 #include "zutils/lock.h"
 #include "zutils/hash.h"
+#include "zmap/map_record.h"
+#include "zmap/swiss.h"
 
-#define z_LIST_MAX_LEN 1024*16
+#define z_LIST_MAX_LEN (1024 * 1024 * 1024)
 
 typedef struct {
-  uint64_t Hash;
-  int64_t Offset;
-} z_MapRecord;
-
-typedef bool z_MapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t offset);
-
-typedef struct {
-  int16_t Pos;
-  int16_t RecordsLen;
+  int32_t Pos;
+  int32_t RecordsLen;
   z_MapRecord *Records;
+  // guards the fields above and the records for z_ListTryFind
+  z_SeqLock Seq;
+  z_Epoch *Epoch;
 } z_List;
 
 void z_ListDestroy(z_List *l) {
@@ -33,7 +33,7 @@ void z_ListDestroy(z_List *l) {
   l->Pos = 0;
 }
 
-z_Error z_ListInit(z_List *l) {
+z_Error z_ListInit(z_List *l, z_Epoch *epoch) {
   if (l == nullptr) {
     z_error("l == nullptr");
     return z_ERR_INVALID_DATA;
@@ -42,36 +42,47 @@ z_Error z_ListInit(z_List *l) {
   l->Records = nullptr;
   l->RecordsLen = 0;
   l->Pos = 0;
+  z_SeqLockInit(&l->Seq);
+  l->Epoch = epoch;
   return z_OK;
 }
 
-z_Error z_ListGrow(z_List *l) {
-  z_MapRecord *src_rs = l->Records;
-  int16_t src_len = l->RecordsLen;
+z_Error z_ListReserve(z_List *l, int64_t len) {
+  if (len <= l->RecordsLen) {
+    return z_OK;
+  }
 
-  int16_t size = src_len == 0 ? 2 : src_len * 2;
-  if (size >= z_LIST_MAX_LEN) {
-    z_error("size == %u max %u", size, z_LIST_MAX_LEN);
+  if (len > z_LIST_MAX_LEN) {
+    z_error("len == %lld max %d", len, z_LIST_MAX_LEN);
     return z_ERR_NOSPACE;
   }
 
-  l->Records = z_malloc(sizeof(z_MapRecord) * size);
-  if (l->Records == nullptr) {
-    z_error("size == %d", size);
-    l->Records = src_rs;
+  z_MapRecord *src_rs = l->Records;
+  z_MapRecord *rs = z_malloc(sizeof(z_MapRecord) * len);
+  if (rs == nullptr) {
+    z_error("len == %lld", len);
     return z_ERR_NOSPACE;
   }
-  l->RecordsLen = size;
-  memset(l->Records, 0, sizeof(z_MapRecord) * l->RecordsLen);
+  memset(rs, 0, sizeof(z_MapRecord) * len);
 
   if (src_rs != nullptr) {
-    memcpy(l->Records, src_rs, sizeof(z_MapRecord) * src_len);
-    z_free(src_rs);
+    memcpy(rs, src_rs, sizeof(z_MapRecord) * l->Pos);
   }
 
+  z_SeqLockWriteBegin(&l->Seq);
+  l->Records = rs;
+  l->RecordsLen = len;
+  z_SeqLockWriteEnd(&l->Seq);
+
+  z_MapRetire(l->Epoch, src_rs);
   return z_OK;
 }
 
+z_Error z_ListGrow(z_List *l) {
+  int64_t len = l->RecordsLen == 0 ? 2 : (int64_t)l->RecordsLen * 2;
+  return z_ListReserve(l, len);
+}
+
 z_Error z_ListFind(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
                    z_MapIsEqual *isEqual, z_MapRecord **record) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
@@ -81,8 +92,8 @@ z_Error z_ListFind(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
     return z_ERR_INVALID_DATA;
   }
 
-  for (int16_t i = 0; i < l->Pos; ++i) {
-    if (l->Records[i].Hash == r.Hash) {
+  for (int32_t i = 0; i < l->Pos; ++i) {
+    if (z_MapRecordIsMatch(&l->Records[i], &r)) {
       if (l->Records[i].Offset == r.Offset) {
         z_debug("i %d hash %llu offset %lld", i, r.Hash, r.Offset);
         *record = &l->Records[i];
@@ -102,6 +113,26 @@ z_Error z_ListFind(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
   return z_ERR_NOT_FOUND;
 }
 
+// lock free z_ListFind, false when a concurrent write was seen and the caller
+// should retry, the caller is protected by l->Epoch
+bool z_ListTryFind(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
+                   z_MapIsEqual *isEqual, int64_t *offset, z_Error *ret) {
+  uint64_t seq = z_SeqLockReadBegin(&l->Seq);
+  z_List snap = {.Pos = l->Pos, .RecordsLen = l->RecordsLen,
+                 .Records = l->Records};
+  if (z_SeqLockReadRetry(&l->Seq, seq)) {
+    return false;
+  }
+
+  z_MapRecord *record;
+  *ret = z_ListFind(&snap, k, r, attr, isEqual, &record);
+  if (*ret == z_OK) {
+    *offset = record->Offset;
+  }
+
+  return z_SeqLockReadRetry(&l->Seq, seq) == false;
+}
+
 z_Error z_ListInsert(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
                      z_MapIsEqual *isEqual) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
@@ -128,13 +159,29 @@ z_Error z_ListInsert(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
     return z_ListInsert(l, k, r, attr, isEqual);
   }
 
+  z_SeqLockWriteBegin(&l->Seq);
   l->Records[l->Pos++] = r;
+  z_SeqLockWriteEnd(&l->Seq);
   return z_OK;
 }
 
+// appends r without looking for its key, the caller knows it is not there
+z_Error z_ListAdd(z_List *l, z_MapRecord r) {
+  if (l->Pos >= l->RecordsLen) {
+    z_Error ret = z_ListGrow(l);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  z_SeqLockWriteBegin(&l->Seq);
+  l->Records[l->Pos++] = r;
+  z_SeqLockWriteEnd(&l->Seq);
+  return z_OK;
+}
 
 z_Error z_ListForceUpdate(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
-                          z_MapIsEqual *isEqual) {
+                          z_MapIsEqual *isEqual, z_MapRecord *old) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("l == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -148,12 +195,15 @@ z_Error z_ListForceUpdate(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
     return ret;
   }
 
+  *old = *record;
+  z_SeqLockWriteBegin(&l->Seq);
   *record = r;
+  z_SeqLockWriteEnd(&l->Seq);
   return z_OK;
 }
 
 z_Error z_ListForceUpsert(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
-                          z_MapIsEqual *isEqual) {
+                          z_MapIsEqual *isEqual, z_MapRecord *old) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("l == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -168,7 +218,10 @@ z_Error z_ListForceUpsert(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
   }
 
   if (ret == z_OK) {
+    *old = *record;
+    z_SeqLockWriteBegin(&l->Seq);
     *record = r;
+    z_SeqLockWriteEnd(&l->Seq);
     return z_OK;
   }
 
@@ -177,15 +230,17 @@ z_Error z_ListForceUpsert(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
     if (ret != z_OK) {
       return ret;
     }
-    return z_ListForceUpsert(l, k, r, attr, isEqual);
+    return z_ListForceUpsert(l, k, r, attr, isEqual, old);
   }
 
+  z_SeqLockWriteBegin(&l->Seq);
   l->Records[l->Pos++] = r;
+  z_SeqLockWriteEnd(&l->Seq);
   return z_OK;
 }
 
 z_Error z_ListUpdate(z_List *l, z_ConstBuffer k, z_MapRecord r, z_ConstBuffer src_v,
-                     void *attr, z_MapIsEqual *isEqual) {
+                     void *attr, z_MapIsEqual *isEqual, z_MapRecord *old) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("l == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -203,12 +258,15 @@ z_Error z_ListUpdate(z_List *l, z_ConstBuffer k, z_MapRecord r, z_ConstBuffer sr
     return z_ERR_CONFLICT;
   }
 
+  *old = *record;
+  z_SeqLockWriteBegin(&l->Seq);
   *record = r;
+  z_SeqLockWriteEnd(&l->Seq);
   return z_OK;
 }
 
-z_Error z_ListDelete(z_List *l, z_ConstBuffer k, uint64_t hash, void *attr,
-                     z_MapIsEqual *isEqual) {
+z_Error z_ListDelete(z_List *l, z_ConstBuffer k, z_MapRecord r, void *attr,
+                     z_MapIsEqual *isEqual, z_MapRecord *old) {
   if (l == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("l == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -216,28 +274,73 @@ z_Error z_ListDelete(z_List *l, z_ConstBuffer k, uint64_t hash, void *attr,
     return z_ERR_INVALID_DATA;
   }
 
-  int16_t ii = 0;
-  for (int16_t i = 0; i < l->Pos; ++i) {
-    if (l->Records[i].Hash != hash ||
-        isEqual(attr, k, (z_ConstBuffer){}, l->Records[i].Offset) != true) {
-      l->Records[ii] = l->Records[i];
-      ++ii;
+  // inserts keep keys unique, so there is at most one record of k
+  z_MapRecord *record;
+  z_Error ret = z_ListFind(l, k, r, attr, isEqual, &record);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  *old = *record;
+  z_SeqLockWriteBegin(&l->Seq);
+  *record = l->Records[--l->Pos];
+  z_SeqLockWriteEnd(&l->Seq);
+  return z_OK;
+}
+
+// list: records of a bucket in a growing array, scanned linearly
+// swiss: records of a bucket in an open addressing table, see zmap/swiss.h
+typedef enum : uint8_t {
+  z_MAP_ENGINE_LIST = 0,
+  z_MAP_ENGINE_SWISS = 1,
+} z_MapEngine;
+
+// moves the records with hash % mod == idx into the empty dst, *len is set to
+// idx + 1 before l is readable again, so a lock free find that saw l without
+// them sees the new len when it checks it again
+z_Error z_ListSplit(z_List *l, z_List *dst, uint64_t mod, uint64_t idx,
+                    atomic_int_fast64_t *len) {
+  int64_t moved = 0;
+  for (int32_t i = 0; i < l->Pos; ++i) {
+    if (l->Records[i].Hash % mod == idx) {
+      ++moved;
     }
   }
 
-  if (l->Pos == ii) {
-    return z_ERR_NOT_FOUND;
+  z_Error ret = z_ListReserve(dst, moved);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_SeqLockWriteBegin(&dst->Seq);
+  z_SeqLockWriteBegin(&l->Seq);
+  int32_t ii = 0;
+  for (int32_t i = 0; i < l->Pos; ++i) {
+    if (l->Records[i].Hash % mod == idx) {
+      dst->Records[dst->Pos++] = l->Records[i];
+    } else {
+      l->Records[ii++] = l->Records[i];
+    }
   }
   l->Pos = ii;
+  atomic_store(len, idx + 1);
+  z_SeqLockWriteEnd(&l->Seq);
+  z_SeqLockWriteEnd(&dst->Seq);
   return z_OK;
 }
 
 typedef struct {
   z_Lock Lock;
-  z_List List;
+  z_MapEngine Engine;
+  // the last snapshot of the map that has the bucket, see z_MapSnapshotBegin
+  int64_t SnapGen;
+  union {
+    z_List List;
+    z_Swiss Swiss;
+  };
 } z_Bucket;
 
-z_Error z_BucketInit(z_Bucket *b) {
+z_Error z_BucketInit(z_Bucket *b, z_MapEngine engine, z_Epoch *epoch) {
   if (b == nullptr) {
     z_error("b == nullptr");
     return z_ERR_INVALID_DATA;
@@ -245,7 +348,17 @@ z_Error z_BucketInit(z_Bucket *b) {
 
   z_LockInit(&b->Lock);
 
-  return z_ListInit(&b->List);
+  b->Engine = engine;
+  b->SnapGen = 0;
+  switch (engine) {
+  case z_MAP_ENGINE_LIST:
+    return z_ListInit(&b->List, epoch);
+  case z_MAP_ENGINE_SWISS:
+    return z_SwissInit(&b->Swiss, epoch);
+  default:
+    z_error("invalid engine %d", engine);
+    return z_ERR_INVALID_DATA;
+  }
 }
 
 void z_BucketDestroy(z_Bucket *b) {
@@ -253,16 +366,25 @@ void z_BucketDestroy(z_Bucket *b) {
     return;
   }
 
-  z_ListDestroy(&b->List);
+  if (b->Engine == z_MAP_ENGINE_SWISS) {
+    z_SwissDestroy(&b->Swiss);
+  } else {
+    z_ListDestroy(&b->List);
+  }
 
   z_LockDestroy(&b->Lock);
 
   return;
 }
 
-z_Error z_BucketInsert(z_Bucket *b, z_ConstBuffer k, uint64_t hash, int64_t offset,
-                       void *attr, z_MapIsEqual *isEqual) {
+int64_t z_BucketLen(z_Bucket *b) {
+  return b->Engine == z_MAP_ENGINE_SWISS ? b->Swiss.Len : b->List.Pos;
+}
+
+// the caller holds b->Lock for the bucket operations below
 
+z_Error z_BucketInsert(z_Bucket *b, z_ConstBuffer k, z_MapRecord r, void *attr,
+                       z_MapIsEqual *isEqual) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("b == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -270,17 +392,33 @@ z_Error z_BucketInsert(z_Bucket *b, z_ConstBuffer k, uint64_t hash, int64_t offs
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissInsert(&b->Swiss, k, r, attr, isEqual)
+             : z_ListInsert(&b->List, k, r, attr, isEqual);
+}
 
-  z_MapRecord r = {.Hash = hash, .Offset = offset};
-  z_Error ret = z_ListInsert(&b->List, k, r, attr, isEqual);
+z_Error z_BucketAdd(z_Bucket *b, z_MapRecord r) {
+  return b->Engine == z_MAP_ENGINE_SWISS ? z_SwissAdd(&b->Swiss, r)
+                                         : z_ListAdd(&b->List, r);
+}
 
-  z_LockUnLock(&b->Lock);
+// copies the records of b to rs, returns how many
+int64_t z_BucketCopy(z_Bucket *b, z_MapRecord *rs) {
+  if (b->Engine == z_MAP_ENGINE_LIST) {
+    memcpy(rs, b->List.Records, sizeof(z_MapRecord) * b->List.Pos);
+    return b->List.Pos;
+  }
 
-  return ret;
+  int64_t len = 0;
+  for (int64_t i = 0; i < b->Swiss.Cap; ++i) {
+    if (b->Swiss.Ctrls[i] >= 0) {
+      rs[len++] = b->Swiss.Records[i];
+    }
+  }
+  return len;
 }
 
-z_Error z_BucketFind(z_Bucket *b, z_ConstBuffer k, uint64_t hash, void *attr,
+z_Error z_BucketFind(z_Bucket *b, z_ConstBuffer k, z_MapRecord r, void *attr,
                      z_MapIsEqual *isEqual, int64_t *offset) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr || offset == nullptr) {
@@ -289,22 +427,28 @@ z_Error z_BucketFind(z_Bucket *b, z_ConstBuffer k, uint64_t hash, void *attr,
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
-
   z_MapRecord *record;
-  z_MapRecord find_req = {.Hash = hash, .Offset = -1};
-  z_Error ret = z_ListFind(&b->List, k, find_req, attr, isEqual, &record);
+  z_Error ret = b->Engine == z_MAP_ENGINE_SWISS
+                    ? z_SwissFind(&b->Swiss, k, r, attr, isEqual, &record)
+                    : z_ListFind(&b->List, k, r, attr, isEqual, &record);
   if (ret == z_OK) {
     *offset = record->Offset;
   }
 
-  z_LockUnLock(&b->Lock);
-
   return ret;
 }
 
-z_Error z_BucketForceUpdate(z_Bucket *b, z_ConstBuffer k, uint64_t hash,
-                            int64_t offset, void *attr, z_MapIsEqual *isEqual) {
+// runs without b->Lock, see z_ListTryFind
+bool z_BucketTryFind(z_Bucket *b, z_ConstBuffer k, z_MapRecord r, void *attr,
+                     z_MapIsEqual *isEqual, int64_t *offset, z_Error *ret) {
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissTryFind(&b->Swiss, k, r, attr, isEqual, offset, ret)
+             : z_ListTryFind(&b->List, k, r, attr, isEqual, offset, ret);
+}
+
+z_Error z_BucketForceUpdate(z_Bucket *b, z_ConstBuffer k, z_MapRecord r,
+                            void *attr, z_MapIsEqual *isEqual,
+                            z_MapRecord *old) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("b == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -312,18 +456,14 @@ z_Error z_BucketForceUpdate(z_Bucket *b, z_ConstBuffer k, uint64_t hash,
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
-
-  z_MapRecord r = {.Hash = hash, .Offset = offset};
-  z_Error ret = z_ListForceUpdate(&b->List, k, r, attr, isEqual);
-
-  z_LockUnLock(&b->Lock);
-
-  return ret;
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissForceUpdate(&b->Swiss, k, r, attr, isEqual, old)
+             : z_ListForceUpdate(&b->List, k, r, attr, isEqual, old);
 }
 
-z_Error z_BucketForceUpsert(z_Bucket *b, z_ConstBuffer k, uint64_t hash,
-                            int64_t offset, void *attr, z_MapIsEqual *isEqual) {
+z_Error z_BucketForceUpsert(z_Bucket *b, z_ConstBuffer k, z_MapRecord r,
+                            void *attr, z_MapIsEqual *isEqual,
+                            z_MapRecord *old) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("b == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -331,18 +471,14 @@ z_Error z_BucketForceUpsert(z_Bucket *b, z_ConstBuffer k, uint64_t hash,
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
-
-  z_MapRecord r = {.Hash = hash, .Offset = offset};
-  z_Error ret = z_ListForceUpsert(&b->List, k, r, attr, isEqual);
-
-  z_LockUnLock(&b->Lock);
-
-  return ret;
-} 
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissForceUpsert(&b->Swiss, k, r, attr, isEqual, old)
+             : z_ListForceUpsert(&b->List, k, r, attr, isEqual, old);
+}
 
-z_Error z_BucketUpdate(z_Bucket *b, z_ConstBuffer k, uint64_t hash, int64_t offset,
-                       z_ConstBuffer src_v, void *attr, z_MapIsEqual *isEqual) {
+z_Error z_BucketUpdate(z_Bucket *b, z_ConstBuffer k, z_MapRecord r,
+                       z_ConstBuffer src_v, void *attr, z_MapIsEqual *isEqual,
+                       z_MapRecord *old) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("b == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -350,18 +486,13 @@ z_Error z_BucketUpdate(z_Bucket *b, z_ConstBuffer k, uint64_t hash, int64_t offs
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
-
-  z_MapRecord r = {.Hash = hash, .Offset = offset};
-  z_Error ret = z_ListUpdate(&b->List, k, r, src_v, attr, isEqual);
-
-  z_LockUnLock(&b->Lock);
-
-  return ret;
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissUpdate(&b->Swiss, k, r, src_v, attr, isEqual, old)
+             : z_ListUpdate(&b->List, k, r, src_v, attr, isEqual, old);
 }
 
-z_Error z_BucketDelete(z_Bucket *b, z_ConstBuffer k, uint64_t hash, void *attr,
-                       z_MapIsEqual *isEqual) {
+z_Error z_BucketDelete(z_Bucket *b, z_ConstBuffer k, z_MapRecord r, void *attr,
+                       z_MapIsEqual *isEqual, z_MapRecord *old) {
   if (b == nullptr || k.Data == nullptr || k.Size == 0 || attr == nullptr ||
       isEqual == nullptr) {
     z_error("b == nullptr || k.Data == nullptr || k.Size == 0 || attr == "
@@ -369,75 +500,461 @@ z_Error z_BucketDelete(z_Bucket *b, z_ConstBuffer k, uint64_t hash, void *attr,
     return z_ERR_INVALID_DATA;
   }
 
-  z_LockLock(&b->Lock);
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissDelete(&b->Swiss, k, r, attr, isEqual, old)
+             : z_ListDelete(&b->List, k, r, attr, isEqual, old);
+}
 
-  z_Error ret = z_ListDelete(&b->List, k, hash, attr, isEqual);
+z_Error z_BucketSplit(z_Bucket *b, z_Bucket *dst, uint64_t mod, uint64_t idx,
+                      atomic_int_fast64_t *len) {
+  return b->Engine == z_MAP_ENGINE_SWISS
+             ? z_SwissSplit(&b->Swiss, &dst->Swiss, mod, idx, len)
+             : z_ListSplit(&b->List, &dst->List, mod, idx, len);
+}
 
-  z_LockUnLock(&b->Lock);
+// linear hashing, the map grows one bucket at a time
+// segment 0 holds InitBucketsLen buckets, segment i holds
+// InitBucketsLen << (i - 1), so a bucket never moves once allocated. a bucket
+// past segment 0 is initialized by the split that takes it into use
+#define z_MAP_SEGMENTS_LEN 48
 
-  return ret;
-}
+// average records per bucket before a split
+#define z_MAP_LIST_LOAD 8
+#define z_MAP_SWISS_LOAD 1024
+
+// threads with a z_ThreadID below this find without locking
+#define z_MAP_EPOCH_THREADS_LEN 1024
+#define z_MAP_EPOCH_ACTIONS_LEN 1024
+
+// the hash of a new map, a checkpoint of another one is not loaded
+#ifndef z_MAP_HASH
+#define z_MAP_HASH z_HASH_WY
+#endif
 
 typedef struct {
   void *Attr;
   z_MapIsEqual *IsEqual;
-  z_Bucket *Buckets;
-  int64_t BucketsLen;
+  // optional, told about the records replaced or deleted
+  z_MapOnRemove *OnRemove;
+  z_MapEngine Engine;
+  // of the keys, z_MapRecord.Hash and the buckets depend on it
+  z_HashFamily Hash;
+  int64_t InitBucketsLen;
+  _Atomic(z_Bucket *) Segments[z_MAP_SEGMENTS_LEN];
+  // buckets in use, all the split state is derived from it
+  atomic_int_fast64_t BucketsLen;
+  atomic_int_fast64_t Len;
+  // held by the only splitting thread, and by a snapshot
+  z_Lock SplitLock;
+  // the snapshot being taken, a write copies its bucket to SnapRecords before
+  // it changes a bucket of an older SnapGen
+  atomic_bool IsSnapping;
+  atomic_bool IsSnapFailed;
+  atomic_int_fast64_t SnapGen;
+  z_MapRecord *SnapRecords;
+  int64_t SnapCap;
+  atomic_int_fast64_t SnapLen;
+  // open while a batch of writes is applied, a find is retried across it so
+  // it never sees a part of a batch, see z_MapBatchBegin
+  z_SeqLock BatchSeq;
+  // reclaims the arrays replaced under lock free readers
+  z_Epoch Epoch;
 } z_Map;
 
+int64_t z_mapSegmentLen(z_Map *m, int64_t seg) {
+  return seg == 0 ? m->InitBucketsLen : m->InitBucketsLen << (seg - 1);
+}
+
+void z_mapSegmentIndex(z_Map *m, int64_t i, int64_t *seg, int64_t *off) {
+  if (i < m->InitBucketsLen) {
+    *seg = 0;
+    *off = i;
+    return;
+  }
+
+  *seg = 64 - __builtin_clzll(i / m->InitBucketsLen);
+  *off = i - (m->InitBucketsLen << (*seg - 1));
+}
+
+z_Bucket *z_mapBucket(z_Map *m, int64_t i) {
+  int64_t seg, off;
+  z_mapSegmentIndex(m, i, &seg, &off);
+  return &atomic_load(&m->Segments[seg])[off];
+}
+
+// the largest InitBucketsLen << n not greater than buckets_len
+int64_t z_mapLevelLen(z_Map *m, int64_t buckets_len) {
+  int64_t seg, off;
+  z_mapSegmentIndex(m, buckets_len, &seg, &off);
+  return seg == 0 ? m->InitBucketsLen : m->InitBucketsLen << (seg - 1);
+}
+
+int64_t z_mapBucketIndex(z_Map *m, uint64_t hash, int64_t buckets_len) {
+  uint64_t level_len = z_mapLevelLen(m, buckets_len);
+  uint64_t i = hash % level_len;
+  if (i < buckets_len - level_len) {
+    i = hash % (level_len * 2);
+  }
+  return i;
+}
+
+// returns the locked bucket of hash, a split between the lookup and the lock
+// is seen through BucketsLen and retried
+z_Bucket *z_mapLockBucket(z_Map *m, uint64_t hash) {
+  while (1) {
+    int64_t i = z_mapBucketIndex(m, hash, atomic_load(&m->BucketsLen));
+    z_Bucket *b = z_mapBucket(m, i);
+    z_LockLock(&b->Lock);
+    if (z_mapBucketIndex(m, hash, atomic_load(&m->BucketsLen)) == i) {
+      return b;
+    }
+    z_LockUnLock(&b->Lock);
+  }
+}
+
+// copies the locked b to the snapshot being taken unless it is there
+void z_mapSnapBucket(z_Map *m, z_Bucket *b) {
+  int64_t gen = atomic_load(&m->SnapGen);
+  if (atomic_load(&m->IsSnapping) == false || b->SnapGen == gen) {
+    return;
+  }
+
+  b->SnapGen = gen;
+  int64_t len = z_BucketLen(b);
+  int64_t pos = atomic_fetch_add(&m->SnapLen, len);
+  if (pos + len > m->SnapCap) {
+    atomic_store(&m->IsSnapFailed, true);
+    return;
+  }
+  z_BucketCopy(b, m->SnapRecords + pos);
+}
+
+// z_mapLockBucket before a write, the bucket is in the snapshot being taken
+// before it changes
+z_Bucket *z_mapLockBucketWrite(z_Map *m, uint64_t hash) {
+  z_Bucket *b = z_mapLockBucket(m, hash);
+  z_mapSnapBucket(m, b);
+  return b;
+}
+
 void z_MapDestroy(z_Map *m) {
-  if (m == nullptr || m->Buckets == nullptr) {
+  if (m == nullptr || atomic_load(&m->Segments[0]) == nullptr) {
     return;
   }
 
-  for (int64_t i = 0; i < m->BucketsLen; ++i) {
-    z_BucketDestroy(&m->Buckets[i]);
+  // the buckets after BucketsLen were never initialized
+  int64_t buckets_len = atomic_load(&m->BucketsLen);
+  for (int64_t i = 0; i < buckets_len; ++i) {
+    z_BucketDestroy(z_mapBucket(m, i));
+  }
+  for (int64_t seg = 0; seg < z_MAP_SEGMENTS_LEN; ++seg) {
+    z_Bucket *buckets = atomic_load(&m->Segments[seg]);
+    if (buckets == nullptr) {
+      break;
+    }
+    z_free(buckets);
+    atomic_store(&m->Segments[seg], nullptr);
   }
 
-  z_free(m->Buckets);
-  m->BucketsLen = 0;
+  z_free(m->SnapRecords);
+
+  // no reader is left, every retired array is freed
+  z_EpochRunActions(&m->Epoch);
+  z_EpochDestroy(&m->Epoch);
+
+  atomic_store(&m->BucketsLen, 0);
+  atomic_store(&m->Len, 0);
   return;
 }
 
-z_Error z_MapInit(z_Map *m, int64_t buckets_len, void *attr,
-                  z_MapIsEqual *isEqual) {
-  if (m == nullptr || buckets_len == 0 || attr == nullptr ||
+// the buckets of a segment are left to their first use, a large calloc gets
+// zero pages from the kernel without touching them, so the split that needs
+// a new segment costs no more than another one
+z_Error z_mapSegmentInit(z_Map *m, int64_t seg) {
+  int64_t len = z_mapSegmentLen(m, seg);
+  z_Bucket *buckets = z_calloc(len, sizeof(z_Bucket));
+  if (buckets == nullptr) {
+    z_error("buckets == nullptr seg %lld len %lld", seg, len);
+    return z_ERR_NOSPACE;
+  }
+
+  atomic_store(&m->Segments[seg], buckets);
+  return z_OK;
+}
+
+// with z_MAP_ENGINE_SWISS a bucket is a lock shard, a few per thread is enough
+// buckets_len is the initial length, the map splits buckets as it grows
+z_Error z_MapInit(z_Map *m, int64_t buckets_len, z_MapEngine engine,
+                  void *attr, z_MapIsEqual *isEqual) {
+  if (m == nullptr || buckets_len <= 0 || attr == nullptr ||
       isEqual == nullptr) {
-    z_error("m == nullptr || buckets_len == 0 || attr == nullptr || isEqual == "
+    z_error("m == nullptr || buckets_len <= 0 || attr == nullptr || isEqual == "
             "nullptr");
     return z_ERR_INVALID_DATA;
   }
 
   m->Attr = attr;
   m->IsEqual = isEqual;
-  m->BucketsLen = buckets_len;
-  m->Buckets = z_malloc(sizeof(z_Bucket) * m->BucketsLen);
-  if (m->Buckets == nullptr) {
-    z_error("m->Buckets == nullptr");
+  m->OnRemove = nullptr;
+  m->Engine = engine;
+  m->Hash = z_MAP_HASH;
+  m->InitBucketsLen = buckets_len;
+  for (int64_t seg = 0; seg < z_MAP_SEGMENTS_LEN; ++seg) {
+    atomic_store(&m->Segments[seg], nullptr);
+  }
+  atomic_store(&m->BucketsLen, buckets_len);
+  atomic_store(&m->Len, 0);
+  z_LockInit(&m->SplitLock);
+  atomic_store(&m->IsSnapping, false);
+  atomic_store(&m->IsSnapFailed, false);
+  atomic_store(&m->SnapGen, 0);
+  m->SnapRecords = nullptr;
+  m->SnapCap = 0;
+  atomic_store(&m->SnapLen, 0);
+  z_SeqLockInit(&m->BatchSeq);
+
+  z_Error ret = z_EpochInit(&m->Epoch, z_MAP_EPOCH_THREADS_LEN,
+                            z_MAP_EPOCH_ACTIONS_LEN);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  ret = z_mapSegmentInit(m, 0);
+  if (ret != z_OK) {
+    z_EpochDestroy(&m->Epoch);
+    return ret;
+  }
+
+  z_Bucket *buckets = atomic_load(&m->Segments[0]);
+  for (int64_t i = 0; i < buckets_len; ++i) {
+    ret = z_BucketInit(&buckets[i], engine, &m->Epoch);
+    if (ret != z_OK) {
+      z_error("z_BucketInit %lld", i);
+      for (int64_t j = 0; j < i; ++j) {
+        z_BucketDestroy(&buckets[j]);
+      }
+      z_free(buckets);
+      atomic_store(&m->Segments[0], nullptr);
+      z_EpochDestroy(&m->Epoch);
+      return ret;
+    }
+  }
+  return z_OK;
+}
+
+// splits the next bucket, the records of one bucket are moved per call
+z_Error z_mapSplit(z_Map *m) {
+  int64_t buckets_len = atomic_load(&m->BucketsLen);
+  int64_t level_len = z_mapLevelLen(m, buckets_len);
+  int64_t src_i = buckets_len - level_len;
+
+  int64_t seg, off;
+  z_mapSegmentIndex(m, buckets_len, &seg, &off);
+  if (seg >= z_MAP_SEGMENTS_LEN) {
     return z_ERR_NOSPACE;
   }
 
-  z_Error ret = z_OK;
-  for (int64_t i = 0; i < m->BucketsLen; ++i) {
-    ret = z_BucketInit(&m->Buckets[i]);
+  if (atomic_load(&m->Segments[seg]) == nullptr) {
+    z_Error ret = z_mapSegmentInit(m, seg);
     if (ret != z_OK) {
-      z_error("buckets_len %lld i %lld", buckets_len, i);
-      z_MapDestroy(m);
+      return ret;
     }
   }
 
+  // nobody maps a key to dst before BucketsLen is published, the split
+  // publishes it, so dst is initialized here on its first use
+  z_Bucket *src = z_mapBucket(m, src_i);
+  z_Bucket *dst = z_mapBucket(m, buckets_len);
+  z_Error ret = z_BucketInit(dst, m->Engine, &m->Epoch);
+  if (ret != z_OK) {
+    z_error("z_BucketInit %lld", buckets_len);
+    return ret;
+  }
+  z_LockLock(&src->Lock);
+  z_LockLock(&dst->Lock);
+
+  ret = z_BucketSplit(src, dst, level_len * 2, buckets_len, &m->BucketsLen);
+
+  z_LockUnLock(&dst->Lock);
+  z_LockUnLock(&src->Lock);
+  // a failed split moved nothing, the next one initializes dst again
+  if (ret != z_OK) {
+    z_BucketDestroy(dst);
+  }
   return ret;
 }
 
-z_Error z_MapInsert(z_Map *m, z_ConstBuffer k, int64_t offset) {
+// called after a record is added, at most one split per call so the cost of
+// growing is spread over the writes
+void z_mapGrow(z_Map *m) {
+  int64_t load =
+      m->Engine == z_MAP_ENGINE_SWISS ? z_MAP_SWISS_LOAD : z_MAP_LIST_LOAD;
+  if (atomic_load(&m->Len) <= atomic_load(&m->BucketsLen) * load) {
+    return;
+  }
+
+  if (z_LockTryLock(&m->SplitLock) == false) {
+    return;
+  }
+
+  z_Error ret = z_mapSplit(m);
+  if (ret != z_OK) {
+    z_debug("z_mapSplit %d", ret);
+  }
+
+  z_LockUnLock(&m->SplitLock);
+}
+
+void z_mapRemoved(z_Map *m, z_MapRecord old) {
+  if (m->OnRemove != nullptr && old.Offset >= 0) {
+    m->OnRemove(m->Attr, old.Offset, old.Size);
+  }
+}
+
+int64_t z_MapLen(z_Map *m) { return atomic_load(&m->Len); }
+
+int64_t z_MapBucketsLen(z_Map *m) { return atomic_load(&m->BucketsLen); }
+
+z_Error z_MapInsert(z_Map *m, z_ConstBuffer k, int64_t offset,
+                    int64_t size) {
   if (m == nullptr || k.Data == nullptr || k.Size == 0) {
     z_error("m == nullptr || k.Data == nullptr || k.Size == 0");
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketInsert(b, k, hash, offset, m->Attr, m->IsEqual);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, offset, size);
+  z_Bucket *b = z_mapLockBucketWrite(m, r.Hash);
+  z_Error ret = z_BucketInsert(b, k, r, m->Attr, m->IsEqual);
+  z_LockUnLock(&b->Lock);
+
+  if (ret == z_OK) {
+    atomic_fetch_add(&m->Len, 1);
+    z_mapGrow(m);
+  }
+  return ret;
+}
+
+// adds records of distinct keys to a map without them, e.g. a checkpoint
+z_Error z_MapLoad(z_Map *m, const z_MapRecord *rs, int64_t len) {
+  if (m == nullptr || rs == nullptr && len > 0) {
+    z_error("m == nullptr || rs == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  for (int64_t i = 0; i < len; ++i) {
+    z_Bucket *b = z_mapLockBucketWrite(m, rs[i].Hash);
+    z_Error ret = z_BucketAdd(b, rs[i]);
+    z_LockUnLock(&b->Lock);
+    if (ret != z_OK) {
+      return ret;
+    }
+
+    atomic_fetch_add(&m->Len, 1);
+    z_mapGrow(m);
+  }
+  return z_OK;
+}
+
+// starts a snapshot of the map as it is now, the caller keeps the writes off
+// meanwhile, e.g. holding z_BinLogLock. z_MapSnapshotEnd copies the buckets
+// after the writes go on, a write copies its bucket before it changes it, so
+// the copy is still of the map as it was here
+z_Error z_MapSnapshotBegin(z_Map *m) {
+  if (m == nullptr) {
+    z_error("m == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  // no split moves the records meanwhile, z_mapGrow only tries it
+  z_LockLock(&m->SplitLock);
+  int64_t cap = atomic_load(&m->Len);
+  m->SnapRecords = z_malloc(sizeof(z_MapRecord) * (cap > 0 ? cap : 1));
+  if (m->SnapRecords == nullptr) {
+    z_LockUnLock(&m->SplitLock);
+    return z_ERR_NOSPACE;
+  }
+
+  m->SnapCap = cap;
+  atomic_store(&m->SnapLen, 0);
+  atomic_store(&m->IsSnapFailed, false);
+  atomic_fetch_add(&m->SnapGen, 1);
+  atomic_store(&m->IsSnapping, true);
+  return z_OK;
+}
+
+// copies the buckets no write copied and ends the snapshot, *rs is freed by
+// the caller
+z_Error z_MapSnapshotEnd(z_Map *m, z_MapRecord **rs, int64_t *len) {
+  if (m == nullptr || rs == nullptr || len == nullptr) {
+    z_error("m == nullptr || rs == nullptr || len == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  int64_t buckets_len = atomic_load(&m->BucketsLen);
+  for (int64_t i = 0; i < buckets_len; ++i) {
+    z_Bucket *b = z_mapBucket(m, i);
+    z_LockLock(&b->Lock);
+    z_mapSnapBucket(m, b);
+    z_LockUnLock(&b->Lock);
+  }
+
+  atomic_store(&m->IsSnapping, false);
+  *rs = m->SnapRecords;
+  *len = atomic_load(&m->SnapLen);
+  m->SnapRecords = nullptr;
+  z_LockUnLock(&m->SplitLock);
+
+  if (atomic_load(&m->IsSnapFailed)) {
+    z_error("map len %lld is changed", m->SnapCap);
+    z_free(*rs);
+    return z_ERR_CONFLICT;
+  }
+  return z_OK;
+}
+
+// the lookup of r of k, a thread with an id below z_MAP_EPOCH_THREADS_LEN is
+// protected by m->Epoch and runs lock free
+z_Error z_mapFind(z_Map *m, z_ConstBuffer k, z_MapRecord r, bool is_protected,
+                  int64_t *offset) {
+  if (is_protected == false) {
+    z_Bucket *b = z_mapLockBucket(m, r.Hash);
+    z_Error ret = z_BucketFind(b, k, r, m->Attr, m->IsEqual, offset);
+    z_LockUnLock(&b->Lock);
+    return ret;
+  }
+
+  // retried only when a write or a split touched the bucket meanwhile
+  z_Error ret = z_OK;
+  while (1) {
+    int64_t i = z_mapBucketIndex(m, r.Hash, atomic_load(&m->BucketsLen));
+    z_Bucket *b = z_mapBucket(m, i);
+    if (z_BucketTryFind(b, k, r, m->Attr, m->IsEqual, offset, &ret) &&
+        z_mapBucketIndex(m, r.Hash, atomic_load(&m->BucketsLen)) == i) {
+      break;
+    }
+  }
+  return ret;
+}
+
+// waits out the batch being applied
+uint64_t z_mapBatchReadBegin(z_Map *m) {
+  uint64_t seq = z_SeqLockReadBegin(&m->BatchSeq);
+  while ((seq & 1) != 0) {
+    sched_yield();
+    seq = z_SeqLockReadBegin(&m->BatchSeq);
+  }
+  return seq;
+}
+
+// the writes until z_MapBatchEnd are seen by the finds all at once, the
+// caller holds off the other writers and finds nothing meanwhile
+void z_MapBatchBegin(z_Map *m) { z_SeqLockWriteBegin(&m->BatchSeq); }
+
+void z_MapBatchEnd(z_Map *m) { z_SeqLockWriteEnd(&m->BatchSeq); }
+
+bool z_mapIsProtectable() {
+  int64_t tid = z_ThreadID();
+  return tid != z_INVALID_THREAD_ID && tid < z_MAP_EPOCH_THREADS_LEN;
 }
 
 z_Error z_MapFind(z_Map *m, z_ConstBuffer k, int64_t *offset) {
@@ -447,42 +964,166 @@ z_Error z_MapFind(z_Map *m, z_ConstBuffer k, int64_t *offset) {
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketFind(b, k, hash, m->Attr, m->IsEqual, offset);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, -1, 0);
+  bool is_protected = z_mapIsProtectable();
+  if (is_protected) {
+    z_EpochProtect(&m->Epoch);
+  }
+  z_Error ret = z_OK;
+  uint64_t seq = 0;
+  do {
+    seq = z_mapBatchReadBegin(m);
+    ret = z_mapFind(m, k, r, is_protected, offset);
+  } while (z_SeqLockReadRetry(&m->BatchSeq, seq));
+  if (is_protected) {
+    z_EpochUnProtect(&m->Epoch);
+  }
+  return ret;
+}
+
+// keys looked up by z_MapFindBatch at a time, their loads are in flight
+// together
+#define z_MAP_FIND_BATCH_GROUP 16
+
+// prefetches where the lookup of hash in b starts, the fields are read
+// without the lock, a stale one only costs a useless prefetch
+void z_bucketPrefetch(z_Bucket *b, uint64_t hash) {
+  if (b->Engine == z_MAP_ENGINE_SWISS) {
+    int64_t cap = b->Swiss.Cap;
+    if (cap == 0) {
+      return;
+    }
+    int64_t pos = z_SwissH1(hash) & (cap - 1);
+    __builtin_prefetch(b->Swiss.Ctrls + pos);
+    __builtin_prefetch(b->Swiss.Records + pos);
+    return;
+  }
+
+  // a list is about z_MAP_LIST_LOAD records long, a few lines
+  z_MapRecord *rs = b->List.Records;
+  int64_t len = b->List.Pos;
+  for (int64_t i = 0; i < len && i < z_MAP_LIST_LOAD * 2; i += 2) {
+    __builtin_prefetch(rs + i);
+  }
+}
+
+// z_MapFind of len keys, rets[i] and offsets[i] are the result of ks[i]. the
+// keys are taken z_MAP_FIND_BATCH_GROUP at a time: all of them are hashed,
+// their buckets prefetched, then the records of the buckets, and only then
+// looked up, so the cache misses of a group overlap rather than chain
+z_Error z_MapFindBatch(z_Map *m, const z_ConstBuffer *ks, int64_t len,
+                       int64_t *offsets, z_Error *rets) {
+  if (m == nullptr || ks == nullptr || offsets == nullptr || rets == nullptr ||
+      len < 0) {
+    z_error("m == nullptr || ks == nullptr || offsets == nullptr || rets == "
+            "nullptr || len < 0");
+    return z_ERR_INVALID_DATA;
+  }
+
+  bool is_protected = z_mapIsProtectable();
+  if (is_protected) {
+    z_EpochProtect(&m->Epoch);
+  }
+
+  z_MapRecord rs[z_MAP_FIND_BATCH_GROUP];
+  z_Bucket *bs[z_MAP_FIND_BATCH_GROUP];
+  // the keys are all found before or after a batch of writes
+  uint64_t seq = z_mapBatchReadBegin(m);
+  for (int64_t start = 0; start < len; start += z_MAP_FIND_BATCH_GROUP) {
+    int64_t n = len - start < z_MAP_FIND_BATCH_GROUP ? len - start
+                                                     : z_MAP_FIND_BATCH_GROUP;
+    for (int64_t i = 0; i < n; ++i) {
+      rs[i] = z_MapRecordNew(m->Hash, ks[start + i], -1, 0);
+    }
+
+    int64_t buckets_len = atomic_load(&m->BucketsLen);
+    for (int64_t i = 0; i < n; ++i) {
+      bs[i] = z_mapBucket(m, z_mapBucketIndex(m, rs[i].Hash, buckets_len));
+      __builtin_prefetch(bs[i]);
+    }
+    for (int64_t i = 0; i < n; ++i) {
+      z_bucketPrefetch(bs[i], rs[i].Hash);
+    }
+
+    for (int64_t i = 0; i < n; ++i) {
+      z_ConstBuffer k = ks[start + i];
+      if (k.Data == nullptr || k.Size == 0) {
+        z_error("k.Data == nullptr || k.Size == 0");
+        rets[start + i] = z_ERR_INVALID_DATA;
+        continue;
+      }
+      rets[start + i] =
+          z_mapFind(m, k, rs[i], is_protected, &offsets[start + i]);
+    }
+
+    if (start + n >= len && z_SeqLockReadRetry(&m->BatchSeq, seq)) {
+      seq = z_mapBatchReadBegin(m);
+      start = -z_MAP_FIND_BATCH_GROUP;
+    }
+  }
+
+  if (is_protected) {
+    z_EpochUnProtect(&m->Epoch);
+  }
+  return z_OK;
 }
 
-z_Error z_MapForceUpdate(z_Map *m, z_ConstBuffer k, int64_t offset) {
+z_Error z_MapForceUpdate(z_Map *m, z_ConstBuffer k, int64_t offset,
+                         int64_t size) {
   if (m == nullptr || k.Data == nullptr || k.Size == 0) {
     z_error("m == nullptr || k.Data == nullptr || k.Size == 0");
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketForceUpdate(b, k, hash, offset, m->Attr, m->IsEqual);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, offset, size);
+  z_MapRecord old = {.Offset = -1};
+  z_Bucket *b = z_mapLockBucketWrite(m, r.Hash);
+  z_Error ret = z_BucketForceUpdate(b, k, r, m->Attr, m->IsEqual, &old);
+  z_LockUnLock(&b->Lock);
+
+  z_mapRemoved(m, old);
+  return ret;
 }
 
-z_Error z_MapForceUpsert(z_Map *m, z_ConstBuffer k, int64_t offset) {
+z_Error z_MapForceUpsert(z_Map *m, z_ConstBuffer k, int64_t offset,
+                         int64_t size) {
   if (m == nullptr || k.Data == nullptr || k.Size == 0) {
     z_error("m == nullptr || k.Data == nullptr || k.Size == 0");
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketForceUpsert(b, k, hash, offset, m->Attr, m->IsEqual);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, offset, size);
+  z_MapRecord old = {.Offset = -1};
+  z_Bucket *b = z_mapLockBucketWrite(m, r.Hash);
+  int64_t len = z_BucketLen(b);
+  z_Error ret = z_BucketForceUpsert(b, k, r, m->Attr, m->IsEqual, &old);
+  bool is_added = z_BucketLen(b) > len;
+  z_LockUnLock(&b->Lock);
+
+  z_mapRemoved(m, old);
+  if (is_added) {
+    atomic_fetch_add(&m->Len, 1);
+    z_mapGrow(m);
+  }
+  return ret;
 }
 
-z_Error z_MapUpdate(z_Map *m, z_ConstBuffer k, int64_t offset, z_ConstBuffer src_v) {
+z_Error z_MapUpdate(z_Map *m, z_ConstBuffer k, int64_t offset, int64_t size,
+                    z_ConstBuffer src_v) {
   if (m == nullptr || k.Data == nullptr || k.Size == 0) {
     z_error("m == nullptr || k.Data == nullptr || k.Size == 0");
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketUpdate(b, k, hash, offset, src_v, m->Attr, m->IsEqual);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, offset, size);
+  z_MapRecord old = {.Offset = -1};
+  z_Bucket *b = z_mapLockBucketWrite(m, r.Hash);
+  z_Error ret =
+      z_BucketUpdate(b, k, r, src_v, m->Attr, m->IsEqual, &old);
+  z_LockUnLock(&b->Lock);
+
+  z_mapRemoved(m, old);
+  return ret;
 }
 
 z_Error z_MapDelete(z_Map *m, z_ConstBuffer k) {
@@ -491,9 +1132,17 @@ z_Error z_MapDelete(z_Map *m, z_ConstBuffer k) {
     return z_ERR_INVALID_DATA;
   }
 
-  uint64_t hash = z_Hash(k.Data, k.Size);
-  z_Bucket *b = &m->Buckets[hash % m->BucketsLen];
-  return z_BucketDelete(b, k, hash, m->Attr, m->IsEqual);
+  z_MapRecord r = z_MapRecordNew(m->Hash, k, -1, 0);
+  z_MapRecord old = {.Offset = -1};
+  z_Bucket *b = z_mapLockBucketWrite(m, r.Hash);
+  z_Error ret = z_BucketDelete(b, k, r, m->Attr, m->IsEqual, &old);
+  z_LockUnLock(&b->Lock);
+
+  z_mapRemoved(m, old);
+  if (ret == z_OK) {
+    atomic_fetch_sub(&m->Len, 1);
+  }
+  return ret;
 }
 
 typedef enum {
@@ -0,0 +1,71 @@
+#ifndef z_MAP_RECORD_H
+#define z_MAP_RECORD_H
+
+#include <stdint.h>
+
+#include "zepoch/epoch.h"
+#include "zutils/buffer.h"
+#include "zutils/hash.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// the Size of a record of this size or larger, it is read from the binlog
+#define z_MAP_RECORD_SIZE_LARGE UINT16_MAX
+
+typedef struct {
+  uint64_t Hash;
+  int64_t Offset;
+  // rejects different keys with the same hash without reading the binlog
+  uint32_t Fingerprint;
+  uint16_t KeySize;
+  // the bytes of the frame at Offset, a replaced record is dead by them
+  uint16_t Size;
+} z_MapRecord;
+
+z_MapRecord z_MapRecordNew(z_HashFamily hash, z_ConstBuffer k, int64_t offset,
+                           int64_t size) {
+  return (z_MapRecord){
+      .Hash = z_HashOf(hash, k.Data, k.Size),
+      .Offset = offset,
+      .Fingerprint = z_FingerprintOf(hash, k.Data, k.Size),
+      .KeySize = k.Size,
+      .Size = size < z_MAP_RECORD_SIZE_LARGE ? size : z_MAP_RECORD_SIZE_LARGE};
+}
+
+// false means different keys, true means the keys are probably equal
+bool z_MapRecordIsMatch(const z_MapRecord *a, const z_MapRecord *b) {
+  return a->Hash == b->Hash && a->KeySize == b->KeySize &&
+         a->Fingerprint == b->Fingerprint;
+}
+
+typedef bool z_MapIsEqual(void *attr, z_ConstBuffer key, z_ConstBuffer value, int64_t offset);
+
+// offset is the record a write replaced or deleted and size its Size, called
+// without the lock
+typedef void z_MapOnRemove(void *attr, int64_t offset, int64_t size);
+
+z_Error z_mapFree(void *attr, uint64_t addr) {
+  void *ptr = (void *)addr;
+  z_free(ptr);
+  return z_OK;
+}
+
+// frees an array once the optimistic readers that may still see it are gone,
+// it is leaked if the action can not even be parked
+void z_MapRetire(z_Epoch *e, void *ptr) {
+  if (ptr == nullptr) {
+    return;
+  }
+
+  if (e == nullptr) {
+    z_free(ptr);
+    return;
+  }
+
+  z_EpochAction action = {.Addr = (uint64_t)ptr, .Func = z_mapFree};
+  if (z_EpohBump(e, action) != z_OK) {
+    z_error("z_EpohBump");
+  }
+}
+
+#endif
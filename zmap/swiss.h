@@ -0,0 +1,388 @@
+#ifndef z_SWISS_H
+#define z_SWISS_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "zerror/error.h"
+#include "zmap/map_record.h"
+#include "zutils/buffer.h"
+#include "zutils/lock.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+// open addressing table, one control byte per slot, probed a group at a time
+// full slot: 0 ~ 127, the top 7 bits of the hash
+// free slot: empty or deleted, the sign bit is set
+#define z_SWISS_GROUP_LEN 16
+#define z_SWISS_EMPTY ((int8_t)-128)
+#define z_SWISS_DELETED ((int8_t)-2)
+
+// bit i is set when slot i of the group matches
+typedef uint32_t z_SwissMask;
+
+z_SwissMask z_SwissGroupMatch(const int8_t *ctrls, int8_t c) {
+#if defined(__SSE2__)
+  __m128i g = _mm_loadu_si128((const __m128i *)ctrls);
+  return _mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8(c)));
+#else
+  z_SwissMask m = 0;
+  for (int64_t i = 0; i < z_SWISS_GROUP_LEN; ++i) {
+    if (ctrls[i] == c) {
+      m |= 1u << i;
+    }
+  }
+  return m;
+#endif
+}
+
+z_SwissMask z_SwissGroupMatchFree(const int8_t *ctrls) {
+#if defined(__SSE2__)
+  __m128i g = _mm_loadu_si128((const __m128i *)ctrls);
+  return _mm_movemask_epi8(g);
+#else
+  z_SwissMask m = 0;
+  for (int64_t i = 0; i < z_SWISS_GROUP_LEN; ++i) {
+    if (ctrls[i] < 0) {
+      m |= 1u << i;
+    }
+  }
+  return m;
+#endif
+}
+
+typedef struct {
+  // Cap + z_SWISS_GROUP_LEN - 1 bytes, the tail mirrors the first group so a
+  // group can be loaded from any slot
+  int8_t *Ctrls;
+  z_MapRecord *Records;
+  // 0 or a power of 2 not less than z_SWISS_GROUP_LEN
+  int64_t Cap;
+  int64_t Len;
+  int64_t Deleted;
+  // guards the fields above and the arrays for z_SwissTryFind
+  z_SeqLock Seq;
+  z_Epoch *Epoch;
+} z_Swiss;
+
+// the low bits of the hash select the map bucket, mix them before use
+uint64_t z_SwissH1(uint64_t hash) {
+  hash ^= hash >> 30;
+  hash *= 0xbf58476d1ce4e5b9;
+  hash ^= hash >> 27;
+  return hash;
+}
+
+int8_t z_SwissH2(uint64_t hash) { return hash >> 57; }
+
+z_Error z_SwissInit(z_Swiss *s, z_Epoch *epoch) {
+  if (s == nullptr) {
+    z_error("s == nullptr");
+    return z_ERR_INVALID_DATA;
+  }
+
+  s->Ctrls = nullptr;
+  s->Records = nullptr;
+  s->Cap = 0;
+  s->Len = 0;
+  s->Deleted = 0;
+  z_SeqLockInit(&s->Seq);
+  s->Epoch = epoch;
+  return z_OK;
+}
+
+void z_SwissDestroy(z_Swiss *s) {
+  if (s == nullptr || s->Ctrls == nullptr) {
+    return;
+  }
+
+  z_free(s->Ctrls);
+  z_free(s->Records);
+  s->Cap = 0;
+  s->Len = 0;
+  s->Deleted = 0;
+}
+
+void z_SwissSetCtrl(z_Swiss *s, int64_t i, int8_t c) {
+  s->Ctrls[i] = c;
+  if (i < z_SWISS_GROUP_LEN - 1) {
+    s->Ctrls[s->Cap + i] = c;
+  }
+}
+
+// the slot of k, -1 when not found
+int64_t z_SwissFindSlot(z_Swiss *s, z_ConstBuffer k, z_MapRecord r, void *attr,
+                        z_MapIsEqual *isEqual) {
+  if (s->Cap == 0) {
+    return -1;
+  }
+
+  int64_t mask = s->Cap - 1;
+  int8_t h2 = z_SwissH2(r.Hash);
+  int64_t pos = z_SwissH1(r.Hash) & mask;
+  int64_t step = 0;
+  for (int64_t i = 0; i < s->Cap / z_SWISS_GROUP_LEN; ++i) {
+    const int8_t *g = s->Ctrls + pos;
+    z_SwissMask m = z_SwissGroupMatch(g, h2);
+    while (m != 0) {
+      int64_t slot = (pos + __builtin_ctz(m)) & mask;
+      z_MapRecord *record = &s->Records[slot];
+      if (z_MapRecordIsMatch(record, &r) &&
+          (record->Offset == r.Offset ||
+           isEqual(attr, k, (z_ConstBuffer){}, record->Offset) == true)) {
+        return slot;
+      }
+      m &= m - 1;
+    }
+
+    if (z_SwissGroupMatch(g, z_SWISS_EMPTY) != 0) {
+      return -1;
+    }
+
+    step += z_SWISS_GROUP_LEN;
+    pos = (pos + step) & mask;
+  }
+
+  return -1;
+}
+
+// the first empty or deleted slot of the probe sequence
+int64_t z_SwissFreeSlot(z_Swiss *s, uint64_t hash) {
+  int64_t mask = s->Cap - 1;
+  int64_t pos = z_SwissH1(hash) & mask;
+  int64_t step = 0;
+  while (1) {
+    z_SwissMask m = z_SwissGroupMatchFree(s->Ctrls + pos);
+    if (m != 0) {
+      return (pos + __builtin_ctz(m)) & mask;
+    }
+
+    step += z_SWISS_GROUP_LEN;
+    pos = (pos + step) & mask;
+  }
+}
+
+z_Error z_SwissRehash(z_Swiss *s, int64_t cap) {
+  z_Swiss dst = {.Cap = cap};
+  dst.Ctrls = z_malloc(cap + z_SWISS_GROUP_LEN - 1);
+  if (dst.Ctrls == nullptr) {
+    z_error("dst.Ctrls == nullptr cap %lld", cap);
+    return z_ERR_NOSPACE;
+  }
+
+  dst.Records = z_malloc(sizeof(z_MapRecord) * cap);
+  if (dst.Records == nullptr) {
+    z_error("dst.Records == nullptr cap %lld", cap);
+    z_free(dst.Ctrls);
+    return z_ERR_NOSPACE;
+  }
+  memset(dst.Ctrls, z_SWISS_EMPTY, cap + z_SWISS_GROUP_LEN - 1);
+
+  for (int64_t i = 0; i < s->Cap; ++i) {
+    if (s->Ctrls[i] < 0) {
+      continue;
+    }
+
+    int64_t slot = z_SwissFreeSlot(&dst, s->Records[i].Hash);
+    z_SwissSetCtrl(&dst, slot, s->Ctrls[i]);
+    dst.Records[slot] = s->Records[i];
+    ++dst.Len;
+  }
+
+  int8_t *src_ctrls = s->Ctrls;
+  z_MapRecord *src_records = s->Records;
+
+  z_SeqLockWriteBegin(&s->Seq);
+  s->Ctrls = dst.Ctrls;
+  s->Records = dst.Records;
+  s->Cap = dst.Cap;
+  s->Len = dst.Len;
+  s->Deleted = 0;
+  z_SeqLockWriteEnd(&s->Seq);
+
+  z_MapRetire(s->Epoch, src_ctrls);
+  z_MapRetire(s->Epoch, src_records);
+  return z_OK;
+}
+
+// room for len records without a rehash
+z_Error z_SwissReserve(z_Swiss *s, int64_t len) {
+  if ((len + s->Deleted) * 8 <= s->Cap * 7) {
+    return z_OK;
+  }
+
+  int64_t cap = z_SWISS_GROUP_LEN;
+  while (len * 8 > cap * 7) {
+    cap *= 2;
+  }
+  return z_SwissRehash(s, cap);
+}
+
+// k must not be in the table
+z_Error z_SwissAdd(z_Swiss *s, z_MapRecord r) {
+  // keep the load factor under 7/8 so probing always meets an empty slot
+  if ((s->Len + s->Deleted + 1) * 8 > s->Cap * 7) {
+    z_Error ret = z_SwissReserve(s, (s->Len + 1) * 2);
+    if (ret != z_OK) {
+      return ret;
+    }
+  }
+
+  int64_t slot = z_SwissFreeSlot(s, r.Hash);
+  z_SeqLockWriteBegin(&s->Seq);
+  if (s->Ctrls[slot] == z_SWISS_DELETED) {
+    --s->Deleted;
+  }
+  // the record first, so a reader never matches a stale one
+  s->Records[slot] = r;
+  z_SwissSetCtrl(s, slot, z_SwissH2(r.Hash));
+  ++s->Len;
+  z_SeqLockWriteEnd(&s->Seq);
+  return z_OK;
+}
+
+z_Error z_SwissInsert(z_Swiss *s, z_ConstBuffer k, z_MapRecord r, void *attr,
+                      z_MapIsEqual *isEqual) {
+  if (z_SwissFindSlot(s, k, r, attr, isEqual) >= 0) {
+    return z_ERR_EXIST;
+  }
+
+  return z_SwissAdd(s, r);
+}
+
+z_Error z_SwissFind(z_Swiss *s, z_ConstBuffer k, z_MapRecord r, void *attr,
+                    z_MapIsEqual *isEqual, z_MapRecord **record) {
+  int64_t slot = z_SwissFindSlot(s, k, r, attr, isEqual);
+  if (slot < 0) {
+    *record = nullptr;
+    return z_ERR_NOT_FOUND;
+  }
+
+  *record = &s->Records[slot];
+  return z_OK;
+}
+
+// lock free z_SwissFind, false when a concurrent write was seen and the caller
+// should retry, the caller is protected by s->Epoch
+bool z_SwissTryFind(z_Swiss *s, z_ConstBuffer k, z_MapRecord r, void *attr,
+                    z_MapIsEqual *isEqual, int64_t *offset, z_Error *ret) {
+  uint64_t seq = z_SeqLockReadBegin(&s->Seq);
+  z_Swiss snap = {.Ctrls = s->Ctrls, .Records = s->Records, .Cap = s->Cap};
+  if (z_SeqLockReadRetry(&s->Seq, seq)) {
+    return false;
+  }
+
+  int64_t slot = z_SwissFindSlot(&snap, k, r, attr, isEqual);
+  if (slot < 0) {
+    *ret = z_ERR_NOT_FOUND;
+  } else {
+    *ret = z_OK;
+    *offset = snap.Records[slot].Offset;
+  }
+
+  return z_SeqLockReadRetry(&s->Seq, seq) == false;
+}
+
+z_Error z_SwissForceUpdate(z_Swiss *s, z_ConstBuffer k, z_MapRecord r,
+                           void *attr, z_MapIsEqual *isEqual,
+                           z_MapRecord *old) {
+  int64_t slot = z_SwissFindSlot(s, k, r, attr, isEqual);
+  if (slot < 0) {
+    return z_ERR_NOT_FOUND;
+  }
+
+  *old = s->Records[slot];
+  z_SeqLockWriteBegin(&s->Seq);
+  s->Records[slot] = r;
+  z_SeqLockWriteEnd(&s->Seq);
+  return z_OK;
+}
+
+z_Error z_SwissForceUpsert(z_Swiss *s, z_ConstBuffer k, z_MapRecord r,
+                           void *attr, z_MapIsEqual *isEqual,
+                           z_MapRecord *old) {
+  int64_t slot = z_SwissFindSlot(s, k, r, attr, isEqual);
+  if (slot >= 0) {
+    *old = s->Records[slot];
+    z_SeqLockWriteBegin(&s->Seq);
+    s->Records[slot] = r;
+    z_SeqLockWriteEnd(&s->Seq);
+    return z_OK;
+  }
+
+  return z_SwissAdd(s, r);
+}
+
+z_Error z_SwissUpdate(z_Swiss *s, z_ConstBuffer k, z_MapRecord r,
+                      z_ConstBuffer src_v, void *attr, z_MapIsEqual *isEqual,
+                      z_MapRecord *old) {
+  int64_t slot = z_SwissFindSlot(s, k, r, attr, isEqual);
+  if (slot < 0) {
+    return z_ERR_NOT_FOUND;
+  }
+
+  if (isEqual(attr, (z_ConstBuffer){}, src_v, s->Records[slot].Offset) ==
+      false) {
+    return z_ERR_CONFLICT;
+  }
+
+  *old = s->Records[slot];
+  z_SeqLockWriteBegin(&s->Seq);
+  s->Records[slot] = r;
+  z_SeqLockWriteEnd(&s->Seq);
+  return z_OK;
+}
+
+z_Error z_SwissDelete(z_Swiss *s, z_ConstBuffer k, z_MapRecord r, void *attr,
+                      z_MapIsEqual *isEqual, z_MapRecord *old) {
+  int64_t slot = z_SwissFindSlot(s, k, r, attr, isEqual);
+  if (slot < 0) {
+    return z_ERR_NOT_FOUND;
+  }
+
+  *old = s->Records[slot];
+  z_SeqLockWriteBegin(&s->Seq);
+  z_SwissSetCtrl(s, slot, z_SWISS_DELETED);
+  --s->Len;
+  ++s->Deleted;
+  z_SeqLockWriteEnd(&s->Seq);
+  return z_OK;
+}
+
+// moves the records with hash % mod == idx into the empty dst, see
+// z_ListSplit for len
+z_Error z_SwissSplit(z_Swiss *s, z_Swiss *dst, uint64_t mod, uint64_t idx,
+                     atomic_int_fast64_t *len) {
+  int64_t moved = 0;
+  for (int64_t i = 0; i < s->Cap; ++i) {
+    if (s->Ctrls[i] >= 0 && s->Records[i].Hash % mod == idx) {
+      ++moved;
+    }
+  }
+
+  z_Error ret = z_SwissReserve(dst, moved);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  z_SeqLockWriteBegin(&s->Seq);
+  for (int64_t i = 0; i < s->Cap; ++i) {
+    if (s->Ctrls[i] >= 0 && s->Records[i].Hash % mod == idx) {
+      z_SwissAdd(dst, s->Records[i]);
+      z_SwissSetCtrl(s, i, z_SWISS_DELETED);
+      --s->Len;
+      ++s->Deleted;
+    }
+  }
+  atomic_store(len, idx + 1);
+  z_SeqLockWriteEnd(&s->Seq);
+
+  return z_OK;
+}
+
+#endif
@@ -69,7 +69,7 @@ z_Error z_CliCall(z_Cli *cli, const z_Req *req, z_Resp *resp) {
     z_error("z_RecordKey failed %d", ret);
     return ret;
   }
-  uint64_t hash = z_Hash(key.Data, key.Size);
+  uint64_t hash = z_HashOf(z_HASH_WY, key.Data, key.Size);
   int64_t i = hash % cli->ConnsLen;
 
   z_LockLock(&cli->Conns[i].Lock);
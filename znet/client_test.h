@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include "zerror/error.h"
+#include "zkv/batch.h"
 #include "znet/client.h"
 #include "znet/kv_proto.h"
 #include "zrecord/record.h"
@@ -36,6 +37,15 @@ z_Error z_InsertTest(z_Cli *cli, int64_t i) {
     return ret;
   }
 
+  if (resp.Header.Code == z_OK) {
+    z_KVSetResp *set_resp = (z_KVSetResp *)resp.Data;
+    if (resp.Header.Size != sizeof(z_KVSetResp) || set_resp->Seq <= 0 ||
+        set_resp->DurableSeq < 0) {
+      z_error("invalid set resp size %u", resp.Header.Size);
+      return z_ERR_INVALID_DATA;
+    }
+  }
+
   return resp.Header.Code;
 }
 
@@ -130,6 +140,49 @@ z_Error z_UpdateTest(z_Cli *cli, int64_t i, int64_t ii, int64_t src_i) {
   return resp.Header.Code;
 }
 
+// an update of the 8 byte head whose Size is 8 bytes more than its KVV and
+// sizes, the bytes are sent as they are
+z_Error z_BadSizeUpdateTest(z_Cli *cli, int64_t i) {
+  z_unique(z_Req) req = {};
+  z_unique(z_Resp) resp = {};
+
+  char key[32] = {};
+  char val[32] = {};
+  sprintf(key, "key%lld", i);
+  sprintf(val, "value%lld", i);
+
+  z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+  z_ConstBuffer v = {.Data = val, .Size = strlen(val)};
+
+  z_Record *r = z_RecordNew(z_RECORD_FORMAT_FLAGS, z_ROP_UPDATE, k, v, v);
+  if (r == nullptr) {
+    z_error("r == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  int64_t size = z_RecordSize(r);
+  z_UpdateRecord *ur = z_malloc(size + 8);
+  if (ur == nullptr) {
+    z_RecordFree(r);
+    return z_ERR_NOSPACE;
+  }
+  memset(ur, 0, size + 8);
+  memcpy(ur, r, size);
+  z_RecordFree(r);
+  ur->Size += 8;
+
+  req.Header.Size = size + 8;
+  req.Header.Type = z_KV_REQ_TYPE_SET;
+  req.Data = (void *)ur;
+
+  z_Error ret = z_CliCall(cli, &req, &resp);
+  if (ret != z_OK) {
+    z_error("z_CliCall failed %d", ret);
+    return ret;
+  }
+
+  return resp.Header.Code;
+}
+
 z_Error z_FindTest(z_Cli *cli, int64_t i, int64_t ii) {
   z_unique(z_Req) req = {};
   z_unique(z_Resp) resp = {};
@@ -176,10 +229,118 @@ z_Error z_FindTest(z_Cli *cli, int64_t i, int64_t ii) {
   return z_OK;
 }
 
+// one batch of force updates of [start, end) to the value ii
+z_Error z_WriteBatchTest(z_Cli *cli, int64_t start, int64_t end, int64_t ii) {
+  z_unique(z_Req) req = {};
+  z_unique(z_Resp) resp = {};
+
+  z_KVWriteBatch b;
+  z_KVWriteBatchInit(&b);
+  char val[32] = {};
+  sprintf(val, "value%lld", ii);
+  z_ConstBuffer v = {.Data = val, .Size = strlen(val)};
+  for (int64_t i = start; i < end; ++i) {
+    char key[32] = {};
+    sprintf(key, "key%lld", i);
+    z_ConstBuffer k = {.Data = key, .Size = strlen(key)};
+    z_Error ret = z_KVWriteBatchForceUpdate(&b, k, v);
+    if (ret != z_OK) {
+      z_KVWriteBatchDestroy(&b);
+      return ret;
+    }
+  }
+  // the req takes the records
+  req.Header.Size = b.Size;
+  req.Header.Type = z_KV_REQ_TYPE_WRITE_BATCH;
+  req.Data = b.Data;
+
+  z_Error ret = z_CliCall(cli, &req, &resp);
+  if (ret != z_OK) {
+    z_error("z_CliCall failed %d", ret);
+    return ret;
+  }
+
+  if (resp.Header.Code == z_OK) {
+    z_KVWriteBatchResp *batch_resp = (z_KVWriteBatchResp *)resp.Data;
+    if (resp.Header.Size !=
+            sizeof(z_KVWriteBatchResp) + sizeof(z_Error) * (end - start) ||
+        batch_resp->Len != end - start || batch_resp->Seq <= 0) {
+      z_error("invalid batch resp size %u", resp.Header.Size);
+      return z_ERR_INVALID_DATA;
+    }
+  }
+
+  return resp.Header.Code;
+}
+
+// one mget of [start, end) and a key never written, the value of key i is
+// value i
+z_Error z_MGetTest(z_Cli *cli, int64_t start, int64_t end) {
+  z_unique(z_Req) req = {};
+  z_unique(z_Resp) resp = {};
+
+  int64_t len = end - start + 1;
+  req.Data = z_malloc((sizeof(z_Record) + 32) * len);
+  if (req.Data == nullptr) {
+    z_error("req.Data == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  for (int64_t i = start; i <= end; ++i) {
+    z_Record *r = (z_Record *)(req.Data + req.Header.Size);
+    *r = (z_Record){.KeySize = sprintf((char *)(r + 1), "key%lld",
+                                       i < end ? i : -1)};
+    req.Header.Size += z_RecordSize(r);
+  }
+  req.Header.Type = z_KV_REQ_TYPE_MGET;
+
+  z_Error ret = z_CliCall(cli, &req, &resp);
+  if (ret != z_OK) {
+    z_error("z_CliCall failed %d", ret);
+    return ret;
+  }
+  if (resp.Header.Code != z_OK) {
+    return resp.Header.Code;
+  }
+
+  z_KVMGetResp *mget_resp = (z_KVMGetResp *)resp.Data;
+  z_Error *rets = (z_Error *)(mget_resp + 1);
+  if (resp.Header.Size < sizeof(z_KVMGetResp) + sizeof(z_Error) * len ||
+      mget_resp->Len != len || rets[len - 1] != z_ERR_NOT_FOUND) {
+    z_error("invalid mget resp size %u", resp.Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  int8_t *p = (int8_t *)(rets + len);
+  for (int64_t i = start; i < end; ++i) {
+    if (rets[i - start] != z_OK) {
+      return rets[i - start];
+    }
+
+    char val[32] = {};
+    sprintf(val, "value%lld", i);
+    z_ConstBuffer v = {.Data = val, .Size = strlen(val)};
+    z_ConstBuffer resp_val;
+    z_RecordValue((z_Record *)p, &resp_val);
+    if (z_BufferIsEqual(&resp_val, &v) == false) {
+      z_error("z_BufferIsEqual");
+      return z_ERR_INVALID_DATA;
+    }
+    p += z_RecordSize((z_Record *)p);
+  }
+  if (p != resp.Data + resp.Header.Size) {
+    z_error("invalid mget resp size %u", resp.Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  return z_OK;
+}
+
 typedef struct {
   int64_t Start;
   int64_t End;
   z_Thread Tid;
+  // a batch across the stripes is refused
+  bool IsStriped;
 } z_ClientTestArgs;
 
 void z_ClientTest(z_ClientTestArgs *args) {
@@ -239,6 +400,10 @@ void z_ClientTest(z_ClientTestArgs *args) {
   }
   z_ASSERT_TRUE(ret == z_OK);
 
+  // refused before it is framed, the records after it are still read
+  ret = z_BadSizeUpdateTest(&cli, args->Start);
+  z_ASSERT_TRUE(ret == z_ERR_INVALID_DATA);
+
   for (int64_t i = args->Start; i < args->End; ++i) {
     int64_t reverse = args->End - args->Start - i - 1;
     ret = z_BlindUpdateTest(&cli, i, i);
@@ -298,4 +463,29 @@ void z_ClientTest(z_ClientTestArgs *args) {
     }
   }
   z_ASSERT_TRUE(ret == z_OK);
-}
\ No newline at end of file
+
+  for (int64_t i = args->Start; i < args->End; i += 100) {
+    ret = z_MGetTest(&cli, i, i + 100 < args->End ? i + 100 : args->End);
+    if (ret != z_OK) {
+      break;
+    }
+  }
+  z_ASSERT_TRUE(ret == z_OK);
+
+  for (int64_t i = args->Start; i < args->End; i += 16) {
+    int64_t end = i + 16 < args->End ? i + 16 : args->End;
+    ret = z_WriteBatchTest(&cli, i, end, i);
+    if (ret != (args->IsStriped ? z_ERR_INVALID_DATA : z_OK)) {
+      break;
+    }
+  }
+  z_ASSERT_TRUE(ret == (args->IsStriped ? z_ERR_INVALID_DATA : z_OK));
+
+  for (int64_t i = args->Start; i < args->End; ++i) {
+    ret = z_FindTest(&cli, i, args->IsStriped ? i : i - (i - args->Start) % 16);
+    if (ret != z_OK) {
+      break;
+    }
+  }
+  z_ASSERT_TRUE(ret == z_OK);
+}
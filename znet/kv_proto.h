@@ -7,10 +7,40 @@
 
 typedef enum : uint8_t {
   z_KV_REQ_TYPE_SET = 1,
+  // the response is a record of an empty key with the value, only its sizes
+  // are set. it has no flags, no Sum and no trailer, a response is not
+  // checked as a record of the binlog is
   z_KV_REQ_TYPE_GET = 2,
   z_KV_REQ_TYPE_BINLOG_GET = 3,
+  // the body is the records of a z_KVWriteBatch back to back
+  z_KV_REQ_TYPE_WRITE_BATCH = 4,
+  // the body is the records of z_KV_REQ_TYPE_GET back to back, one per key
+  z_KV_REQ_TYPE_MGET = 5,
 } z_KV_REQ_TYPE;
 
+// the body of a successful z_KV_REQ_TYPE_SET response
+typedef struct {
+  int64_t Seq;
+  // records up to DurableSeq are on the disk
+  int64_t DurableSeq;
+} z_KVSetResp;
+
+// the body of a z_KV_REQ_TYPE_WRITE_BATCH response, Len z_Error of the records
+// follow it, the code is the first failed one. a batch with a failed record
+// is not written, its other records are z_ERR_ABORTED
+typedef struct {
+  int64_t Seq;
+  int64_t DurableSeq;
+  int64_t Len;
+} z_KVWriteBatchResp;
+
+// the body of a z_KV_REQ_TYPE_MGET response, Len z_Error of the keys follow
+// it, then the record of a z_KV_REQ_TYPE_GET response for each key found, in
+// the order of the keys
+typedef struct {
+  int64_t Len;
+} z_KVMGetResp;
+
 typedef struct {
   int64_t MinSeq;
   int64_t Len;
@@ -21,15 +21,94 @@ void *CliRun(void *ptr) {
   return nullptr;
 }
 
+// the stripe mode serves the same requests, the binlogs of all the stripes hold
+// every acked record once
+void z_KVSvrCliStripesTest() {
+  int64_t thread_count = 2;
+  int64_t test_count = 1024 * 8;
+  int64_t stripes_len = 4;
+
+  const char *bp = "./bin/binlog.log";
+  z_KVStripesRemove(bp, stripes_len);
+
+  z_unique(z_SvrKV) svr_kv;
+  z_Error ret = z_SvrKVInitStripes(
+      &svr_kv, bp, 1024 * 1024 * 1024, 1024,
+      (z_BinLogSync){.Mode = z_BINLOG_SYNC_INTERVAL, .IntervalMS = 10},
+      "127.0.0.1", 12301, stripes_len, z_EVENT_LEN);
+  z_ASSERT_TRUE(ret == z_OK);
+
+  z_Thread t;
+  z_ThreadCreate(&t, SvrRun, &svr_kv);
+  sleep(1);
+
+  z_ClientTestArgs args[thread_count];
+  for (int64_t i = 0; i < thread_count; ++i) {
+    args[i].Start = i * test_count / thread_count;
+    args[i].End = args[i].Start + test_count / thread_count;
+    args[i].IsStriped = true;
+    z_ThreadCreate(&args[i].Tid, CliRun, &args[i]);
+  }
+  for (int64_t i = 0; i < thread_count; ++i) {
+    z_ThreadJion(args[i].Tid);
+  }
+
+  z_SvrKVStop(&svr_kv);
+  z_ThreadJion(t);
+
+  z_BinlogGetReq binlog_get_req = {.MinSeq = 0, .Len = INT64_MAX};
+  z_Req req = {.Header = {.Type = z_KV_REQ_TYPE_BINLOG_GET,
+                          .Size = sizeof(binlog_get_req)},
+               .Data = (int8_t *)&binlog_get_req};
+  z_unique(z_Resp) resp = {};
+  ret = z_KVStripesHandleBinLogGet(&svr_kv.Stripes, &req, &resp);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(((z_BinlogGetResp *)resp.Data)->RecordsLen ==
+                z_KVStripesAckedSeq(&svr_kv.Stripes));
+  bool is_spread = true;
+  for (int64_t i = 0; i < stripes_len; ++i) {
+    is_spread = is_spread && z_KVAckedSeq(&svr_kv.Stripes.KVs[i]) > 0;
+  }
+  z_ASSERT_TRUE(is_spread);
+
+  // a body shorter than its record is refused before its key is read
+  z_Record head = {.OP = z_ROP_INSERT, .KeySize = 16, .ValSize = 16};
+  z_Req short_req = {.Header = {.Type = z_KV_REQ_TYPE_SET,
+                                .Size = sizeof(head)},
+                     .Data = (int8_t *)&head};
+  z_unique(z_Resp) short_resp = {};
+  ret = z_KVStripesHandleSet(&svr_kv.Stripes, &short_req, &short_resp);
+  z_ASSERT_TRUE(ret == z_ERR_INVALID_DATA);
+  short_req.Header.Type = z_KV_REQ_TYPE_GET;
+  ret = z_KVStripesHandleGet(&svr_kv.Stripes, &short_req, &short_resp);
+  z_ASSERT_TRUE(ret == z_ERR_INVALID_DATA);
+
+  // so is a compact head cut in its sizes
+  z_ConstBuffer k = {.Data = (int8_t *)"key", .Size = 3};
+  z_Record *r = z_RecordNew(z_RECORD_COMPACT, z_ROP_INSERT, k, k,
+                            (z_ConstBuffer){});
+  z_ASSERT_TRUE(r != nullptr);
+  ((uint8_t *)r)[2] |= 0x80;
+  short_req = (z_Req){.Header = {.Type = z_KV_REQ_TYPE_SET, .Size = 3},
+                      .Data = (int8_t *)r};
+  ret = z_KVStripesHandleSet(&svr_kv.Stripes, &short_req, &short_resp);
+  z_ASSERT_TRUE(ret == z_ERR_INVALID_DATA);
+  z_RecordFree(r);
+  z_KVStripesRemove(bp, stripes_len);
+}
+
 void z_KVSvrCliTest() {
   int64_t thread_count = 2;
   int64_t test_count = 1024 * 32;
 
   const char *bp = "./bin/binlog.log";
-  remove(bp);
+  z_SegmentsRemove(bp);
 
   z_unique(z_SvrKV) svr_kv;
-  z_Error ret = z_SvrKVInit(&svr_kv, bp, 1024*1024*1024, 1024, "127.0.0.1", 12301, 16);
+  z_Error ret = z_SvrKVInit(
+      &svr_kv, bp, 1024 * 1024 * 1024, 1024,
+      (z_BinLogSync){.Mode = z_BINLOG_SYNC_INTERVAL, .IntervalMS = 10},
+      "127.0.0.1", 12301, 16, z_EVENT_LEN);
   z_ASSERT_TRUE(ret == z_OK);
 
   z_Thread t;
@@ -46,6 +125,7 @@ void z_KVSvrCliTest() {
   for (int64_t i = 0; i < thread_count; ++i) {
     args[i].Start = i * test_count / thread_count;
     args[i].End = args[i].Start + test_count / thread_count;
+    args[i].IsStriped = false;
     z_ThreadCreate(&args[i].Tid, CliRun, &args[i]);
   }
 
@@ -56,4 +136,15 @@ void z_KVSvrCliTest() {
   z_SvrKVStop(&svr_kv);
 
   z_ThreadJion(t);
+
+  // every acked record is walked once
+  z_BinlogGetReq binlog_get_req = {.MinSeq = 0, .Len = INT64_MAX};
+  z_Req req = {.Header = {.Type = z_KV_REQ_TYPE_BINLOG_GET,
+                          .Size = sizeof(binlog_get_req)},
+               .Data = (int8_t *)&binlog_get_req};
+  z_unique(z_Resp) resp = {};
+  ret = z_KVHandleBinLogGet(&svr_kv.KV, &req, &resp);
+  z_ASSERT_TRUE(ret == z_OK);
+  z_ASSERT_TRUE(((z_BinlogGetResp *)resp.Data)->RecordsLen ==
+                z_KVAckedSeq(&svr_kv.KV));
 }
\ No newline at end of file
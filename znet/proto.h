@@ -2,8 +2,11 @@
 #define z_PROTO_H
 #include <stdint.h>
 
+#include <sys/uio.h>
+
 #include "zerror/error.h"
 #include "znet/socket.h"
+#include "zutils/buffer.h"
 
 typedef struct {
   uint64_t Type : 8;
@@ -24,9 +27,16 @@ typedef struct {
   int8_t *Data;
 } z_Req;
 
+typedef void z_RespDone(void *attr);
+
 typedef struct {
   z_RespHeader Header;
   int8_t *Data;
+  // sent after Data without a copy, Header.Size counts both. Done releases it
+  // once the resp is sent or dropped
+  z_ConstBuffer Borrowed;
+  z_RespDone *Done;
+  void *DoneAttr;
 } z_Resp;
 
 #define z_ProtoFromSocket(r, s)                                                \
@@ -102,14 +112,33 @@ z_Error z_RespInitBySocket(z_Resp *resp, const z_Socket *s) {
 }
 
 z_Error z_RespToSocket(z_Resp *resp, const z_Socket *s) {
-  return z_ProtoToSocket(resp, s);
+  if (resp->Borrowed.Size == 0) {
+    return z_ProtoToSocket(resp, s);
+  }
+
+  z_assert(resp->Data != nullptr, resp->Header.Size > resp->Borrowed.Size);
+  struct iovec iov[3] = {
+      {.iov_base = &resp->Header, .iov_len = sizeof(resp->Header)},
+      {.iov_base = resp->Data,
+       .iov_len = resp->Header.Size - resp->Borrowed.Size},
+      {.iov_base = (void *)resp->Borrowed.Data,
+       .iov_len = resp->Borrowed.Size},
+  };
+  return z_SocketWriteV(s, iov, 3);
 }
 
 void z_RespDestroy(z_Resp *resp) {
-  if (resp == nullptr || resp->Data == nullptr) {
+  if (resp == nullptr) {
     return;
   }
 
-  z_free(resp->Data);
+  if (resp->Done != nullptr) {
+    resp->Done(resp->DoneAttr);
+    resp->Done = nullptr;
+  }
+
+  if (resp->Data != nullptr) {
+    z_free(resp->Data);
+  }
 }
 #endif
\ No newline at end of file
@@ -5,9 +5,12 @@
 #include <string.h>
 
 #include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netinet/in.h>
-#include <sys/event.h>
+#include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h> // close()
 
 #include "zerror/error.h"
@@ -55,6 +58,34 @@ z_Error z_SocketSetTimeout(z_Socket *s, int64_t sec) {
   return z_OK;
 }
 
+// header and body are sent separately, nagle would delay the body until ack
+z_Error z_SocketSetNoDelay(z_Socket *s) {
+  int flag = 1;
+  int ret =
+      setsockopt(s->FD, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(flag));
+  if (ret != 0) {
+    z_error("setsockopt(TCP_NODELAY) failed %d", ret);
+    return z_ERR_NET;
+  }
+  return z_OK;
+}
+
+z_Error z_SocketSetNonBlock(z_Socket *s, bool non_block) {
+  int flags = fcntl(s->FD, F_GETFL, 0);
+  if (flags < 0) {
+    z_error("fcntl(F_GETFL) failed %d", flags);
+    return z_ERR_NET;
+  }
+
+  flags = non_block ? flags | O_NONBLOCK : flags & ~O_NONBLOCK;
+  int ret = fcntl(s->FD, F_SETFL, flags);
+  if (ret != 0) {
+    z_error("fcntl(F_SETFL) failed %d", ret);
+    return z_ERR_NET;
+  }
+  return z_OK;
+}
+
 z_Error z_SocketInit(z_Socket *s) {
   s->FD = socket(AF_INET, SOCK_STREAM, 0);
   if (s->FD < 0) {
@@ -68,6 +99,12 @@ z_Error z_SocketInit(z_Socket *s) {
     z_error("z_SocketSetTimeout %d", ret);
     return ret;
   }
+
+  ret = z_SocketSetNoDelay(s);
+  if (ret != z_OK) {
+    z_error("z_SocketSetNoDelay %d", ret);
+    return ret;
+  }
   return z_OK;
 }
 
@@ -95,6 +132,13 @@ z_Error z_SocketSvrInit(z_Socket *s, const char *ip, uint16_t port) {
     return ret;
   }
 
+  int reuse = 1;
+  if (setsockopt(s->FD, SOL_SOCKET, SO_REUSEADDR, (char *)&reuse,
+                 sizeof(reuse)) != 0) {
+    z_error("setsockopt(SO_REUSEADDR) failed");
+    return z_ERR_NET;
+  }
+
   z_SockAddr addr;
   z_SockAddrFromStr(&addr, ip, port);
   if (bind(s->FD, &addr, sizeof(addr)) < 0) {
@@ -107,19 +151,41 @@ z_Error z_SocketSvrInit(z_Socket *s, const char *ip, uint16_t port) {
     return z_ERR_NET;
   }
 
+  // channels may be edge-triggered, accept is drained until it would block
+  ret = z_SocketSetNonBlock(s, true);
+  if (ret != z_OK) {
+    z_error("z_SocketSetNonBlock failed %d", ret);
+    return ret;
+  }
+
   z_debug("listen IP %s Port %d", ip, port);
 
   return z_OK;
 }
 
+// z_ERR_TIMEOUT means no more pending connections
 z_Error z_SocketAccept(const z_Socket *svr, z_Socket *cli) {
   int64_t cli_socket = accept(svr->FD, nullptr, nullptr);
   if (cli_socket < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+      return z_ERR_TIMEOUT;
+    }
     z_error("cli_socket < 0 %lld", cli_socket);
     return z_ERR_NET;
   }
 
   cli->FD = cli_socket;
+  // bsd accepted socket inherits O_NONBLOCK from the listen socket
+  z_Error ret = z_SocketSetNonBlock(cli, false);
+  if (ret == z_OK) {
+    ret = z_SocketSetNoDelay(cli);
+  }
+  if (ret != z_OK) {
+    z_error("accept socket options failed %d", ret);
+    close(cli->FD);
+    cli->FD = z_INVALID_SOCKET;
+    return ret;
+  }
   return z_OK;
 }
 
@@ -141,6 +207,15 @@ z_Error z_SocketRead(const z_Socket *s, int8_t *data, int64_t size) {
   return z_OK;
 }
 
+// whether more data is pending, without blocking and consuming it
+bool z_SocketReadable(const z_Socket *s) {
+  z_assert(s != nullptr);
+
+  int8_t c = 0;
+  int64_t bytes = recv(s->FD, &c, sizeof(c), MSG_PEEK | MSG_DONTWAIT);
+  return bytes > 0;
+}
+
 z_Error z_SocketWrite(const z_Socket *s, int8_t *data, int64_t size) {
   z_assert(s != nullptr, data != nullptr, size != 0);
 
@@ -151,4 +226,22 @@ z_Error z_SocketWrite(const z_Socket *s, int8_t *data, int64_t size) {
   }
   return z_OK;
 }
-#endif
\ No newline at end of file
+// one send of all the iov, a short send is an error like z_SocketWrite
+z_Error z_SocketWriteV(const z_Socket *s, struct iovec *iov, int64_t iov_len) {
+  z_assert(s != nullptr, iov != nullptr, iov_len != 0);
+
+  int64_t size = 0;
+  for (int64_t i = 0; i < iov_len; ++i) {
+    size += iov[i].iov_len;
+  }
+
+  struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iov_len};
+  int64_t bytes = sendmsg(s->FD, &msg, 0);
+  if (bytes <= 0 || bytes != size) {
+    z_error("sendmsg failed bytes:%lld socket:%lld size %lld", bytes, s->FD,
+            size);
+    return z_ERR_NET;
+  }
+  return z_OK;
+}
+#endif
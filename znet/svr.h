@@ -4,7 +4,6 @@
 #include <stdatomic.h>
 #include <stdint.h>
 #include <string.h>
-#include <sys/syslimits.h>
 
 #include "zepoch/epoch.h"
 #include "zerror/error.h"
@@ -56,7 +55,7 @@ z_Error z_HandlesAdd(z_Handles *hs, uint8_t type, z_Handle *handle) {
       hs->HandlesLen = src_len;
       return z_ERR_NOSPACE;
     }
-    memset(hs->Handles, 0, hs->HandlesLen);
+    memset(hs->Handles, 0, sizeof(z_Handle*) * hs->HandlesLen);
 
     if (src != nullptr) {
       memcpy(hs->Handles, src, sizeof(z_Handle*) * src_len);
@@ -105,6 +104,7 @@ typedef struct {
   z_Socket Socket;
   z_Channel AcceptCh;
   int64_t WorkerCount;
+  int64_t EventsLen;
   z_ThreadIDs TIDs;
   z_Epoch Epoch;
   z_Channels WorkerChs;
@@ -116,6 +116,29 @@ void z_ConnectClose(z_Channel *ch, z_Socket *socket) {
   z_SocketDestroy(socket);
 }
 
+z_Error z_IORequest(z_Svr *svr, z_Socket *cli_socket) {
+  z_unique(z_Req) req = {};
+  z_Error ret = z_ReqInitBySocket(&req, cli_socket);
+  if (ret != z_OK) {
+    z_error("z_ReqInitBySocket %d", ret);
+    return ret;
+  }
+
+  z_unique(z_Resp) resp = {};
+  ret = z_HandlesRun(svr->Handles, svr->Arg, &req, &resp);
+  if (ret != z_OK) {
+    z_debug("z_HandlesRun error %d", ret);
+  }
+
+  resp.Header.Code = ret;
+  ret = z_RespToSocket(&resp, cli_socket);
+  if (ret != z_OK) {
+    z_error("z_RespToSocket %d", ret);
+    return ret;
+  }
+  return z_OK;
+}
+
 void *z_IOProcess(z_Svr *svr) {
   if (svr == nullptr) {
     z_error("ptr == nullptr");
@@ -132,6 +155,17 @@ void *z_IOProcess(z_Svr *svr) {
   }
   z_debug("IOThread Start %lld", z_ThreadID());
 
+  z_Event *events = z_malloc(sizeof(z_Event) * svr->EventsLen);
+  if (events == nullptr) {
+    z_error("events == nullptr");
+    return nullptr;
+  }
+  z_defer(
+      ^(z_Event **ptr) {
+        z_free(*ptr);
+      },
+      &events);
+
   while (1) {
     int8_t status = atomic_load(&svr->Status);
     if (status != z_SVR_STATUS_RUNNING) {
@@ -139,9 +173,8 @@ void *z_IOProcess(z_Svr *svr) {
       break;
     }
 
-    z_Event events[z_EVENT_LEN] = {};
     int64_t ev_count = 0;
-    ret = z_ChannelWait(ch, events, z_EVENT_LEN, &ev_count, 1000);
+    ret = z_ChannelWait(ch, events, svr->EventsLen, &ev_count, 1000);
     switch (ret) {
     case z_ERR_TIMEOUT: {
       z_debug("timeout");
@@ -165,28 +198,14 @@ void *z_IOProcess(z_Svr *svr) {
         continue;
       }
 
-      z_unique(z_Req) req = {};
-      z_Error ret = z_ReqInitBySocket(&req, &cli_socket);
-      if (ret != z_OK) {
-        z_error("z_ReqInitBySocket %d", ret);
-        z_ConnectClose(ch, &cli_socket);
-        continue;
-      }
-
-      z_unique(z_Resp) resp = {};
-      z_Handle *handle;
-      ret = z_HandlesRun(svr->Handles, svr->Arg, &req, &resp);
-      if (ret != z_OK) {
-        z_debug("z_HandlesRun error %d", ret);
-      }
-
-      resp.Header.Code = ret;
-      ret = z_RespToSocket(&resp, &cli_socket);
-      if (ret != z_OK) {
-        z_error("z_RespToSocket %d", ret);
-        z_ConnectClose(ch, &cli_socket);
-        continue;
-      }
+      // the channel may be edge-triggered, serve every pending request
+      do {
+        ret = z_IORequest(svr, &cli_socket);
+        if (ret != z_OK) {
+          z_ConnectClose(ch, &cli_socket);
+          break;
+        }
+      } while (z_SocketReadable(&cli_socket));
     }
   }
 
@@ -209,9 +228,10 @@ void z_SvrDestroy(z_Svr *svr) {
 }
 
 z_Error z_SvrInit(z_Svr *svr, const char *ip, uint16_t port,
-                  int64_t worker_count, void *arg, z_Handles *handles) {
+                  int64_t worker_count, int64_t events_len, void *arg,
+                  z_Handles *handles) {
   z_assert(svr != nullptr, ip != nullptr, port != 0, worker_count != 0,
-           arg != nullptr, handles != nullptr);
+           events_len > 0, arg != nullptr, handles != nullptr);
 
   memset(svr->IP, 0, z_IP_MAX_LEN);
   strncpy(svr->IP, ip, z_IP_MAX_LEN - 1);
@@ -219,6 +239,7 @@ z_Error z_SvrInit(z_Svr *svr, const char *ip, uint16_t port,
   svr->Arg = arg;
   svr->Handles = handles;
   svr->WorkerCount = worker_count;
+  svr->EventsLen = events_len;
   svr->Socket = (z_Socket) {.FD = z_INVALID_SOCKET};
   svr->AcceptCh = (z_Channel) {.CH = z_INVALID_CHANNEL};
   svr->TIDs = (z_ThreadIDs){};
@@ -284,6 +305,17 @@ z_Error z_SvrRun(z_Svr *svr) {
     return ret;
   }
 
+  z_Event *events = z_malloc(sizeof(z_Event) * svr->EventsLen);
+  if (events == nullptr) {
+    z_error("events == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  z_defer(
+      ^(z_Event **ptr) {
+        z_free(*ptr);
+      },
+      &events);
+
   ret = z_ChannelSubscribeSocket(&svr->AcceptCh, &svr->Socket);
   if (ret != z_OK) {
     z_error("z_ChannelSubscribeSocket %d", ret);
@@ -297,9 +329,9 @@ z_Error z_SvrRun(z_Svr *svr) {
       break;
     }
 
-    z_Event events[z_EVENT_LEN] = {};
     int64_t ev_count = 0;
-    ret = z_ChannelWait(&svr->AcceptCh, events, z_EVENT_LEN, &ev_count, 1000);
+    ret = z_ChannelWait(&svr->AcceptCh, events, svr->EventsLen, &ev_count,
+                        1000);
     switch (ret) {
     case z_ERR_TIMEOUT: {
       z_debug("timeout");
@@ -314,12 +346,16 @@ z_Error z_SvrRun(z_Svr *svr) {
     }
     }
 
-    for (int64_t i = 0; i < ev_count; ++i) {
+    // the listen socket is non-blocking, accept until no more pending
+    while (1) {
       z_Socket sock_cli = {};
       z_Error ret = z_SocketAccept(&svr->Socket, &sock_cli);
+      if (ret == z_ERR_TIMEOUT) {
+        break;
+      }
       if (ret != z_OK) {
         z_error("z_SocketAccept %d", ret);
-        continue;
+        break;
       }
 
       z_Channel *ch_cli = nullptr;
@@ -1,11 +1,14 @@
 #ifndef z_SVR_KV_H
 #define z_SVR_KV_H
+#include <stdatomic.h>
 #include <stdint.h>
 
 #include "zbinlog/file.h"
 #include "zbinlog/file_record.h"
 #include "zerror/error.h"
+#include "zkv/batch.h"
 #include "zkv/kv.h"
+#include "zkv/stripes.h"
 #include "znet/kv_proto.h"
 #include "znet/proto.h"
 #include "znet/svr.h"
@@ -14,6 +17,23 @@
 #include "zutils/buffer.h"
 #include "zutils/log.h"
 
+// the key of the one record of the body of req, the sizes of the record are
+// checked against the body before the key is read
+z_Error z_kvReqKey(const z_Req *req, z_ConstBuffer *key) {
+  z_Record *r = (z_Record *)req->Data;
+  if (z_RecordHeadSize(req->Data, req->Header.Size) == 0 ||
+      z_RecordCheckSize(r) != z_OK || z_RecordSize(r) != req->Header.Size) {
+    z_error("invalid record size %u", req->Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  if (z_RecordSizesOf(r).KeySize == 0) {
+    z_error("empty key");
+    return z_ERR_INVALID_DATA;
+  }
+  return z_RecordKey(r, key);
+}
+
 z_Error z_KVHandleSet(void *arg, const z_Req *req, z_Resp *resp) {
   z_assert(arg != nullptr, req != nullptr, resp != nullptr,
            req->Data != nullptr);
@@ -23,14 +43,148 @@ z_Error z_KVHandleSet(void *arg, const z_Req *req, z_Resp *resp) {
     return z_ERR_INVALID_DATA;
   }
 
+  // the record is taken as the client sent it, its sizes are checked before
+  // it is framed
+  z_ConstBuffer key = {};
+  z_Error ret = z_kvReqKey(req, &key);
+  if (ret != z_OK) {
+    return ret;
+  }
+
   z_KV *kv = (z_KV *)arg;
-  z_Error ret = z_KVFromRecord(kv, (z_Record *)req->Data);
+  int64_t seq = 0;
+  ret = z_KVFromRecord(kv, (z_Record *)req->Data, &seq);
   if (ret != z_OK) {
     z_debug("z_KVFromRecord %d", ret);
+    return ret;
+  }
+
+  z_KVSetResp *set_resp = z_malloc(sizeof(z_KVSetResp));
+  if (set_resp == nullptr) {
+    z_error("set_resp == nullptr");
+    return z_ERR_NOSPACE;
   }
+  set_resp->Seq = seq;
+  set_resp->DurableSeq = z_KVDurableSeq(kv);
+
+  resp->Data = (void *)set_resp;
+  resp->Header.Size = sizeof(z_KVSetResp);
+  return z_OK;
+}
+
+// the resp of a batch of rs written to kv, with the result of each record
+z_Error z_kvWriteBatchResp(z_KV *kv, z_FileRecord *rs, int64_t rs_len,
+                           z_Resp *resp) {
+  z_Error rets[z_BINLOG_BATCH_LEN];
+  int64_t seq = 0;
+  z_Error ret = z_KVWriteRecords(kv, rs, rs_len, rets, &seq);
+
+  int64_t size = sizeof(z_KVWriteBatchResp) + sizeof(z_Error) * rs_len;
+  z_KVWriteBatchResp *batch_resp = z_malloc(size);
+  if (batch_resp == nullptr) {
+    z_error("batch_resp == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  batch_resp->Seq = seq;
+  batch_resp->DurableSeq = z_KVDurableSeq(kv);
+  batch_resp->Len = rs_len;
+  memcpy(batch_resp + 1, rets, sizeof(z_Error) * rs_len);
+
+  resp->Data = (void *)batch_resp;
+  resp->Header.Size = size;
   return ret;
 }
 
+z_Error z_KVHandleWriteBatch(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  if (req->Header.Type != z_KV_REQ_TYPE_WRITE_BATCH) {
+    z_error("invalid type %u", req->Header.Type);
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_FileRecord rs[z_BINLOG_BATCH_LEN];
+  int64_t rs_len = 0;
+  if (z_KVRecordsSplit(req->Data, req->Header.Size, rs, &rs_len) == false) {
+    z_error("invalid batch size %u", req->Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+  return z_kvWriteBatchResp((z_KV *)arg, rs, rs_len, resp);
+}
+
+// the resp of the values vs of len keys found with rets, the values are freed
+z_Error z_kvMGetResp(z_Buffer *vs, z_Error *rets, int64_t len, z_Resp *resp) {
+  int64_t size = sizeof(z_KVMGetResp) + sizeof(z_Error) * len;
+  for (int64_t i = 0; i < len; ++i) {
+    if (rets[i] == z_OK) {
+      size += sizeof(z_Record) + vs[i].Size;
+    }
+  }
+
+  int8_t *data = z_malloc(size);
+  if (data == nullptr) {
+    z_error("data == nullptr");
+    for (int64_t i = 0; i < len; ++i) {
+      z_BufferDestroy(&vs[i]);
+    }
+    return z_ERR_NOSPACE;
+  }
+  ((z_KVMGetResp *)data)->Len = len;
+  memcpy(data + sizeof(z_KVMGetResp), rets, sizeof(z_Error) * len);
+  int8_t *p = data + sizeof(z_KVMGetResp) + sizeof(z_Error) * len;
+  for (int64_t i = 0; i < len; ++i) {
+    if (rets[i] != z_OK) {
+      continue;
+    }
+    // the unsummed record of the resp of a get, see z_KV_REQ_TYPE_GET
+    z_Record head = {.ValSize = vs[i].Size};
+    memcpy(p, &head, sizeof(head));
+    memcpy(p + sizeof(head), vs[i].Data, vs[i].Size);
+    p += sizeof(head) + vs[i].Size;
+    z_BufferDestroy(&vs[i]);
+  }
+
+  resp->Data = data;
+  resp->Header.Size = size;
+  return z_OK;
+}
+
+z_Error z_KVHandleMGet(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  if (req->Header.Type != z_KV_REQ_TYPE_MGET) {
+    z_error("invalid type %u", req->Header.Type);
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_ConstBuffer ks[z_KV_FIND_BATCH_LEN];
+  int64_t len = 0;
+  if (z_KVKeysSplit(req->Data, req->Header.Size, ks, &len) == false) {
+    z_error("invalid mget size %u", req->Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_Buffer vs[z_KV_FIND_BATCH_LEN];
+  z_Error rets[z_KV_FIND_BATCH_LEN];
+  z_Error ret = z_KVFindBatch((z_KV *)arg, ks, len, vs, rets);
+  if (ret != z_OK) {
+    z_debug("z_KVFindBatch %d", ret);
+  }
+  return z_kvMGetResp(vs, rets, len, resp);
+}
+
+// the head of a get resp, the value is sent straight from View after it
+typedef struct {
+  z_Record Head;
+  z_KVView View;
+} z_KVGetResp;
+
+void z_kvGetRespDone(void *attr) {
+  z_KVViewDestroy(&((z_KVGetResp *)attr)->View);
+}
+
 z_Error z_KVHandleGet(void *arg, const z_Req *req, z_Resp *resp) {
   z_assert(arg != nullptr, req != nullptr, resp != nullptr,
            req->Data != nullptr);
@@ -42,29 +196,33 @@ z_Error z_KVHandleGet(void *arg, const z_Req *req, z_Resp *resp) {
 
   z_KV *kv = (z_KV *)arg;
   z_ConstBuffer key = {};
-  z_Error ret = z_RecordKey((z_Record *)req->Data, &key);
+  z_Error ret = z_kvReqKey(req, &key);
   if (ret != z_OK) {
-    z_error("z_RecordKey failed %d", ret);
     return ret;
   }
 
-  z_unique(z_Buffer) val = {};
-  ret = z_KVFind(kv, key, &val);
-  if (ret != z_OK) {
-    z_debug("z_KVFind failed %d", ret);
-    return ret;
+  z_KVGetResp *get_resp = z_malloc(sizeof(z_KVGetResp));
+  if (get_resp == nullptr) {
+    z_error("get_resp == nullptr");
+    return z_ERR_NOSPACE;
   }
 
-  z_ConstBuffer empty = {};
-  z_ConstBuffer v = {.Data = val.Data, .Size = val.Size};
-  z_Record *record = z_RecordNewByKV(0, empty, v);
-  if (record == nullptr) {
-    z_error("record == nullptr");
-    return z_ERR_NOSPACE;
+  ret = z_KVFindView(kv, key, &get_resp->View);
+  if (ret != z_OK) {
+    z_debug("z_KVFindView failed %d", ret);
+    z_free(get_resp);
+    return ret;
   }
 
-  resp->Data = (void *)record;
-  resp->Header.Size = z_RecordSize(record);
+  // a record of an empty key with the value, unsummed and without flags so
+  // it has no trailer, see z_KV_REQ_TYPE_GET
+  z_ConstBuffer v = get_resp->View.Value;
+  get_resp->Head = (z_Record){.ValSize = v.Size};
+  resp->Data = (int8_t *)get_resp;
+  resp->Header.Size = sizeof(z_Record) + v.Size;
+  resp->Borrowed = v;
+  resp->Done = z_kvGetRespDone;
+  resp->DoneAttr = get_resp;
   return z_OK;
 }
 
@@ -78,71 +236,259 @@ z_Error z_KVHandleBinLogGet(void *arg, const z_Req *req, z_Resp *resp) {
   }
 
   z_KV *kv = (z_KV *)arg;
-  z_unique(z_Reader) rd = {};
-  z_Error ret = z_ReaderInit(&rd, kv->BinLogPath);
-  if (ret != z_OK) {
-    z_error("z_ReaderInit %d", ret);
-    return ret;
-  }
-
   z_BinlogGetReq *binlogGetReq = (z_BinlogGetReq*)(req->Data); 
   int64_t len = binlogGetReq->Len;
   int64_t minSeq = binlogGetReq->MinSeq;
-  while (len > 0) {
+
+  // the records up to the acked one are complete, the sealed segments are
+  // read from their mappings
+  int64_t end = atomic_load(&kv->BinLog.AckedOffset);
+  int64_t first = z_SegmentNext(kv->BinLogPath, -1);
+  int64_t offset =
+      end < 0 || first < 0 ? -1 : z_PReaderFirst(&kv->Reader, first);
+  int64_t phase = z_PReaderPin(&kv->Reader);
+  z_defer(z_PReaderUnPin, &kv->Reader, phase);
+
+  int64_t records_len = 0;
+  z_unique(z_Buffer) buf = {};
+  while (len > 0 && offset >= 0) {
     z_FileRecord fr;
-    ret = z_ReaderGetRecord(&rd, &fr);
+    z_Error ret = z_PReaderGetRecord(&kv->Reader, offset, &fr, &buf);
     if (ret != z_OK) {
-      z_error("z_ReaderGetRecord %d", ret);
-      break;
+      z_error("z_PReaderGetRecord %d", ret);
+      return ret;
     }
 
     if (fr.Seq >= minSeq) {
       --len;
+      ++records_len;
+    }
+    offset = z_PReaderNext(&kv->Reader, offset, fr.Size, end);
+  }
+
+  z_BinlogGetResp *binlog_get_resp = z_malloc(sizeof(z_BinlogGetResp));
+  if (binlog_get_resp == nullptr) {
+    z_error("binlog_get_resp == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  binlog_get_resp->RecordsLen = records_len;
+
+  resp->Data = (void *)binlog_get_resp;
+  resp->Header.Size = sizeof(z_BinlogGetResp);
+  return z_OK;
+}
+
+// the handles of the stripe mode pick the stripe by the key and run the ones of
+// a single kv on it
+z_Error z_KVStripesHandleSet(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  z_ConstBuffer key = {};
+  z_Error ret = z_kvReqKey(req, &key);
+  if (ret != z_OK) {
+    return ret;
+  }
+  return z_KVHandleSet(z_KVStripesGet((z_KVStripes *)arg, key), req, resp);
+}
+
+z_Error z_KVStripesHandleGet(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  z_ConstBuffer key = {};
+  z_Error ret = z_kvReqKey(req, &key);
+  if (ret != z_OK) {
+    return ret;
+  }
+  return z_KVHandleGet(z_KVStripesGet((z_KVStripes *)arg, key), req, resp);
+}
+
+// a batch is atomic in one stripe only, the keys of a batch must be in the same
+// stripe
+z_Error z_KVStripesHandleWriteBatch(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  z_KVStripes *s = (z_KVStripes *)arg;
+  z_FileRecord rs[z_BINLOG_BATCH_LEN];
+  int64_t rs_len = 0;
+  if (z_KVRecordsSplit(req->Data, req->Header.Size, rs, &rs_len) == false) {
+    z_error("invalid batch size %u", req->Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  int64_t stripe = -1;
+  for (int64_t i = 0; i < rs_len; ++i) {
+    z_ConstBuffer key = {};
+    z_RecordKey(rs[i].Record, &key);
+    int64_t si = z_KVStripeOf(s, key);
+    if (stripe >= 0 && si != stripe) {
+      z_debug("batch across stripes %lld %lld", stripe, si);
+      return z_ERR_INVALID_DATA;
     }
+    stripe = si;
   }
+  return z_kvWriteBatchResp(&s->KVs[stripe], rs, rs_len, resp);
+}
 
+z_Error z_KVStripesHandleMGet(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
 
+  z_ConstBuffer ks[z_KV_FIND_BATCH_LEN];
+  int64_t len = 0;
+  if (z_KVKeysSplit(req->Data, req->Header.Size, ks, &len) == false) {
+    z_error("invalid mget size %u", req->Header.Size);
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_Buffer vs[z_KV_FIND_BATCH_LEN];
+  z_Error rets[z_KV_FIND_BATCH_LEN];
+  z_Error ret = z_KVStripesFindBatch((z_KVStripes *)arg, ks, len, vs, rets);
+  if (ret != z_OK) {
+    z_debug("z_KVStripesFindBatch %d", ret);
+  }
+  return z_kvMGetResp(vs, rets, len, resp);
+}
+
+// the records of every stripe from MinSeq of its own seqs
+z_Error z_KVStripesHandleBinLogGet(void *arg, const z_Req *req, z_Resp *resp) {
+  z_assert(arg != nullptr, req != nullptr, resp != nullptr,
+           req->Data != nullptr);
+
+  z_KVStripes *s = (z_KVStripes *)arg;
+  z_BinlogGetReq binlog_get_req = *(z_BinlogGetReq *)req->Data;
+  z_Req stripe_req = {.Header = req->Header,
+                     .Data = (int8_t *)&binlog_get_req};
+  int64_t records_len = 0;
+  for (int64_t i = 0; i < s->Len && binlog_get_req.Len > 0; ++i) {
+    z_unique(z_Resp) stripe_resp = {};
+    z_Error ret = z_KVHandleBinLogGet(&s->KVs[i], &stripe_req, &stripe_resp);
+    if (ret != z_OK) {
+      return ret;
+    }
+    int64_t len = ((z_BinlogGetResp *)stripe_resp.Data)->RecordsLen;
+    records_len += len;
+    binlog_get_req.Len -= len;
+  }
+
+  z_BinlogGetResp *binlog_get_resp = z_malloc(sizeof(z_BinlogGetResp));
+  if (binlog_get_resp == nullptr) {
+    z_error("binlog_get_resp == nullptr");
+    return z_ERR_NOSPACE;
+  }
+  binlog_get_resp->RecordsLen = records_len;
+
+  resp->Data = (void *)binlog_get_resp;
+  resp->Header.Size = sizeof(z_BinlogGetResp);
   return z_OK;
 }
 
 typedef struct {
   z_KV KV;
+  // the stripe mode when Stripes.Len > 0, KV is not used then
+  z_KVStripes Stripes;
   z_Handles HS;
   z_Svr Svr;
 } z_SvrKV;
 
+z_Error z_svrKVInitHandles(z_SvrKV *svr, z_Handle *set, z_Handle *get,
+                           z_Handle *binlog_get, z_Handle *write_batch,
+                           z_Handle *mget) {
+  z_Error ret = z_HandlesInit(&svr->HS);
+  if (ret != z_OK) {
+    z_error("z_HandlesInit %d", ret);
+    return ret;
+  }
+
+  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_SET, set);
+  if (ret != z_OK) {
+    z_error("z_HandlesAdd %d", ret);
+    return ret;
+  }
+  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_GET, get);
+  if (ret != z_OK) {
+    z_error("z_HandlesAdd %d", ret);
+    return ret;
+  }
+  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_BINLOG_GET, binlog_get);
+  if (ret != z_OK) {
+    z_error("z_HandlesAdd %d", ret);
+    return ret;
+  }
+  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_WRITE_BATCH, write_batch);
+  if (ret != z_OK) {
+    z_error("z_HandlesAdd %d", ret);
+    return ret;
+  }
+  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_MGET, mget);
+  if (ret != z_OK) {
+    z_error("z_HandlesAdd %d", ret);
+    return ret;
+  }
+  return z_OK;
+}
+
 z_Error z_SvrKVInit(z_SvrKV *svr, const char *binlog_path,
                     int64_t binlog_max_size, int64_t buckets_len,
-                    const char *ip, int64_t port, int64_t thread_count) {
-  z_Error ret = z_KVInit(&svr->KV, binlog_path, binlog_max_size, buckets_len);
+                    z_BinLogSync sync, const char *ip, int64_t port,
+                    int64_t thread_count, int64_t events_len) {
+  svr->Stripes = (z_KVStripes){};
+  z_Error ret = z_KVInit(&svr->KV, binlog_path, binlog_max_size, buckets_len,
+                         z_MAP_ENGINE_LIST, sync);
   if (ret != z_OK) {
     z_error("z_KVInit %d", ret);
     return ret;
   }
+  z_KVMapSealed(&svr->KV);
 
-  ret = z_HandlesInit(&svr->HS);
+  ret = z_svrKVInitHandles(svr, z_KVHandleSet, z_KVHandleGet,
+                           z_KVHandleBinLogGet, z_KVHandleWriteBatch,
+                           z_KVHandleMGet);
   if (ret != z_OK) {
-    z_error("z_HandlesInit %d", ret);
     return ret;
   }
 
-  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_SET, z_KVHandleSet);
+  ret = z_SvrInit(&svr->Svr, ip, port, thread_count, events_len, &svr->KV,
+                  &svr->HS);
   if (ret != z_OK) {
-    z_error("z_HandlesAdd %d", ret);
+    z_error("z_SvrInit %d", ret);
     return ret;
   }
-  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_GET, z_KVHandleGet);
+
+  return ret;
+}
+
+// the stripe mode, as many stripes as worker threads, see zkv/stripes.h. any
+// worker serves any stripe, a request runs on the stripe of its key on the
+// worker that reads it. the binlog of stripe i is at binlog_path.s<i>,
+// buckets_len is per stripe
+z_Error z_SvrKVInitStripes(z_SvrKV *svr, const char *binlog_path,
+                           int64_t binlog_max_size, int64_t buckets_len,
+                           z_BinLogSync sync, const char *ip, int64_t port,
+                           int64_t thread_count, int64_t events_len) {
+  z_Error ret = z_KVStripesInit(&svr->Stripes, binlog_path, thread_count,
+                                binlog_max_size, buckets_len,
+                                z_MAP_ENGINE_LIST, sync);
   if (ret != z_OK) {
-    z_error("z_HandlesAdd %d", ret);
+    z_error("z_KVStripesInit %d", ret);
     return ret;
   }
-  ret = z_HandlesAdd(&svr->HS, z_KV_REQ_TYPE_BINLOG_GET, z_KVHandleBinLogGet);
+  for (int64_t i = 0; i < svr->Stripes.Len; ++i) {
+    z_KVMapSealed(&svr->Stripes.KVs[i]);
+  }
+
+  ret = z_svrKVInitHandles(svr, z_KVStripesHandleSet, z_KVStripesHandleGet,
+                           z_KVStripesHandleBinLogGet,
+                           z_KVStripesHandleWriteBatch,
+                           z_KVStripesHandleMGet);
   if (ret != z_OK) {
-    z_error("z_HandlesAdd %d", ret);
     return ret;
   }
 
-  ret = z_SvrInit(&svr->Svr, ip, port, thread_count, &svr->KV, &svr->HS);
+  ret = z_SvrInit(&svr->Svr, ip, port, thread_count, events_len,
+                  &svr->Stripes, &svr->HS);
   if (ret != z_OK) {
     z_error("z_SvrInit %d", ret);
     return ret;
@@ -165,6 +511,10 @@ void z_SvrKVStop(z_SvrKV *svr) { z_SvrStop(&svr->Svr); }
 void z_SvrKVDestroy(z_SvrKV *svr) {
   z_SvrDestroy(&svr->Svr);
   z_HandlesDestroy(&svr->HS);
-  z_KVDestroy(&svr->KV);
+  if (svr->Stripes.Len > 0) {
+    z_KVStripesDestroy(&svr->Stripes);
+  } else {
+    z_KVDestroy(&svr->KV);
+  }
 }
 #endif
\ No newline at end of file
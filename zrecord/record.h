@@ -9,6 +9,7 @@
 #include "zutils/hash.h"
 #include "zutils/log.h"
 #include "zutils/mem.h"
+#include "zutils/varint.h"
 
 typedef enum : uint8_t {
   z_ROP_INSERT = 1,
@@ -18,10 +19,59 @@ typedef enum : uint8_t {
   z_ROP_FORCE_UPSERT = 5,
 } z_RecordOP;
 
+// the bits of Flags
+enum : uint8_t {
+  // the next record of the binlog belongs to the same write batch, a batch
+  // ends with a record without it
+  z_RECORD_FLAG_BATCH = 1,
+  // the record format 2, the record ends with the CRC32C of all its bytes
+  // before and Sum is the low byte of the CRC32C of the head alone. without it
+  // Sum is the low byte of the FNV-1a of the whole record, as format 1 wrote
+  z_RECORD_FLAG_CRC32C = 2,
+  // set together with z_RECORD_FLAG_CRC32C, a single bit flip of the flags
+  // can not turn a record of the format 2 into one of the weaker format 1
+  z_RECORD_FLAG_FORMAT_2 = 4,
+  // the flags of the format 2, a record has both or none of them
+  z_RECORD_FLAGS_FORMAT_2 = z_RECORD_FLAG_CRC32C | z_RECORD_FLAG_FORMAT_2,
+};
+
+// the flags of the records of the 8 byte head made by z_RecordNewByKV and
+// z_RecordNewByKVV, 0 writes format 1 for the readers before format 2
+#ifndef z_RECORD_FORMAT_FLAGS
+#define z_RECORD_FORMAT_FLAGS z_RECORD_FLAGS_FORMAT_2
+#endif
+
+// a compact record starts with a byte of z_RECORD_COMPACT, the op and
+// z_RECORD_COMPACT_BATCH for z_RECORD_FLAG_BATCH. Sum follows, the low byte of
+// the CRC32C of the head with Sum 0, then the key size, the value size and for
+// an update the source value size as varints. the key and the values follow
+// and the CRC32C of all the bytes before ends it, as in the format 2. no op of
+// the 8 byte head has the bit of z_RECORD_COMPACT, the accessors read both
+// heads where the record lies
+enum : uint8_t {
+  z_RECORD_COMPACT = 0x80,
+  z_RECORD_COMPACT_BATCH = 0x08,
+  z_RECORD_COMPACT_OP = 0x07,
+};
+
+// z_RecordNewByKV and z_RecordNewByKVV make compact records, 0 makes the 8
+// byte head for the readers before them. a compact record always ends with the
+// CRC32C, so the format 1 keeps the 8 byte head
+#ifndef z_RECORD_NEW_COMPACT
+#define z_RECORD_NEW_COMPACT (z_RECORD_FORMAT_FLAGS != 0)
+#endif
+
+// the most bytes of the head of a record, the 8 byte head and the KVV of an
+// update. a compact head takes at most 13
+#define z_RECORD_HEAD_MAX 16
+// the largest key and value of both heads, as the 8 byte head holds them
+#define z_RECORD_KEY_MAX 0xFFFF
+#define z_RECORD_VAL_MAX 0xFFFFFF
+
 typedef struct {
   uint64_t OP : 8;
   uint64_t Sum : 8;
-  uint64_t Reserved : 8;
+  uint64_t Flags : 8;
   uint64_t KeySize : 16;
   uint64_t ValSize : 24;
 } z_Record;
@@ -29,7 +79,8 @@ typedef struct {
 typedef struct {
   uint64_t OP : 8;
   uint64_t Sum : 8;
-  uint64_t Reserved : 16;
+  uint64_t Flags : 8;
+  uint64_t Reserved : 8;
   uint64_t Size : 32;
 } z_UpdateRecord;
 
@@ -41,8 +92,93 @@ typedef struct {
   uint64_t SrcValSize : 24;
 } z_UpdateRecordKVV;
 
-bool z_IsUpdateRecord(z_Record *r) {
-  if (r->OP == z_ROP_UPDATE) {
+// the sizes of a record of either head, see z_RecordSizesOf
+typedef struct {
+  int64_t HeadSize;
+  int64_t KeySize;
+  int64_t ValSize;
+  int64_t SrcValSize;
+} z_RecordSizes;
+
+bool z_RecordIsCompact(const z_Record *r) {
+  return (*(const uint8_t *)r & z_RECORD_COMPACT) != 0;
+}
+
+uint8_t z_RecordOPOf(const z_Record *r) {
+  if (z_RecordIsCompact(r)) {
+    return *(const uint8_t *)r & z_RECORD_COMPACT_OP;
+  }
+  return r->OP;
+}
+
+// the sum is made again by z_RecordSum
+void z_RecordSetOP(z_Record *r, uint8_t op) {
+  if (z_RecordIsCompact(r)) {
+    uint8_t *p = (uint8_t *)r;
+    *p = (*p & ~z_RECORD_COMPACT_OP) | (op & z_RECORD_COMPACT_OP);
+    return;
+  }
+  r->OP = op;
+}
+
+// whether the next record of the binlog belongs to the batch of r
+bool z_RecordIsBatched(const z_Record *r) {
+  if (z_RecordIsCompact(r)) {
+    return (*(const uint8_t *)r & z_RECORD_COMPACT_BATCH) != 0;
+  }
+  return (r->Flags & z_RECORD_FLAG_BATCH) != 0;
+}
+
+// the sum is made again by z_RecordSum
+void z_RecordSetBatched(z_Record *r, bool is_batched) {
+  if (z_RecordIsCompact(r)) {
+    uint8_t *p = (uint8_t *)r;
+    *p = is_batched ? *p | z_RECORD_COMPACT_BATCH
+                    : *p & ~z_RECORD_COMPACT_BATCH;
+    return;
+  }
+  r->Flags = is_batched ? r->Flags | z_RECORD_FLAG_BATCH
+                        : r->Flags & ~z_RECORD_FLAG_BATCH;
+}
+
+// whether r is of the format 2, see z_RECORD_FLAG_CRC32C. a compact record is
+bool z_RecordHasCrc32c(const z_Record *r) {
+  if (z_RecordIsCompact(r)) {
+    return true;
+  }
+  return (r->Flags & z_RECORD_FLAG_CRC32C) != 0;
+}
+
+// the head of the compact record at p, 0 if size bytes do not hold it or a
+// size is too long
+int64_t z_recordCompactParse(const int8_t *p, int64_t size,
+                             z_RecordSizes *s) {
+  *s = (z_RecordSizes){.HeadSize = 2};
+  int64_t *sizes[] = {&s->KeySize, &s->ValSize, &s->SrcValSize};
+  int64_t maxs[] = {z_RECORD_KEY_MAX, z_RECORD_VAL_MAX, z_RECORD_VAL_MAX};
+  int64_t len = ((uint8_t)p[0] & z_RECORD_COMPACT_OP) == z_ROP_UPDATE ? 3 : 2;
+  for (int64_t i = 0; i < len; ++i) {
+    uint64_t v = 0;
+    int64_t n = size < s->HeadSize
+                    ? 0
+                    : z_VarintGet(p + s->HeadSize, size - s->HeadSize,
+                                  z_VarintSize(maxs[i]), &v);
+    if (n == 0 || v > (uint64_t)maxs[i]) {
+      return 0;
+    }
+    *sizes[i] = (int64_t)v;
+    s->HeadSize += n;
+  }
+  return s->HeadSize;
+}
+
+// the bytes of the CRC32C at the end of r
+int64_t z_recordTrailerSize(z_Record *r) {
+  return z_RecordHasCrc32c(r) ? sizeof(uint32_t) : 0;
+}
+
+bool z_IsUpdateRecord(const z_Record *r) {
+  if (z_RecordOPOf(r) == z_ROP_UPDATE) {
     return true;
   }
 
@@ -51,7 +187,8 @@ bool z_IsUpdateRecord(z_Record *r) {
 
 int64_t z_UpdateRecordSize(z_UpdateRecord *r) {
   z_assert(r != nullptr);
-  return ((z_UpdateRecord *)r)->Size + sizeof(z_UpdateRecord);
+  return ((z_UpdateRecord *)r)->Size + sizeof(z_UpdateRecord) +
+         z_recordTrailerSize((z_Record *)r);
 }
 
 z_Error z_UpdateRecordKey(z_UpdateRecord *r, z_ConstBuffer *key) {
@@ -85,17 +222,72 @@ z_Error z_UpdateRecordSrcValue(z_UpdateRecord *r, z_ConstBuffer *value) {
   return z_OK;
 }
 
+// the sizes of r, whose head is whole, see z_RecordHeadSize
+z_RecordSizes z_RecordSizesOf(z_Record *r) {
+  z_assert(r != nullptr);
+
+  z_RecordSizes s = {};
+  if (z_RecordIsCompact(r)) {
+    int64_t n = z_recordCompactParse((int8_t *)r, z_RECORD_HEAD_MAX, &s);
+    z_assert(n != 0);
+    return s;
+  }
+  if (z_IsUpdateRecord(r)) {
+    z_UpdateRecordKVV *kvv = (z_UpdateRecordKVV *)(r + 1);
+    return (z_RecordSizes){
+        .HeadSize = sizeof(z_Record) + sizeof(z_UpdateRecordKVV),
+        .KeySize = kvv->KeySize,
+        .ValSize = kvv->ValSize,
+        .SrcValSize = kvv->SrcValSize};
+  }
+  return (z_RecordSizes){.HeadSize = sizeof(z_Record),
+                         .KeySize = r->KeySize,
+                         .ValSize = r->ValSize};
+}
+
+// the bytes of the head of the record at data, 0 if size bytes do not hold it
+// or it is broken. the accessors read a record whose head is whole
+int64_t z_RecordHeadSize(const int8_t *data, int64_t size) {
+  if (size < 1) {
+    return 0;
+  }
+  if (z_RecordIsCompact((const z_Record *)data)) {
+    z_RecordSizes s;
+    return z_recordCompactParse(data, size, &s);
+  }
+
+  if (size < (int64_t)sizeof(z_Record)) {
+    return 0;
+  }
+  int64_t n = z_IsUpdateRecord((const z_Record *)data)
+                  ? sizeof(z_Record) + sizeof(z_UpdateRecordKVV)
+                  : sizeof(z_Record);
+  return size < n ? 0 : n;
+}
+
 int64_t z_RecordSize(z_Record *r) {
   z_assert(r != nullptr);
 
+  if (z_RecordIsCompact(r)) {
+    z_RecordSizes s = z_RecordSizesOf(r);
+    return s.HeadSize + s.KeySize + s.ValSize + s.SrcValSize +
+           sizeof(uint32_t);
+  }
   if (z_IsUpdateRecord(r) == true) {
     return z_UpdateRecordSize((z_UpdateRecord *)r);
   }
-  return r->KeySize + r->ValSize + sizeof(z_Record);
+  return r->KeySize + r->ValSize + sizeof(z_Record) + z_recordTrailerSize(r);
 }
 
 z_Error z_RecordKey(z_Record *r, z_ConstBuffer *key) {
   z_assert(r != nullptr, key != nullptr);
+  if (z_RecordIsCompact(r)) {
+    z_RecordSizes s = z_RecordSizesOf(r);
+    z_assert(s.KeySize != 0);
+    key->Data = (int8_t *)r + s.HeadSize;
+    key->Size = s.KeySize;
+    return z_OK;
+  }
   if (z_IsUpdateRecord(r)) {
     return z_UpdateRecordKey((z_UpdateRecord *)r, key);
   }
@@ -109,6 +301,12 @@ z_Error z_RecordKey(z_Record *r, z_ConstBuffer *key) {
 
 z_Error z_RecordValue(z_Record *r, z_ConstBuffer *val) {
   z_assert(r != nullptr, val != nullptr);
+  if (z_RecordIsCompact(r)) {
+    z_RecordSizes s = z_RecordSizesOf(r);
+    val->Data = (int8_t *)r + s.HeadSize + s.KeySize;
+    val->Size = s.ValSize;
+    return z_OK;
+  }
   if (z_IsUpdateRecord(r)) {
     return z_UpdateRecordValue((z_UpdateRecord *)r, val);
   }
@@ -119,28 +317,125 @@ z_Error z_RecordValue(z_Record *r, z_ConstBuffer *val) {
 }
 
 z_Error z_RecordSrcValue(z_Record *r, z_ConstBuffer *src_val) {
-  z_assert(r != nullptr, r->OP == z_ROP_UPDATE);
+  z_assert(r != nullptr, z_RecordOPOf(r) == z_ROP_UPDATE);
+  if (z_RecordIsCompact(r)) {
+    z_RecordSizes s = z_RecordSizesOf(r);
+    src_val->Data = (int8_t *)r + s.HeadSize + s.KeySize + s.ValSize;
+    src_val->Size = s.SrcValSize;
+    return z_OK;
+  }
   return z_UpdateRecordSrcValue((z_UpdateRecord *)r, src_val);
 }
 
+// the Sum of a head of the format 2 or of a compact head
+uint8_t z_recordHeadSum(z_Record *r) {
+  if (z_RecordIsCompact(r)) {
+    int8_t head[z_RECORD_HEAD_MAX];
+    int64_t size = z_RecordSizesOf(r).HeadSize;
+    memcpy(head, r, size);
+    head[1] = 0;
+    return z_Crc32c(0, head, size) & 0xFF;
+  }
+
+  z_Record head = *r;
+  head.Sum = 0;
+  return z_Crc32c(0, (int8_t *)&head, sizeof(head)) & 0xFF;
+}
+
+// checks the head alone before its size is trusted, only the flags of the
+// format for the format 1 whose Sum covers the whole record
+z_Error z_RecordCheckHead(z_Record *r) {
+  z_assert(r != nullptr);
+
+  if (z_RecordIsCompact(r)) {
+    z_RecordSizes s;
+    if (z_recordCompactParse((int8_t *)r, z_RECORD_HEAD_MAX, &s) != 0 &&
+        z_recordHeadSum(r) == ((uint8_t *)r)[1]) {
+      return z_OK;
+    }
+    return z_ERR_INVALID_DATA;
+  }
+
+  uint8_t format = r->Flags & z_RECORD_FLAGS_FORMAT_2;
+  if (format == 0 ||
+      format == z_RECORD_FLAGS_FORMAT_2 && z_recordHeadSum(r) == r->Sum) {
+    return z_OK;
+  }
+
+  return z_ERR_INVALID_DATA;
+}
+
+// the Size of an update record is that of its KVV and the sizes in it, the
+// binlog frames it by Size and the readers take the key and the values by the
+// sizes. a compact head has the sizes alone
+z_Error z_RecordCheckSize(z_Record *r) {
+  z_assert(r != nullptr);
+
+  if (z_RecordIsCompact(r) || z_IsUpdateRecord(r) == false) {
+    return z_OK;
+  }
+
+  z_UpdateRecord *ur = (z_UpdateRecord *)r;
+  if (ur->Size < sizeof(z_UpdateRecordKVV)) {
+    return z_ERR_INVALID_DATA;
+  }
+  z_UpdateRecordKVV *kvv = (z_UpdateRecordKVV *)(ur + 1);
+  if (ur->Size != sizeof(z_UpdateRecordKVV) + kvv->KeySize + kvv->ValSize +
+                      kvv->SrcValSize) {
+    return z_ERR_INVALID_DATA;
+  }
+  return z_OK;
+}
+
+// r is not written, it may be mapped read only
 z_Error z_RecordCheck(z_Record *r) {
   z_assert(r != nullptr);
 
-  uint8_t sum = r->Sum;
-  r->Sum = 0;
-  uint8_t s = z_Checksum((int8_t *)r, z_RecordSize(r));
-  r->Sum = sum;
+  // the head is checked first, a broken size would read past r
+  if (z_RecordCheckHead(r) != z_OK || z_RecordCheckSize(r) != z_OK) {
+    return z_ERR_INVALID_DATA;
+  }
 
-  if (s == sum) {
+  int64_t size = z_RecordSize(r);
+  if (z_RecordHasCrc32c(r)) {
+    uint32_t crc;
+    memcpy(&crc, (int8_t *)r + size - sizeof(crc), sizeof(crc));
+    if (z_Crc32c(0, (int8_t *)r, size - sizeof(crc)) == crc) {
+      return z_OK;
+    }
+    return z_ERR_INVALID_DATA;
+  }
+
+  z_Record head = *r;
+  head.Sum = 0;
+  uint64_t hash = z_Hash((int8_t *)&head, sizeof(head));
+  hash = z_HashMore(hash, (int8_t *)(r + 1), size - sizeof(head));
+  uint8_t s = hash & 0xFF;
+
+  if (s == r->Sum) {
     return z_OK;
   }
 
   return z_ERR_INVALID_DATA;
 }
 
+// sums r in its own format, see z_RECORD_FLAG_CRC32C
 void z_RecordSum(z_Record *r) {
   z_assert(r != nullptr);
 
+  if (z_RecordHasCrc32c(r)) {
+    uint8_t sum = z_recordHeadSum(r);
+    if (z_RecordIsCompact(r)) {
+      ((uint8_t *)r)[1] = sum;
+    } else {
+      r->Sum = sum;
+    }
+    int64_t size = z_RecordSize(r) - sizeof(uint32_t);
+    uint32_t crc = z_Crc32c(0, (int8_t *)r, size);
+    memcpy((int8_t *)r + size, &crc, sizeof(crc));
+    return;
+  }
+
   r->Sum = 0;
   uint8_t s = z_Checksum((int8_t *)r, z_RecordSize(r));
   r->Sum = s;
@@ -148,6 +443,82 @@ void z_RecordSum(z_Record *r) {
   return;
 }
 
+// the format of z_RecordNewByKV and z_RecordNewByKVV, see z_RecordPut
+#define z_RECORD_NEW_FORMAT                                                    \
+  (z_RECORD_NEW_COMPACT ? z_RECORD_COMPACT : z_RECORD_FORMAT_FLAGS)
+
+// the bytes of the record of op and the sizes in format, z_RECORD_COMPACT or
+// the flags of the 8 byte head. 0 if they do not fit the head
+int64_t z_RecordPutSize(uint8_t format, uint8_t op, int64_t key_size,
+                        int64_t val_size, int64_t src_val_size) {
+  z_assert(op == z_ROP_UPDATE || src_val_size == 0);
+  if (key_size > z_RECORD_KEY_MAX || val_size > z_RECORD_VAL_MAX ||
+      src_val_size > z_RECORD_VAL_MAX) {
+    return 0;
+  }
+
+  int64_t size = key_size + val_size + src_val_size;
+  if (format == z_RECORD_COMPACT) {
+    if (op > z_RECORD_COMPACT_OP) {
+      return 0;
+    }
+    size += 2 + z_VarintSize(key_size) + z_VarintSize(val_size) +
+            sizeof(uint32_t);
+    return op == z_ROP_UPDATE ? size + z_VarintSize(src_val_size) : size;
+  }
+
+  size += sizeof(z_Record);
+  if (op == z_ROP_UPDATE) {
+    size += sizeof(z_UpdateRecordKVV);
+  }
+  return (format & z_RECORD_FLAG_CRC32C) != 0 ? size + sizeof(uint32_t)
+                                              : size;
+}
+
+// writes the record of op in format to p of z_RecordPutSize bytes, src_val is
+// of an update alone. the sum is made by z_RecordSum
+void z_RecordPut(int8_t *p, uint8_t format, uint8_t op, z_ConstBuffer key,
+                 z_ConstBuffer val, z_ConstBuffer src_val) {
+  if (format == z_RECORD_COMPACT) {
+    p[0] = (int8_t)(z_RECORD_COMPACT | op);
+    p[1] = 0;
+    int64_t n = 2;
+    n += z_VarintPut(p + n, key.Size);
+    n += z_VarintPut(p + n, val.Size);
+    if (op == z_ROP_UPDATE) {
+      n += z_VarintPut(p + n, src_val.Size);
+    }
+    p += n;
+  } else if (op == z_ROP_UPDATE) {
+    z_UpdateRecord head = {.OP = op,
+                           .Flags = format,
+                           .Size = key.Size + val.Size + src_val.Size +
+                                   sizeof(z_UpdateRecordKVV)};
+    z_UpdateRecordKVV kvv = {
+        .KeySize = key.Size, .ValSize = val.Size, .SrcValSize = src_val.Size};
+    memcpy(p, &head, sizeof(head));
+    memcpy(p + sizeof(head), &kvv, sizeof(kvv));
+    p += sizeof(head) + sizeof(kvv);
+  } else {
+    z_Record head = {
+        .OP = op, .Flags = format, .KeySize = key.Size, .ValSize = val.Size};
+    memcpy(p, &head, sizeof(head));
+    p += sizeof(head);
+  }
+
+  if (key.Size > 0) {
+    memcpy(p, key.Data, key.Size);
+    p += key.Size;
+  }
+  if (val.Size > 0) {
+    memcpy(p, val.Data, val.Size);
+    p += val.Size;
+  }
+  if (src_val.Size > 0) {
+    memcpy(p, src_val.Data, src_val.Size);
+  }
+}
+
 z_Record *z_RecordNewBySize(int64_t size) {
   if (size < sizeof(z_Record)) {
     z_error("size %lld record_size %zu", size, sizeof(z_Record));
@@ -161,24 +532,27 @@ z_Record *z_RecordNewBySize(int64_t size) {
   return r;
 }
 
-z_Record *z_RecordNewByKV(uint8_t op, z_ConstBuffer key, z_ConstBuffer val) {
-  z_Record record = {.OP = op, .KeySize = key.Size, .ValSize = val.Size};
-  int64_t size = z_RecordSize(&record);
-  z_Record *ret_record = z_RecordNewBySize(size);
-  if (ret_record == nullptr) {
-    z_error("ret_record == nullptr");
+// a record of op in format, see z_RecordPut
+z_Record *z_RecordNew(uint8_t format, uint8_t op, z_ConstBuffer key,
+                      z_ConstBuffer val, z_ConstBuffer src_val) {
+  int64_t size = z_RecordPutSize(format, op, key.Size, val.Size, src_val.Size);
+  if (size == 0) {
+    z_error("op %u key %lld val %lld src_val %lld", op, key.Size, val.Size,
+            src_val.Size);
     return nullptr;
   }
 
-  *ret_record = record;
-  if (key.Size > 0) {
-    memcpy(ret_record + 1, key.Data, key.Size);
-  }
-  if (val.Size > 0) {
-    memcpy((int8_t *)(ret_record + 1) + key.Size, val.Data, val.Size);
+  z_Record *r = z_RecordNewBySize(size);
+  if (r == nullptr) {
+    z_error("r == nullptr");
+    return nullptr;
   }
+  z_RecordPut((int8_t *)r, format, op, key, val, src_val);
+  return r;
+}
 
-  return ret_record;
+z_Record *z_RecordNewByKV(uint8_t op, z_ConstBuffer key, z_ConstBuffer val) {
+  return z_RecordNew(z_RECORD_NEW_FORMAT, op, key, val, (z_ConstBuffer){});
 }
 
 z_Record *z_RecordNewByKVV(uint8_t op, z_ConstBuffer key, z_ConstBuffer val,
@@ -187,37 +561,7 @@ z_Record *z_RecordNewByKVV(uint8_t op, z_ConstBuffer key, z_ConstBuffer val,
     z_error("op != z_ROP_UPDATE");
     return nullptr;
   }
-  z_UpdateRecord record = {.OP = op,
-                           .Size = key.Size + val.Size + src_val.Size +
-                                   sizeof(z_UpdateRecordKVV)};
-  int64_t size = z_RecordSize((z_Record *)&record);
-  z_UpdateRecord *ret_record = (z_UpdateRecord *)z_RecordNewBySize(size);
-  if (ret_record == nullptr) {
-    z_error("ret_record == nullptr");
-    return nullptr;
-  }
-  z_UpdateRecordKVV *kvv = (z_UpdateRecordKVV *)ret_record + 1;
-  kvv->KeySize = key.Size;
-  kvv->ValSize = val.Size;
-  kvv->SrcValSize = src_val.Size;
-
-  *ret_record = record;
-  if (key.Size > 0) {
-    memcpy((int8_t *)ret_record + sizeof(z_Record) + sizeof(z_UpdateRecordKVV),
-           key.Data, key.Size);
-  }
-  if (val.Size > 0) {
-    memcpy((int8_t *)ret_record + sizeof(z_Record) + sizeof(z_UpdateRecordKVV) +
-               kvv->KeySize,
-           val.Data, val.Size);
-  }
-  if (src_val.Size > 0) {
-    memcpy((int8_t *)ret_record + sizeof(z_Record) + sizeof(z_UpdateRecordKVV) +
-               kvv->KeySize + kvv->ValSize,
-           src_val.Data, src_val.Size);
-  }
-
-  return (z_Record *)ret_record;
+  return z_RecordNew(z_RECORD_NEW_FORMAT, op, key, val, src_val);
 }
 
 void z_RecordFree(z_Record *r) {
@@ -237,8 +581,8 @@ void z_RecordDebugString(z_Record *r) {
 
   z_BufferStr(k, ks);
   z_BufferStr(v, vs);
-  z_debug("OP %u Sum %u KeySize %u ValSize %u key %s val %s", r->OP, r->Sum,
-          r->KeySize, r->ValSize, ks, vs);
+  z_debug("OP %u KeySize %lld ValSize %lld key %s val %s", z_RecordOPOf(r),
+          k.Size, v.Size, ks, vs);
 }
 
 #define z_RecordTo(type, fd, record)                                           \
@@ -256,17 +600,32 @@ void z_RecordDebugString(z_Record *r) {
     z_Error ret = z_OK;                                                        \
     z_Record *ret_record = nullptr;                                            \
     do {                                                                       \
-      z_Record head;                                                           \
-      z_Error ret = z_cat(type, Read)(fd, (int8_t *)&head, sizeof(z_Record));  \
+      z_Record heads[z_RECORD_HEAD_MAX / sizeof(z_Record)];                    \
+      int8_t *head = (int8_t *)heads;                                          \
+      int64_t head_size = sizeof(z_Record);                                    \
+      z_Error ret = z_cat(type, Read)(fd, head, head_size);                    \
+      /* a record is 8 bytes or more, the rest of a compact head is read a */  \
+      /* byte at a time */                                                     \
+      while (ret == z_OK && z_RecordIsCompact((z_Record *)head) &&             \
+             z_RecordHeadSize(head, head_size) == 0 &&                         \
+             head_size < z_RECORD_HEAD_MAX) {                                  \
+        ret = z_cat(type, Read)(fd, head + head_size, 1);                      \
+        ++head_size;                                                           \
+      }                                                                        \
       if (ret != z_OK) {                                                       \
         z_error(#type "Read");                                                 \
         break;                                                                 \
       }                                                                        \
-      int64_t size = z_RecordSize(&head);                                      \
+      ret = z_RecordCheckHead((z_Record *)head);                               \
+      if (ret != z_OK) {                                                       \
+        z_error("z_RecordCheckHead");                                          \
+        break;                                                                 \
+      }                                                                        \
+      int64_t size = z_RecordSize((z_Record *)head);                           \
       ret_record = z_RecordNewBySize(size);                                    \
-      *ret_record = head;                                                      \
-      ret = z_cat(type, Read)(fd, (int8_t *)ret_record + sizeof(z_Record),     \
-                              size - sizeof(z_Record));                        \
+      memcpy(ret_record, head, head_size);                                     \
+      ret = z_cat(type, Read)(fd, (int8_t *)ret_record + head_size,            \
+                              size - head_size);                               \
       if (ret != z_OK) {                                                       \
         z_error(#type "Read");                                                 \
         break;                                                                 \
@@ -1,14 +1,21 @@
 #include "ztest/test.h"
 
 #include "zepoch/epoch_test.h"
+#include "zkv/kv_batch_test.h"
+#include "zkv/kv_cache_test.h"
+#include "zkv/kv_checkpoint_test.h"
 #include "zkv/kv_cocurrent_test.h"
+#include "zkv/kv_compact_test.h"
+#include "zkv/kv_hlog_test.h"
 #include "zkv/kv_restore_test.h"
 #include "zkv/kv_seq_test.h"
+#include "zkv/kv_stripes_test.h"
 #include "zkv/kv_test.h"
 #include "zutils/defer.h"
 #include "zutils/lock_test.h"
 #include "zutils/time_test.h"
 #include "zutils/defer_test.h"
+#include "zutils/hash_test.h"
 #include "zutils/macro_test.h"
 #include "znet/kv_svr_cli_test.h"
 #include "zutils/local_test.h"
@@ -23,13 +30,25 @@ int main() {
   z_MacroTest();
   z_DeferTest();
   z_TimeTest();
+  z_HashTest();
   z_LockTest();
   z_KVTest();
   z_KVCocurrentTest();
   z_KVRestoreTest();
   z_KVSeqTestCheck();
+  z_KVRolloverTest();
+  z_KVParallelRecoverTest();
+  z_KVRecordFormatTest();
+  z_KVFrameTest();
+  z_KVCompactTest();
+  z_KVCheckpointTest();
+  z_KVCacheTest();
+  z_KVHLogTest();
   z_EpochTest();
+  z_KVStripesTest();
+  z_KVBatchTest();
   z_KVSvrCliTest();
+  z_KVSvrCliStripesTest();
 
   z_TEST_END();
 }
\ No newline at end of file
@@ -55,6 +55,23 @@ z_Error z_BufferInitByConstBuffer(z_Buffer *b, const z_ConstBuffer *cb) {
   return z_BufferInit(b, cb->Data, cb->Size);
 }
 
+// grows b to hold size bytes, the content is kept
+z_Error z_BufferReserve(z_Buffer *b, int64_t size) {
+  z_assert(b != nullptr);
+  if (b->Data != nullptr && b->Size >= size) {
+    return z_OK;
+  }
+
+  void *data = z_realloc(b->Data, size);
+  if (data == nullptr) {
+    z_error("z_realloc failed %lld", size);
+    return z_ERR_NOSPACE;
+  }
+  b->Data = data;
+  b->Size = size;
+  return z_OK;
+}
+
 void z_BufferDestroy(z_Buffer *b) {
   z_assert(b != nullptr);
   if (b->Data != nullptr) {
@@ -1,4 +1,8 @@
 #ifndef z_CHANNEL_H
 #define z_CHANNEL_H
+#if defined(__linux__)
+#include "zutils/channel_linux.h" // IWYU pragma: export
+#else
 #include "zutils/channel_macos.h" // IWYU pragma: export
-#endif
\ No newline at end of file
+#endif
+#endif
@@ -9,7 +9,10 @@
 #include "zutils/log.h"
 #include "zutils/mem.h"
 
+// default events batch size of one z_ChannelWait
+#ifndef z_EVENT_LEN
 #define z_EVENT_LEN 16
+#endif
 typedef struct {
   int64_t FD;
   int64_t Flag;
@@ -19,6 +22,10 @@ bool z_EventIsEnd(z_Event *e);
 #define z_INVALID_CHANNEL -1
 typedef struct {
   int64_t CH;
+  // native events reused by every z_ChannelWait, a channel is waited by one
+  // thread
+  void *Events;
+  int64_t EventsLen;
 } z_Channel;
 z_Error z_ChannelInit(z_Channel *ch);
 z_Error z_ChannelSubscribe(z_Channel *ch, int64_t fd);
@@ -26,6 +33,34 @@ void z_ChannelUnsubscribe(z_Channel *ch, int64_t fd);
 z_Error z_ChannelWait(z_Channel *ch, z_Event *events, int64_t events_len, int64_t *events_count, int64_t timeout_ms);
 void z_ChannelDestroy(z_Channel *ch);
 
+z_Error z_ChannelEventsReserve(z_Channel *ch, int64_t event_size,
+                               int64_t events_len) {
+  z_assert(ch != nullptr, event_size > 0, events_len > 0);
+
+  if (ch->Events != nullptr && ch->EventsLen >= events_len) {
+    return z_OK;
+  }
+
+  void *events = z_malloc(event_size * events_len);
+  if (events == nullptr) {
+    z_error("events == nullptr");
+    return z_ERR_NOSPACE;
+  }
+
+  z_free(ch->Events);
+  ch->Events = events;
+  ch->EventsLen = events_len;
+  return z_OK;
+}
+
+void z_ChannelEventsDestroy(z_Channel *ch) {
+  z_assert(ch != nullptr);
+
+  // z_free nulls Events, a second destroy frees nothing
+  z_free(ch->Events);
+  ch->EventsLen = 0;
+}
+
 z_Error z_ChannelSubscribeSocket(z_Channel *ch, const z_Socket *s) {
   return z_ChannelSubscribe(ch, s->FD);
 }
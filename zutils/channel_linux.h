@@ -0,0 +1,97 @@
+#ifndef z_CHANNEL_LINUX_H
+#define z_CHANNEL_LINUX_H
+#include <errno.h>
+#include <stdint.h>
+
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#include "zerror/error.h"
+#include "zutils/assert.h"
+#include "zutils/channel_interface.h"
+#include "zutils/log.h"
+#include "zutils/mem.h"
+
+bool z_EventIsEnd(z_Event *e) {
+  return e->Flag & (EPOLLRDHUP | EPOLLHUP | EPOLLERR);
+}
+
+z_Error z_ChannelInit(z_Channel *ch) {
+  z_assert(ch != nullptr);
+
+  ch->Events = nullptr;
+  ch->EventsLen = 0;
+  ch->CH = epoll_create1(EPOLL_CLOEXEC);
+  if (ch->CH < 0) {
+    z_error("epoll_create1 failed %lld", ch->CH);
+    return z_ERR_NET;
+  }
+  return z_OK;
+}
+
+// edge-triggered, the caller must drain fd until it would block
+z_Error z_ChannelSubscribe(z_Channel *ch, int64_t fd) {
+  z_assert(ch != nullptr);
+
+  struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                           .data.fd = fd};
+  if (epoll_ctl(ch->CH, EPOLL_CTL_ADD, fd, &ev) < 0) {
+    z_error("registering client socket for read events failed");
+    return z_ERR_NET;
+  }
+  return z_OK;
+}
+
+void z_ChannelUnsubscribe(z_Channel *ch, int64_t fd) {
+  z_assert(ch != nullptr);
+
+  struct epoll_event ev = {};
+  if (epoll_ctl(ch->CH, EPOLL_CTL_DEL, fd, &ev) < 0) {
+    z_error("delete client socket for read events failed");
+    return;
+  }
+  return;
+}
+
+z_Error z_ChannelWait(z_Channel *ch, z_Event *events, int64_t events_len,
+                      int64_t *events_count, int64_t timeout_ms) {
+  z_assert(ch != nullptr, events != nullptr, events_len > 0);
+
+  z_Error ret = z_ChannelEventsReserve(ch, sizeof(struct epoll_event), events_len);
+  if (ret != z_OK) {
+    return ret;
+  }
+
+  struct epoll_event *es = ch->Events;
+  *events_count = epoll_wait(ch->CH, es, events_len, timeout_ms);
+  if (*events_count < 0) {
+    if (errno == EINTR) {
+      return z_ERR_TIMEOUT;
+    }
+    z_error("epoll_wait failed");
+    return z_ERR_NET;
+  }
+
+  if (*events_count == 0) {
+    z_debug("timeout");
+    return z_ERR_TIMEOUT;
+  }
+
+  for (int64_t i = 0; i < *events_count; ++i) {
+    events[i].FD = es[i].data.fd;
+    events[i].Flag = es[i].events;
+  }
+
+  return z_OK;
+}
+
+void z_ChannelDestroy(z_Channel *ch) {
+  z_assert(ch != nullptr);
+
+  if (ch != nullptr && ch->CH != z_INVALID_CHANNEL) {
+    close(ch->CH);
+    ch->CH = z_INVALID_CHANNEL;
+  }
+  z_ChannelEventsDestroy(ch);
+}
+#endif
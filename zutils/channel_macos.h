@@ -10,13 +10,14 @@
 #include "zutils/channel_interface.h"
 #include "zutils/log.h"
 #include "zutils/mem.h"
-#include "zutils/defer.h"
 
 bool z_EventIsEnd(z_Event *e) { return e->Flag & EV_EOF; }
 
 z_Error z_ChannelInit(z_Channel *ch) {
   z_assert(ch != nullptr);
 
+  ch->Events = nullptr;
+  ch->EventsLen = 0;
   ch->CH = kqueue();
   if (ch->CH < 0) {
     z_error("kqueue failed %lld", ch->CH);
@@ -53,17 +54,12 @@ z_Error z_ChannelWait(z_Channel *ch, z_Event *events, int64_t events_len, int64_
                       int64_t timeout_ms) {
   z_assert(ch != nullptr);
 
-  struct kevent *es = z_malloc(sizeof(struct kevent) * events_len);
-  z_defer(
-      ^(struct kevent **ptr) {
-        z_free(*ptr);
-      },
-      &es);
-  if (es == nullptr) {
-    z_error("es == nullptr");
-    return z_ERR_NOSPACE;
+  z_Error ret = z_ChannelEventsReserve(ch, sizeof(struct kevent), events_len);
+  if (ret != z_OK) {
+    return ret;
   }
 
+  struct kevent *es = ch->Events;
   struct timespec ts = {.tv_sec = timeout_ms / 1000,
                         .tv_nsec = (timeout_ms % 1000) * 1000000};
   *events_count = kevent(ch->CH, NULL, 0, es, events_len, &ts);
@@ -92,5 +88,6 @@ void z_ChannelDestroy(z_Channel *ch) {
     close(ch->CH);
     ch->CH = z_INVALID_CHANNEL;
   }
+  z_ChannelEventsDestroy(ch);
 }
 #endif
\ No newline at end of file
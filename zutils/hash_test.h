@@ -0,0 +1,78 @@
+#include <string.h>
+
+#include "ztest/test.h"
+#include "zutils/hash.h"
+
+// every prefix of data hashes apart, each size takes its own path
+bool z_HashTestPrefixes(const int8_t *data, int64_t size) {
+  uint64_t hashes[size + 1];
+  for (int64_t i = 0; i <= size; ++i) {
+    hashes[i] = z_WyHash(data, i, 0);
+    for (int64_t j = 0; j < i; ++j) {
+      if (hashes[j] == hashes[i]) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+// the crc32 instructions agree with the table for every size and alignment,
+// and a crc goes on across two calls. the instructions are only run where the
+// cpu has them
+bool z_HashTestCrc32c(const int8_t *data, int64_t size) {
+  bool is_hard = z_crc32cIsHard();
+  for (int64_t start = 0; start < 8; ++start) {
+    for (int64_t i = start; i <= size; ++i) {
+      uint32_t crc = z_Crc32c(0, data + start, i - start);
+      if (~z_crc32cSoft(~0U, data + start, i - start) != crc ||
+          is_hard && ~z_crc32cHard(~0U, data + start, i - start) != crc) {
+        return false;
+      }
+      int64_t half = (i - start) / 2;
+      if (z_Crc32c(z_Crc32c(0, data + start, half), data + start + half,
+                   i - start - half) != crc) {
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+void z_HashTest() {
+  // the FNV-1a of the data written before stays the same
+  z_ASSERT_TRUE(z_Hash((const int8_t *)"a", 1) == 0xaf63dc4c8601ec8cULL);
+  z_ASSERT_TRUE(z_HashOf(z_HASH_FNV, (const int8_t *)"a", 1) ==
+                z_Hash((const int8_t *)"a", 1));
+
+  int8_t data[256 + 1];
+  for (int64_t i = 0; i < (int64_t)sizeof(data); ++i) {
+    data[i] = (int8_t)(i * 131 + 7);
+  }
+  z_ASSERT_TRUE(z_HashTestPrefixes(data, 256));
+
+  // the reads do not depend on the alignment, nor on the bytes after size
+  int8_t copy[256 + 8];
+  memcpy(copy + 1, data, 256);
+  copy[257] = ~data[256];
+  z_ASSERT_TRUE(z_WyHash(copy + 1, 256, 0) == z_WyHash(data, 256, 0) &&
+                z_WyHash(copy + 1, 33, 0) == z_WyHash(data, 33, 0) &&
+                z_WyHash(copy + 1, 7, 0) == z_WyHash(data, 7, 0));
+
+  // a bit flip anywhere changes the hash, the seed too
+  bool is_changed = true;
+  for (int64_t i = 0; i < 100; ++i) {
+    uint64_t h = z_WyHash(data, 100, 0);
+    data[i] ^= 1;
+    is_changed = is_changed && z_WyHash(data, 100, 0) != h;
+    data[i] ^= 1;
+  }
+  z_ASSERT_TRUE(is_changed);
+  z_ASSERT_TRUE(z_WyHash(data, 100, 0) != z_WyHash(data, 100, 1));
+  z_ASSERT_TRUE(z_FingerprintOf(z_HASH_WY, data, 100) !=
+                (uint32_t)z_HashOf(z_HASH_WY, data, 100));
+
+  // the check value of CRC32C
+  z_ASSERT_TRUE(z_Crc32c(0, (const int8_t *)"123456789", 9) == 0xe3069283);
+  z_ASSERT_TRUE(z_HashTestCrc32c(data, 200));
+}
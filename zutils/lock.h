@@ -2,6 +2,7 @@
 #define z_LOCK_H
 
 #include <stdatomic.h>
+#include <stdint.h>
 
 typedef struct {
   atomic_flag Lock;
@@ -22,4 +23,27 @@ bool z_LockTryLock(z_Lock *l) {
   return atomic_flag_test_and_set(&l->Lock) == false;
 }
 
+// writers are serialized by another lock, readers never block
+// Seq is odd while a write is in progress
+typedef struct {
+  atomic_uint_fast64_t Seq;
+} z_SeqLock;
+
+void z_SeqLockInit(z_SeqLock *l) { atomic_store(&l->Seq, 0); }
+
+void z_SeqLockWriteBegin(z_SeqLock *l) {
+  atomic_fetch_add(&l->Seq, 1);
+  atomic_thread_fence(memory_order_release);
+}
+
+void z_SeqLockWriteEnd(z_SeqLock *l) { atomic_fetch_add(&l->Seq, 1); }
+
+uint64_t z_SeqLockReadBegin(z_SeqLock *l) { return atomic_load(&l->Seq); }
+
+// true when the reads since z_SeqLockReadBegin may be torn
+bool z_SeqLockReadRetry(z_SeqLock *l, uint64_t seq) {
+  atomic_thread_fence(memory_order_acquire);
+  return (seq & 1) != 0 || atomic_load(&l->Seq) != seq;
+}
+
 #endif
\ No newline at end of file
@@ -48,4 +48,15 @@ void z_LockTest() {
   z_LockUnLock(&z_lock);
 
   z_LockDestroy(&z_lock);
-}
\ No newline at end of file
+
+  z_SeqLock sl;
+  z_SeqLockInit(&sl);
+  uint64_t seq = z_SeqLockReadBegin(&sl);
+  z_ASSERT_TRUE(z_SeqLockReadRetry(&sl, seq) == false);
+  z_SeqLockWriteBegin(&sl);
+  z_ASSERT_TRUE(z_SeqLockReadRetry(&sl, seq) == true);
+  z_ASSERT_TRUE(z_SeqLockReadRetry(&sl, z_SeqLockReadBegin(&sl)) == true);
+  z_SeqLockWriteEnd(&sl);
+  z_ASSERT_TRUE(z_SeqLockReadRetry(&sl, seq) == true);
+  z_ASSERT_TRUE(z_SeqLockReadRetry(&sl, z_SeqLockReadBegin(&sl)) == false);
+}
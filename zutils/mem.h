@@ -4,6 +4,8 @@
 #include <stdlib.h> // IWYU pragma: export
 
 #define z_malloc(s) malloc(s);
+#define z_realloc(ptr, s) realloc(ptr, s);
+#define z_calloc(n, s) calloc(n, s);
 #define z_free(ptr) {free(ptr);ptr=nullptr;}
 
 #endif
\ No newline at end of file
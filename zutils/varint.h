@@ -0,0 +1,45 @@
+#ifndef z_VARINT_H
+#define z_VARINT_H
+
+#include <stdint.h>
+
+// the most bytes of a varint of 64 bits
+#define z_VARINT_MAX 10
+
+// the low 7 bits first, the high bit of a byte is set when more follow.
+// returns the bytes written to p
+int64_t z_VarintPut(int8_t *p, uint64_t v) {
+  int64_t n = 0;
+  while (v >= 0x80) {
+    p[n++] = (int8_t)(v | 0x80);
+    v >>= 7;
+  }
+  p[n++] = (int8_t)v;
+  return n;
+}
+
+// the bytes of the varint at p, 0 if it does not end in size bytes or is
+// longer than max_len
+int64_t z_VarintGet(const int8_t *p, int64_t size, int64_t max_len,
+                    uint64_t *v) {
+  *v = 0;
+  for (int64_t n = 0; n < size && n < max_len; ++n) {
+    *v |= (uint64_t)((uint8_t)p[n] & 0x7F) << (7 * n);
+    if (((uint8_t)p[n] & 0x80) == 0) {
+      return n + 1;
+    }
+  }
+  return 0;
+}
+
+// the bytes of the varint of v
+int64_t z_VarintSize(uint64_t v) {
+  int64_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    ++n;
+  }
+  return n;
+}
+
+#endif